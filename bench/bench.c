@@ -0,0 +1,366 @@
+// Micro-benchmarks of the hot paths that do not need a database. Run every benchmark, or only
+// the ones whose name contains the first argument:
+//
+//     ./picoWeatherBench [filter]
+//
+// Each benchmark doubles its iterations until a run lasts at least BENCH_MIN_TIME_NS and
+// reports the time per operation of that run
+
+#include <libpq-fe.h>
+#include <sodium/core.h>
+#include <sodium/crypto_generichash.h>
+#include <sodium/utils.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/core/flags.h"
+#include "../src/http/router.h"
+#include "../src/http/server.h"
+#include "../src/utils/downsample.h"
+#include "../src/utils/json_writer.h"
+#include "../src/utils/query_text.h"
+#include "../src/utils/session_cache.h"
+#include "../src/utils/utils.h"
+
+#define BENCH_MIN_TIME_NS 500000000.0 // 0.5s
+#define BENCH_MAX_ITERATIONS (1L << 30)
+#define BENCH_VALUE_SIZE 32
+#define BENCH_MAX_POINTS 800 // Roughly the width of a chart in pixels
+
+typedef void (*benchFn_t)(void *cls, long iterations);
+
+static const char *benchFilter = NULL;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void run_bench(const char *name, benchFn_t fn, void *cls) {
+    if (benchFilter && !strstr(name, benchFilter))
+        return;
+
+    long iterations = 1;
+    double elapsed;
+    for (;;) {
+        double start = now_ns();
+        fn(cls, iterations);
+        elapsed = now_ns() - start;
+
+        if (elapsed >= BENCH_MIN_TIME_NS || iterations >= BENCH_MAX_ITERATIONS)
+            break;
+        iterations *= 2;
+    }
+
+    printf("%-52s %12ld %16.1f ns/op\n", name, iterations, elapsed / (double)iterations);
+    fflush(stdout);
+}
+
+// ---- JSON serialization ----
+
+// Text result shaped like an hourly summary, built without a server
+static PGresult *make_summary_result(int nRows) {
+    PGresult *res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+    if (!res)
+        return NULL;
+
+    PGresAttDesc attrs[] = {
+        {"period_start", 0, 0, 0, 1184, 8, -1},    {"period_end", 0, 0, 0, 1184, 8, -1},
+        {"avg_temperature", 0, 0, 0, 701, 8, -1},  {"avg_humidity", 0, 0, 0, 701, 8, -1},
+        {"sum_rainfall", 0, 0, 0, 701, 8, -1},     {"readings", 0, 0, 0, 23, 4, -1},
+    };
+    int nFields = sizeof(attrs) / sizeof(attrs[0]);
+
+    if (!PQsetResultAttrs(res, nFields, attrs)) {
+        PQclear(res);
+        return NULL;
+    }
+
+    char value[BENCH_VALUE_SIZE];
+    for (int i = 0; i < nRows; i++) {
+        int day = 1 + (i / 24) % 28;
+        int hour = i % 24;
+
+        snprintf(value, sizeof(value), "2025-09-%02d %02d:00:00+02", day, hour);
+        PQsetvalue(res, i, 0, value, (int)strlen(value));
+        snprintf(value, sizeof(value), "2025-09-%02d %02d:59:59+02", day, hour);
+        PQsetvalue(res, i, 1, value, (int)strlen(value));
+        snprintf(value, sizeof(value), "%.3f", 15.0 + (i % 200) / 10.0);
+        PQsetvalue(res, i, 2, value, (int)strlen(value));
+        snprintf(value, sizeof(value), "%.2f", 40.0 + (i % 50));
+        PQsetvalue(res, i, 3, value, (int)strlen(value));
+
+        // Some nulls, like hours without rain data
+        if (i % 7 == 0)
+            PQsetvalue(res, i, 4, NULL, -1);
+        else
+            PQsetvalue(res, i, 4, "0.2", 3);
+
+        snprintf(value, sizeof(value), "%d", 60 + i % 3);
+        PQsetvalue(res, i, 5, value, (int)strlen(value));
+    }
+
+    return res;
+}
+
+static void bench_pgresult_to_json(void *cls, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        json_t *json = pgresult_to_json(cls, false);
+        char *dump = json_dumps(json, JSON_COMPACT);
+        free(dump);
+        json_decref(json);
+    }
+}
+
+static void bench_pgresult_write_json(void *cls, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        StrBuf out = {NULL, 0, 0};
+        pgresult_write_json(cls, false, false, &out);
+        strbuf_free(&out);
+    }
+}
+
+static void bench_pgresult_write_json_columns(void *cls, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        StrBuf out = {NULL, 0, 0};
+        pgresult_write_json_columns(cls, false, &out);
+        strbuf_free(&out);
+    }
+}
+
+// Decoding the numeric columns and picking the rows of a ?max_points= chart
+static void bench_downsample(void *cls, long iterations) {
+    PGresult *res = cls;
+    int nRows = PQntuples(res);
+    int nFields = PQnfields(res);
+
+    double *x = malloc((size_t)nRows * sizeof(double));
+    double *ys = malloc((size_t)nRows * nFields * sizeof(double));
+    int *rows = malloc(BENCH_MAX_POINTS * sizeof(int));
+    if (!x || !ys || !rows) {
+        free(x);
+        free(ys);
+        free(rows);
+        return;
+    }
+
+    for (int i = 0; i < nRows; i++)
+        x[i] = i;
+
+    for (long i = 0; i < iterations; i++) {
+        int nSeries = 0;
+        for (int j = 0; j < nFields; j++) {
+            if (pgresult_column_values(res, j, ys + (size_t)nSeries * nRows))
+                nSeries++;
+        }
+        lttb_select(x, ys, nSeries, nRows, BENCH_MAX_POINTS, rows);
+    }
+
+    free(x);
+    free(ys);
+    free(rows);
+}
+
+static const struct {
+    const char *name;
+    benchFn_t fn;
+} jsonBenches[] = {
+    {"pgresult_to_json", bench_pgresult_to_json},
+    {"pgresult_write_json", bench_pgresult_write_json},
+    {"pgresult_write_json_columns", bench_pgresult_write_json_columns},
+    {"downsample", bench_downsample},
+};
+
+#define N_JSON_BENCHES (sizeof(jsonBenches) / sizeof(jsonBenches[0]))
+
+static void run_json_benches(void) {
+    static const int sizes[] = {1000, 100000, 1000000};
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char names[N_JSON_BENCHES][64];
+        bool wanted = false;
+        for (size_t j = 0; j < N_JSON_BENCHES; j++) {
+            snprintf(names[j], sizeof(names[j]), "json/%d/%s", sizes[i], jsonBenches[j].name);
+            wanted = wanted || !benchFilter || strstr(names[j], benchFilter);
+        }
+
+        // Building a million rows takes a while, skip it when nothing would use it
+        if (!wanted)
+            continue;
+
+        PGresult *res = make_summary_result(sizes[i]);
+        if (!res) {
+            fprintf(stderr, "Failed to build a result of %d rows\n", sizes[i]);
+            continue;
+        }
+
+        for (size_t j = 0; j < N_JSON_BENCHES; j++)
+            run_bench(names[j], jsonBenches[j].fn, res);
+
+        PQclear(res);
+    }
+}
+
+// ---- Query building ----
+
+#define BENCH_SUMMARY_FIELDS                                                                       \
+    (SUMMARY_AVG_TEMPERATURE | SUMMARY_MAX_TEMPERATURE | SUMMARY_MIN_TEMPERATURE |                 \
+     SUMMARY_AVG_HUMIDITY | SUMMARY_SUM_RAINFALL | SUMMARY_AVG_WIND_SPEED |                        \
+     SUMMARY_MAX_GUST_SPEED)
+
+static void bench_build_static_query(void *cls, long iterations) {
+    (void)cls;
+    for (long i = 0; i < iterations; i++)
+        free(build_static_query(BENCH_SUMMARY_FIELDS, GRANULARITY_DAY, false));
+}
+
+static void bench_build_generic_query(void *cls, long iterations) {
+    (void)cls;
+    for (long i = 0; i < iterations; i++)
+        free(build_generic_weather_query(BENCH_SUMMARY_FIELDS, false));
+}
+
+static void bench_lookup_query(void *cls, long iterations) {
+    (void)cls;
+    for (long i = 0; i < iterations; i++)
+        lookup_weather_query(WEATHER_QUERY_GENERIC, GRANULARITY_DAY, BENCH_SUMMARY_FIELDS,
+                             false);
+}
+
+// ---- Timezones ----
+
+typedef struct {
+    const char *start;
+    const char *end;
+    const char *tz1;
+    const char *tz2;
+} TzRange;
+
+static void bench_same_offset(void *cls, long iterations) {
+    const TzRange *range = cls;
+    for (long i = 0; i < iterations; i++)
+        same_timezone_offset_during_range(range->start, range->end, range->tz1, range->tz2);
+}
+
+static void bench_whole_hour_offset(void *cls, long iterations) {
+    const TzRange *range = cls;
+    for (long i = 0; i < iterations; i++)
+        whole_hour_offset_during_range(range->start, range->end, range->tz1);
+}
+
+// ---- Routing ----
+
+static const char *routedUrls[] = {
+    "/users",
+    "/users/theUser",
+    "/users/theUser/sessions/3f1c7a52-8d4e-4b6a-9a0e-2c5d7b8e1f90",
+    "/users/theUser/api-keys",
+    "/stations/3f1c7a52-8d4e-4b6a-9a0e-2c5d7b8e1f90",
+    "/stations/3f1c7a52-8d4e-4b6a-9a0e-2c5d7b8e1f90/data",
+    "/data",
+    "/missing/route",
+};
+
+// HTTP_OTHER matches a route but no handler, so only the dispatch is measured
+static void bench_route_request(void *cls, long iterations) {
+    struct HandlerContext *handlerContext = cls;
+    size_t nUrls = sizeof(routedUrls) / sizeof(routedUrls[0]);
+
+    for (long i = 0; i < iterations; i++)
+        route_request(handlerContext, routedUrls[i % nUrls]);
+}
+
+// ---- Token validation ----
+
+typedef struct {
+    char token[sodium_base64_ENCODED_LEN(KEY_ENTROPY, BASE64_VARIANT)];
+    char userUUID[UUID_SIZE + 1];
+} SessionBench;
+
+// A session already in the cache, the path every authenticated request takes once warm
+static bool prepare_session_bench(SessionBench *bench) {
+    char hashB64[sodium_base64_ENCODED_LEN(crypto_generichash_BYTES, BASE64_VARIANT)];
+    generate_session_token(bench->token, sizeof(bench->token), hashB64, sizeof(hashB64));
+
+    unsigned char hash[crypto_generichash_BYTES];
+    if (sodium_base642bin(hash, sizeof(hash), hashB64, strlen(hashB64), NULL, NULL, NULL,
+                          BASE64_VARIANT) != 0)
+        return false;
+
+    SessionInfo info;
+    memset(&info, 0, sizeof(info));
+    snprintf(info.userUUID, sizeof(info.userUUID), "3f1c7a52-8d4e-4b6a-9a0e-2c5d7b8e1f90");
+    snprintf(info.username, sizeof(info.username), "theUser");
+    snprintf(info.sessionUUID, sizeof(info.sessionUUID), "8b0e6c1d-2f3a-4e5b-8c7d-9a1b2c3d4e5f");
+    info.expiresAt = time(NULL) + 3600;
+
+    session_cache_put(hash, &info);
+    snprintf(bench->userUUID, sizeof(bench->userUUID), "%s", info.userUUID);
+
+    return true;
+}
+
+static void bench_validate_session(void *cls, long iterations) {
+    const SessionBench *bench = cls;
+    for (long i = 0; i < iterations; i++)
+        validate_session_token(NULL, bench->userUUID, bench->token);
+}
+
+static void bench_hash_api_key(void *cls, long iterations) {
+    unsigned char keyHash[crypto_generichash_BYTES];
+    for (long i = 0; i < iterations; i++)
+        hash_api_key(cls, keyHash);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1)
+        benchFilter = argv[1];
+
+    if (sodium_init() < 0) {
+        fprintf(stderr, "Failed to initizalize libsodium\n");
+        return EXIT_FAILURE;
+    }
+
+    init_session_cache();
+
+    printf("%-52s %12s %16s\n", "benchmark", "iterations", "time");
+
+    run_json_benches();
+
+    run_bench("query/build_static_query", bench_build_static_query, NULL);
+    run_bench("query/build_generic_weather_query", bench_build_generic_query, NULL);
+    run_bench("query/lookup_weather_query", bench_lookup_query, NULL);
+
+    TzRange sameYear = {"2024-01-01T00:00:00", "2025-01-01T00:00:00", "Europe/Paris",
+                        "Europe/Madrid"};
+    TzRange sameDecade = {"2015-01-01T00:00:00", "2025-01-01T00:00:00", "Europe/Paris",
+                          "Europe/Madrid"};
+    TzRange wholeHourDecade = {"2015-01-01T00:00:00", "2025-01-01T00:00:00", "America/New_York",
+                               NULL};
+    run_bench("tz/same_offset/1y", bench_same_offset, &sameYear);
+    run_bench("tz/same_offset/10y", bench_same_offset, &sameDecade);
+    run_bench("tz/whole_hour_offset/10y", bench_whole_hour_offset, &wholeHourDecade);
+
+    struct ResponseData responseData;
+    memset(&responseData, 0, sizeof(responseData));
+    struct QueryData queryData;
+    memset(&queryData, 0, sizeof(queryData));
+    struct HandlerContext handlerContext = {HTTP_OTHER, &responseData, NULL, NULL, &queryData,
+                                            NULL, NULL};
+    run_bench("router/route_request", bench_route_request, &handlerContext);
+
+    SessionBench sessionBench;
+    if (prepare_session_bench(&sessionBench)) {
+        run_bench("auth/validate_session_token_cached", bench_validate_session, &sessionBench);
+
+        // API keys have the same encoding as the session tokens
+        run_bench("auth/hash_api_key", bench_hash_api_key, sessionBench.token);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,815 @@
+// End to end load generator. Seeds a running server through its own API, one user, station
+// and upload key per station and a few hours of readings each, then runs every scenario for a
+// while over keep-alive connections and reports throughput and latency percentiles:
+//
+//     ./picoWeatherLoad [-h host] [-p port] [-c connections] [-d seconds] [-s stations]
+//                       [-H seed hours] [filter]
+//
+// Only the scenarios whose name contains filter run when one is given. The server should point
+// at a scratch database, seeding leaves its users and stations behind
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <jansson.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_DEFAULT_HOST "127.0.0.1"
+#define LOAD_DEFAULT_PORT "8080"
+#define LOAD_DEFAULT_CONNECTIONS 8
+#define LOAD_DEFAULT_DURATION 10
+#define LOAD_DEFAULT_STATIONS 10
+#define LOAD_DEFAULT_SEED_HOURS 24
+
+#define LOAD_READING_INTERVAL 300   // Seconds between seeded readings
+#define LOAD_UPLOAD_BODY_SIZE 12288 // Under the server's 16KiB body limit
+#define LOAD_REQUEST_SIZE 16384
+#define LOAD_INITIAL_BUFFER 16384
+#define LOAD_ID_SIZE 64
+#define LOAD_TOKEN_SIZE 128
+#define LOAD_INITIAL_SAMPLES 4096
+#define LOAD_TIME_SIZE 32
+
+typedef struct {
+    char username[LOAD_ID_SIZE];
+    char password[LOAD_ID_SIZE];
+    char sessionToken[LOAD_TOKEN_SIZE];
+    char stationId[LOAD_ID_SIZE];
+    char apiKey[LOAD_TOKEN_SIZE];
+} SeededStation;
+
+typedef struct {
+    int fd;
+    char *buf; // Bytes read from the socket and not consumed yet
+    size_t len;
+    size_t cap;
+} HttpConn;
+
+typedef struct {
+    int status;
+    char *body; // Decoded, only when the caller asked for it
+    size_t bodyLen;
+    char sessionToken[LOAD_TOKEN_SIZE];
+} HttpResponse;
+
+static const char *host = LOAD_DEFAULT_HOST;
+static const char *port = LOAD_DEFAULT_PORT;
+static int nConnections = LOAD_DEFAULT_CONNECTIONS;
+static int duration = LOAD_DEFAULT_DURATION;
+static int nStations = LOAD_DEFAULT_STATIONS;
+static int seedHours = LOAD_DEFAULT_SEED_HOURS;
+
+static SeededStation *stations = NULL;
+static char *stationList = NULL; // Comma separated ids for GET /data
+
+static time_t seedStart; // First seeded reading, uploads during the run go before it
+static unsigned long uploadCounter = 0;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void format_utc(time_t t, char *buf, size_t size) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%Y-%m-%dT%H:%M:%S+00", &tm);
+}
+
+// ---- HTTP/1.1 client ----
+
+static void conn_close(HttpConn *conn) {
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+    conn->len = 0;
+}
+
+static bool conn_open(HttpConn *conn) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addrs;
+    if (getaddrinfo(host, port, &hints, &addrs) != 0)
+        return false;
+
+    conn->fd = -1;
+    for (struct addrinfo *addr = addrs; addr; addr = addr->ai_next) {
+        int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            conn->fd = fd;
+            break;
+        }
+        close(fd);
+    }
+
+    freeaddrinfo(addrs);
+    conn->len = 0;
+    return conn->fd >= 0;
+}
+
+static bool conn_init(HttpConn *conn) {
+    conn->fd = -1;
+    conn->len = 0;
+    conn->cap = LOAD_INITIAL_BUFFER;
+    conn->buf = malloc(conn->cap);
+    return conn->buf != NULL;
+}
+
+static void conn_free(HttpConn *conn) {
+    conn_close(conn);
+    free(conn->buf);
+    conn->buf = NULL;
+}
+
+// Reads until at least needed bytes are buffered
+static bool conn_fill(HttpConn *conn, size_t needed) {
+    while (conn->len < needed) {
+        if (conn->cap < needed + 1 || conn->cap - conn->len < 4096) {
+            size_t cap = conn->cap * 2;
+            while (cap < needed + 4096)
+                cap *= 2;
+
+            char *buf = realloc(conn->buf, cap);
+            if (!buf)
+                return false;
+            conn->buf = buf;
+            conn->cap = cap;
+        }
+
+        ssize_t n = recv(conn->fd, conn->buf + conn->len, conn->cap - conn->len - 1, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        conn->len += (size_t)n;
+        conn->buf[conn->len] = '\0';
+    }
+
+    return true;
+}
+
+// Offset of the first "\r\n" at or after from, reading more as needed
+static bool conn_find_crlf(HttpConn *conn, size_t from, size_t *at) {
+    for (;;) {
+        for (size_t i = from; i + 1 < conn->len; i++) {
+            if (conn->buf[i] == '\r' && conn->buf[i + 1] == '\n') {
+                *at = i;
+                return true;
+            }
+        }
+
+        if (!conn_fill(conn, conn->len + 1))
+            return false;
+    }
+}
+
+static bool append_body(HttpResponse *response, const char *data, size_t len) {
+    char *body = realloc(response->body, response->bodyLen + len + 1);
+    if (!body)
+        return false;
+
+    memcpy(body + response->bodyLen, data, len);
+    response->body = body;
+    response->bodyLen += len;
+    response->body[response->bodyLen] = '\0';
+    return true;
+}
+
+static const char *find_header(const char *headers, size_t headersLen, const char *name) {
+    size_t nameLen = strlen(name);
+    const char *p = headers;
+    const char *end = headers + headersLen;
+
+    while (p < end) {
+        const char *lineEnd = strstr(p, "\r\n");
+        if (!lineEnd || lineEnd > end)
+            break;
+
+        if ((size_t)(lineEnd - p) > nameLen && strncasecmp(p, name, nameLen) == 0 &&
+            p[nameLen] == ':') {
+            p += nameLen + 1;
+            while (*p == ' ')
+                p++;
+            return p;
+        }
+
+        p = lineEnd + 2;
+    }
+
+    return NULL;
+}
+
+// Reads one response, keeping the decoded body when keepBody is set
+static bool read_response(HttpConn *conn, bool keepBody, HttpResponse *response) {
+    size_t headerEnd = 0;
+    for (;;) {
+        char *end = conn->len ? strstr(conn->buf, "\r\n\r\n") : NULL;
+        if (end) {
+            headerEnd = (size_t)(end - conn->buf) + 4;
+            break;
+        }
+        if (!conn_fill(conn, conn->len + 1))
+            return false;
+    }
+
+    if (sscanf(conn->buf, "HTTP/1.%*d %d", &response->status) != 1)
+        return false;
+
+    const char *cookie = find_header(conn->buf, headerEnd, "Set-Cookie");
+    if (cookie && strncmp(cookie, "sessiontoken=", 13) == 0) {
+        cookie += 13;
+        size_t len = strcspn(cookie, ";\r");
+        if (len < sizeof(response->sessionToken)) {
+            memcpy(response->sessionToken, cookie, len);
+            response->sessionToken[len] = '\0';
+        }
+    }
+
+    bool mustClose = false;
+    const char *connection = find_header(conn->buf, headerEnd, "Connection");
+    if (connection && strncasecmp(connection, "close", 5) == 0)
+        mustClose = true;
+
+    size_t consumed;
+    const char *encoding = find_header(conn->buf, headerEnd, "Transfer-Encoding");
+    if (encoding && strncasecmp(encoding, "chunked", 7) == 0) {
+        size_t pos = headerEnd;
+        for (;;) {
+            size_t lineEnd;
+            if (!conn_find_crlf(conn, pos, &lineEnd))
+                return false;
+
+            size_t chunkSize = strtoul(conn->buf + pos, NULL, 16);
+            pos = lineEnd + 2;
+
+            if (chunkSize == 0) {
+                // No trailers are sent, only the final CRLF
+                if (!conn_fill(conn, pos + 2))
+                    return false;
+                consumed = pos + 2;
+                break;
+            }
+
+            if (!conn_fill(conn, pos + chunkSize + 2))
+                return false;
+            if (keepBody && !append_body(response, conn->buf + pos, chunkSize))
+                return false;
+            pos += chunkSize + 2;
+        }
+    }
+    else {
+        const char *lengthHeader = find_header(conn->buf, headerEnd, "Content-Length");
+        size_t contentLength = lengthHeader ? strtoul(lengthHeader, NULL, 10) : 0;
+
+        if (!conn_fill(conn, headerEnd + contentLength))
+            return false;
+        if (keepBody && !append_body(response, conn->buf + headerEnd, contentLength))
+            return false;
+        consumed = headerEnd + contentLength;
+    }
+
+    memmove(conn->buf, conn->buf + consumed, conn->len - consumed);
+    conn->len -= consumed;
+    conn->buf[conn->len] = '\0';
+
+    if (mustClose)
+        conn_close(conn);
+
+    return true;
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Sends the request and reads its response, reconnecting once when a kept alive connection
+// turns out to be closed
+static bool http_exchange(HttpConn *conn, const char *request, size_t requestLen, bool keepBody,
+                          HttpResponse *response) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        memset(response, 0, sizeof(*response));
+
+        bool reused = conn->fd >= 0;
+        if (!reused && !conn_open(conn))
+            return false;
+
+        if (send_all(conn->fd, request, requestLen) && read_response(conn, keepBody, response))
+            return true;
+
+        free(response->body);
+        response->body = NULL;
+        conn_close(conn);
+
+        if (!reused)
+            return false;
+    }
+
+    return false;
+}
+
+static int build_request(char *buf, size_t size, const char *method, const char *path,
+                         const char *extraHeaders, const char *contentType, const char *body) {
+    size_t bodyLen = body ? strlen(body) : 0;
+    int len;
+
+    if (body)
+        len = snprintf(buf, size,
+                       "%s %s HTTP/1.1\r\nHost: %s\r\n%sContent-Type: %s\r\n"
+                       "Content-Length: %zu\r\n\r\n%s",
+                       method, path, host, extraHeaders ? extraHeaders : "", contentType, bodyLen,
+                       body);
+    else
+        len = snprintf(buf, size, "%s %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", method, path, host,
+                       extraHeaders ? extraHeaders : "");
+
+    return len > 0 && (size_t)len < size ? len : -1;
+}
+
+// ---- Seeding ----
+
+static bool seed_request(HttpConn *conn, const char *method, const char *path,
+                         const char *extraHeaders, const char *contentType, const char *body,
+                         int expected, HttpResponse *response) {
+    char request[LOAD_REQUEST_SIZE];
+    int len = build_request(request, sizeof(request), method, path, extraHeaders, contentType,
+                            body);
+    if (len < 0 || !http_exchange(conn, request, (size_t)len, true, response))
+        return false;
+
+    if (response->status != expected) {
+        fprintf(stderr, "%s %s answered %d: %s\n", method, path, response->status,
+                response->body ? response->body : "");
+        free(response->body);
+        response->body = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static bool copy_json_string(const char *body, const char *key, char *out, size_t size) {
+    json_t *root = json_loads(body ? body : "", 0, NULL);
+    const char *value = json_string_value(json_object_get(root, key));
+    bool ok = value && strlen(value) < size;
+    if (ok)
+        strcpy(out, value);
+    json_decref(root);
+    return ok;
+}
+
+static bool seed_readings(HttpConn *conn, const SeededStation *station) {
+    char headers[LOAD_TOKEN_SIZE + 32];
+    snprintf(headers, sizeof(headers), "X-API-KEY: %s\r\n", station->apiKey);
+
+    char path[LOAD_ID_SIZE + 32];
+    snprintf(path, sizeof(path), "/stations/%s/data", station->stationId);
+
+    static const char header[] = "start_time,end_time,temperature,humidity\n";
+    char body[LOAD_UPLOAD_BODY_SIZE];
+    size_t len = 0;
+
+    int nReadings = seedHours * 3600 / LOAD_READING_INTERVAL;
+    for (int i = 0; i <= nReadings; i++) {
+        // Flush before the next line could overflow the body, and after the last one
+        if (len > 0 && (i == nReadings || len + 128 > sizeof(body))) {
+            HttpResponse response;
+            if (!seed_request(conn, "POST", path, headers, "text/csv", body, 201, &response))
+                return false;
+            free(response.body);
+            len = 0;
+        }
+
+        if (i == nReadings)
+            break;
+
+        if (len == 0) {
+            memcpy(body, header, sizeof(header) - 1);
+            len = sizeof(header) - 1;
+        }
+
+        char start[LOAD_TIME_SIZE], end[LOAD_TIME_SIZE];
+        time_t t = seedStart + (time_t)i * LOAD_READING_INTERVAL;
+        format_utc(t, start, sizeof(start));
+        format_utc(t + LOAD_READING_INTERVAL, end, sizeof(end));
+
+        len += (size_t)snprintf(body + len, sizeof(body) - len, "%s,%s,%.1f,%d\n", start, end,
+                                15.0 + (i % 100) / 10.0, 40 + i % 30);
+    }
+
+    return true;
+}
+
+static bool seed_station(HttpConn *conn, int index, long runId) {
+    SeededStation *station = &stations[index];
+    HttpResponse response;
+    char body[1024], path[256], headers[LOAD_TOKEN_SIZE + 64];
+
+    snprintf(station->username, sizeof(station->username), "load%ld_%d", runId, index);
+    snprintf(station->password, sizeof(station->password), "loadPassword%ld", runId);
+
+    snprintf(body, sizeof(body),
+             "{\"username\":\"%s\",\"email\":\"%s@load.invalid\",\"password\":\"%s\"}",
+             station->username, station->username, station->password);
+    if (!seed_request(conn, "POST", "/users", NULL, "application/json", body, 201, &response))
+        return false;
+    free(response.body);
+
+    snprintf(path, sizeof(path), "/users/%s/sessions", station->username);
+    snprintf(body, sizeof(body), "{\"password\":\"%s\"}", station->password);
+    if (!seed_request(conn, "POST", path, NULL, "application/json", body, 201, &response))
+        return false;
+    free(response.body);
+    snprintf(station->sessionToken, sizeof(station->sessionToken), "%s", response.sessionToken);
+
+    snprintf(headers, sizeof(headers), "Cookie: sessiontoken=%s\r\n", station->sessionToken);
+    snprintf(body, sizeof(body),
+             "{\"name\":\"Load station %d\",\"lat\":%.4f,\"lon\":%.4f,\"altitude\":%.1f}", index,
+             40.0 + index * 0.01, -3.5 + index * 0.01, 650.5);
+    if (!seed_request(conn, "POST", "/stations", headers, "application/json", body, 201,
+                      &response))
+        return false;
+    bool ok = copy_json_string(response.body, "uuid", station->stationId,
+                               sizeof(station->stationId));
+    free(response.body);
+    if (!ok)
+        return false;
+
+    snprintf(path, sizeof(path), "/users/%s/api-keys", station->username);
+    snprintf(body, sizeof(body),
+             "{\"name\":\"load upload\",\"api_key_type\":\"weather_upload\",\"station_id\":\"%s\"}",
+             station->stationId);
+    if (!seed_request(conn, "POST", path, headers, "application/json", body, 201, &response))
+        return false;
+    ok = copy_json_string(response.body, "api_key", station->apiKey, sizeof(station->apiKey));
+    free(response.body);
+
+    return ok && seed_readings(conn, station);
+}
+
+static bool seed(void) {
+    stations = calloc((size_t)nStations, sizeof(SeededStation));
+    stationList = calloc((size_t)nStations, LOAD_ID_SIZE + 1);
+    if (!stations || !stationList)
+        return false;
+
+    HttpConn conn;
+    if (!conn_init(&conn))
+        return false;
+
+    seedStart = time(NULL) - (time_t)seedHours * 3600;
+    seedStart -= seedStart % 3600;
+
+    long runId = (long)time(NULL) % 100000;
+    bool ok = true;
+    for (int i = 0; i < nStations && ok; i++) {
+        ok = seed_station(&conn, i, runId);
+        if (ok) {
+            if (i > 0)
+                strcat(stationList, ",");
+            strcat(stationList, stations[i].stationId);
+        }
+    }
+
+    conn_free(&conn);
+    return ok;
+}
+
+// ---- Scenarios ----
+
+typedef struct {
+    unsigned long iteration;
+    char request[LOAD_REQUEST_SIZE];
+} ScenarioState;
+
+// Writes the next request of the scenario into state->request, returning its length
+typedef int (*scenarioBuild_t)(ScenarioState *state);
+
+static const SeededStation *pick_station(const ScenarioState *state) {
+    return &stations[state->iteration % (unsigned long)nStations];
+}
+
+static void seeded_range(char *start, char *end) {
+    struct tm tm;
+    time_t t = seedStart;
+    gmtime_r(&t, &tm);
+    strftime(start, LOAD_TIME_SIZE, "%Y-%m-%dT%H:%M:%S", &tm);
+    t = seedStart + (time_t)seedHours * 3600;
+    gmtime_r(&t, &tm);
+    strftime(end, LOAD_TIME_SIZE, "%Y-%m-%dT%H:%M:%S", &tm);
+}
+
+static int build_stations_list(ScenarioState *state) {
+    return build_request(state->request, sizeof(state->request), "GET", "/stations", NULL, NULL,
+                         NULL);
+}
+
+static int build_station_get(ScenarioState *state) {
+    char path[LOAD_ID_SIZE + 16];
+    snprintf(path, sizeof(path), "/stations/%s", pick_station(state)->stationId);
+    return build_request(state->request, sizeof(state->request), "GET", path, NULL, NULL, NULL);
+}
+
+static int build_data(ScenarioState *state, const char *granularity, const char *fields) {
+    char start[LOAD_TIME_SIZE], end[LOAD_TIME_SIZE], path[512];
+    seeded_range(start, end);
+    snprintf(path, sizeof(path),
+             "/stations/%s/data?granularity=%s&fields=%s&timezone=UTC&start_time=%s&end_time=%s",
+             pick_station(state)->stationId, granularity, fields, start, end);
+    return build_request(state->request, sizeof(state->request), "GET", path, NULL, NULL, NULL);
+}
+
+static int build_data_hour(ScenarioState *state) {
+    return build_data(state, "hour", "avg_temperature,avg_humidity");
+}
+
+static int build_data_raw(ScenarioState *state) {
+    return build_data(state, "raw", "temperature,humidity");
+}
+
+static int build_data_batch(ScenarioState *state) {
+    char start[LOAD_TIME_SIZE], end[LOAD_TIME_SIZE];
+    seeded_range(start, end);
+
+    size_t size = strlen(stationList) + 256;
+    char *path = malloc(size);
+    if (!path)
+        return -1;
+
+    snprintf(path, size,
+             "/data?stations=%s&granularity=hour&fields=avg_temperature&timezone=UTC"
+             "&start_time=%s&end_time=%s",
+             stationList, start, end);
+    int len = build_request(state->request, sizeof(state->request), "GET", path, NULL, NULL,
+                            NULL);
+    free(path);
+    return len;
+}
+
+static int build_upload(ScenarioState *state) {
+    const SeededStation *station = pick_station(state);
+
+    // Every upload gets its own minute, walking back from the seeded readings
+    unsigned long n = __atomic_add_fetch(&uploadCounter, 1, __ATOMIC_RELAXED);
+    time_t t = seedStart - (time_t)n * 60;
+
+    char start[LOAD_TIME_SIZE], end[LOAD_TIME_SIZE], body[160], path[LOAD_ID_SIZE + 32];
+    char headers[LOAD_TOKEN_SIZE + 32];
+    format_utc(t, start, sizeof(start));
+    format_utc(t + 60, end, sizeof(end));
+    snprintf(body, sizeof(body),
+             "[{\"start_time\":\"%s\",\"end_time\":\"%s\",\"temperature\":21.5}]", start, end);
+    snprintf(path, sizeof(path), "/stations/%s/data", station->stationId);
+    snprintf(headers, sizeof(headers), "X-API-KEY: %s\r\n", station->apiKey);
+
+    return build_request(state->request, sizeof(state->request), "POST", path, headers,
+                         "application/json", body);
+}
+
+static int build_login(ScenarioState *state) {
+    const SeededStation *station = pick_station(state);
+    char path[LOAD_ID_SIZE + 32], body[LOAD_ID_SIZE + 32];
+    snprintf(path, sizeof(path), "/users/%s/sessions", station->username);
+    snprintf(body, sizeof(body), "{\"password\":\"%s\"}", station->password);
+    return build_request(state->request, sizeof(state->request), "POST", path, NULL,
+                         "application/json", body);
+}
+
+static int build_user_get(ScenarioState *state) {
+    const SeededStation *station = pick_station(state);
+    char path[LOAD_ID_SIZE + 16], headers[LOAD_TOKEN_SIZE + 32];
+    snprintf(path, sizeof(path), "/users/%s", station->username);
+    snprintf(headers, sizeof(headers), "Cookie: sessiontoken=%s\r\n", station->sessionToken);
+    return build_request(state->request, sizeof(state->request), "GET", path, headers, NULL,
+                         NULL);
+}
+
+static int build_metrics(ScenarioState *state) {
+    return build_request(state->request, sizeof(state->request), "GET", "/metrics", NULL, NULL,
+                         NULL);
+}
+
+static const struct {
+    const char *name;
+    scenarioBuild_t build;
+} scenarios[] = {
+    {"GET /stations", build_stations_list},
+    {"GET /stations/{id}", build_station_get},
+    {"GET /users/{id}", build_user_get},
+    {"GET /stations/{id}/data hour", build_data_hour},
+    {"GET /stations/{id}/data raw", build_data_raw},
+    {"GET /data hour", build_data_batch},
+    {"POST /stations/{id}/data", build_upload},
+    {"POST /users/{id}/sessions", build_login},
+    {"GET /metrics", build_metrics},
+};
+
+typedef struct {
+    scenarioBuild_t build;
+    double deadline;
+    unsigned long offset; // Spreads the threads over the stations
+    uint32_t *samples;    // Latencies in microseconds
+    size_t nSamples;
+    size_t capacity;
+    unsigned long errors;
+} Worker;
+
+static bool add_sample(Worker *worker, uint32_t us) {
+    if (worker->nSamples == worker->capacity) {
+        size_t capacity = worker->capacity ? worker->capacity * 2 : LOAD_INITIAL_SAMPLES;
+        uint32_t *samples = realloc(worker->samples, capacity * sizeof(uint32_t));
+        if (!samples)
+            return false;
+        worker->samples = samples;
+        worker->capacity = capacity;
+    }
+
+    worker->samples[worker->nSamples++] = us;
+    return true;
+}
+
+static void *worker_loop(void *arg) {
+    Worker *worker = arg;
+
+    HttpConn conn;
+    ScenarioState *state = malloc(sizeof(ScenarioState));
+    if (!state || !conn_init(&conn)) {
+        free(state);
+        return NULL;
+    }
+
+    state->iteration = worker->offset;
+
+    while (now_seconds() < worker->deadline) {
+        int len = worker->build(state);
+        state->iteration++;
+        if (len < 0) {
+            worker->errors++;
+            continue;
+        }
+
+        double start = now_seconds();
+        HttpResponse response;
+        bool ok = http_exchange(&conn, state->request, (size_t)len, false, &response);
+        double elapsed = now_seconds() - start;
+
+        // 304 is a hit for the clients sending If-None-Match, everything else non 2xx failed
+        if (!ok || response.status < 200 || (response.status >= 300 && response.status != 304))
+            worker->errors++;
+
+        if (ok && !add_sample(worker, (uint32_t)(elapsed * 1e6)))
+            break;
+    }
+
+    conn_free(&conn);
+    free(state);
+    return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(const uint32_t *samples, size_t n, double p) {
+    if (n == 0)
+        return 0;
+    size_t index = (size_t)(p * (double)(n - 1) + 0.5);
+    return samples[index] / 1000.0;
+}
+
+static void run_scenario(const char *name, scenarioBuild_t build) {
+    Worker *workers = calloc((size_t)nConnections, sizeof(Worker));
+    pthread_t *threads = calloc((size_t)nConnections, sizeof(pthread_t));
+    if (!workers || !threads) {
+        free(workers);
+        free(threads);
+        return;
+    }
+
+    double start = now_seconds();
+    int started = 0;
+    for (int i = 0; i < nConnections; i++) {
+        workers[i].build = build;
+        workers[i].deadline = start + duration;
+        workers[i].offset = (unsigned long)i * 7919;
+        if (pthread_create(&threads[i], NULL, worker_loop, &workers[i]) != 0)
+            break;
+        started++;
+    }
+
+    size_t total = 0;
+    unsigned long errors = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        total += workers[i].nSamples;
+        errors += workers[i].errors;
+    }
+    double elapsed = now_seconds() - start;
+
+    uint32_t *samples = malloc((total ? total : 1) * sizeof(uint32_t));
+    size_t n = 0;
+    for (int i = 0; i < started && samples; i++) {
+        memcpy(samples + n, workers[i].samples, workers[i].nSamples * sizeof(uint32_t));
+        n += workers[i].nSamples;
+    }
+
+    if (samples) {
+        qsort(samples, n, sizeof(uint32_t), compare_samples);
+        printf("%-32s %10zu %8lu %10.1f %9.2f %9.2f %9.2f\n", name, n, errors,
+               (double)n / elapsed, percentile_ms(samples, n, 0.50),
+               percentile_ms(samples, n, 0.99), n ? samples[n - 1] / 1000.0 : 0.0);
+    }
+
+    for (int i = 0; i < nConnections; i++)
+        free(workers[i].samples);
+    free(samples);
+    free(workers);
+    free(threads);
+}
+
+static int positive_arg(const char *value, int fallback) {
+    int parsed = atoi(value);
+    return parsed > 0 ? parsed : fallback;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:s:H:")) != -1) {
+        switch (opt) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'c':
+                nConnections = positive_arg(optarg, LOAD_DEFAULT_CONNECTIONS);
+                break;
+            case 'd':
+                duration = positive_arg(optarg, LOAD_DEFAULT_DURATION);
+                break;
+            case 's':
+                nStations = positive_arg(optarg, LOAD_DEFAULT_STATIONS);
+                break;
+            case 'H':
+                seedHours = positive_arg(optarg, LOAD_DEFAULT_SEED_HOURS);
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-h host] [-p port] [-c connections] [-d seconds] "
+                        "[-s stations] [-H seed hours] [filter]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    const char *filter = optind < argc ? argv[optind] : NULL;
+
+    printf("Seeding %d stations with %d hours of readings...\n", nStations, seedHours);
+    if (!seed()) {
+        fprintf(stderr, "Failed to seed the server at %s:%s\n", host, port);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d connections, %d seconds per scenario\n\n", nConnections, duration);
+    printf("%-32s %10s %8s %10s %9s %9s %9s\n", "scenario", "requests", "errors", "req/s",
+           "p50 ms", "p99 ms", "max ms");
+
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (!filter || strstr(scenarios[i].name, filter))
+            run_scenario(scenarios[i].name, scenarios[i].build);
+    }
+
+    free(stations);
+    free(stationList);
+    return EXIT_SUCCESS;
+}
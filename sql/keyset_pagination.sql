@@ -0,0 +1,14 @@
+-- Indexes behind the ?limit= and ?cursor= pages of /stations/{id}/data, the sessions and the API
+-- keys. Each page resumes after the last row of the previous one, so these keep the cost of a
+-- page the same however deep into the list it is instead of scanning every row before it.
+--
+-- Built concurrently so uploads and logins carry on meanwhile, which rules out a transaction.
+
+CREATE INDEX CONCURRENTLY IF NOT EXISTS weather_data_station_start_idx
+    ON weather.weather_data (station_id, lower(time_range));
+
+CREATE INDEX CONCURRENTLY IF NOT EXISTS user_sessions_user_created_idx
+    ON auth.user_sessions (user_id, created_at, uuid);
+
+CREATE INDEX CONCURRENTLY IF NOT EXISTS api_keys_user_created_idx
+    ON auth.api_keys (user_id, created_at, uuid);
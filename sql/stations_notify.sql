@@ -0,0 +1,26 @@
+-- Notifies the stations channel on every change to stations.stations, so the station directory
+-- of each API instance reloads after stations are renamed, moved or deleted outside the API.
+-- The API already notifies the stations it creates itself, this only covers everything else.
+--
+-- The api_keys channel is notified too: the API key cache only loads the keys of stations that
+-- are not deleted, so a soft-deleted station has to drop its keys from every instance.
+
+BEGIN;
+
+CREATE OR REPLACE FUNCTION stations.notify_stations_changed() RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    -- Folded into a single notification per transaction and channel by the server
+    PERFORM pg_notify('stations', '');
+    PERFORM pg_notify('api_keys', '');
+    RETURN NULL;
+END;
+$$;
+
+DROP TRIGGER IF EXISTS stations_notify ON stations.stations;
+CREATE TRIGGER stations_notify
+    AFTER INSERT OR UPDATE OR DELETE ON stations.stations
+    FOR EACH STATEMENT
+    EXECUTE FUNCTION stations.notify_stations_changed();
+
+COMMIT;
@@ -0,0 +1,211 @@
+-- Hourly partial aggregates of weather.weather_data, merged by the API into the day, month and
+-- year summaries of timezones other than the one the stored summaries follow. Every column can
+-- be combined across hours: counts and sums instead of averages, the sum of squares for the
+-- standard deviations and both wind vector components for the average direction.
+--
+-- Rows are bucketed by the UTC hour their time_range starts in, which for any timezone on a
+-- whole hour offset is also a local hour. The API uses the table when HOURLY_PARTIALS=1.
+--
+-- Inserts, updates and deletes recompute the hours they touch. To repair a range by hand:
+-- SELECT weather.rebuild_hourly_partials(station_id, from, to);
+
+BEGIN;
+
+-- No rows can land between the backfill and the trigger taking over
+LOCK TABLE weather.weather_data IN SHARE MODE;
+
+CREATE TABLE IF NOT EXISTS weather.weather_hourly_partials (
+    station_id bigint NOT NULL REFERENCES stations.stations (station_id),
+    hour timestamptz NOT NULL,
+
+    temperature_n bigint NOT NULL DEFAULT 0,
+    temperature_sum double precision NOT NULL DEFAULT 0,
+    temperature_sumsq double precision NOT NULL DEFAULT 0,
+    temperature_min double precision,
+    temperature_max double precision,
+
+    humidity_n bigint NOT NULL DEFAULT 0,
+    humidity_sum double precision NOT NULL DEFAULT 0,
+    humidity_sumsq double precision NOT NULL DEFAULT 0,
+    humidity_min double precision,
+    humidity_max double precision,
+
+    pressure_n bigint NOT NULL DEFAULT 0,
+    pressure_sum double precision NOT NULL DEFAULT 0,
+    pressure_min double precision,
+    pressure_max double precision,
+
+    rainfall_n bigint NOT NULL DEFAULT 0,
+    rainfall_sum double precision NOT NULL DEFAULT 0,
+    rainfall_sumsq double precision NOT NULL DEFAULT 0,
+
+    wind_speed_n bigint NOT NULL DEFAULT 0,
+    wind_speed_sum double precision NOT NULL DEFAULT 0,
+    wind_speed_sumsq double precision NOT NULL DEFAULT 0,
+    wind_x double precision NOT NULL DEFAULT 0, -- SUM(wind_speed * sin(direction))
+    wind_y double precision NOT NULL DEFAULT 0, -- SUM(wind_speed * cos(direction))
+    wind_run double precision NOT NULL DEFAULT 0,
+
+    gust_speed_max double precision,
+    gust_direction_at_max double precision,
+
+    lux_n bigint NOT NULL DEFAULT 0,
+    lux_sum double precision NOT NULL DEFAULT 0,
+    lux_max double precision,
+
+    uvi_n bigint NOT NULL DEFAULT 0,
+    uvi_sum double precision NOT NULL DEFAULT 0,
+    uvi_max double precision,
+
+    solar_irradiance_n bigint NOT NULL DEFAULT 0,
+    solar_irradiance_sum double precision NOT NULL DEFAULT 0,
+
+    PRIMARY KEY (station_id, hour)
+);
+
+-- The partials of the hours of a station starting in [p_from, p_to), the one place the aggregates
+-- are spelled out. Plain SQL, so the planner inlines it and the range is a scan of the
+-- (station_id, lower(time_range)) index
+CREATE OR REPLACE FUNCTION weather.hourly_partials(p_station bigint, p_from timestamptz,
+                                                   p_to timestamptz)
+RETURNS SETOF weather.weather_hourly_partials
+LANGUAGE sql STABLE AS $$
+    SELECT
+        station_id,
+        date_trunc('hour', lower(time_range), 'UTC'),
+
+        COUNT(temperature), COALESCE(SUM(temperature), 0), COALESCE(SUM(temperature ^ 2), 0),
+        MIN(temperature), MAX(temperature),
+
+        COUNT(humidity), COALESCE(SUM(humidity), 0), COALESCE(SUM(humidity ^ 2), 0),
+        MIN(humidity), MAX(humidity),
+
+        COUNT(pressure), COALESCE(SUM(pressure), 0), MIN(pressure), MAX(pressure),
+
+        COUNT(rainfall), COALESCE(SUM(rainfall), 0), COALESCE(SUM(rainfall ^ 2), 0),
+
+        COUNT(wind_speed), COALESCE(SUM(wind_speed), 0), COALESCE(SUM(wind_speed ^ 2), 0),
+        COALESCE(SUM(wind_speed * sin(radians(wind_direction))), 0),
+        COALESCE(SUM(wind_speed * cos(radians(wind_direction))), 0),
+        COALESCE(SUM(wind_speed * EXTRACT(EPOCH FROM (upper(time_range) - lower(time_range)))), 0),
+
+        MAX(gust_speed),
+        (array_agg(gust_direction ORDER BY gust_speed DESC NULLS LAST))[1],
+
+        COUNT(lux), COALESCE(SUM(lux), 0), MAX(lux),
+        COUNT(uvi), COALESCE(SUM(uvi), 0), MAX(uvi),
+        COUNT(solar_irradiance), COALESCE(SUM(solar_irradiance), 0)
+    FROM weather.weather_data
+    WHERE station_id = p_station AND lower(time_range) >= p_from AND lower(time_range) < p_to
+    GROUP BY 1, 2
+$$;
+
+-- Computes the hours of a station overlapping [p_from, p_to) again from weather.weather_data.
+-- The triggers go through it, a minimum or a maximum can not be taken back out of an hour, and it
+-- repairs a range by hand, after a fix with the triggers disabled for instance
+CREATE OR REPLACE FUNCTION weather.rebuild_hourly_partials(p_station bigint, p_from timestamptz,
+                                                           p_to timestamptz) RETURNS void
+LANGUAGE plpgsql AS $$
+DECLARE
+    -- Whole hours covering the range
+    v_from timestamptz := date_trunc('hour', p_from, 'UTC');
+    v_to timestamptz := date_trunc('hour', p_to, 'UTC');
+BEGIN
+    IF v_to < p_to THEN
+        v_to := v_to + interval '1 hour';
+    END IF;
+
+    DELETE FROM weather.weather_hourly_partials
+    WHERE station_id = p_station AND hour >= v_from AND hour < v_to;
+
+    INSERT INTO weather.weather_hourly_partials
+    SELECT * FROM weather.hourly_partials(p_station, v_from, v_to);
+END;
+$$;
+
+-- Each hour a statement touches is computed again, a batched COPY from the API only rereads the
+-- few readings already in its hours
+CREATE OR REPLACE FUNCTION weather.refresh_hourly_partials() RETURNS trigger
+LANGUAGE plpgsql AS $$
+DECLARE
+    k record;
+BEGIN
+    -- One hour at a time, each is a range scan of the (station_id, lower(time_range)) index
+    IF TG_OP = 'UPDATE' THEN
+        FOR k IN
+            SELECT station_id, date_trunc('hour', lower(time_range), 'UTC') AS hour FROM old_rows
+            UNION
+            SELECT station_id, date_trunc('hour', lower(time_range), 'UTC') FROM new_rows
+        LOOP
+            PERFORM weather.rebuild_hourly_partials(k.station_id, k.hour,
+                                                    k.hour + interval '1 hour');
+        END LOOP;
+    ELSIF TG_OP = 'INSERT' THEN
+        FOR k IN
+            SELECT DISTINCT station_id, date_trunc('hour', lower(time_range), 'UTC') AS hour
+            FROM new_rows
+        LOOP
+            PERFORM weather.rebuild_hourly_partials(k.station_id, k.hour,
+                                                    k.hour + interval '1 hour');
+        END LOOP;
+    ELSE
+        FOR k IN
+            SELECT DISTINCT station_id, date_trunc('hour', lower(time_range), 'UTC') AS hour
+            FROM old_rows
+        LOOP
+            PERFORM weather.rebuild_hourly_partials(k.station_id, k.hour,
+                                                    k.hour + interval '1 hour');
+        END LOOP;
+    END IF;
+
+    RETURN NULL;
+END;
+$$;
+
+CREATE OR REPLACE FUNCTION weather.truncate_hourly_partials() RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+    TRUNCATE weather.weather_hourly_partials;
+    RETURN NULL;
+END;
+$$;
+
+-- Transition tables need a trigger per event, once per statement so a batched COPY from the API
+-- handles each hour it touches a single time
+DROP TRIGGER IF EXISTS weather_hourly_partials_merge ON weather.weather_data;
+DROP FUNCTION IF EXISTS weather.merge_hourly_partials();
+
+DROP TRIGGER IF EXISTS weather_hourly_partials_insert ON weather.weather_data;
+CREATE TRIGGER weather_hourly_partials_insert
+    AFTER INSERT ON weather.weather_data
+    REFERENCING NEW TABLE AS new_rows
+    FOR EACH STATEMENT
+    EXECUTE FUNCTION weather.refresh_hourly_partials();
+
+DROP TRIGGER IF EXISTS weather_hourly_partials_update ON weather.weather_data;
+CREATE TRIGGER weather_hourly_partials_update
+    AFTER UPDATE ON weather.weather_data
+    REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows
+    FOR EACH STATEMENT
+    EXECUTE FUNCTION weather.refresh_hourly_partials();
+
+DROP TRIGGER IF EXISTS weather_hourly_partials_delete ON weather.weather_data;
+CREATE TRIGGER weather_hourly_partials_delete
+    AFTER DELETE ON weather.weather_data
+    REFERENCING OLD TABLE AS old_rows
+    FOR EACH STATEMENT
+    EXECUTE FUNCTION weather.refresh_hourly_partials();
+
+DROP TRIGGER IF EXISTS weather_hourly_partials_truncate ON weather.weather_data;
+CREATE TRIGGER weather_hourly_partials_truncate
+    AFTER TRUNCATE ON weather.weather_data
+    FOR EACH STATEMENT
+    EXECUTE FUNCTION weather.truncate_hourly_partials();
+
+-- Rebuilt from the existing data, a station at a time
+TRUNCATE weather.weather_hourly_partials;
+
+SELECT weather.rebuild_hourly_partials(station_id, '-infinity', 'infinity')
+FROM stations.stations;
+
+COMMIT;
@@ -0,0 +1,252 @@
+#include <libpq-fe.h>
+#include <pthread.h>
+#include <sodium/crypto_generichash.h>
+#include <sodium/utils.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../database/database.h"
+#include "../database/listener.h"
+#include "../utils/utils.h"
+#include "api_key_cache.h"
+#include "weather.h"
+
+#define API_KEYS_CHANNEL "api_keys"
+#define KEY_TYPE_SIZE 32
+
+typedef struct {
+    unsigned char keyHash[crypto_generichash_BYTES];
+    char keyType[KEY_TYPE_SIZE];
+    char stationDbId[STATION_DB_ID_SIZE];
+    char stationName[NAME_SIZE + 1];
+    char stationUUID[UUID_SIZE + 1];
+    time_t expiresAt; // 0 when the key never expires
+    bool used;
+} ApiKeyEntry;
+
+// Immutable once published, a reload builds a new one and swaps it in
+typedef struct {
+    ApiKeyEntry *entries;
+    size_t mask; // Open addressing over a power of two number of slots
+    size_t count;
+} ApiKeyTable;
+
+static pthread_rwlock_t tableLock = PTHREAD_RWLOCK_INITIALIZER;
+static ApiKeyTable *table = NULL;
+static bool synced = false; // Written under the write lock
+
+static bool cacheEnabled = true;
+
+// The hash is uniformly distributed, its first bytes are already a good slot index
+static size_t slot_of(const unsigned char *keyHash, size_t mask) {
+    uint64_t h;
+    memcpy(&h, keyHash, sizeof(h));
+    return (size_t)h & mask;
+}
+
+static void free_table(ApiKeyTable *t) {
+    if (!t)
+        return;
+
+    free(t->entries);
+    free(t);
+}
+
+static bool table_insert(ApiKeyTable *t, const ApiKeyEntry *entry) {
+    size_t slot = slot_of(entry->keyHash, t->mask);
+    while (t->entries[slot].used) {
+        // Keys are unique, a repeated hash means the row came twice
+        if (memcmp(t->entries[slot].keyHash, entry->keyHash, sizeof(entry->keyHash)) == 0)
+            return false;
+        slot = (slot + 1) & t->mask;
+    }
+
+    t->entries[slot] = *entry;
+    t->entries[slot].used = true;
+    t->count++;
+
+    return true;
+}
+
+static bool copy_field(char *dst, size_t dstLen, const PGresult *res, int row, int col) {
+    if (PQgetisnull(res, row, col) || (size_t)PQgetlength(res, row, col) >= dstLen)
+        return false;
+
+    memcpy(dst, PQgetvalue(res, row, col), (size_t)PQgetlength(res, row, col) + 1);
+    return true;
+}
+
+static ApiKeyTable *build_table(const PGresult *res) {
+    int nRows = PQntuples(res);
+
+    ApiKeyTable *t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+
+    // At most half full keeps the probe sequences short
+    size_t nSlots = 16;
+    while (nSlots < (size_t)nRows * 2)
+        nSlots <<= 1;
+
+    t->entries = calloc(nSlots, sizeof(*t->entries));
+    if (!t->entries) {
+        free(t);
+        return NULL;
+    }
+    t->mask = nSlots - 1;
+
+    for (int i = 0; i < nRows; i++) {
+        ApiKeyEntry entry;
+        memset(&entry, 0, sizeof(entry));
+
+        const char *keyHashB64 = PQgetvalue(res, i, 0);
+        size_t keyHashLen;
+        if (sodium_base642bin(entry.keyHash, sizeof(entry.keyHash), keyHashB64,
+                              strlen(keyHashB64), NULL, &keyHashLen, NULL, BASE64_VARIANT) != 0 ||
+            keyHashLen != sizeof(entry.keyHash))
+            continue;
+
+        if (!copy_field(entry.keyType, sizeof(entry.keyType), res, i, 1) ||
+            !copy_field(entry.stationDbId, sizeof(entry.stationDbId), res, i, 2) ||
+            !copy_field(entry.stationName, sizeof(entry.stationName), res, i, 3) ||
+            !copy_field(entry.stationUUID, sizeof(entry.stationUUID), res, i, 4))
+            continue;
+
+        if (!PQgetisnull(res, i, 5))
+            entry.expiresAt = (time_t)strtoll(PQgetvalue(res, i, 5), NULL, 10);
+
+        table_insert(t, &entry);
+    }
+
+    return t;
+}
+
+static void set_table(ApiKeyTable *newTable, bool isSynced) {
+    pthread_rwlock_wrlock(&tableLock);
+    ApiKeyTable *oldTable = table;
+    if (newTable)
+        table = newTable;
+    synced = isSynced;
+    pthread_rwlock_unlock(&tableLock);
+
+    if (newTable)
+        free_table(oldTable);
+}
+
+// Full reload, key changes are rare enough that diffing is not worth it
+static bool reload_api_keys(void) {
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
+        return false;
+
+    PGconn *conn = get_pg_conn(dbConn);
+
+    PGresult *res = PQexec(conn, "SELECT k.api_key, k.api_key_type, s.station_id::text, s.name, "
+                                 "  s.uuid::text, EXTRACT(EPOCH FROM k.expires_at)::bigint "
+                                 "FROM auth.api_keys k "
+                                 "JOIN stations.stations s ON k.station_id = s.station_id "
+                                 "WHERE k.revoked_at IS NULL "
+                                 "  AND (k.expires_at IS NULL OR k.expires_at > NOW()) "
+                                 "  AND s.deleted_at IS NULL");
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Error loading the API keys: %s", PQerrorMessage(conn));
+        PQclear(res);
+        release_conn(dbConn);
+        return false;
+    }
+
+    ApiKeyTable *newTable = build_table(res);
+    PQclear(res);
+    release_conn(dbConn);
+
+    if (!newTable)
+        return false;
+
+    set_table(newTable, true);
+    return true;
+}
+
+static void on_api_keys_event(listenerEvent_t event, const char *payload, void *cls) {
+    (void)payload;
+    (void)cls;
+
+    switch (event) {
+        case LISTENER_NOTIFY:
+        case LISTENER_CONNECTED:
+            // Until the reload succeeds the old table may still know revoked keys
+            if (!reload_api_keys())
+                set_table(NULL, false);
+            break;
+        case LISTENER_DISCONNECTED:
+            // Revocations are not seen anymore, everything goes to the database
+            set_table(NULL, false);
+            break;
+    }
+}
+
+bool init_api_key_cache(void) {
+    const char *enabledStr = getenv("API_KEY_CACHE");
+    if (enabledStr && strcmp(enabledStr, "0") == 0) {
+        cacheEnabled = false;
+        return true;
+    }
+
+    // The table is only trusted once the listener is connected
+    return listener_subscribe(API_KEYS_CHANNEL, on_api_keys_event, NULL);
+}
+
+void free_api_key_cache(void) {
+    pthread_rwlock_wrlock(&tableLock);
+    free_table(table);
+    table = NULL;
+    synced = false;
+    pthread_rwlock_unlock(&tableLock);
+}
+
+bool api_key_cache_validate(const char *apiKey, const char *keyType, const char *stationId,
+                            char *stationDbId, size_t stationDbIdLen) {
+    if (!cacheEnabled || !apiKey || !keyType || !stationId || !stationDbId)
+        return false;
+
+    unsigned char keyHash[crypto_generichash_BYTES];
+    if (!hash_api_key(apiKey, keyHash))
+        return false;
+
+    time_t now = time(NULL);
+    bool valid = false;
+
+    pthread_rwlock_rdlock(&tableLock);
+
+    if (synced && table) {
+        size_t slot = slot_of(keyHash, table->mask);
+        while (table->entries[slot].used) {
+            const ApiKeyEntry *entry = &table->entries[slot];
+            if (sodium_memcmp(entry->keyHash, keyHash, sizeof(keyHash)) == 0) {
+                valid = strcmp(entry->keyType, keyType) == 0 &&
+                        (entry->expiresAt == 0 || entry->expiresAt > now) &&
+                        (strcmp(entry->stationName, stationId) == 0 ||
+                         strcmp(entry->stationUUID, stationId) == 0);
+                if (valid)
+                    snprintf(stationDbId, stationDbIdLen, "%s", entry->stationDbId);
+                break;
+            }
+            slot = (slot + 1) & table->mask;
+        }
+    }
+
+    pthread_rwlock_unlock(&tableLock);
+
+    return valid;
+}
+
+void notify_api_keys_changed(PGconn *conn) {
+    PGresult *res = PQexec(conn, "NOTIFY " API_KEYS_CHANNEL);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        fprintf(stderr, "Error notifying the API key change: %s", PQerrorMessage(conn));
+    PQclear(res);
+}
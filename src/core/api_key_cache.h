@@ -0,0 +1,22 @@
+#ifndef API_KEY_CACHE_H
+#define API_KEY_CACHE_H
+
+#include <libpq-fe.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Loads every active station key and subscribes to the api_keys channel, must run before
+// start_listener
+bool init_api_key_cache(void);
+
+void free_api_key_cache(void);
+
+// True when the key is resident, valid for keyType and bound to stationId. False means the
+// caller has to ask the database, either the key is unknown or the cache is not in sync
+bool api_key_cache_validate(const char *apiKey, const char *keyType, const char *stationId,
+                            char *stationDbId, size_t stationDbIdLen);
+
+// Asks every instance to reload its keys once the current transaction commits
+void notify_api_keys_changed(PGconn *conn);
+
+#endif
@@ -50,4 +50,6 @@ typedef enum {
     GRANULARITY_YEAR
 } granularity_t;
 
+typedef enum { DATA_FORMAT_ROWS = 0, DATA_FORMAT_COLUMNS, DATA_FORMAT_INVALID } dataFormat_t;
+
 #endif
@@ -0,0 +1,413 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../utils/json_writer.h"
+#include "../utils/metrics.h"
+#include "../utils/utils.h"
+#include "live_feed.h"
+#include "weather.h"
+
+#define LIVE_CHANNEL_BUCKETS 1024 // Power of two
+#define LIVE_SUBSCRIBERS_DIVISOR 2 // Streams get at most this fraction of the connections
+#define DEFAULT_LIVE_BUFFER_SIZE 65536
+#define DEFAULT_LIVE_HEARTBEAT_S 15
+
+// First bytes of every stream, the reconnection delay of the EventSource
+#define LIVE_PREAMBLE "retry: 5000\n\n"
+// Comments are ignored by clients, they only make writes fail on dead connections
+#define LIVE_HEARTBEAT ": keepalive\n\n"
+#define LIVE_EVENT_PREFIX "event: reading\ndata: "
+#define LIVE_EVENT_SUFFIX "\n\n"
+
+// The subscribers of one station
+typedef struct LiveChannel {
+    char stationDbId[STATION_DB_ID_SIZE];
+    LiveSubscriber *subscribers;
+    struct LiveChannel *next;
+} LiveChannel;
+
+struct LiveSubscriber {
+    LiveChannel *channel; // NULL once closed, the reader then gets LIVE_FEED_END
+    LiveSubscriber *prev;
+    LiveSubscriber *next;
+    char *buf; // Events not read yet are buf[off] up to buf[len]
+    size_t off;
+    size_t len;
+    size_t cap;
+    liveWake_t wake;
+    void *wakeCls;
+};
+
+// One lock for the whole feed, publishing only copies into the buffers
+static pthread_mutex_t feedMutex = PTHREAD_MUTEX_INITIALIZER;
+static LiveChannel *channels[LIVE_CHANNEL_BUCKETS];
+static bool feedOpen = false;
+static int nSubscribers = 0;
+static uint64_t eventsTotal = 0;
+static uint64_t droppedTotal = 0;
+
+static int maxSubscribers = 0;
+static size_t bufferSize = DEFAULT_LIVE_BUFFER_SIZE;
+static int heartbeatS = DEFAULT_LIVE_HEARTBEAT_S;
+
+static pthread_t heartbeatThread;
+static bool heartbeatRunning = false;
+static bool heartbeatStop = false;
+static pthread_mutex_t heartbeatMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t heartbeatCond;
+
+// FNV-1a, ids are short
+static size_t channel_bucket(const char *stationDbId) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)stationDbId; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h & (LIVE_CHANNEL_BUCKETS - 1);
+}
+
+static LiveChannel *find_channel(const char *stationDbId, LiveChannel ***link) {
+    LiveChannel **p = &channels[channel_bucket(stationDbId)];
+    while (*p && strcmp((*p)->stationDbId, stationDbId) != 0)
+        p = &(*p)->next;
+
+    if (link)
+        *link = p;
+    return *p;
+}
+
+// Wakes are called with the lock held, so the subscriber cannot be freed meanwhile. They only
+// flag the connection to be resumed by MHD and never call back into the feed
+static void wake_subscriber(LiveSubscriber *subscriber) {
+    if (subscriber->wake)
+        subscriber->wake(subscriber->wakeCls);
+}
+
+// Takes the subscriber out of its channel, freeing the channel once it is empty
+static void detach_subscriber(LiveSubscriber *subscriber) {
+    LiveChannel *channel = subscriber->channel;
+    if (!channel)
+        return;
+
+    if (subscriber->prev)
+        subscriber->prev->next = subscriber->next;
+    else
+        channel->subscribers = subscriber->next;
+    if (subscriber->next)
+        subscriber->next->prev = subscriber->prev;
+
+    subscriber->channel = NULL;
+    subscriber->prev = subscriber->next = NULL;
+    nSubscribers--;
+
+    if (!channel->subscribers) {
+        LiveChannel **link;
+        find_channel(channel->stationDbId, &link);
+        *link = channel->next;
+        free(channel);
+    }
+}
+
+static void close_subscriber(LiveSubscriber *subscriber) {
+    detach_subscriber(subscriber);
+    free(subscriber->buf);
+    subscriber->buf = NULL;
+    subscriber->off = subscriber->len = subscriber->cap = 0;
+    wake_subscriber(subscriber);
+}
+
+// A client that falls bufferSize behind is dropped instead of buffering without end
+static bool append_events(LiveSubscriber *subscriber, const char *data, size_t len) {
+    size_t pending = subscriber->len - subscriber->off;
+    if (pending + len > bufferSize) {
+        droppedTotal++;
+        close_subscriber(subscriber);
+        return false;
+    }
+
+    if (subscriber->off > 0) {
+        memmove(subscriber->buf, subscriber->buf + subscriber->off, pending);
+        subscriber->off = 0;
+        subscriber->len = pending;
+    }
+
+    if (pending + len > subscriber->cap) {
+        size_t cap = subscriber->cap ? subscriber->cap : 1024;
+        while (cap < pending + len)
+            cap *= 2;
+        if (cap > bufferSize)
+            cap = bufferSize;
+
+        char *buf = realloc(subscriber->buf, cap);
+        if (!buf) {
+            close_subscriber(subscriber);
+            return false;
+        }
+        subscriber->buf = buf;
+        subscriber->cap = cap;
+    }
+
+    memcpy(subscriber->buf + subscriber->len, data, len);
+    subscriber->len += len;
+    return true;
+}
+
+static void *heartbeat_loop(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&heartbeatMutex);
+    while (!heartbeatStop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += heartbeatS;
+
+        pthread_cond_timedwait(&heartbeatCond, &heartbeatMutex, &deadline);
+        if (heartbeatStop)
+            break;
+        pthread_mutex_unlock(&heartbeatMutex);
+
+        // Only the idle ones, the rest get their writes checked by the events
+        pthread_mutex_lock(&feedMutex);
+        for (int bucket = 0; bucket < LIVE_CHANNEL_BUCKETS; bucket++) {
+            LiveChannel *channel = channels[bucket];
+            while (channel) {
+                LiveChannel *nextChannel = channel->next;
+                LiveSubscriber *subscriber = channel->subscribers;
+                while (subscriber) {
+                    LiveSubscriber *next = subscriber->next;
+                    if (subscriber->off == subscriber->len &&
+                        append_events(subscriber, LIVE_HEARTBEAT, strlen(LIVE_HEARTBEAT)))
+                        wake_subscriber(subscriber);
+                    subscriber = next;
+                }
+                channel = nextChannel;
+            }
+        }
+        pthread_mutex_unlock(&feedMutex);
+
+        pthread_mutex_lock(&heartbeatMutex);
+    }
+    pthread_mutex_unlock(&heartbeatMutex);
+
+    return NULL;
+}
+
+bool init_live_feed(int connectionLimit) {
+    // Each subscriber holds a connection for as long as it stays, the rest are left to requests
+    int subscriberLimit = connectionLimit / LIVE_SUBSCRIBERS_DIVISOR;
+    maxSubscribers = env_int("LIVE_MAX_SUBSCRIBERS", subscriberLimit, 0);
+    if (maxSubscribers > subscriberLimit) {
+        fprintf(stderr, "LIVE_MAX_SUBSCRIBERS is over a half of the %d connections, using %d\n",
+                connectionLimit, subscriberLimit);
+        maxSubscribers = subscriberLimit;
+    }
+    bufferSize = (size_t)env_int("LIVE_BUFFER_SIZE", DEFAULT_LIVE_BUFFER_SIZE, 4096);
+    // 0 disables the heartbeat, dead clients are then only noticed by the next event
+    heartbeatS = env_int("LIVE_HEARTBEAT_S", DEFAULT_LIVE_HEARTBEAT_S, 0);
+
+    pthread_mutex_lock(&feedMutex);
+    feedOpen = true;
+    pthread_mutex_unlock(&feedMutex);
+
+    if (heartbeatS == 0)
+        return true;
+
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0)
+        return false;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int ret = pthread_cond_init(&heartbeatCond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (ret != 0)
+        return false;
+
+    heartbeatStop = false;
+    if (pthread_create(&heartbeatThread, NULL, heartbeat_loop, NULL) != 0) {
+        fprintf(stderr, "Failed to start the live feed heartbeat thread\n");
+        pthread_cond_destroy(&heartbeatCond);
+        return false;
+    }
+    heartbeatRunning = true;
+
+    return true;
+}
+
+void free_live_feed(void) {
+    if (heartbeatRunning) {
+        pthread_mutex_lock(&heartbeatMutex);
+        heartbeatStop = true;
+        pthread_cond_signal(&heartbeatCond);
+        pthread_mutex_unlock(&heartbeatMutex);
+
+        pthread_join(heartbeatThread, NULL);
+        pthread_cond_destroy(&heartbeatCond);
+        heartbeatRunning = false;
+    }
+
+    // The subscribers themselves are freed by their responses
+    pthread_mutex_lock(&feedMutex);
+    feedOpen = false;
+    for (int bucket = 0; bucket < LIVE_CHANNEL_BUCKETS; bucket++) {
+        while (channels[bucket])
+            close_subscriber(channels[bucket]->subscribers);
+    }
+    pthread_mutex_unlock(&feedMutex);
+}
+
+bool live_feed_has_subscribers(const char *stationDbId) {
+    pthread_mutex_lock(&feedMutex);
+    bool found = find_channel(stationDbId, NULL) != NULL;
+    pthread_mutex_unlock(&feedMutex);
+    return found;
+}
+
+apiError_t live_feed_subscribe(const char *stationDbId, LiveSubscriber **subscriber) {
+    if (!stationDbId || !subscriber || strlen(stationDbId) >= STATION_DB_ID_SIZE)
+        return API_INVALID_PARAMS;
+
+    LiveSubscriber *sub = calloc(1, sizeof(LiveSubscriber));
+    if (!sub)
+        return API_MEMORY_ERROR;
+
+    pthread_mutex_lock(&feedMutex);
+    if (!feedOpen || nSubscribers >= maxSubscribers) {
+        pthread_mutex_unlock(&feedMutex);
+        free(sub);
+        return API_BUSY;
+    }
+
+    LiveChannel **link;
+    LiveChannel *channel = find_channel(stationDbId, &link);
+    if (!channel) {
+        channel = calloc(1, sizeof(LiveChannel));
+        if (!channel) {
+            pthread_mutex_unlock(&feedMutex);
+            free(sub);
+            return API_MEMORY_ERROR;
+        }
+        snprintf(channel->stationDbId, sizeof(channel->stationDbId), "%s", stationDbId);
+        *link = channel;
+    }
+
+    sub->channel = channel;
+    sub->next = channel->subscribers;
+    if (channel->subscribers)
+        channel->subscribers->prev = sub;
+    channel->subscribers = sub;
+    nSubscribers++;
+
+    bool ok = append_events(sub, LIVE_PREAMBLE, strlen(LIVE_PREAMBLE));
+    pthread_mutex_unlock(&feedMutex);
+
+    if (!ok) {
+        free(sub);
+        return API_MEMORY_ERROR;
+    }
+
+    *subscriber = sub;
+    return API_OK;
+}
+
+void live_feed_attach(LiveSubscriber *subscriber, liveWake_t wake, void *cls) {
+    pthread_mutex_lock(&feedMutex);
+    subscriber->wake = wake;
+    subscriber->wakeCls = cls;
+    pthread_mutex_unlock(&feedMutex);
+}
+
+ssize_t live_feed_read(LiveSubscriber *subscriber, char *buf, size_t max) {
+    pthread_mutex_lock(&feedMutex);
+    if (!subscriber->channel) {
+        pthread_mutex_unlock(&feedMutex);
+        return LIVE_FEED_END;
+    }
+
+    size_t len = subscriber->len - subscriber->off;
+    if (len > max)
+        len = max;
+
+    memcpy(buf, subscriber->buf + subscriber->off, len);
+    subscriber->off += len;
+    if (subscriber->off == subscriber->len)
+        subscriber->off = subscriber->len = 0;
+    pthread_mutex_unlock(&feedMutex);
+
+    return (ssize_t)len;
+}
+
+void live_feed_unsubscribe(LiveSubscriber *subscriber) {
+    if (!subscriber)
+        return;
+
+    pthread_mutex_lock(&feedMutex);
+    detach_subscriber(subscriber);
+    pthread_mutex_unlock(&feedMutex);
+
+    free(subscriber->buf);
+    free(subscriber);
+}
+
+void live_feed_publish(const char *stationDbId, const char *readings, size_t len) {
+    // Framed once, outside the lock, then copied to every subscriber
+    StrBuf events;
+    if (!strbuf_init(&events, len + 64))
+        return;
+
+    size_t nEvents = 0;
+    const char *p = readings;
+    const char *end = readings + len;
+    while (p < end) {
+        const char *lineEnd = memchr(p, '\n', (size_t)(end - p));
+        if (!lineEnd)
+            lineEnd = end;
+
+        if (lineEnd > p) {
+            if (!strbuf_append_str(&events, LIVE_EVENT_PREFIX) ||
+                !strbuf_append(&events, p, (size_t)(lineEnd - p)) ||
+                !strbuf_append_str(&events, LIVE_EVENT_SUFFIX)) {
+                strbuf_free(&events);
+                return;
+            }
+            nEvents++;
+        }
+        p = lineEnd + 1;
+    }
+
+    pthread_mutex_lock(&feedMutex);
+    LiveChannel *channel = find_channel(stationDbId, NULL);
+    if (channel) {
+        LiveSubscriber *subscriber = channel->subscribers;
+        while (subscriber) {
+            // The last one dropped frees the channel too
+            LiveSubscriber *next = subscriber->next;
+            if (append_events(subscriber, events.data, events.len))
+                wake_subscriber(subscriber);
+            subscriber = next;
+        }
+        eventsTotal += nEvents;
+    }
+    pthread_mutex_unlock(&feedMutex);
+
+    strbuf_free(&events);
+}
+
+bool live_feed_write_metrics(StrBuf *out) {
+    pthread_mutex_lock(&feedMutex);
+    double subscribers = nSubscribers;
+    double events = (double)eventsTotal;
+    double dropped = (double)droppedTotal;
+    pthread_mutex_unlock(&feedMutex);
+
+    return metrics_write_value(out, "picoweather_live_subscribers", "gauge",
+                               "Connections following a live station feed.", subscribers) &&
+           metrics_write_value(out, "picoweather_live_events_total", "counter",
+                               "Readings published to the live feeds with a subscriber.",
+                               events) &&
+           metrics_write_value(out, "picoweather_live_dropped_total", "counter",
+                               "Subscribers closed for falling too far behind.", dropped);
+}
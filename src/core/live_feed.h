@@ -0,0 +1,45 @@
+#ifndef LIVE_FEED_H
+#define LIVE_FEED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "../utils/json_writer.h"
+#include "weather.h"
+
+// Returned by live_feed_read once the subscription was closed
+#define LIVE_FEED_END -1
+
+// Called when a subscriber that had nothing to read gets data or is closed
+typedef void (*liveWake_t)(void *cls);
+
+typedef struct LiveSubscriber LiveSubscriber;
+
+// Starts the heartbeat thread. LIVE_MAX_SUBSCRIBERS defaults to, and is capped at, a half of the
+// connectionLimit of the HTTP server
+bool init_live_feed(int connectionLimit);
+
+// Closes every subscription and wakes its reader, before the HTTP server stops
+void free_live_feed(void);
+
+// Cheap check done before building the events of an upload
+bool live_feed_has_subscribers(const char *stationDbId);
+
+// API_BUSY once LIVE_MAX_SUBSCRIBERS are connected
+apiError_t live_feed_subscribe(const char *stationDbId, LiveSubscriber **subscriber);
+
+// Events published before the wake callback is set are kept for the first read
+void live_feed_attach(LiveSubscriber *subscriber, liveWake_t wake, void *cls);
+
+// Copies up to max bytes of pending events, 0 when there are none yet, LIVE_FEED_END when closed
+ssize_t live_feed_read(LiveSubscriber *subscriber, char *buf, size_t max);
+
+void live_feed_unsubscribe(LiveSubscriber *subscriber);
+
+// readings holds one JSON object per line, each sent to the subscribers as an event
+void live_feed_publish(const char *stationDbId, const char *readings, size_t len);
+
+bool live_feed_write_metrics(StrBuf *out);
+
+#endif
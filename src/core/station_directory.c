@@ -0,0 +1,648 @@
+#include <jansson.h>
+#include <libpq-fe.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../database/database.h"
+#include "../database/listener.h"
+#include "../utils/json_writer.h"
+#include "../utils/utils.h"
+#include "station_directory.h"
+#include "weather.h"
+
+#define STATIONS_CHANNEL "stations"
+
+// Uniform lon/lat grid of the spatial index
+#define GRID_CELL_DEG 1.0
+#define GRID_COLS 360
+#define GRID_ROWS 180
+#define GRID_CELLS (GRID_COLS * GRID_ROWS)
+
+#define EARTH_RADIUS_KM 6371.0088
+#define DEG_TO_RAD 0.017453292519943295
+
+typedef struct {
+    char stationDbId[STATION_DB_ID_SIZE];
+    char name[NAME_SIZE + 1];
+    char uuid[UUID_SIZE + 1];
+    double lon;
+    double lat;
+    char *json; // Serialized as GET /stations/{id} returns it
+    char *jsonPretty;
+} StationEntry;
+
+// Immutable once published, a reload builds a new one and swaps it in
+typedef struct {
+    StationEntry *entries;
+    size_t count;
+    // Open addressing over a power of two number of slots, holding entry index + 1
+    uint32_t *byName;
+    uint32_t *byUUID;
+    size_t mask;
+    char *listJson; // Every station, as GET /stations returns them
+    char *listJsonPretty;
+    // Entry indexes bucketed by grid cell, the ones of cell c are cellEntries[cellStart[c]] up
+    // to cellEntries[cellStart[c + 1]]
+    uint32_t *cellStart;
+    uint32_t *cellEntries;
+    uint32_t *cells; // The cells holding any station
+    size_t nCells;
+} StationTable;
+
+typedef struct {
+    double distanceKm;
+    uint32_t entry;
+} StationMatch;
+
+static pthread_rwlock_t tableLock = PTHREAD_RWLOCK_INITIALIZER;
+static StationTable *table = NULL;
+static bool synced = false; // Written under the write lock
+
+static bool directoryEnabled = true;
+
+// FNV-1a, names and UUIDs are short
+static size_t hash_string(const char *str) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+static void free_table(StationTable *t) {
+    if (!t)
+        return;
+
+    for (size_t i = 0; i < t->count; i++) {
+        free(t->entries[i].json);
+        free(t->entries[i].jsonPretty);
+    }
+    free(t->entries);
+    free(t->byName);
+    free(t->byUUID);
+    free(t->listJson);
+    free(t->listJsonPretty);
+    free(t->cellStart);
+    free(t->cellEntries);
+    free(t->cells);
+    free(t);
+}
+
+static void index_insert(uint32_t *slots, size_t mask, const char *key, uint32_t entry) {
+    size_t slot = hash_string(key) & mask;
+    while (slots[slot])
+        slot = (slot + 1) & mask;
+    slots[slot] = entry;
+}
+
+// Names and UUIDs are unique among the stations that are not deleted
+static const StationEntry *index_find(const StationTable *t, const char *key) {
+    // Names are at most NAME_SIZE long, so only a UUID can be UUID_SIZE long
+    bool isUUID = strlen(key) == UUID_SIZE;
+    const uint32_t *slots = isUUID ? t->byUUID : t->byName;
+
+    size_t slot = hash_string(key) & t->mask;
+    while (slots[slot]) {
+        const StationEntry *entry = &t->entries[slots[slot] - 1];
+        if (strcmp(isUUID ? entry->uuid : entry->name, key) == 0)
+            return entry;
+        slot = (slot + 1) & t->mask;
+    }
+
+    return NULL;
+}
+
+static bool copy_field(char *dst, size_t dstLen, const PGresult *res, int row, int col) {
+    if (PQgetisnull(res, row, col) || (size_t)PQgetlength(res, row, col) >= dstLen)
+        return false;
+
+    memcpy(dst, PQgetvalue(res, row, col), (size_t)PQgetlength(res, row, col) + 1);
+    return true;
+}
+
+// Same shape pgresult_to_json gives the stations query
+static json_t *station_to_json(const PGresult *res, int row) {
+    return json_pack("{s:s, s:s, s:f, s:f, s:f}", "uuid", PQgetvalue(res, row, 0), "name",
+                     PQgetvalue(res, row, 1), "lon", atof(PQgetvalue(res, row, 2)), "lat",
+                     atof(PQgetvalue(res, row, 3)), "alt", atof(PQgetvalue(res, row, 4)));
+}
+
+static int grid_col(double lon) {
+    int col = (int)floor((lon + 180.0) / GRID_CELL_DEG);
+    return col < 0 ? 0 : col >= GRID_COLS ? GRID_COLS - 1 : col;
+}
+
+static int grid_row(double lat) {
+    int row = (int)floor((lat + 90.0) / GRID_CELL_DEG);
+    return row < 0 ? 0 : row >= GRID_ROWS ? GRID_ROWS - 1 : row;
+}
+
+static int grid_cell(const StationEntry *entry) {
+    return grid_row(entry->lat) * GRID_COLS + grid_col(entry->lon);
+}
+
+static bool build_grid(StationTable *t) {
+    t->cellStart = calloc(GRID_CELLS + 1, sizeof(*t->cellStart));
+    t->cellEntries = calloc(t->count > 0 ? t->count : 1, sizeof(*t->cellEntries));
+    t->cells = calloc(t->count > 0 ? t->count : 1, sizeof(*t->cells));
+    if (!t->cellStart || !t->cellEntries || !t->cells)
+        return false;
+
+    // Counted, turned into offsets and filled, from the end so each cell keeps the entry order
+    for (size_t i = 0; i < t->count; i++)
+        t->cellStart[grid_cell(&t->entries[i]) + 1]++;
+
+    for (int c = 0; c < GRID_CELLS; c++) {
+        if (t->cellStart[c + 1] > 0)
+            t->cells[t->nCells++] = (uint32_t)c;
+        t->cellStart[c + 1] += t->cellStart[c];
+    }
+
+    for (size_t i = t->count; i-- > 0;)
+        t->cellEntries[--t->cellStart[grid_cell(&t->entries[i]) + 1]] = (uint32_t)i;
+
+    // The fill left every offset one cell behind
+    for (int c = 0; c < GRID_CELLS; c++)
+        t->cellStart[c] = t->cellStart[c + 1];
+    t->cellStart[GRID_CELLS] = (uint32_t)t->count;
+
+    return true;
+}
+
+static StationTable *build_table(const PGresult *res) {
+    int nRows = PQntuples(res);
+
+    StationTable *t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+
+    // At most half full keeps the probe sequences short
+    size_t nSlots = 16;
+    while (nSlots < (size_t)nRows * 2)
+        nSlots <<= 1;
+
+    t->mask = nSlots - 1;
+    t->entries = calloc(nRows > 0 ? (size_t)nRows : 1, sizeof(*t->entries));
+    t->byName = calloc(nSlots, sizeof(*t->byName));
+    t->byUUID = calloc(nSlots, sizeof(*t->byUUID));
+    json_t *list = json_array();
+    if (!t->entries || !t->byName || !t->byUUID || !list) {
+        json_decref(list);
+        free_table(t);
+        return NULL;
+    }
+
+    for (int i = 0; i < nRows; i++) {
+        StationEntry *entry = &t->entries[t->count];
+
+        if (!copy_field(entry->uuid, sizeof(entry->uuid), res, i, 0) ||
+            !copy_field(entry->name, sizeof(entry->name), res, i, 1) ||
+            !copy_field(entry->stationDbId, sizeof(entry->stationDbId), res, i, 5))
+            continue;
+
+        json_t *station = station_to_json(res, i);
+        if (!station || json_array_append(list, station) != 0) {
+            json_decref(station);
+            json_decref(list);
+            free_table(t);
+            return NULL;
+        }
+
+        entry->lon = atof(PQgetvalue(res, i, 2));
+        entry->lat = atof(PQgetvalue(res, i, 3));
+        entry->json = json_dumps(station, JSON_COMPACT);
+        entry->jsonPretty = json_dumps(station, JSON_INDENT(2));
+        json_decref(station);
+        t->count++;
+
+        if (!entry->json || !entry->jsonPretty) {
+            json_decref(list);
+            free_table(t);
+            return NULL;
+        }
+
+        index_insert(t->byName, t->mask, entry->name, (uint32_t)t->count);
+        index_insert(t->byUUID, t->mask, entry->uuid, (uint32_t)t->count);
+    }
+
+    t->listJson = json_dumps(list, JSON_COMPACT);
+    t->listJsonPretty = json_dumps(list, JSON_INDENT(2));
+    json_decref(list);
+
+    if (!t->listJson || !t->listJsonPretty || !build_grid(t)) {
+        free_table(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+static void set_table(StationTable *newTable, bool isSynced) {
+    pthread_rwlock_wrlock(&tableLock);
+    StationTable *oldTable = table;
+    if (newTable)
+        table = newTable;
+    synced = isSynced;
+    pthread_rwlock_unlock(&tableLock);
+
+    if (newTable)
+        free_table(oldTable);
+}
+
+// Full reload, stations change far less often than they are read
+static bool reload_stations(void) {
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
+        return false;
+
+    PGconn *conn = get_pg_conn(dbConn);
+
+    PGresult *res = PQexec(conn, "SELECT "
+                                 "uuid, "
+                                 "name, "
+                                 "ST_X(location::geometry) AS lon, "
+                                 "ST_Y(location::geometry) AS lat, "
+                                 "COALESCE(ST_Z(location::geometry), 0) AS alt, "
+                                 "station_id::text "
+                                 "FROM stations.stations "
+                                 "WHERE deleted_at IS NULL "
+                                 "ORDER BY station_id");
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Error loading the stations: %s", PQerrorMessage(conn));
+        PQclear(res);
+        release_conn(dbConn);
+        return false;
+    }
+
+    StationTable *newTable = build_table(res);
+    PQclear(res);
+    release_conn(dbConn);
+
+    if (!newTable)
+        return false;
+
+    set_table(newTable, true);
+    return true;
+}
+
+static void on_stations_event(listenerEvent_t event, const char *payload, void *cls) {
+    (void)payload;
+    (void)cls;
+
+    switch (event) {
+        case LISTENER_NOTIFY:
+        case LISTENER_CONNECTED:
+            // Until the reload succeeds the old table may still know deleted stations
+            if (!reload_stations())
+                set_table(NULL, false);
+            break;
+        case LISTENER_DISCONNECTED:
+            // Changes are not seen anymore, everything goes to the database
+            set_table(NULL, false);
+            break;
+    }
+}
+
+bool init_station_directory(void) {
+    const char *enabledStr = getenv("STATION_DIRECTORY");
+    if (enabledStr && strcmp(enabledStr, "0") == 0) {
+        directoryEnabled = false;
+        return true;
+    }
+
+    // The table is only trusted once the listener is connected
+    return listener_subscribe(STATIONS_CHANNEL, on_stations_event, NULL);
+}
+
+void free_station_directory(void) {
+    pthread_rwlock_wrlock(&tableLock);
+    free_table(table);
+    table = NULL;
+    synced = false;
+    pthread_rwlock_unlock(&tableLock);
+}
+
+stationLookup_t station_directory_lookup(const char *stationId, char *stationDbId,
+                                         size_t stationDbIdLen) {
+    if (!directoryEnabled || !stationId || !stationDbId)
+        return STATION_UNSYNCED;
+
+    stationLookup_t result = STATION_UNSYNCED;
+
+    pthread_rwlock_rdlock(&tableLock);
+
+    if (synced && table) {
+        const StationEntry *entry = index_find(table, stationId);
+        if (entry) {
+            snprintf(stationDbId, stationDbIdLen, "%s", entry->stationDbId);
+            result = STATION_FOUND;
+        }
+        else {
+            result = STATION_UNKNOWN;
+        }
+    }
+
+    pthread_rwlock_unlock(&tableLock);
+
+    return result;
+}
+
+stationLookup_t station_directory_json(const char *stationId, bool pretty, char **json) {
+    if (!directoryEnabled || !json)
+        return STATION_UNSYNCED;
+
+    stationLookup_t result = STATION_UNSYNCED;
+    const char *source = NULL;
+
+    pthread_rwlock_rdlock(&tableLock);
+
+    if (synced && table) {
+        if (stationId) {
+            const StationEntry *entry = index_find(table, stationId);
+            if (entry)
+                source = pretty ? entry->jsonPretty : entry->json;
+        }
+        // An empty list is a 404, as it is from the database
+        else if (table->count > 0) {
+            source = pretty ? table->listJsonPretty : table->listJson;
+        }
+
+        result = STATION_UNKNOWN;
+        if (source) {
+            // A NULL json with STATION_FOUND means the copy failed
+            *json = strdup(source);
+            result = STATION_FOUND;
+        }
+    }
+
+    pthread_rwlock_unlock(&tableLock);
+
+    return result;
+}
+
+void notify_stations_changed(PGconn *conn) {
+    PGresult *res = PQexec(conn, "NOTIFY " STATIONS_CHANNEL);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        fprintf(stderr, "Error notifying the station change: %s", PQerrorMessage(conn));
+    PQclear(res);
+}
+
+void station_directory_refresh(void) {
+    pthread_rwlock_rdlock(&tableLock);
+    bool isSynced = synced;
+    pthread_rwlock_unlock(&tableLock);
+
+    // Until the listener connects the directory is not used, it loads once it does
+    if (!directoryEnabled || !isSynced)
+        return;
+
+    if (!reload_stations())
+        set_table(NULL, false);
+}
+
+static double distance_km(double lon1, double lat1, double lon2, double lat2) {
+    double dLat = (lat2 - lat1) * DEG_TO_RAD;
+    double dLon = (lon2 - lon1) * DEG_TO_RAD;
+    double a = sin(dLat / 2) * sin(dLat / 2) +
+               cos(lat1 * DEG_TO_RAD) * cos(lat2 * DEG_TO_RAD) * sin(dLon / 2) * sin(dLon / 2);
+    return 2 * EARTH_RADIUS_KM * asin(sqrt(a < 1 ? a : 1));
+}
+
+static bool in_lon_range(double lon, double minLon, double maxLon) {
+    if (minLon <= maxLon)
+        return lon >= minLon && lon <= maxLon;
+    return lon >= minLon || lon <= maxLon; // Across the antimeridian
+}
+
+static int compare_entry(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Every station in the box, in the order of the directory and at most limit of them
+static size_t search_box(const StationTable *t, const StationArea *area, size_t limit,
+                         StationMatch *matches) {
+    int firstRow = grid_row(area->minLat), lastRow = grid_row(area->maxLat);
+    int firstCol = grid_col(area->minLon), lastCol = grid_col(area->maxLon);
+
+    uint32_t *found = malloc((t->count > 0 ? t->count : 1) * sizeof(*found));
+    if (!found)
+        return 0;
+
+    // Columns wrap around when the box crosses the antimeridian
+    int nCols;
+    if (area->minLon <= area->maxLon)
+        nCols = lastCol - firstCol + 1;
+    else if (firstCol == lastCol)
+        nCols = GRID_COLS;
+    else
+        nCols = (lastCol - firstCol + GRID_COLS) % GRID_COLS + 1;
+
+    size_t nFound = 0;
+    for (int row = firstRow; row <= lastRow; row++) {
+        for (int k = 0; k < nCols; k++) {
+            int c = row * GRID_COLS + (firstCol + k) % GRID_COLS;
+            for (uint32_t i = t->cellStart[c]; i < t->cellStart[c + 1]; i++) {
+                const StationEntry *entry = &t->entries[t->cellEntries[i]];
+                if (entry->lat >= area->minLat && entry->lat <= area->maxLat &&
+                    in_lon_range(entry->lon, area->minLon, area->maxLon))
+                    found[nFound++] = t->cellEntries[i];
+            }
+        }
+    }
+
+    qsort(found, nFound, sizeof(*found), compare_entry);
+
+    size_t count = nFound < limit ? nFound : limit;
+    for (size_t i = 0; i < count; i++) {
+        matches[i].entry = found[i];
+        matches[i].distanceKm = 0;
+    }
+
+    free(found);
+    return count;
+}
+
+typedef struct {
+    double boundKm; // No station of the cell is closer than this
+    uint32_t cell;
+} CellBound;
+
+static int compare_bound(const void *a, const void *b) {
+    double x = ((const CellBound *)a)->boundKm, y = ((const CellBound *)b)->boundKm;
+    return (x > y) - (x < y);
+}
+
+static int compare_distance(const void *a, const void *b) {
+    double x = ((const StationMatch *)a)->distanceKm, y = ((const StationMatch *)b)->distanceKm;
+    return (x > y) - (x < y);
+}
+
+// Keeps the limit closest matches in a max heap on distance
+static void heap_push(StationMatch *heap, size_t *size, size_t limit, StationMatch match) {
+    size_t i;
+    if (*size < limit) {
+        i = (*size)++;
+        while (i > 0 && heap[(i - 1) / 2].distanceKm < match.distanceKm) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = match;
+        return;
+    }
+
+    if (match.distanceKm >= heap[0].distanceKm)
+        return;
+
+    // Replaces the farthest one and sifts down
+    i = 0;
+    for (;;) {
+        size_t child = i * 2 + 1;
+        if (child >= *size)
+            break;
+        if (child + 1 < *size && heap[child + 1].distanceKm > heap[child].distanceKm)
+            child++;
+        if (heap[child].distanceKm <= match.distanceKm)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = match;
+}
+
+// The limit stations closest to the point. Cells are visited from the closest one their center
+// and size allow, and the search ends once no unvisited cell can hold a closer station
+static size_t search_nearest(const StationTable *t, const StationArea *area, size_t limit,
+                             StationMatch *matches) {
+    CellBound *bounds = malloc((t->nCells > 0 ? t->nCells : 1) * sizeof(*bounds));
+    if (!bounds)
+        return 0;
+
+    for (size_t i = 0; i < t->nCells; i++) {
+        int row = (int)(t->cells[i] / GRID_COLS), col = (int)(t->cells[i] % GRID_COLS);
+        double south = row * GRID_CELL_DEG - 90.0, west = col * GRID_CELL_DEG - 180.0;
+        double centerLat = south + GRID_CELL_DEG / 2, centerLon = west + GRID_CELL_DEG / 2;
+
+        // Bounds every point of the cell from its center. The corners of the edge closest to the
+        // equator are the farthest, that edge being the widest, the max of both keeps it true
+        // without relying on which one it is
+        double southRadius = distance_km(centerLon, centerLat, west, south);
+        double northRadius = distance_km(centerLon, centerLat, west, south + GRID_CELL_DEG);
+        double radius = southRadius > northRadius ? southRadius : northRadius;
+        double bound = distance_km(area->lon, area->lat, centerLon, centerLat) - radius;
+
+        bounds[i].boundKm = bound > 0 ? bound : 0;
+        bounds[i].cell = t->cells[i];
+    }
+
+    qsort(bounds, t->nCells, sizeof(*bounds), compare_bound);
+
+    size_t count = 0;
+    for (size_t i = 0; i < t->nCells; i++) {
+        if (count == limit && bounds[i].boundKm >= matches[0].distanceKm)
+            break;
+
+        uint32_t c = bounds[i].cell;
+        for (uint32_t j = t->cellStart[c]; j < t->cellStart[c + 1]; j++) {
+            const StationEntry *entry = &t->entries[t->cellEntries[j]];
+            StationMatch match = {distance_km(area->lon, area->lat, entry->lon, entry->lat),
+                                  t->cellEntries[j]};
+            heap_push(matches, &count, limit, match);
+        }
+    }
+
+    free(bounds);
+
+    qsort(matches, count, sizeof(*matches), compare_distance);
+    return count;
+}
+
+// The compact station objects as a JSON array, each with its distance_km when nearest
+static char *write_matches(const StationTable *t, const StationMatch *matches, size_t count,
+                           bool nearest) {
+    StrBuf out;
+    if (!strbuf_init(&out, count * 128 + 2) || !strbuf_append_char(&out, '['))
+        return NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        const char *json = t->entries[matches[i].entry].json;
+        size_t len = strlen(json);
+        bool ok = (i == 0 || strbuf_append_char(&out, ','));
+
+        if (ok && nearest) {
+            // Spliced in before the closing brace of the serialized object
+            char distance[48];
+            snprintf(distance, sizeof(distance), ",\"distance_km\":%.3f}", matches[i].distanceKm);
+            ok = strbuf_append(&out, json, len - 1) && strbuf_append_str(&out, distance);
+        }
+        else if (ok) {
+            ok = strbuf_append(&out, json, len);
+        }
+
+        if (!ok) {
+            strbuf_free(&out);
+            return NULL;
+        }
+    }
+
+    if (!strbuf_append_char(&out, ']')) {
+        strbuf_free(&out);
+        return NULL;
+    }
+
+    return strbuf_release(&out);
+}
+
+stationLookup_t station_directory_search(const StationArea *area, size_t limit, bool pretty,
+                                         char **json, char (*uuids)[UUID_SIZE + 1],
+                                         size_t *count) {
+    if (!directoryEnabled || !area || limit == 0)
+        return STATION_UNSYNCED;
+
+    StationMatch *matches = malloc(limit * sizeof(*matches));
+    if (!matches)
+        return STATION_UNSYNCED;
+
+    stationLookup_t result = STATION_UNSYNCED;
+
+    pthread_rwlock_rdlock(&tableLock);
+
+    if (synced && table) {
+        size_t nMatches = area->nearest ? search_nearest(table, area, limit, matches)
+                                        : search_box(table, area, limit, matches);
+
+        if (uuids) {
+            for (size_t i = 0; i < nMatches; i++)
+                memcpy(uuids[i], table->entries[matches[i].entry].uuid, UUID_SIZE + 1);
+        }
+        if (count)
+            *count = nMatches;
+
+        result = STATION_FOUND;
+        if (json) {
+            // A NULL json with STATION_FOUND means the copy failed
+            *json = write_matches(table, matches, nMatches, area->nearest);
+        }
+    }
+
+    pthread_rwlock_unlock(&tableLock);
+
+    free(matches);
+
+    // Indented from the compact copy, outside the lock
+    if (result == STATION_FOUND && json && *json && pretty) {
+        json_t *parsed = json_loads(*json, 0, NULL);
+        free(*json);
+        *json = parsed ? json_dumps(parsed, JSON_INDENT(2)) : NULL;
+        json_decref(parsed);
+    }
+
+    return result;
+}
@@ -0,0 +1,44 @@
+#ifndef STATION_DIRECTORY_H
+#define STATION_DIRECTORY_H
+
+#include <libpq-fe.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../utils/utils.h"
+#include "weather.h"
+
+typedef enum {
+    STATION_FOUND = 0,
+    STATION_UNKNOWN, // No station with that name or UUID
+    STATION_UNSYNCED // The directory may be stale, the caller has to ask the database
+} stationLookup_t;
+
+// Subscribes to the stations channel, must run before start_listener. The directory loads once
+// the listener connects
+bool init_station_directory(void);
+
+void free_station_directory(void);
+
+// Resolves a station name or UUID to its internal station_id
+stationLookup_t station_directory_lookup(const char *stationId, char *stationDbId,
+                                         size_t stationDbIdLen);
+
+// The serialized station, or the array of every station when stationId is NULL. The caller
+// frees json
+stationLookup_t station_directory_json(const char *stationId, bool pretty, char **json);
+
+// The stations of the area from the spatial index, at most limit of them. Fills json with their
+// array when set, and uuids, with room for limit, when set
+stationLookup_t station_directory_search(const StationArea *area, size_t limit, bool pretty,
+                                         char **json, char (*uuids)[UUID_SIZE + 1],
+                                         size_t *count);
+
+// Asks every instance to reload its directory once the current transaction commits
+void notify_stations_changed(PGconn *conn);
+
+// Reloads the directory of this instance right away, so the next request of the client that
+// just created a station finds it without waiting for the notification to come back
+void station_directory_refresh(void);
+
+#endif
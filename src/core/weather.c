@@ -1,28 +1,55 @@
+#include "../core/api_key_cache.h"
+#include "../core/live_feed.h"
+#include "../core/station_directory.h"
 #include "../core/weather.h"
+#include "../database/copy_batcher.h"
 #include "../database/database.h"
+#include "../database/reactor.h"
 #include "../http/server.h"
+#include "../utils/admission.h"
+#include "../utils/downsample.h"
+#include "../utils/json_writer.h"
+#include "../utils/metrics.h"
+#include "../utils/pwhash_pool.h"
+#include "../utils/query_text.h"
+#include "../utils/response_cache.h"
+#include "../utils/session_cache.h"
 #include "../utils/utils.h"
 #include "flags.h"
 #include <jansson.h>
 #include <libpq-fe.h>
+#include <math.h>
 #include <sodium/crypto_generichash.h>
-#include <sodium/crypto_pwhash.h>
 #include <sodium/utils.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+static apiError_t pwhash_error(pwhashResult_t result) {
+    switch (result) {
+        case PWHASH_MISMATCH:
+            return API_AUTH_ERROR;
+        case PWHASH_BUSY:
+            return API_BUSY;
+        default:
+            return API_MEMORY_ERROR;
+    }
+}
 
 apiError_t users_list(const char *userId, const struct AuthData *authData, json_t **users) {
     if (!authData || !authData->sessionToken || !users)
         return API_AUTH_ERROR;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
+    PGconn *conn = get_pg_conn(dbConn);
+
     if (!validate_session_token(conn, userId, authData->sessionToken)) {
-        release_conn(conn);
+        release_conn(dbConn);
         return API_AUTH_ERROR;
     }
 
@@ -38,13 +65,13 @@ apiError_t users_list(const char *userId, const struct AuthData *authData, json_
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_NOT_FOUND;
     }
 
@@ -55,13 +82,13 @@ apiError_t users_list(const char *userId, const struct AuthData *authData, json_
 
     if (!*users) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_JSON_ERROR;
     }
 
     PQclear(res);
 
-    release_conn(conn);
+    release_conn(dbConn);
 
     return API_OK;
 }
@@ -79,15 +106,16 @@ apiError_t users_create(const char *username, const char *email, const char *pas
 
     char hashedPassword[crypto_pwhash_STRBYTES];
 
-    if (crypto_pwhash_str(hashedPassword, password, strlen(password),
-                          crypto_pwhash_OPSLIMIT_MODERATE, crypto_pwhash_MEMLIMIT_MODERATE) != 0) {
-        return API_MEMORY_ERROR;
-    }
+    pwhashResult_t hashResult = pwhash_create(password, hashedPassword);
+    if (hashResult != PWHASH_OK)
+        return pwhash_error(hashResult);
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
+    PGconn *conn = get_pg_conn(dbConn);
+
     PGresult *res = NULL;
 
     const char *paramValues[3] = {username, email, hashedPassword};
@@ -100,7 +128,7 @@ apiError_t users_create(const char *username, const char *email, const char *pas
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
@@ -115,26 +143,26 @@ apiError_t users_create(const char *username, const char *email, const char *pas
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_NOT_FOUND;
     }
 
     *user = pgresult_to_json(res, true);
     if (!*user) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_JSON_ERROR;
     }
 
     PQclear(res);
 
-    release_conn(conn);
+    release_conn(dbConn);
 
     return API_OK;
 }
@@ -143,12 +171,14 @@ apiError_t users_delete(const char *userId, const struct AuthData *authData) {
     if (!authData || !authData->sessionToken)
         return API_AUTH_ERROR;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
+    PGconn *conn = get_pg_conn(dbConn);
+
     if (!validate_session_token(conn, userId, authData->sessionToken)) {
-        release_conn(conn);
+        release_conn(dbConn);
         return API_AUTH_ERROR;
     }
 
@@ -165,13 +195,15 @@ apiError_t users_delete(const char *userId, const struct AuthData *authData) {
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     PQclear(res);
 
-    release_conn(conn);
+    session_cache_invalidate_user(userId);
+
+    release_conn(dbConn);
 
     return API_OK;
 }
@@ -191,35 +223,30 @@ apiError_t users_patch(const char *userId, const char *username, const char *ema
     if (email && !validate_email(email))
         return API_INVALID_PARAMS;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    // Changing the password needs both of them
+    if (newPass && !oldPass)
+        return API_AUTH_ERROR;
+    if (oldPass && !newPass)
+        return API_INVALID_PARAMS;
+
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
+    PGconn *conn = get_pg_conn(dbConn);
+
     if (!validate_session_token(conn, userId, authData->sessionToken)) {
-        release_conn(conn);
+        release_conn(dbConn);
         return API_AUTH_ERROR;
     }
 
     const char *paramValues[6] = {userId, username, email, NULL, NULL, NULL};
 
-    char hashedPasswordBuf[crypto_pwhash_STRBYTES];
-    const char *hashedPassPtr = NULL;
-    // Atempt to change password
-    if (oldPass || newPass) {
-        if (validate_password(conn, userId, oldPass)) {
-            // Calculate the password hash
-            if (crypto_pwhash_str(hashedPasswordBuf, newPass, strlen(newPass),
-                                  crypto_pwhash_OPSLIMIT_MODERATE,
-                                  crypto_pwhash_MEMLIMIT_MODERATE) != 0) {
-                return API_MEMORY_ERROR;
-            }
-            hashedPassPtr = hashedPasswordBuf;
-        }
-        else {
-            return API_AUTH_ERROR;
-        }
+    char storedHash[crypto_pwhash_STRBYTES];
+    if (oldPass && !get_password_hash(conn, userId, storedHash, sizeof(storedHash))) {
+        release_conn(dbConn);
+        return API_AUTH_ERROR;
     }
-    paramValues[5] = hashedPassPtr;
 
     char maxStationsBuf[20];
     const char *maxStationsStr = NULL;
@@ -241,6 +268,26 @@ apiError_t users_patch(const char *userId, const char *username, const char *ema
         paramValues[4] = isAdminStr;
     }
 
+    // Atempt to change password, the hashing pool runs without holding the connection
+    char hashedPasswordBuf[crypto_pwhash_STRBYTES];
+    if (oldPass) {
+        release_conn(dbConn);
+
+        pwhashResult_t hashResult = pwhash_verify(storedHash, oldPass);
+        if (hashResult == PWHASH_OK)
+            hashResult = pwhash_create(newPass, hashedPasswordBuf);
+        if (hashResult != PWHASH_OK)
+            return pwhash_error(hashResult);
+
+        paramValues[5] = hashedPasswordBuf;
+
+        dbConn = get_conn();
+        if (!dbConn)
+            return API_DB_ERROR;
+
+        conn = get_pg_conn(dbConn);
+    }
+
     PGresult *res;
 
     res = PQexecParams(
@@ -258,27 +305,27 @@ apiError_t users_patch(const char *userId, const char *username, const char *ema
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_NOT_FOUND;
     }
 
     *user = pgresult_to_json(res, true);
     if (!*user) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_JSON_ERROR;
     }
 
     PQclear(res);
 
     // Revoke all active sessions only on password change or username change
-    if (hashedPassPtr || username) {
+    if (oldPass || username) {
         res = PQexecParams(
             conn,
             "UPDATE auth.user_sessions "
@@ -289,13 +336,19 @@ apiError_t users_patch(const char *userId, const char *username, const char *ema
         if (PQresultStatus(res) != PGRES_COMMAND_OK) {
             fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
             PQclear(res);
-            release_conn(conn);
+            release_conn(dbConn);
+            // The users update went through, the cached sessions are stale all the same
+            session_cache_invalidate_user(userId);
             return API_DB_ERROR;
         }
         PQclear(res);
     }
 
-    release_conn(conn);
+    // Cached sessions may carry the old username or admin flag. Only once they are revoked, a
+    // lookup in between would put a session about to be revoked back in the cache
+    session_cache_invalidate_user(userId);
+
+    release_conn(dbConn);
 
     return API_OK;
 }
@@ -306,13 +359,30 @@ apiError_t sessions_create(const char *userId, const struct AuthData *authData,
     if (!userId || !password || !sessionToken)
         return API_AUTH_ERROR;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    char storedHash[crypto_pwhash_STRBYTES];
+
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
-    if (!validate_password(conn, userId, password))
+    bool userFound = get_password_hash(get_pg_conn(dbConn), userId, storedHash,
+                                       sizeof(storedHash));
+    release_conn(dbConn);
+
+    if (!userFound)
         return API_AUTH_ERROR;
 
+    // The connection goes back to the pool while Argon2 runs
+    pwhashResult_t hashResult = pwhash_verify(storedHash, password);
+    if (hashResult != PWHASH_OK)
+        return pwhash_error(hashResult);
+
+    dbConn = get_conn();
+    if (!dbConn)
+        return API_DB_ERROR;
+
+    PGconn *conn = get_pg_conn(dbConn);
+
     char hashB64[sodium_base64_ENCODED_LEN(crypto_generichash_BYTES, BASE64_VARIANT)];
 
     generate_session_token(sessionToken, sessionTokenLen, hashB64, sizeof(hashB64));
@@ -336,6 +406,7 @@ apiError_t sessions_create(const char *userId, const struct AuthData *authData,
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
@@ -351,44 +422,133 @@ apiError_t sessions_create(const char *userId, const struct AuthData *authData,
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_NOT_FOUND;
     }
 
     *session = pgresult_to_json(res, true);
     if (!*session) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_JSON_ERROR;
     }
 
     PQclear(res);
 
-    release_conn(conn);
+    release_conn(dbConn);
+
+    return API_OK;
+}
+
+// Keyset of the row a page starts after and its LIMIT, before every row on the first page. No
+// LIMIT when the list is not paged
+typedef struct {
+    bool paged;
+    char afterTime[PAGE_TIME_SIZE];
+    char afterId[PAGE_ID_SIZE];
+    char limit[16];
+} PageParams;
+
+// False for a limit out of range or a cursor of another list
+static bool page_params(const PageRequest *page, char tag, bool withId, PageParams *params) {
+    params->paged = page && page->limit > 0;
+    snprintf(params->afterTime, sizeof(params->afterTime), "-infinity");
+    snprintf(params->afterId, sizeof(params->afterId), "00000000-0000-0000-0000-000000000000");
+    params->limit[0] = '\0';
+
+    if (!params->paged)
+        return true;
+
+    if (page->limit > PAGE_MAX_LIMIT)
+        return false;
+
+    // One row past the page tells whether another one follows
+    snprintf(params->limit, sizeof(params->limit), "%d", page->limit + 1);
+
+    return !page->cursor || page_cursor_decode(page->cursor, tag, params->afterTime,
+                                               withId ? params->afterId : NULL);
+}
+
+static const char *page_limit_param(const PageParams *params) {
+    return params->paged ? params->limit : NULL;
+}
+
+// The cursor of the page after the first page->limit rows of res, NULL in *nextCursor when they
+// are all there is or page is NULL. idColumn is -1 for the lists keyed by time alone
+static apiError_t next_page_cursor(PGresult *res, const PageRequest *page, char tag,
+                                   int timeColumn, int idColumn, char **nextCursor) {
+    *nextCursor = NULL;
+    if (!page || page->limit <= 0 || PQntuples(res) <= page->limit)
+        return API_OK;
+
+    int last = page->limit - 1;
+    *nextCursor = page_cursor_encode(tag, PQgetvalue(res, last, timeColumn),
+                                     idColumn >= 0 ? PQgetvalue(res, last, idColumn) : NULL);
+    return *nextCursor ? API_OK : API_MEMORY_ERROR;
+}
+
+// Serializes a paged list, leaving out the row fetched past the page
+static apiError_t page_to_json(PGresult *res, const PageParams *params, const PageRequest *page,
+                               char tag, bool canBeObject, json_t **rows, char **nextCursor) {
+    char *cursor;
+    apiError_t code = next_page_cursor(res, params->paged ? page : NULL, tag,
+                                       PQfnumber(res, "created_at"), PQfnumber(res, "uuid"),
+                                       &cursor);
+    if (code != API_OK)
+        return code;
+
+    *rows = pgresult_to_json(res, canBeObject);
+    if (!*rows) {
+        free(cursor);
+        return API_JSON_ERROR;
+    }
+
+    if (cursor)
+        json_array_remove(*rows, (size_t)page->limit);
+
+    if (nextCursor)
+        *nextCursor = cursor;
+    else
+        free(cursor);
 
     return API_OK;
 }
 
 apiError_t sessions_list(const char *userId, const char *sessionUUID,
-                         const struct AuthData *authData, json_t **sessions) {
+                         const struct AuthData *authData, const PageRequest *page,
+                         json_t **sessions, char **nextCursor) {
     if (!authData || !authData->sessionToken || !userId)
         return API_INVALID_PARAMS;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    if (nextCursor)
+        *nextCursor = NULL;
+
+    // A single session is never paged
+    PageParams pageParams;
+    if (!page_params(sessionUUID ? NULL : page, PAGE_CURSOR_SESSIONS, true, &pageParams))
+        return API_INVALID_PARAMS;
+
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
-    if (!validate_session_token(conn, userId, authData->sessionToken))
+    PGconn *conn = get_pg_conn(dbConn);
+
+    if (!validate_session_token(conn, userId, authData->sessionToken)) {
+        release_conn(dbConn);
         return API_AUTH_ERROR;
+    }
 
-    const char *paramValues[2] = {userId, sessionUUID};
+    const char *paramValues[5] = {userId, sessionUUID, pageParams.afterTime, pageParams.afterId,
+                                  page_limit_param(&pageParams)};
 
+    // Keyset pagination, a page costs the same however far in the list it is
     PGresult *res = PQexecParams(conn,
                                  "SELECT s.created_at, "
                                  "s.last_seen_at, s.expires_at, s.reauth_at, s.ip_address, "
@@ -398,38 +558,34 @@ apiError_t sessions_list(const char *userId, const char *sessionUUID,
                                  "WHERE s.expires_at > NOW() "
                                  "  AND s.revoked_at IS NULL "
                                  "  AND (u.uuid::text = $1::text OR u.username = $1::text) "
-                                 "  AND ($2::text IS NULL OR s.uuid::text = $2::text)",
-                                 2, NULL, paramValues, NULL, NULL, 0);
+                                 "  AND ($2::text IS NULL OR s.uuid::text = $2::text) "
+                                 "  AND ($5::bigint IS NULL "
+                                 "       OR (s.created_at, s.uuid) > ($3::timestamptz, $4::uuid)) "
+                                 "ORDER BY s.created_at, s.uuid "
+                                 "LIMIT $5::bigint",
+                                 5, NULL, paramValues, NULL, NULL, 0);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_NOT_FOUND;
     }
 
-    if (!sessionUUID)
-        *sessions = pgresult_to_json(res, false);
-    else
-        *sessions = pgresult_to_json(res, true);
-
-    if (!*sessions) {
-        PQclear(res);
-        release_conn(conn);
-        return API_JSON_ERROR;
-    }
+    apiError_t code = page_to_json(res, &pageParams, page, PAGE_CURSOR_SESSIONS,
+                                   sessionUUID != NULL, sessions, nextCursor);
 
     PQclear(res);
 
-    release_conn(conn);
+    release_conn(dbConn);
 
-    return API_OK;
+    return code;
 }
 
 apiError_t sessions_delete(const char *userId, const char *sessionUUID,
@@ -437,12 +593,14 @@ apiError_t sessions_delete(const char *userId, const char *sessionUUID,
     if (!authData || !authData->sessionToken)
         return API_AUTH_ERROR;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
+    PGconn *conn = get_pg_conn(dbConn);
+
     if (!validate_session_token(conn, userId, authData->sessionToken)) {
-        release_conn(conn);
+        release_conn(dbConn);
         return API_AUTH_ERROR;
     }
 
@@ -458,13 +616,15 @@ apiError_t sessions_delete(const char *userId, const char *sessionUUID,
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     PQclear(res);
 
-    release_conn(conn);
+    session_cache_invalidate_session(sessionUUID);
+
+    release_conn(dbConn);
 
     return API_OK;
 }
@@ -477,14 +637,16 @@ apiError_t stations_create(const char *name, double lon, double lat, double alt,
     if (!validate_name(name))
         return API_INVALID_PARAMS;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
+    PGconn *conn = get_pg_conn(dbConn);
+
     char *userUUID = NULL;
 
     if (!get_user_session_token(conn, &userUUID, authData->sessionToken)) {
-        release_conn(conn);
+        release_conn(dbConn);
         return API_AUTH_ERROR;
     }
 
@@ -516,38 +678,50 @@ apiError_t stations_create(const char *name, double lon, double lat, double alt,
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_FORBIDDEN;
     }
 
     *station = pgresult_to_json(res, true);
     if (!*station) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_JSON_ERROR;
     }
 
     PQclear(res);
 
-    release_conn(conn);
+    // Every instance reloads its station directory, this one at once
+    notify_stations_changed(conn);
+
+    release_conn(dbConn);
+
+    station_directory_refresh();
 
     return API_OK;
 }
 
-apiError_t stations_list(const char *stationId, json_t **stations) {
+apiError_t stations_list(const char *stationId, bool pretty, char **stations) {
     if (!stations)
         return API_INVALID_PARAMS;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    // A miss is asked to the database, the station may have been created on another instance
+    // whose notification has not reached this one yet
+    if (station_directory_json(stationId, pretty, stations) == STATION_FOUND)
+        return *stations ? API_OK : API_MEMORY_ERROR;
+
+    ConnWrapper *dbConn = get_read_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
+    PGconn *conn = get_pg_conn(dbConn);
+
     const char *paramValues[1] = {stationId};
 
     PGresult *res = PQexecParams(conn,
@@ -565,34 +739,138 @@ apiError_t stations_list(const char *stationId, json_t **stations) {
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_NOT_FOUND;
     }
 
-    if (!stationId)
-        *stations = pgresult_to_json(res, false);
-    else
-        *stations = pgresult_to_json(res, true);
+    json_t *json = pgresult_to_json(res, stationId != NULL);
 
-    if (!*stations) {
-        PQclear(res);
-        release_conn(conn);
+    PQclear(res);
+
+    release_conn(dbConn);
+
+    if (!json)
         return API_JSON_ERROR;
+
+    *stations = json_dumps(json, pretty ? JSON_INDENT(2) : JSON_COMPACT);
+    json_decref(json);
+
+    return *stations ? API_OK : API_MEMORY_ERROR;
+}
+
+// The station directory's search done by PostGIS, for when the directory is not in sync
+static apiError_t query_station_area(PGconn *conn, const StationArea *area, size_t limit,
+                                     PGresult **res) {
+    char values[5][32];
+    const char *paramValues[5];
+    int nParams;
+    const char *command;
+
+    if (area->nearest) {
+        snprintf(values[0], sizeof(values[0]), "%.9g", area->lon);
+        snprintf(values[1], sizeof(values[1]), "%.9g", area->lat);
+        snprintf(values[2], sizeof(values[2]), "%zu", limit);
+        nParams = 3;
+        command = "SELECT "
+                  "uuid, "
+                  "name, "
+                  "ST_X(location::geometry) AS lon, "
+                  "ST_Y(location::geometry) AS lat, "
+                  "COALESCE(ST_Z(location::geometry), 0) AS alt, "
+                  "round((ST_Distance(location, ST_SetSRID(ST_MakePoint($1, $2), 4326)::geography)"
+                  " / 1000)::numeric, 3)::float8 AS distance_km "
+                  "FROM stations.stations "
+                  "WHERE deleted_at IS NULL "
+                  "ORDER BY location <-> ST_SetSRID(ST_MakePoint($1, $2), 4326)::geography "
+                  "LIMIT $3;";
+    }
+    else {
+        snprintf(values[0], sizeof(values[0]), "%.9g", area->minLon);
+        snprintf(values[1], sizeof(values[1]), "%.9g", area->minLat);
+        snprintf(values[2], sizeof(values[2]), "%.9g", area->maxLon);
+        snprintf(values[3], sizeof(values[3]), "%.9g", area->maxLat);
+        snprintf(values[4], sizeof(values[4]), "%zu", limit);
+        nParams = 5;
+        // Split in two envelopes when the box crosses the antimeridian
+        command = "SELECT "
+                  "uuid, "
+                  "name, "
+                  "ST_X(location::geometry) AS lon, "
+                  "ST_Y(location::geometry) AS lat, "
+                  "COALESCE(ST_Z(location::geometry), 0) AS alt "
+                  "FROM stations.stations "
+                  "WHERE deleted_at IS NULL "
+                  "AND CASE WHEN $1::float8 <= $3::float8 "
+                  "  THEN location::geometry && ST_MakeEnvelope($1, $2, $3, $4, 4326) "
+                  "  ELSE location::geometry && ST_MakeEnvelope($1, $2, 180, $4, 4326) "
+                  "    OR location::geometry && ST_MakeEnvelope(-180, $2, $3, $4, 4326) END "
+                  "ORDER BY station_id "
+                  "LIMIT $5;";
     }
 
-    PQclear(res);
+    for (int i = 0; i < nParams; i++)
+        paramValues[i] = values[i];
+
+    *res = PQexecParams(conn, command, nParams, NULL, paramValues, NULL, NULL, 0);
 
-    release_conn(conn);
+    if (PQresultStatus(*res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
+        PQclear(*res);
+        *res = NULL;
+        return API_DB_ERROR;
+    }
 
     return API_OK;
 }
 
+static bool valid_station_area(const StationArea *area, size_t limit) {
+    if (!area || limit == 0 || limit > STATION_SEARCH_MAX_LIMIT)
+        return false;
+
+    if (area->nearest)
+        return area->lon >= -180 && area->lon <= 180 && area->lat >= -90 && area->lat <= 90;
+
+    return area->minLon >= -180 && area->minLon <= 180 && area->maxLon >= -180 &&
+           area->maxLon <= 180 && area->minLat >= -90 && area->maxLat <= 90 &&
+           area->minLat <= area->maxLat;
+}
+
+apiError_t stations_search(const StationArea *area, size_t limit, bool pretty, char **stations) {
+    if (!valid_station_area(area, limit) || !stations)
+        return API_INVALID_PARAMS;
+
+    if (station_directory_search(area, limit, pretty, stations, NULL, NULL) == STATION_FOUND)
+        return *stations ? API_OK : API_MEMORY_ERROR;
+
+    ConnWrapper *dbConn = get_read_conn();
+    if (!dbConn)
+        return API_DB_ERROR;
+
+    PGresult *res;
+    apiError_t code = query_station_area(get_pg_conn(dbConn), area, limit, &res);
+    release_conn(dbConn);
+
+    if (code != API_OK)
+        return code;
+
+    json_t *json = pgresult_to_json(res, false);
+    PQclear(res);
+
+    if (!json)
+        return API_JSON_ERROR;
+
+    *stations = json_dumps(json, pretty ? JSON_INDENT(2) : JSON_COMPACT);
+    json_decref(json);
+
+    return *stations ? API_OK : API_MEMORY_ERROR;
+}
+
 apiError_t api_key_create(const char *name, const char *keyType, const char *stationId,
                           const char *userId, const struct AuthData *authData, json_t **key) {
     if (!authData || !authData->sessionToken)
@@ -601,12 +879,16 @@ apiError_t api_key_create(const char *name, const char *keyType, const char *sta
     if (!validate_name(name) || !name || !keyType || !stationId)
         return API_INVALID_PARAMS;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
-    if (!validate_session_token(conn, userId, authData->sessionToken))
+    PGconn *conn = get_pg_conn(dbConn);
+
+    if (!validate_session_token(conn, userId, authData->sessionToken)) {
+        release_conn(dbConn);
         return API_AUTH_ERROR;
+    }
 
     char tokenB64[sodium_base64_ENCODED_LEN(KEY_ENTROPY, BASE64_VARIANT)];
     char hashB64[sodium_base64_ENCODED_LEN(crypto_generichash_BYTES, BASE64_VARIANT)];
@@ -642,46 +924,60 @@ apiError_t api_key_create(const char *name, const char *keyType, const char *sta
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_NOT_FOUND;
     }
 
     *key = pgresult_to_json(res, true);
     if (!*key) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_JSON_ERROR;
     }
 
     PQclear(res);
 
-    release_conn(conn);
+    notify_api_keys_changed(conn);
+
+    release_conn(dbConn);
 
     return API_OK;
 }
 
 apiError_t api_key_list(const char *userId, const char *keyId, const struct AuthData *authData,
-                        json_t **keys) {
+                        const PageRequest *page, json_t **keys, char **nextCursor) {
     if (!authData || !authData->sessionToken)
         return API_AUTH_ERROR;
 
     if (!userId)
         return API_INVALID_PARAMS;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    if (nextCursor)
+        *nextCursor = NULL;
+
+    PageParams pageParams;
+    if (!page_params(keyId ? NULL : page, PAGE_CURSOR_API_KEYS, true, &pageParams))
+        return API_INVALID_PARAMS;
+
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
-    if (!validate_session_token(conn, userId, authData->sessionToken))
+    PGconn *conn = get_pg_conn(dbConn);
+
+    if (!validate_session_token(conn, userId, authData->sessionToken)) {
+        release_conn(dbConn);
         return API_AUTH_ERROR;
+    }
 
-    const char *paramValues[2] = {userId, keyId};
+    const char *paramValues[5] = {userId, keyId, pageParams.afterTime, pageParams.afterId,
+                                  page_limit_param(&pageParams)};
 
     PGresult *res = PQexecParams(
         conn,
@@ -698,38 +994,33 @@ apiError_t api_key_list(const char *userId, const char *keyId, const struct Auth
         "WHERE (k.expires_at IS NULL OR k.expires_at > NOW()) "
         "  AND k.revoked_at IS NULL "
         "  AND (u.uuid::text = $1::text OR u.username::text = $1::text) "
-        "  AND ($2::text IS NULL OR k.uuid::text = $2::text OR k.name::text = $2::text)",
-        2, NULL, paramValues, NULL, NULL, 0);
+        "  AND ($2::text IS NULL OR k.uuid::text = $2::text OR k.name::text = $2::text) "
+        "  AND ($5::bigint IS NULL OR (k.created_at, k.uuid) > ($3::timestamptz, $4::uuid)) "
+        "ORDER BY k.created_at, k.uuid "
+        "LIMIT $5::bigint",
+        5, NULL, paramValues, NULL, NULL, 0);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_NOT_FOUND;
     }
 
-    if (!keyId)
-        *keys = pgresult_to_json(res, false);
-    else
-        *keys = pgresult_to_json(res, true);
-
-    if (!*keys) {
-        PQclear(res);
-        release_conn(conn);
-        return API_JSON_ERROR;
-    }
+    apiError_t code = page_to_json(res, &pageParams, page, PAGE_CURSOR_API_KEYS, keyId != NULL,
+                                   keys, nextCursor);
 
     PQclear(res);
 
-    release_conn(conn);
+    release_conn(dbConn);
 
-    return API_OK;
+    return code;
 }
 
 apiError_t api_key_delete(const char *userId, const char *keyId, const struct AuthData *authData) {
@@ -739,12 +1030,14 @@ apiError_t api_key_delete(const char *userId, const char *keyId, const struct Au
     if (!userId || !keyId)
         return API_INVALID_PARAMS;
 
-    PGconn *conn = get_conn();
-    if (!conn)
+    ConnWrapper *dbConn = get_conn();
+    if (!dbConn)
         return API_DB_ERROR;
 
+    PGconn *conn = get_pg_conn(dbConn);
+
     if (!validate_session_token(conn, userId, authData->sessionToken)) {
-        release_conn(conn);
+        release_conn(dbConn);
         return API_AUTH_ERROR;
     }
 
@@ -760,103 +1053,1595 @@ apiError_t api_key_delete(const char *userId, const char *keyId, const struct Au
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
+        release_conn(dbConn);
         return API_DB_ERROR;
     }
 
     PQclear(res);
 
-    release_conn(conn);
+    // Revocations reach the upload key caches of every instance
+    notify_api_keys_changed(conn);
+
+    release_conn(dbConn);
 
     return API_OK;
 }
 
-apiError_t weather_data_list(int fields, const char *granularityStr, const char *stationId,
-                             const char *timezone, const char *startTime, const char *endTime,
-                             json_t **weatherData) {
-    if (!timezone || !startTime || !endTime || !weatherData || !granularityStr)
-        return API_INVALID_PARAMS;
-
-    if (fields < 0)
-        return API_INVALID_PARAMS;
+// Binary results, encoded by the JSON writer without Postgres printing every float first
+#define WEATHER_RESULT_FORMAT 1
+
+typedef struct {
+    char name[STMT_NAME_SIZE];
+    const char *paramValues[7];
+    int nParams;
+    char stationDbId[STATION_DB_ID_SIZE];
+    PageParams page;
+} WeatherStatement;
+
+static const char *weatherQueryNames[] = {"static", "generic", "partials"};
+
+// Set from HOURLY_PARTIALS, the table and its trigger come from sql/weather_hourly_partials.sql
+static bool usePartials = false;
+
+static weatherQuery_t choose_weather_query(const WeatherQuery *query, granularity_t granularity) {
+    if (granularity == GRANULARITY_DATA)
+        return WEATHER_QUERY_STATIC;
+
+    // The stored summaries follow the periods of DEFAULT_TIMEZONE
+    if (same_timezone_offset_during_range(query->startTime, query->endTime, query->timezone,
+                                          DEFAULT_TIMEZONE))
+        return WEATHER_QUERY_STATIC;
+
+    // DEFAULT_TIMEZONE is on whole hour offsets, so are the hours of other timezones that only
+    // shift by whole hours. Their hours are the stored ones and longer periods can be merged from
+    // the hourly partials
+    if (whole_hour_offset_during_range(query->startTime, query->endTime, query->timezone)) {
+        if (granularity == GRANULARITY_HOUR)
+            return WEATHER_QUERY_STATIC;
+        if (usePartials)
+            return WEATHER_QUERY_PARTIALS;
+    }
 
-    PGconn *conn = get_conn();
-    if (!conn)
-        return API_DB_ERROR;
+    // Half hour zones and anything else go through the raw data
+    return WEATHER_QUERY_GENERIC;
+}
 
-    PGresult *res = NULL;
+// The internal station_id of a station name or UUID, API_NOT_FOUND when there is none
+static apiError_t resolve_station(PGconn *conn, const char *stationId, char *stationDbId) {
+    // Only a hit is trusted, a station created on another instance is missing until its
+    // notification arrives, and the indexed lookup below is cheap next to a wrong 404
+    if (station_directory_lookup(stationId, stationDbId, STATION_DB_ID_SIZE) == STATION_FOUND)
+        return API_OK;
 
-    char quoteQuery[256];
-    snprintf(quoteQuery, sizeof(quoteQuery), "SELECT quote_literal('%s');", timezone);
+    // Names are never as long as a UUID, so only one of the indexes has to be searched
+    const char *paramValues[1] = {stationId};
+    PGresult *res = PQexecParams(conn,
+                                 validate_uuid(stationId)
+                                     ? "SELECT station_id::text FROM stations.stations "
+                                       "WHERE uuid = $1::uuid AND deleted_at IS NULL;"
+                                     : "SELECT station_id::text FROM stations.stations "
+                                       "WHERE name = $1 AND deleted_at IS NULL;",
+                                 1, NULL, paramValues, NULL, NULL, 0);
 
-    res = PQexec(conn, quoteQuery);
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "Error quoting literal: %s\n", PQerrorMessage(conn));
+        fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
-        release_conn(conn);
         return API_DB_ERROR;
     }
 
-    char *escapedTz = PQgetvalue(res, 0, 0);
-
-    char queryTz[512];
-    snprintf(queryTz, sizeof(queryTz), "SET TIME ZONE %s;", escapedTz);
+    if (PQntuples(res) == 0 || PQgetlength(res, 0, 0) >= STATION_DB_ID_SIZE) {
+        PQclear(res);
+        return API_NOT_FOUND;
+    }
 
+    snprintf(stationDbId, STATION_DB_ID_SIZE, "%s", PQgetvalue(res, 0, 0));
     PQclear(res);
-    res = PQexec(conn, queryTz);
 
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
-        PQclear(res);
-        release_conn(conn);
-        return API_DB_ERROR;
+    return API_OK;
+}
+
+// Moves the connection to the timezone and makes sure the statement answering the request is
+// prepared on it. Without query->stationId the station parameter is left to the caller
+static apiError_t prepare_weather_statement(ConnWrapper *dbConn, const WeatherQuery *query,
+                                            WeatherStatement *stmt) {
+    stmt->paramValues[0] = NULL;
+    if (!page_params(&query->page, PAGE_CURSOR_WEATHER, false, &stmt->page))
+        return API_INVALID_PARAMS;
+
+    if (query->stationId) {
+        apiError_t code = resolve_station(get_pg_conn(dbConn), query->stationId,
+                                          stmt->stationDbId);
+        if (code != API_OK)
+            return code;
+        stmt->paramValues[0] = stmt->stationDbId;
     }
-    PQclear(res);
 
-    char *query;
-    granularity_t granularity = string_to_granularity(granularityStr);
+    // Only touches the session when the connection was left on another timezone
+    if (!set_conn_timezone(dbConn, query->timezone))
+        return API_DB_ERROR;
+
+    granularity_t granularity = string_to_granularity(query->granularity);
+
+    weatherQuery_t kind = choose_weather_query(query, granularity);
+    bool paged = stmt->page.paged;
+    int baseParams = kind == WEATHER_QUERY_STATIC ? 4 : 5;
+    stmt->nParams = paged ? baseParams + 2 : baseParams;
+
+    int fields = normalize_weather_fields(kind, granularity, query->fields);
+
+    // One prepared statement per (kind, granularity, fields, paged) and connection
+    snprintf(stmt->name, sizeof(stmt->name), "weather_%s_%d_%d%s", weatherQueryNames[kind],
+             (int)granularity, fields, paged ? "_paged" : "");
+
+    if (!conn_statement_prepared(dbConn, stmt->name)) {
+        const char *queryText = lookup_weather_query(kind, granularity, fields, paged);
+
+        // Only when the shared table is full
+        char *builtText = NULL;
+        if (!queryText) {
+            builtText = build_weather_query(kind, granularity, fields, paged);
+            if (!builtText)
+                return API_MEMORY_ERROR;
+
+            queryText = builtText;
+        }
+
+        bool prepared = conn_prepare_statement(dbConn, stmt->name, queryText, stmt->nParams);
+        free(builtText);
 
-    // Cannot use static data
-    bool sameTimezone =
-        same_timezone_offset_during_range(startTime, endTime, timezone, DEFAULT_TIMEZONE);
+        if (!prepared)
+            return API_DB_ERROR;
+    }
 
-    if (!sameTimezone && granularity != GRANULARITY_DATA) {
-        query = build_generic_weather_query(fields);
+    stmt->paramValues[1] = query->startTime;
+    stmt->paramValues[2] = query->endTime;
+    if (kind != WEATHER_QUERY_STATIC) {
+        stmt->paramValues[3] = query->granularity;
+        stmt->paramValues[4] = query->timezone;
     }
     else {
-        query = build_static_query(fields, granularity);
+        stmt->paramValues[3] = query->timezone;
+        stmt->paramValues[4] = NULL;
     }
 
-    if (!query) {
-        release_conn(conn);
-        return API_MEMORY_ERROR;
+    // The period_start the page comes after, then its LIMIT
+    if (paged) {
+        stmt->paramValues[baseParams] = stmt->page.afterTime;
+        stmt->paramValues[baseParams + 1] = stmt->page.limit;
+    }
+
+    return API_OK;
+}
+
+static bool valid_weather_query(const WeatherQuery *query) {
+    if (!query || !query->timezone || !query->startTime || !query->endTime ||
+        !query->granularity)
+        return false;
+
+    // Both ends are wall times of query->timezone
+    if (!validate_local_timestamp(query->startTime) || !validate_local_timestamp(query->endTime))
+        return false;
+
+    return query->fields >= 0 && query->format != DATA_FORMAT_INVALID &&
+           (query->maxPoints == 0 || query->maxPoints >= DOWNSAMPLE_MIN_POINTS) &&
+           query->page.limit >= 0 && query->page.limit <= PAGE_MAX_LIMIT;
+}
+
+// Strings are length prefixed so no combination of parameters can build another one's key
+static bool build_cache_key(const WeatherQuery *query, char *key, size_t keySize) {
+    int len = snprintf(key, keySize, "%zu:%s%zu:%s%zu:%s%zu:%s%zu:%s|%d|%d|%d|%d",
+                       strlen(query->stationId), query->stationId, strlen(query->granularity),
+                       query->granularity, strlen(query->timezone), query->timezone,
+                       strlen(query->startTime), query->startTime, strlen(query->endTime),
+                       query->endTime, query->fields, (int)query->format, (int)query->pretty,
+                       query->maxPoints);
+
+    return len > 0 && (size_t)len < keySize;
+}
+
+// Summaries of a period are only final once it is over and late uploads had time to land
+static bool range_is_closed(const WeatherQuery *query, granularity_t granularity) {
+    // The last row overlapping endTime can extend up to a whole period past it
+    time_t periodLength;
+    switch (granularity) {
+        case GRANULARITY_HOUR:
+            periodLength = 3600;
+            break;
+        case GRANULARITY_DAY:
+            periodLength = 86400;
+            break;
+        case GRANULARITY_MONTH:
+            periodLength = 31 * 86400;
+            break;
+        case GRANULARITY_YEAR:
+            periodLength = 366 * 86400;
+            break;
+        default:
+            return false;
+    }
+
+    time_t end;
+    if (!local_time_to_epoch(query->endTime, query->timezone, &end))
+        return false;
+
+    return end + periodLength + SUMMARY_SETTLE_TIME <= time(NULL);
+}
+
+// Where the body of a /stations/{id}/data query goes in the response cache
+typedef struct {
+    bool cacheable;
+    char key[CACHE_KEY_SIZE];
+    char stationDbId[STATION_DB_ID_SIZE];
+    uint64_t generation; // Of the station before the query ran, an upload since drops the body
+} WeatherCacheSlot;
+
+// Answers from the response cache when it can, filling the key of slot when the body may be
+// cached
+static bool weather_data_cached(const WeatherQuery *query, granularity_t granularity,
+                                WeatherCacheSlot *slot, char **weatherData, char **etag) {
+    // Raw data is streamed and changes with every upload, only summaries are cached. Pages are
+    // cheap already and each cursor is only asked for once
+    slot->cacheable = granularity != GRANULARITY_DATA && query->stationId &&
+                      query->page.limit == 0 && build_cache_key(query, slot->key, CACHE_KEY_SIZE);
+
+    char etagValue[ETAG_SIZE];
+    if (!slot->cacheable || !response_cache_get(slot->key, weatherData, etagValue))
+        return false;
+
+    if (etag)
+        *etag = strdup(etagValue);
+    return true;
+}
+
+// Picks the rows kept by ?max_points= with LTTB over every numeric column, against the start of
+// each period, out of the first *nRows of the result. The columns are decoded once into contiguous
+// arrays. NULL rows when every row of the result is kept
+static bool downsample_result(const WeatherQuery *query, PGresult *res, int **rows,
+                              int *nRows) {
+    *rows = NULL;
+    int nTuples = PQntuples(res);
+    if (query->maxPoints == 0 || *nRows <= query->maxPoints) {
+        if (*nRows == nTuples)
+            return true;
+
+        // A page leaves out the row fetched past it
+        *rows = malloc((size_t)*nRows * sizeof(int));
+        if (!*rows)
+            return false;
+        for (int i = 0; i < *nRows; i++)
+            (*rows)[i] = i;
+        return true;
+    }
+
+    int nFields = PQnfields(res);
+    double *x = malloc((size_t)*nRows * sizeof(double));
+    double *ys = malloc((size_t)nTuples * nFields * sizeof(double));
+    int *selected = malloc((size_t)query->maxPoints * sizeof(int));
+    if (!x || !ys || !selected) {
+        free(x);
+        free(ys);
+        free(selected);
+        return false;
+    }
+
+    // Evenly spaced when a timestamp does not parse, like infinite range bounds
+    for (int i = 0; i < *nRows; i++) {
+        if (!parse_timestamptz(PQgetvalue(res, i, 0), &x[i]) || (i > 0 && x[i] < x[i - 1])) {
+            for (int j = 0; j < *nRows; j++)
+                x[j] = j;
+            break;
+        }
+    }
+
+    // period_start and period_end are text, so they are skipped with any other such column.
+    // Every row is decoded, then the columns are packed to the rows kept
+    int nSeries = 0;
+    for (int j = 0; j < nFields; j++) {
+        if (pgresult_column_values(res, j, ys + (size_t)nSeries * nTuples))
+            nSeries++;
+    }
+    for (int j = 1; j < nSeries && *nRows < nTuples; j++)
+        memmove(ys + (size_t)j * *nRows, ys + (size_t)j * nTuples,
+                (size_t)*nRows * sizeof(double));
+
+    int nSelected = lttb_select(x, ys, nSeries, *nRows, query->maxPoints, selected);
+    free(x);
+    free(ys);
+
+    if (nSelected < 0) {
+        free(selected);
+        return false;
     }
 
-    const char *paramValues[4] = {stationId, startTime, endTime, granularityStr};
-    if (!sameTimezone && granularity != GRANULARITY_DATA)
-        res = PQexecParams(conn, query, 4, NULL, paramValues, NULL, NULL, 0);
+    *rows = selected;
+    *nRows = nSelected;
+    return true;
+}
+
+// Serializes the first nRows of a weather result in the format asked for, downsampled when asked
+static bool write_weather_rows(const WeatherQuery *query, PGresult *res, int nRows,
+                               StrBuf *out) {
+    // Part of writing the body, the rows only get picked here
+    uint64_t start = metrics_now_us();
+    int *rows;
+    bool selected = downsample_result(query, res, &rows, &nRows);
+    metrics_add(METRICS_PHASE_SERIALIZE, metrics_now_us() - start);
+    if (!selected)
+        return false;
+
+    bool written;
+    if (rows && query->format == DATA_FORMAT_COLUMNS)
+        written = pgresult_write_json_columns_subset(res, rows, nRows, query->pretty, out);
+    else if (rows)
+        written = pgresult_write_json_subset(res, rows, nRows, query->pretty, out);
+    else if (query->format == DATA_FORMAT_COLUMNS)
+        written = pgresult_write_json_columns(res, query->pretty, out);
     else
-        res = PQexecParams(conn, query, 3, NULL, paramValues, NULL, NULL, 0);
+        written = pgresult_write_json(res, false, query->pretty, out);
+
+    free(rows);
+    return written;
+}
 
-    free(query);
+// Snapshot of the station's cache generation, taken once it is resolved and before its query
+static void weather_cache_station(WeatherCacheSlot *slot, const char *stationDbId) {
+    if (!slot->cacheable)
+        return;
 
+    snprintf(slot->stationDbId, sizeof(slot->stationDbId), "%s", stationDbId);
+    slot->generation = response_cache_generation(stationDbId);
+}
+
+// Writes the body of a /stations/{id}/data result and keeps it in the cache when the slot is
+// cacheable. Takes over res
+static apiError_t write_weather_result(const WeatherQuery *query, granularity_t granularity,
+                                       const WeatherCacheSlot *slot, PGresult *res,
+                                       char **weatherData, char **etag, char **nextCursor) {
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
+        fprintf(stderr, "Error executing the query: %s", PQresultErrorMessage(res));
+
+        // query_canceled, what statement_timeout raises
+        const char *sqlState = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+        bool timedOut = sqlState && strcmp(sqlState, "57014") == 0;
+
         PQclear(res);
-        release_conn(conn);
-        return API_DB_ERROR;
+        return timedOut ? API_TIMEOUT : API_DB_ERROR;
     }
 
     if (PQntuples(res) == 0) {
         PQclear(res);
-        release_conn(conn);
         return API_NOT_FOUND;
     }
 
-    *weatherData = pgresult_to_json(res, false);
+    // Only the first page.limit rows belong to a page, the cursor resumes after the last of them
+    char *cursor;
+    apiError_t code = next_page_cursor(res, &query->page, PAGE_CURSOR_WEATHER, 0, -1, &cursor);
+    if (code != API_OK) {
+        PQclear(res);
+        return code;
+    }
+
+    // Large ranges are written straight from the result, without a jansson tree
+    StrBuf out = {NULL, 0, 0};
+    bool written = write_weather_rows(query, res, cursor ? query->page.limit : PQntuples(res),
+                                      &out);
 
     PQclear(res);
-    release_conn(conn);
+
+    if (!written) {
+        free(cursor);
+        strbuf_free(&out);
+        return API_JSON_ERROR;
+    }
+
+    if (nextCursor)
+        *nextCursor = cursor;
+    else
+        free(cursor);
+
+    char etagValue[ETAG_SIZE];
+    compute_etag(out.data, out.len, etagValue);
+
+    if (slot->cacheable)
+        response_cache_put(slot->key, slot->stationDbId, slot->generation, out.data, out.len,
+                           etagValue, response_cache_ttl(range_is_closed(query, granularity)));
+
+    if (etag)
+        *etag = strdup(etagValue);
+
+    *weatherData = strbuf_release(&out);
+
+    return API_OK;
+}
+
+apiError_t weather_data_list(const WeatherQuery *query, char **weatherData, char **etag,
+                             char **nextCursor) {
+    if (nextCursor)
+        *nextCursor = NULL;
+
+    if (!valid_weather_query(query) || !weatherData)
+        return API_INVALID_PARAMS;
+
+    granularity_t granularity = string_to_granularity(query->granularity);
+
+    WeatherCacheSlot slot;
+    if (weather_data_cached(query, granularity, &slot, weatherData, etag))
+        return API_OK;
+
+    // Readings are only appended, a replica within DB_REPLICA_MAX_LAG_MS serves them
+    ConnWrapper *dbConn = get_read_conn();
+    if (!dbConn)
+        return API_DB_ERROR;
+
+    PGconn *conn = get_pg_conn(dbConn);
+
+    uint64_t queryStart = metrics_now_us();
+
+    WeatherStatement stmt;
+    apiError_t code = prepare_weather_statement(dbConn, query, &stmt);
+    if (code != API_OK) {
+        release_conn(dbConn);
+        return code;
+    }
+
+    weather_cache_station(&slot, stmt.stationDbId);
+
+    PGresult *res = PQexecPrepared(conn, stmt.name, stmt.nParams, stmt.paramValues, NULL, NULL,
+                                   WEATHER_RESULT_FORMAT);
+
+    metrics_add(METRICS_PHASE_QUERY, metrics_now_us() - queryStart);
+
+    // The result does not need the connection
+    release_conn(dbConn);
+
+    return write_weather_result(query, granularity, &slot, res, weatherData, etag, nextCursor);
+}
+
+struct WeatherDataRequest {
+    WeatherQuery query;
+    granularity_t granularity;
+    WeatherCacheSlot cacheSlot;
+    PGresult *res; // Set by the reactor thread before ready
+    uint64_t queryStartUs;
+    uint64_t queryUs;
+    weatherDataReady_t ready;
+    void *cls;
+};
+
+static void weather_query_done(PGresult *res, void *cls) {
+    WeatherDataRequest *request = cls;
+
+    request->res = res;
+    request->queryUs = metrics_now_us() - request->queryStartUs;
+    request->ready(request->cls);
+}
+
+apiError_t weather_data_list_async(const WeatherQuery *query, weatherDataReady_t ready, void *cls,
+                                   WeatherDataRequest **request, char **weatherData,
+                                   char **etag, char **nextCursor) {
+    if (!request || !ready)
+        return API_INVALID_PARAMS;
+
+    *request = NULL;
+
+    if (!db_reactor_running())
+        return weather_data_list(query, weatherData, etag, nextCursor);
+
+    if (nextCursor)
+        *nextCursor = NULL;
+
+    if (!valid_weather_query(query) || !weatherData)
+        return API_INVALID_PARAMS;
+
+    WeatherDataRequest *pending = calloc(1, sizeof(WeatherDataRequest));
+    if (!pending)
+        return API_MEMORY_ERROR;
+
+    pending->query = *query;
+    pending->granularity = string_to_granularity(query->granularity);
+    pending->ready = ready;
+    pending->cls = cls;
+
+    if (weather_data_cached(query, pending->granularity, &pending->cacheSlot, weatherData,
+                            etag)) {
+        free(pending);
+        return API_OK;
+    }
+
+    ConnWrapper *dbConn = get_read_conn();
+    if (!dbConn) {
+        free(pending);
+        return API_DB_ERROR;
+    }
+
+    pending->queryStartUs = metrics_now_us();
+
+    WeatherStatement stmt;
+    apiError_t code = prepare_weather_statement(dbConn, query, &stmt);
+    if (code != API_OK) {
+        release_conn(dbConn);
+        free(pending);
+        return code;
+    }
+
+    weather_cache_station(&pending->cacheSlot, stmt.stationDbId);
+
+    // The reactor releases the connection, and may call ready before this returns
+    if (!db_reactor_send_prepared(dbConn, stmt.name, stmt.nParams, stmt.paramValues,
+                                  WEATHER_RESULT_FORMAT, weather_query_done, pending)) {
+        release_conn(dbConn);
+        free(pending);
+        return API_DB_ERROR;
+    }
+
+    *request = pending;
+    return API_OK;
+}
+
+apiError_t weather_data_finish(WeatherDataRequest *request, char **weatherData, char **etag,
+                               char **nextCursor) {
+    if (nextCursor)
+        *nextCursor = NULL;
+
+    if (!request)
+        return API_INVALID_PARAMS;
+
+    metrics_add(METRICS_PHASE_QUERY, request->queryUs);
+
+    apiError_t code;
+    if (!weatherData) {
+        PQclear(request->res);
+        code = API_INVALID_PARAMS;
+    }
+    else {
+        code = write_weather_result(&request->query, request->granularity, &request->cacheSlot,
+                                    request->res, weatherData, etag, nextCursor);
+    }
+
+    free(request);
+    return code;
+}
+
+void weather_data_cancel(WeatherDataRequest *request) {
+    if (!request)
+        return;
+
+    PQclear(request->res);
+    free(request);
+}
+
+// Reads what is left of the pipeline up to its sync point, so the connection can leave pipeline
+// mode and go back to the pool
+static void drain_pipeline(PGconn *conn) {
+    for (;;) {
+        PGresult *res = PQgetResult(conn);
+        if (!res) {
+            // NULL only ends one query's results, unless the connection is gone
+            if (PQstatus(conn) != CONNECTION_OK)
+                break;
+            continue;
+        }
+
+        ExecStatusType status = PQresultStatus(res);
+        PQclear(res);
+        if (status == PGRES_PIPELINE_SYNC)
+            break;
+    }
+
+    PQexitPipelineMode(conn);
+}
+
+// Writes the result of one station as it would be written for /stations/{id}/data and keeps it
+// in the response cache on the way, unless the station had an upload since generation was read
+static bool write_batch_station(const WeatherQuery *query, granularity_t granularity,
+                                const char *stationDbId, uint64_t generation, PGresult *res,
+                                StrBuf *out) {
+    StrBuf station = {NULL, 0, 0};
+    bool written = write_weather_rows(query, res, PQntuples(res), &station);
+
+    if (!written || !strbuf_append(out, station.data, station.len)) {
+        strbuf_free(&station);
+        return false;
+    }
+
+    char cacheKey[CACHE_KEY_SIZE];
+    if (granularity != GRANULARITY_DATA && PQntuples(res) > 0 &&
+        build_cache_key(query, cacheKey, sizeof(cacheKey))) {
+        char etagValue[ETAG_SIZE];
+        compute_etag(station.data, station.len, etagValue);
+        response_cache_put(cacheKey, stationDbId, generation, station.data, station.len,
+                           etagValue, response_cache_ttl(range_is_closed(query, granularity)));
+    }
+
+    strbuf_free(&station);
+    return true;
+}
+
+// Queries in flight at once. Each chunk is read before the next is sent, so the server never
+// waits on a client that is itself blocked sending, however large the results are
+#define WEATHER_BATCH_PIPELINE_DEPTH 32
+
+// Queries of the stations not in cached, sent down one pipeline a chunk at a time
+typedef struct {
+    PGconn *conn;
+    WeatherStatement *stmt;
+    char (*stationDbIds)[STATION_DB_ID_SIZE];
+    uint64_t *generations; // Cache generation of each station, read before it was sent
+    char **cached;
+    size_t nStations;
+    size_t nextStation; // First station not sent yet
+    int inFlight;       // Results of the chunk still to be read
+    bool syncPending;   // The sync ending the chunk was not read yet
+} BatchPipeline;
+
+// Sends the next chunk, ending it with a sync. Unknown stations, with an empty stationDbIds entry,
+// are queried for no rows
+static apiError_t send_batch_chunk(BatchPipeline *pipeline) {
+    WeatherStatement *stmt = pipeline->stmt;
+    apiError_t code = API_OK;
+
+    for (; pipeline->nextStation < pipeline->nStations &&
+           pipeline->inFlight < WEATHER_BATCH_PIPELINE_DEPTH && code == API_OK;
+         pipeline->nextStation++) {
+        size_t i = pipeline->nextStation;
+        if (pipeline->cached[i])
+            continue;
+
+        stmt->paramValues[0] = pipeline->stationDbIds[i][0] ? pipeline->stationDbIds[i] : NULL;
+        if (!PQsendQueryPrepared(pipeline->conn, stmt->name, stmt->nParams, stmt->paramValues,
+                                 NULL, NULL, WEATHER_RESULT_FORMAT)) {
+            fprintf(stderr, "Error sending the query: %s", PQerrorMessage(pipeline->conn));
+            code = API_DB_ERROR;
+        }
+        else {
+            pipeline->inFlight++;
+        }
+    }
+
+    // Also sent after a failure, so the drain has a sync point to stop at
+    if (!PQpipelineSync(pipeline->conn)) {
+        fprintf(stderr, "Error syncing the pipeline: %s", PQerrorMessage(pipeline->conn));
+        return API_DB_ERROR;
+    }
+    pipeline->syncPending = true;
+
+    return code;
+}
+
+// The result of the next station not in cached, sending its chunk first when needed
+static apiError_t next_batch_result(BatchPipeline *pipeline, PGresult **res) {
+    *res = NULL;
+    if (pipeline->inFlight == 0) {
+        apiError_t code = send_batch_chunk(pipeline);
+        if (code != API_OK)
+            return code;
+    }
+
+    *res = PQgetResult(pipeline->conn);
+
+    // The NULL ending the results of this query
+    PQclear(PQgetResult(pipeline->conn));
+
+    // The whole chunk was read, its sync is the last thing left of it
+    if (--pipeline->inFlight == 0) {
+        PGresult *sync = PQgetResult(pipeline->conn);
+        if (PQresultStatus(sync) == PGRES_PIPELINE_SYNC)
+            pipeline->syncPending = false;
+        PQclear(sync);
+    }
+
+    return API_OK;
+}
+
+// Reads what is left of the chunk in flight, then leaves pipeline mode so the connection can go
+// back to the pool
+static void end_batch_pipeline(BatchPipeline *pipeline) {
+    if (pipeline->syncPending)
+        drain_pipeline(pipeline->conn);
+    else
+        PQexitPipelineMode(pipeline->conn);
+}
+
+// Writes the members of the batch object in the order of stationIds, taking the results of the
+// stations not in cached from the pipeline, which returns them in the order they were sent
+static apiError_t write_batch_members(BatchPipeline *pipeline, const WeatherQuery *query,
+                                      granularity_t granularity, const char *const *stationIds,
+                                      size_t nStations, char **cached, StrBuf *out) {
+    for (size_t i = 0; i < nStations; i++) {
+        if ((i > 0 && !strbuf_append_char(out, ',')) ||
+            !strbuf_append_json_string(out, stationIds[i]) || !strbuf_append_char(out, ':'))
+            return API_MEMORY_ERROR;
+
+        if (cached[i]) {
+            if (!strbuf_append_str(out, cached[i]))
+                return API_MEMORY_ERROR;
+            continue;
+        }
+
+        // Only the wait for the result, the writing in between is serialization
+        uint64_t waitStart = metrics_now_us();
+        PGresult *res;
+        apiError_t code = next_batch_result(pipeline, &res);
+        metrics_add(METRICS_PHASE_QUERY, metrics_now_us() - waitStart);
+
+        if (code != API_OK)
+            return code;
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            fprintf(stderr, "Error executing the query: %s", PQerrorMessage(pipeline->conn));
+            PQclear(res);
+            return API_DB_ERROR;
+        }
+
+        WeatherQuery stationQuery = *query;
+        stationQuery.stationId = stationIds[i];
+        bool written = write_batch_station(&stationQuery, granularity, pipeline->stationDbIds[i],
+                                           pipeline->generations[i], res, out);
+        PQclear(res);
+
+        if (!written)
+            return API_JSON_ERROR;
+    }
+
+    return API_OK;
+}
+
+static apiError_t query_batch(const WeatherQuery *query, granularity_t granularity,
+                              const char *const *stationIds, size_t nStations, char **cached,
+                              size_t nMisses, StrBuf *out) {
+    if (nMisses == 0)
+        return write_batch_members(NULL, query, granularity, stationIds, nStations, cached, out);
+
+    ConnWrapper *dbConn = get_read_conn();
+    if (!dbConn)
+        return API_DB_ERROR;
+
+    PGconn *conn = get_pg_conn(dbConn);
+
+    uint64_t queryStart = metrics_now_us();
+
+    char(*stationDbIds)[STATION_DB_ID_SIZE] = calloc(nStations, sizeof(*stationDbIds));
+    uint64_t *generations = calloc(nStations, sizeof(*generations));
+    if (!stationDbIds || !generations) {
+        free(stationDbIds);
+        free(generations);
+        release_conn(dbConn);
+        return API_MEMORY_ERROR;
+    }
+
+    // Resolved before the pipeline starts, a stale directory means a lookup per station
+    apiError_t code = API_OK;
+    for (size_t i = 0; i < nStations && code == API_OK; i++) {
+        if (cached[i])
+            continue;
+
+        code = resolve_station(conn, stationIds[i], stationDbIds[i]);
+        if (code == API_NOT_FOUND) {
+            stationDbIds[i][0] = '\0';
+            code = API_OK;
+        }
+        else if (code == API_OK)
+            generations[i] = response_cache_generation(stationDbIds[i]);
+    }
+
+    // The statement only depends on the range, one timezone switch and prepare for all of them
+    WeatherQuery batchQuery = *query;
+    batchQuery.stationId = NULL;
+    batchQuery.page.limit = 0;
+    batchQuery.page.cursor = NULL;
+
+    WeatherStatement stmt;
+    if (code == API_OK)
+        code = prepare_weather_statement(dbConn, &batchQuery, &stmt);
+
+    metrics_add(METRICS_PHASE_QUERY, metrics_now_us() - queryStart);
+
+    if (code == API_OK && !PQenterPipelineMode(conn)) {
+        fprintf(stderr, "Error entering pipeline mode: %s", PQerrorMessage(conn));
+        code = API_DB_ERROR;
+    }
+
+    if (code == API_OK) {
+        BatchPipeline pipeline = {conn,   &stmt,     stationDbIds, generations,
+                                  cached, nStations, 0,            0, false};
+        code = write_batch_members(&pipeline, query, granularity, stationIds, nStations, cached,
+                                   out);
+        end_batch_pipeline(&pipeline);
+    }
+
+    free(stationDbIds);
+    free(generations);
+
+    release_conn(dbConn);
+    return code;
+}
+
+apiError_t weather_data_batch(const WeatherQuery *query, const char *const *stationIds,
+                              size_t nStations, char **weatherData, char **etag) {
+    if (!valid_weather_query(query) || !stationIds || nStations == 0 ||
+        nStations > WEATHER_BATCH_MAX_STATIONS || !weatherData)
+        return API_INVALID_PARAMS;
+
+    granularity_t granularity = string_to_granularity(query->granularity);
+
+    // Cached stations are copied in place, only the misses go to the database
+    char **cached = calloc(nStations, sizeof(char *));
+    if (!cached)
+        return API_MEMORY_ERROR;
+
+    size_t nMisses = nStations;
+    if (granularity != GRANULARITY_DATA) {
+        for (size_t i = 0; i < nStations; i++) {
+            WeatherQuery stationQuery = *query;
+            stationQuery.stationId = stationIds[i];
+
+            char cacheKey[CACHE_KEY_SIZE];
+            char etagValue[ETAG_SIZE];
+            if (build_cache_key(&stationQuery, cacheKey, sizeof(cacheKey)) &&
+                response_cache_get(cacheKey, &cached[i], etagValue))
+                nMisses--;
+        }
+    }
+
+    StrBuf out = {NULL, 0, 0};
+    apiError_t code = API_MEMORY_ERROR;
+    if (strbuf_init(&out, WEATHER_STREAM_CHUNK_SIZE) && strbuf_append_char(&out, '{'))
+        code = query_batch(query, granularity, stationIds, nStations, cached, nMisses, &out);
+
+    if (code == API_OK && !strbuf_append_char(&out, '}'))
+        code = API_MEMORY_ERROR;
+
+    for (size_t i = 0; i < nStations; i++)
+        free(cached[i]);
+    free(cached);
+
+    if (code != API_OK) {
+        strbuf_free(&out);
+        return code;
+    }
+
+    if (etag) {
+        char etagValue[ETAG_SIZE];
+        compute_etag(out.data, out.len, etagValue);
+        *etag = strdup(etagValue);
+    }
+
+    *weatherData = strbuf_release(&out);
+
+    return API_OK;
+}
+
+apiError_t weather_data_area(const WeatherQuery *query, const StationArea *area, size_t limit,
+                             char **weatherData, char **etag) {
+    if (!valid_weather_query(query) || !valid_station_area(area, limit) ||
+        limit > WEATHER_BATCH_MAX_STATIONS || !weatherData)
+        return API_INVALID_PARAMS;
+
+    char(*uuids)[UUID_SIZE + 1] = malloc(limit * sizeof(*uuids));
+    const char **stationIds = malloc(limit * sizeof(*stationIds));
+    if (!uuids || !stationIds) {
+        free(uuids);
+        free(stationIds);
+        return API_MEMORY_ERROR;
+    }
+
+    size_t nStations = 0;
+    apiError_t code = API_OK;
+    if (station_directory_search(area, limit, false, NULL, uuids, &nStations) != STATION_FOUND) {
+        ConnWrapper *dbConn = get_read_conn();
+        PGresult *res = NULL;
+        code = dbConn ? query_station_area(get_pg_conn(dbConn), area, limit, &res) : API_DB_ERROR;
+        release_conn(dbConn);
+
+        for (int i = 0; code == API_OK && i < PQntuples(res); i++) {
+            if (PQgetlength(res, i, 0) == UUID_SIZE)
+                memcpy(uuids[nStations++], PQgetvalue(res, i, 0), UUID_SIZE + 1);
+        }
+        PQclear(res);
+    }
+
+    for (size_t i = 0; i < nStations; i++)
+        stationIds[i] = uuids[i];
+
+    // Nothing in view is an empty object, not an error
+    if (code == API_OK && nStations == 0) {
+        *weatherData = strdup("{}");
+        code = *weatherData ? API_OK : API_MEMORY_ERROR;
+        if (code == API_OK && etag) {
+            char etagValue[ETAG_SIZE];
+            compute_etag(*weatherData, 2, etagValue);
+            *etag = strdup(etagValue);
+        }
+    }
+    else if (code == API_OK) {
+        code = weather_data_batch(query, stationIds, nStations, weatherData, etag);
+    }
+
+    free(stationIds);
+    free(uuids);
+    return code;
+}
+
+struct WeatherDataStream {
+    ConnWrapper *dbConn;
+    JsonArrayWriter *writer;
+    StrBuf pending; // Serialized rows not yet handed to the reader
+    size_t offset;
+    bool finished;  // The closing ] is in pending
+    bool drained;   // PQgetResult returned NULL, the connection is idle again
+};
+
+static void drain_results(WeatherDataStream *stream) {
+    PGconn *conn = get_pg_conn(stream->dbConn);
+    PGresult *res;
+
+    while ((res = PQgetResult(conn)))
+        PQclear(res);
+
+    stream->drained = true;
+}
+
+// Serializes the next rows until roughly a chunk is buffered or the result ends
+static bool fetch_stream_rows(WeatherDataStream *stream) {
+    PGconn *conn = get_pg_conn(stream->dbConn);
+
+    while (stream->pending.len < WEATHER_STREAM_CHUNK_SIZE) {
+        PGresult *res = PQgetResult(conn);
+        if (!res) {
+            stream->drained = true;
+            return false;
+        }
+
+        ExecStatusType status = PQresultStatus(res);
+
+        if (status == PGRES_SINGLE_TUPLE) {
+            bool ok = json_array_writer_append(stream->writer, res, 0, &stream->pending);
+            PQclear(res);
+            if (!ok)
+                return false;
+            continue;
+        }
+
+        PQclear(res);
+
+        // The zero row result marks the end of the rows
+        if (status == PGRES_TUPLES_OK) {
+            drain_results(stream);
+            stream->finished = true;
+            return json_array_writer_finish(stream->writer, &stream->pending);
+        }
+
+        fprintf(stderr, "Error streaming the query: %s", PQerrorMessage(conn));
+        return false;
+    }
+
+    return true;
+}
+
+apiError_t weather_data_stream_open(const WeatherQuery *query, WeatherDataStream **stream) {
+    if (!valid_weather_query(query) || query->format != DATA_FORMAT_ROWS ||
+        query->maxPoints != 0 || query->page.limit != 0 || !stream)
+        return API_INVALID_PARAMS;
+
+    WeatherDataStream *newStream = calloc(1, sizeof(WeatherDataStream));
+    if (!newStream)
+        return API_MEMORY_ERROR;
+
+    if (!strbuf_init(&newStream->pending, WEATHER_STREAM_CHUNK_SIZE * 2)) {
+        free(newStream);
+        return API_MEMORY_ERROR;
+    }
+
+    newStream->drained = true;
+
+    newStream->dbConn = get_read_conn();
+    if (!newStream->dbConn) {
+        weather_data_stream_close(newStream);
+        return API_DB_ERROR;
+    }
+
+    PGconn *conn = get_pg_conn(newStream->dbConn);
+
+    uint64_t queryStart = metrics_now_us();
+
+    WeatherStatement stmt;
+    apiError_t code = prepare_weather_statement(newStream->dbConn, query, &stmt);
+    if (code != API_OK) {
+        weather_data_stream_close(newStream);
+        return code;
+    }
+
+    if (!PQsendQueryPrepared(conn, stmt.name, stmt.nParams, stmt.paramValues, NULL, NULL,
+                             WEATHER_RESULT_FORMAT)) {
+        fprintf(stderr, "Error sending the query: %s", PQerrorMessage(conn));
+        weather_data_stream_close(newStream);
+        return API_DB_ERROR;
+    }
+
+    newStream->drained = false;
+
+    if (!PQsetSingleRowMode(conn)) {
+        fprintf(stderr, "Error enabling single row mode: %s", PQerrorMessage(conn));
+        weather_data_stream_close(newStream);
+        return API_DB_ERROR;
+    }
+
+    // Wait for the first row so errors and empty ranges still get a proper status code
+    PGresult *res = PQgetResult(conn);
+    ExecStatusType status = PQresultStatus(res);
+
+    // The remaining rows arrive while the response is sent
+    metrics_add(METRICS_PHASE_QUERY, metrics_now_us() - queryStart);
+
+    if (status == PGRES_TUPLES_OK) {
+        PQclear(res);
+        drain_results(newStream);
+        weather_data_stream_close(newStream);
+        return API_NOT_FOUND;
+    }
+
+    if (status != PGRES_SINGLE_TUPLE) {
+        fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
+        PQclear(res);
+        drain_results(newStream);
+        weather_data_stream_close(newStream);
+        return API_DB_ERROR;
+    }
+
+    newStream->writer = json_array_writer_create(res, query->pretty);
+    if (!newStream->writer ||
+        !json_array_writer_append(newStream->writer, res, 0, &newStream->pending)) {
+        PQclear(res);
+        weather_data_stream_close(newStream);
+        return API_JSON_ERROR;
+    }
+
+    PQclear(res);
+
+    *stream = newStream;
+
+    return API_OK;
+}
+
+ssize_t weather_data_stream_read(WeatherDataStream *stream, char *buf, size_t max) {
+    if (!stream || !buf)
+        return WEATHER_STREAM_ERROR;
+
+    while (stream->offset == stream->pending.len) {
+        if (stream->finished)
+            return WEATHER_STREAM_END;
+
+        stream->pending.len = 0;
+        stream->pending.data[0] = '\0';
+        stream->offset = 0;
+
+        if (!fetch_stream_rows(stream))
+            return WEATHER_STREAM_ERROR;
+    }
+
+    size_t len = stream->pending.len - stream->offset;
+    if (len > max)
+        len = max;
+
+    memcpy(buf, stream->pending.data + stream->offset, len);
+    stream->offset += len;
+
+    return (ssize_t)len;
+}
+
+void weather_data_stream_close(WeatherDataStream *stream) {
+    if (!stream)
+        return;
+
+    if (stream->dbConn) {
+        // The client went away mid-response, stop the server from sending the rest
+        if (!stream->drained) {
+            PGcancel *cancel = PQgetCancel(get_pg_conn(stream->dbConn));
+            if (cancel) {
+                char errbuf[256];
+                if (!PQcancel(cancel, errbuf, sizeof(errbuf)))
+                    fprintf(stderr, "Error cancelling the query: %s\n", errbuf);
+                PQfreeCancel(cancel);
+            }
+            drain_results(stream);
+        }
+        release_conn(stream->dbConn);
+    }
+
+    json_array_writer_free(stream->writer);
+    strbuf_free(&stream->pending);
+    free(stream);
+}
+
+// Raw columns an upload can fill, in the order they are sent to COPY
+static const char *ingestColumns[] = {"temperature",    "humidity",   "pressure",
+                                      "lux",            "uvi",        "wind_speed",
+                                      "wind_direction", "gust_speed", "gust_direction",
+                                      "rainfall",       "solar_irradiance"};
+
+#define N_INGEST_COLUMNS ((int)(sizeof(ingestColumns) / sizeof(ingestColumns[0])))
+#define INGEST_COLUMN_START -2
+#define INGEST_COLUMN_END -3
+#define INGEST_VALUE_SIZE 32
+
+bool init_weather_ingest(void) {
+    char command[512];
+    size_t len = (size_t)snprintf(command, sizeof(command),
+                                  "COPY weather.weather_data (station_id, time_range");
+    for (int i = 0; i < N_INGEST_COLUMNS && len < sizeof(command); i++)
+        len += (size_t)snprintf(command + len, sizeof(command) - len, ", %s", ingestColumns[i]);
+    if (len < sizeof(command))
+        len += (size_t)snprintf(command + len, sizeof(command) - len, ") FROM STDIN");
+    if (len >= sizeof(command))
+        return false;
+
+    int batchMs = DEFAULT_INGEST_BATCH_MS;
+    const char *batchMsStr = getenv("INGEST_BATCH_MS");
+    if (batchMsStr && atoi(batchMsStr) >= 0)
+        batchMs = atoi(batchMsStr);
+
+    size_t batchBytes = DEFAULT_INGEST_BATCH_BYTES;
+    const char *batchBytesStr = getenv("INGEST_BATCH_BYTES");
+    if (batchBytesStr && atol(batchBytesStr) > 0)
+        batchBytes = (size_t)atol(batchBytesStr);
+
+    // Kept in sync by a trigger on the table the batcher copies into
+    const char *partialsStr = getenv("HOURLY_PARTIALS");
+    usePartials = partialsStr && strcmp(partialsStr, "1") == 0;
+
+    return init_copy_batcher(command, batchMs, batchBytes);
+}
+
+void free_weather_ingest(void) {
+    free_copy_batcher();
+}
+
+static int ingest_column_index(const char *name, size_t len) {
+    if (len == 10 && strncmp(name, "start_time", len) == 0)
+        return INGEST_COLUMN_START;
+    if (len == 8 && strncmp(name, "end_time", len) == 0)
+        return INGEST_COLUMN_END;
+
+    for (int i = 0; i < N_INGEST_COLUMNS; i++) {
+        if (strlen(ingestColumns[i]) == len && strncmp(ingestColumns[i], name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Postgres parses the timestamp, this only keeps COPY and range delimiters out of it
+static bool valid_timestamp(const char *str, size_t len) {
+    if (len == 0 || len > INGEST_TIMESTAMP_MAX_LEN)
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = str[i];
+        if (!((c >= '0' && c <= '9') || c == '-' || c == ':' || c == '.' || c == 'T' ||
+              c == ' ' || c == '+' || c == 'Z'))
+            return false;
+    }
+    return true;
+}
+
+// Writes the number back normalized, which also keeps anything else out of the COPY stream
+static bool normalize_number(const char *str, size_t len, char *out) {
+    char buf[INGEST_VALUE_SIZE];
+    if (len == 0 || len >= sizeof(buf))
+        return false;
+
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+
+    char *end;
+    double value = strtod(buf, &end);
+    if (end != buf + len || !isfinite(value))
+        return false;
+
+    format_double(out, INGEST_VALUE_SIZE, value);
+    return true;
+}
+
+// values[i] is NULL for the columns the reading does not have
+static bool append_copy_row(StrBuf *rows, const char *stationDbId, const char *start,
+                            size_t startLen, const char *end, size_t endLen,
+                            char values[][INGEST_VALUE_SIZE], const bool *present) {
+    if (!strbuf_append_str(rows, stationDbId) || !strbuf_append_str(rows, "\t[\"") ||
+        !strbuf_append(rows, start, startLen) || !strbuf_append_str(rows, "\",\"") ||
+        !strbuf_append(rows, end, endLen) || !strbuf_append_str(rows, "\")"))
+        return false;
+
+    for (int i = 0; i < N_INGEST_COLUMNS; i++) {
+        if (!strbuf_append_char(rows, '\t'))
+            return false;
+        if (!strbuf_append_str(rows, present[i] ? values[i] : "\\N"))
+            return false;
+    }
+
+    return strbuf_append_char(rows, '\n');
+}
+
+// The reading as one line of JSON for the live feed, the timestamps as the station sent them
+static bool append_live_event(StrBuf *events, const char *start, size_t startLen,
+                              const char *end, size_t endLen, char values[][INGEST_VALUE_SIZE],
+                              const bool *present) {
+    if (!strbuf_append_str(events, "{\"start_time\":\"") ||
+        !strbuf_append(events, start, startLen) ||
+        !strbuf_append_str(events, "\",\"end_time\":\"") || !strbuf_append(events, end, endLen) ||
+        !strbuf_append_char(events, '"'))
+        return false;
+
+    for (int i = 0; i < N_INGEST_COLUMNS; i++) {
+        if (!present[i])
+            continue;
+        if (!strbuf_append_str(events, ",\"") || !strbuf_append_str(events, ingestColumns[i]) ||
+            !strbuf_append_str(events, "\":") || !strbuf_append_str(events, values[i]))
+            return false;
+    }
+
+    return strbuf_append_str(events, "}\n");
+}
+
+// [{"start_time": "...", "end_time": "...", "temperature": 21.3, ...}, ...]
+static apiError_t parse_json_readings(const char *body, size_t bodyLen, const char *stationDbId,
+                                      StrBuf *rows, StrBuf *events, int *nReadings) {
+    json_error_t error;
+    json_t *readings = json_loadb(body, bodyLen, 0, &error);
+    if (!readings)
+        return API_INVALID_PARAMS;
+
+    if (!json_is_array(readings) || json_array_size(readings) == 0) {
+        json_decref(readings);
+        return API_INVALID_PARAMS;
+    }
+
+    size_t index;
+    json_t *reading;
+    json_array_foreach(readings, index, reading) {
+        const char *start = json_string_value(json_object_get(reading, "start_time"));
+        const char *end = json_string_value(json_object_get(reading, "end_time"));
+        if (!json_is_object(reading) || !start || !end || !valid_timestamp(start, strlen(start)) ||
+            !valid_timestamp(end, strlen(end))) {
+            json_decref(readings);
+            return API_INVALID_PARAMS;
+        }
+
+        char values[N_INGEST_COLUMNS][INGEST_VALUE_SIZE];
+        bool present[N_INGEST_COLUMNS] = {false};
+
+        const char *key;
+        json_t *value;
+        json_object_foreach(reading, key, value) {
+            int column = ingest_column_index(key, strlen(key));
+            if (column == INGEST_COLUMN_START || column == INGEST_COLUMN_END || json_is_null(value))
+                continue;
+
+            if (column < 0 || !json_is_number(value) || !isfinite(json_number_value(value))) {
+                json_decref(readings);
+                return API_INVALID_PARAMS;
+            }
+
+            format_double(values[column], INGEST_VALUE_SIZE, json_number_value(value));
+            present[column] = true;
+        }
+
+        if (!append_copy_row(rows, stationDbId, start, strlen(start), end, strlen(end), values,
+                             present) ||
+            (events && !append_live_event(events, start, strlen(start), end, strlen(end), values,
+                                          present))) {
+            json_decref(readings);
+            return API_MEMORY_ERROR;
+        }
+        (*nReadings)++;
+    }
+
+    json_decref(readings);
+    return API_OK;
+}
+
+// A header naming the columns, then one comma separated reading per line:
+// start_time,end_time,temperature,humidity
+// 2025-09-11T10:00:00+02,2025-09-11T10:01:00+02,21.3,40
+static apiError_t parse_line_readings(const char *body, size_t bodyLen, const char *stationDbId,
+                                      StrBuf *rows, StrBuf *events, int *nReadings) {
+    int header[N_INGEST_COLUMNS + 2];
+    int nHeader = 0;
+    bool headerRead = false;
+
+    const char *p = body;
+    const char *bodyEnd = body + bodyLen;
+
+    while (p < bodyEnd) {
+        const char *lineEnd = memchr(p, '\n', (size_t)(bodyEnd - p));
+        if (!lineEnd)
+            lineEnd = bodyEnd;
+
+        const char *next = lineEnd < bodyEnd ? lineEnd + 1 : bodyEnd;
+        if (lineEnd > p && lineEnd[-1] == '\r')
+            lineEnd--;
+
+        if (lineEnd == p) {
+            p = next;
+            continue;
+        }
+
+        const char *start = NULL, *end = NULL;
+        size_t startLen = 0, endLen = 0;
+        char values[N_INGEST_COLUMNS][INGEST_VALUE_SIZE];
+        bool present[N_INGEST_COLUMNS] = {false};
+        int nTokens = 0;
+
+        const char *token = p;
+        while (token <= lineEnd) {
+            const char *tokenEnd = memchr(token, ',', (size_t)(lineEnd - token));
+            if (!tokenEnd)
+                tokenEnd = lineEnd;
+            size_t tokenLen = (size_t)(tokenEnd - token);
+
+            if (!headerRead) {
+                int column = ingest_column_index(token, tokenLen);
+                if (column == -1 || nHeader == N_INGEST_COLUMNS + 2)
+                    return API_INVALID_PARAMS;
+                for (int i = 0; i < nHeader; i++) {
+                    if (header[i] == column)
+                        return API_INVALID_PARAMS;
+                }
+                header[nHeader++] = column;
+            }
+            else {
+                if (nTokens == nHeader)
+                    return API_INVALID_PARAMS;
+
+                int column = header[nTokens];
+                if (column == INGEST_COLUMN_START) {
+                    start = token;
+                    startLen = tokenLen;
+                }
+                else if (column == INGEST_COLUMN_END) {
+                    end = token;
+                    endLen = tokenLen;
+                }
+                else if (tokenLen > 0) {
+                    if (!normalize_number(token, tokenLen, values[column]))
+                        return API_INVALID_PARAMS;
+                    present[column] = true;
+                }
+            }
+
+            nTokens++;
+            token = tokenEnd + 1;
+        }
+
+        if (!headerRead) {
+            headerRead = true;
+            bool hasStart = false, hasEnd = false;
+            for (int i = 0; i < nHeader; i++) {
+                hasStart |= header[i] == INGEST_COLUMN_START;
+                hasEnd |= header[i] == INGEST_COLUMN_END;
+            }
+            if (!hasStart || !hasEnd)
+                return API_INVALID_PARAMS;
+        }
+        else {
+            if (nTokens != nHeader || !valid_timestamp(start, startLen) ||
+                !valid_timestamp(end, endLen))
+                return API_INVALID_PARAMS;
+
+            if (!append_copy_row(rows, stationDbId, start, startLen, end, endLen, values,
+                                 present) ||
+                (events && !append_live_event(events, start, startLen, end, endLen, values,
+                                              present)))
+                return API_MEMORY_ERROR;
+            (*nReadings)++;
+        }
+
+        p = next;
+    }
+
+    return *nReadings > 0 ? API_OK : API_INVALID_PARAMS;
+}
+
+apiError_t weather_data_upload(const char *stationId, const char *body, size_t bodyLen,
+                               const struct AuthData *authData, json_t **result) {
+    if (!authData || !authData->apiKey)
+        return API_AUTH_ERROR;
+
+    if (!stationId || !body || bodyLen == 0 || !result)
+        return API_INVALID_PARAMS;
+
+    // Resident keys need no round trip, the rest are checked against the database
+    char stationDbId[STATION_DB_ID_SIZE];
+    bool validKey = api_key_cache_validate(authData->apiKey, "weather_upload", stationId,
+                                           stationDbId, sizeof(stationDbId));
+
+    if (!validKey) {
+        // The connection is only needed for the key, the rows go through the batcher's one
+        ConnWrapper *dbConn = get_conn();
+        if (!dbConn)
+            return API_DB_ERROR;
+
+        validKey = validate_station_api_key(get_pg_conn(dbConn), authData->apiKey,
+                                            "weather_upload", stationId, stationDbId,
+                                            sizeof(stationDbId));
+        release_conn(dbConn);
+    }
+
+    if (!validKey)
+        return API_AUTH_ERROR;
+
+    StrBuf rows;
+    if (!strbuf_init(&rows, bodyLen * 2))
+        return API_MEMORY_ERROR;
+
+    // The events are only built while somebody follows the station
+    StrBuf events;
+    bool live = live_feed_has_subscribers(stationDbId);
+    if (live && !strbuf_init(&events, bodyLen * 2)) {
+        strbuf_free(&rows);
+        return API_MEMORY_ERROR;
+    }
+
+    const char *p = body;
+    while (p < body + bodyLen && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+
+    int nReadings = 0;
+    apiError_t code;
+    if (p < body + bodyLen && *p == '[')
+        code = parse_json_readings(body, bodyLen, stationDbId, &rows, live ? &events : NULL,
+                                   &nReadings);
+    else
+        code = parse_line_readings(body, bodyLen, stationDbId, &rows, live ? &events : NULL,
+                                   &nReadings);
+
+    copyResult_t copyResult = COPY_OK;
+    if (code == API_OK)
+        copyResult = copy_batcher_submit(rows.data, rows.len);
+    strbuf_free(&rows);
+
+    // Summaries cached before the commit may be missing these readings
+    if (code == API_OK && copyResult == COPY_OK)
+        response_cache_invalidate_station(stationDbId);
+
+    // Published once committed, so subscribers never see a reading the table does not have
+    if (live && code == API_OK && copyResult == COPY_OK)
+        live_feed_publish(stationDbId, events.data, events.len);
+    if (live)
+        strbuf_free(&events);
+
+    if (code != API_OK)
+        return code;
+    if (copyResult == COPY_DATA_ERROR)
+        return API_INVALID_PARAMS;
+    if (copyResult != COPY_OK)
+        return API_DB_ERROR;
+
+    *result = json_pack("{s:i}", "readings", nReadings);
+    if (!*result)
+        return API_JSON_ERROR;
+
+    return API_OK;
+}
+
+apiError_t weather_live_subscribe(const char *stationId, LiveSubscriber **subscriber) {
+    if (!stationId || !subscriber)
+        return API_INVALID_PARAMS;
+
+    // Only a miss costs a round trip
+    char stationDbId[STATION_DB_ID_SIZE];
+    if (station_directory_lookup(stationId, stationDbId, sizeof(stationDbId)) != STATION_FOUND) {
+        ConnWrapper *dbConn = get_read_conn();
+        if (!dbConn)
+            return API_DB_ERROR;
+
+        apiError_t code = resolve_station(get_pg_conn(dbConn), stationId, stationDbId);
+        release_conn(dbConn);
+        if (code != API_OK)
+            return code;
+    }
+
+    return live_feed_subscribe(stationDbId, subscriber);
+}
+
+static bool write_replica_series(StrBuf *out, const char *name, const char *type, const char *help,
+                                 const ReplicaStats *replicas, int nReplicas,
+                                 const double *values) {
+    if (nReplicas == 0)
+        return true;
+
+    if (!metrics_write_help(out, name, type, help))
+        return false;
+
+    for (int i = 0; i < nReplicas; i++) {
+        char labels[DB_ENDPOINT_SIZE + 16];
+        snprintf(labels, sizeof(labels), "replica=\"%s\"", replicas[i].endpoint);
+        if (!metrics_write_sample(out, name, labels, values[i]))
+            return false;
+    }
+
+    return true;
+}
+
+static bool write_replica_metrics(StrBuf *out) {
+    ReplicaStats replicas[DB_MAX_REPLICAS];
+    double healthy[DB_MAX_REPLICAS], lag[DB_MAX_REPLICAS], open[DB_MAX_REPLICAS];
+    double busy[DB_MAX_REPLICAS], checkouts[DB_MAX_REPLICAS], reconnects[DB_MAX_REPLICAS];
+
+    int nReplicas = 0;
+    for (int i = 0; i < get_replica_count(); i++) {
+        if (!get_replica_stats(i, &replicas[nReplicas]))
+            continue;
+
+        const ReplicaStats *replica = &replicas[nReplicas];
+        healthy[nReplicas] = replica->healthy;
+        lag[nReplicas] = replica->lagMs >= 0 ? replica->lagMs / 1e3 : -1;
+        open[nReplicas] = replica->pool.open;
+        busy[nReplicas] = replica->pool.busy;
+        checkouts[nReplicas] = (double)replica->pool.checkouts;
+        reconnects[nReplicas] = (double)replica->pool.reconnects;
+        nReplicas++;
+    }
+
+    return write_replica_series(out, "picoweather_db_replica_healthy", "gauge",
+                                "1 while the replica takes reads.", replicas, nReplicas,
+                                healthy) &&
+           write_replica_series(out, "picoweather_db_replica_lag_seconds", "gauge",
+                                "Replay lag at the last health check, -1 when unreachable.",
+                                replicas, nReplicas, lag) &&
+           write_replica_series(out, "picoweather_db_replica_open", "gauge",
+                                "Open connections to the replica.", replicas, nReplicas, open) &&
+           write_replica_series(out, "picoweather_db_replica_busy", "gauge",
+                                "Replica connections checked out.", replicas, nReplicas, busy) &&
+           write_replica_series(out, "picoweather_db_replica_checkouts_total", "counter",
+                                "Reads sent to the replica.", replicas, nReplicas, checkouts) &&
+           write_replica_series(out, "picoweather_db_replica_reconnects_total", "counter",
+                                "Broken replica connections reset.", replicas, nReplicas,
+                                reconnects);
+}
+
+apiError_t metrics_list(char **metrics) {
+    if (!metrics)
+        return API_INVALID_PARAMS;
+
+    StrBuf out;
+    if (!strbuf_init(&out, METRICS_INITIAL_SIZE))
+        return API_MEMORY_ERROR;
+
+    PoolStats pool;
+    get_pool_stats(&pool);
+
+    bool ok =
+        metrics_write(&out) && admission_write_metrics(&out) &&
+        metrics_write_value(&out, "picoweather_db_pool_size", "gauge",
+                            "Connection slots of the pool.", pool.size) &&
+        metrics_write_value(&out, "picoweather_db_pool_open", "gauge", "Open connections.",
+                            pool.open) &&
+        metrics_write_value(&out, "picoweather_db_pool_busy", "gauge",
+                            "Connections checked out.", pool.busy) &&
+        metrics_write_value(&out, "picoweather_db_pool_checkouts_total", "counter",
+                            "Connections handed out.", (double)pool.checkouts) &&
+        metrics_write_value(&out, "picoweather_db_pool_waits_total", "counter",
+                            "Checkouts that had to wait for a free connection.",
+                            (double)pool.waits) &&
+        metrics_write_value(&out, "picoweather_db_pool_wait_seconds_total", "counter",
+                            "Time spent waiting for a free connection.",
+                            (double)pool.waitTimeUs / 1e6) &&
+        metrics_write_value(&out, "picoweather_db_pool_max_wait_seconds", "gauge",
+                            "Longest wait for a free connection.",
+                            (double)pool.maxWaitUs / 1e6) &&
+        metrics_write_value(&out, "picoweather_db_pool_timeouts_total", "counter",
+                            "Checkouts that gave up waiting.", (double)pool.timeouts) &&
+        metrics_write_value(&out, "picoweather_db_pool_reconnects_total", "counter",
+                            "Broken connections reset.", (double)pool.reconnects) &&
+        write_replica_metrics(&out) && live_feed_write_metrics(&out) &&
+        metrics_write_value(&out, "picoweather_pwhash_queue_depth", "gauge",
+                            "Password hashes waiting for a worker.", pwhash_queue_depth());
+
+    if (!ok) {
+        strbuf_free(&out);
+        return API_MEMORY_ERROR;
+    }
+
+    *metrics = strbuf_release(&out);
 
     return API_OK;
 }
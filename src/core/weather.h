@@ -1,9 +1,12 @@
 #ifndef WEATHER_H
 #define WEATHER_H
 
+#include "../utils/page_cursor.h"
+#include "flags.h"
 #include <jansson.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 struct AuthData;
 
@@ -17,7 +20,9 @@ typedef enum {
     API_DB_ERROR,
     API_FORBIDDEN,
     API_MEMORY_ERROR,
-    API_JSON_ERROR
+    API_JSON_ERROR,
+    API_BUSY,   // Shed under load, the client should retry later
+    API_TIMEOUT // The statement ran past the deadline of the request
 } apiError_t;
 
 typedef enum {
@@ -42,8 +47,11 @@ apiError_t sessions_create(const char *userId, const struct AuthData *authData,
                            const char *password, char *sessionToken, size_t sessionTokenLen,
                            int sessionTokenMaxAge, json_t **session);
 
+// Oldest first. Without sessionUUID the list can be paged, *nextCursor is then the malloc'd
+// cursor of the next page or NULL after the last one
 apiError_t sessions_list(const char *userId, const char *sessionUUID,
-                         const struct AuthData *authData, json_t **sessions);
+                         const struct AuthData *authData, const PageRequest *page,
+                         json_t **sessions, char **nextCursor);
 
 apiError_t sessions_delete(const char *userId, const char *sessionUUID,
                            const struct AuthData *authData);
@@ -51,17 +59,135 @@ apiError_t sessions_delete(const char *userId, const char *sessionUUID,
 apiError_t stations_create(const char *name, double lon, double lat, double alt,
                            const struct AuthData *authData, json_t **station);
 
-apiError_t stations_list(const char *stationId, json_t **stations);
+// Serialized, from the station directory while it is in sync
+apiError_t stations_list(const char *stationId, bool pretty, char **stations);
+
+#define STATION_SEARCH_DEFAULT_LIMIT 10
+#define STATION_SEARCH_MAX_LIMIT 1000
+
+typedef struct {
+    bool nearest; // The closest stations to lon, lat instead of the ones in the box
+    double lon;
+    double lat;
+    double minLon; // Greater than maxLon when the box crosses the antimeridian
+    double minLat;
+    double maxLon;
+    double maxLat;
+} StationArea;
+
+// JSON array of the stations in the area, the nearest ones sorted by distance and with their
+// distance_km. Answered from the station directory while it is in sync, from PostGIS otherwise
+apiError_t stations_search(const StationArea *area, size_t limit, bool pretty, char **stations);
 
 apiError_t api_key_create(const char *name, const char *keyType, const char *stationId,
                           const char *userId, const struct AuthData *authData, json_t **key);
 
+// Paged like sessions_list
 apiError_t api_key_list(const char *userId, const char *keyId, const struct AuthData *authData,
-                        json_t **keys);
+                        const PageRequest *page, json_t **keys, char **nextCursor);
 
 apiError_t api_key_delete(const char *userId, const char *keyId, const struct AuthData *authData);
 
-apiError_t weather_data_list(int fields, const char *granularityStr, const char *stationId,
-                             const char *timezone, const char *startTime, const char *endTime,
-                             json_t **weatherData);
+// Parameters of a /stations/{id}/data request
+typedef struct {
+    int fields;
+    const char *granularity;
+    const char *stationId;
+    const char *timezone;
+    const char *startTime;
+    const char *endTime;
+    dataFormat_t format;
+    bool pretty;
+    int maxPoints;    // Rows kept by the downsampling, 0 keeps every row
+    PageRequest page; // Rows after page.cursor, ordered by period_start. The batches ignore it
+} WeatherQuery;
+
+// Seconds after a period ends before its summary is considered final and cached for long
+#define SUMMARY_SETTLE_TIME 3600
+#define CACHE_KEY_SIZE 512
+
+// etag is optional, when given it gets a malloc'd validator of the body. So is nextCursor, set to
+// the malloc'd cursor of the next page when query->page is limited and more rows follow
+apiError_t weather_data_list(const WeatherQuery *query, char **weatherData, char **etag,
+                             char **nextCursor);
+
+// Query of weather_data_list in flight on the database reactor
+typedef struct WeatherDataRequest WeatherDataRequest;
+
+// Called from the reactor thread once the result is in, weather_data_finish then serializes it
+typedef void (*weatherDataReady_t)(void *cls);
+
+// Same answer as weather_data_list without waiting for the query. Cached bodies, errors, and
+// everything when the reactor is not running are answered right away with *request left NULL,
+// otherwise ready is called later and the strings of query must live until the finish
+apiError_t weather_data_list_async(const WeatherQuery *query, weatherDataReady_t ready, void *cls,
+                                   WeatherDataRequest **request, char **weatherData,
+                                   char **etag, char **nextCursor);
+
+// Frees the request whatever it returns
+apiError_t weather_data_finish(WeatherDataRequest *request, char **weatherData, char **etag,
+                               char **nextCursor);
+
+// Frees a request whose result came in but will not be finished, the client went away
+void weather_data_cancel(WeatherDataRequest *request);
+
+#define WEATHER_BATCH_MAX_STATIONS 500
+
+// The same query for every station of stationIds, sent down one connection in pipeline mode.
+// weatherData is an object holding the body /stations/{id}/data would return for each of them,
+// with no rows for stations that have none instead of API_NOT_FOUND. query->stationId is ignored
+apiError_t weather_data_batch(const WeatherQuery *query, const char *const *stationIds,
+                              size_t nStations, char **weatherData, char **etag);
+
+// weather_data_batch over the stations of the area, keyed by their UUIDs. limit is at most
+// WEATHER_BATCH_MAX_STATIONS
+apiError_t weather_data_area(const WeatherQuery *query, const StationArea *area, size_t limit,
+                             char **weatherData, char **etag);
+
+// Raw data streamed in single row mode, holding its connection until closed
+typedef struct WeatherDataStream WeatherDataStream;
+
+// Rows serialized ahead of the reader, so memory stays bounded whatever the range
+#define WEATHER_STREAM_CHUNK_SIZE 32768
+
+#define WEATHER_STREAM_END -1
+#define WEATHER_STREAM_ERROR -2
+
+// Fails with API_NOT_FOUND when the range has no rows, before anything is sent
+// Only for the rows format without maxPoints nor a page limit, columns and downsampling need the
+// whole result before writing anything
+apiError_t weather_data_stream_open(const WeatherQuery *query, WeatherDataStream **stream);
+
+// Copies up to max bytes of the JSON array into buf, returning the amount written,
+// WEATHER_STREAM_END once everything was read or WEATHER_STREAM_ERROR
+ssize_t weather_data_stream_read(WeatherDataStream *stream, char *buf, size_t max);
+
+void weather_data_stream_close(WeatherDataStream *stream);
+
+struct LiveSubscriber;
+
+// Follows the readings uploaded for the station from now on, through the live feed
+apiError_t weather_live_subscribe(const char *stationId, struct LiveSubscriber **subscriber);
+
+#define METRICS_INITIAL_SIZE 16384
+
+// Request metrics, pool and password hashing queue figures in the Prometheus text format
+apiError_t metrics_list(char **metrics);
+
+#define DEFAULT_INGEST_BATCH_MS 50
+#define DEFAULT_INGEST_BATCH_BYTES (1024 * 1024)
+#define INGEST_TIMESTAMP_MAX_LEN 40
+#define STATION_DB_ID_SIZE 24
+
+// Starts the batcher that groups the uploads of every station into one COPY. Reads
+// INGEST_BATCH_MS and INGEST_BATCH_BYTES
+bool init_weather_ingest(void);
+
+void free_weather_ingest(void);
+
+// body is a JSON array of readings or the header + comma separated lines format. Returns
+// once the readings are committed, authenticated with a weather_upload key of the station
+apiError_t weather_data_upload(const char *stationId, const char *body, size_t bodyLen,
+                               const struct AuthData *authData, json_t **result);
+
 #endif
@@ -0,0 +1,274 @@
+#include <libpq-fe.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "copy_batcher.h"
+#include "database.h"
+
+// SQLSTATE class 22, the rows themselves were rejected
+#define SQLSTATE_DATA_EXCEPTION "22"
+
+#define INGEST_TIMEZONE "UTC"
+
+typedef struct CopySubmission {
+    struct CopySubmission *next;
+    const char *rows;
+    size_t len;
+    copyResult_t result;
+    bool done;
+} CopySubmission;
+
+static char *copyCommand = NULL;
+static int batchIntervalMs;
+static size_t maxBatchBytes;
+
+static pthread_mutex_t batchMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batchCond = PTHREAD_COND_INITIALIZER; // Rows queued or stopping
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;  // A batch was committed
+static CopySubmission *queueHead = NULL;
+static CopySubmission *queueTail = NULL;
+static size_t queuedBytes = 0;
+
+static pthread_t batchThread;
+static bool batchRunning = false;
+static bool batchStop = false;
+
+static copyResult_t result_from_error(PGresult *res) {
+    const char *sqlState = res ? PQresultErrorField(res, PG_DIAG_SQLSTATE) : NULL;
+    if (sqlState && strncmp(sqlState, SQLSTATE_DATA_EXCEPTION, 2) == 0)
+        return COPY_DATA_ERROR;
+    return COPY_DB_ERROR;
+}
+
+// Runs one COPY with every submission in the list. *broken is set when the connection is left
+// in the COPY and has to be reset before anything else runs on it
+static copyResult_t run_copy(PGconn *conn, CopySubmission *first, CopySubmission *last,
+                             bool *broken) {
+    *broken = false;
+
+    PGresult *res = PQexec(conn, copyCommand);
+    if (PQresultStatus(res) != PGRES_COPY_IN) {
+        fprintf(stderr, "Error starting the COPY: %s", PQerrorMessage(conn));
+        copyResult_t result = result_from_error(res);
+        PQclear(res);
+        return result;
+    }
+    PQclear(res);
+
+    bool sent = true;
+    for (CopySubmission *sub = first; sent; sub = sub->next) {
+        if (PQputCopyData(conn, sub->rows, (int)sub->len) != 1)
+            sent = false;
+        if (sub == last)
+            break;
+    }
+
+    if (PQputCopyEnd(conn, sent ? NULL : "client failed to send the rows") != 1) {
+        fprintf(stderr, "Error ending the COPY: %s", PQerrorMessage(conn));
+
+        // Whatever already came back is read, the COPY itself can not be finished anymore
+        while ((res = PQgetResult(conn))) {
+            bool inCopy = PQresultStatus(res) == PGRES_COPY_IN;
+            PQclear(res);
+            if (inCopy)
+                break;
+        }
+        *broken = true;
+        return COPY_DB_ERROR;
+    }
+
+    copyResult_t result = COPY_OK;
+    while ((res = PQgetResult(conn))) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK && result == COPY_OK) {
+            fprintf(stderr, "Error executing the COPY: %s", PQerrorMessage(conn));
+            result = sent ? result_from_error(res) : COPY_DB_ERROR;
+        }
+        PQclear(res);
+    }
+
+    return result;
+}
+
+static void write_batch(CopySubmission *batch) {
+    ConnWrapper *dbConn = get_conn();
+
+    if (!dbConn) {
+        for (CopySubmission *sub = batch; sub; sub = sub->next)
+            sub->result = COPY_DB_ERROR;
+        return;
+    }
+
+    // Pooled connections keep the TimeZone of the last read, readings without an offset are
+    // always taken as UTC
+    if (!set_conn_timezone(dbConn, INGEST_TIMEZONE)) {
+        for (CopySubmission *sub = batch; sub; sub = sub->next)
+            sub->result = COPY_DB_ERROR;
+        release_conn(dbConn);
+        return;
+    }
+
+    PGconn *conn = get_pg_conn(dbConn);
+
+    CopySubmission *last = batch;
+    while (last->next)
+        last = last->next;
+
+    bool broken;
+    copyResult_t result = run_copy(conn, batch, last, &broken);
+
+    if (result == COPY_DATA_ERROR && batch != last) {
+        // One upload has bad rows, isolate it so the rest still get written
+        for (CopySubmission *sub = batch; sub; sub = sub->next)
+            sub->result = broken ? COPY_DB_ERROR : run_copy(conn, sub, sub, &broken);
+    }
+    else {
+        for (CopySubmission *sub = batch; sub; sub = sub->next)
+            sub->result = result;
+    }
+
+    // Never handed back to the pool in the middle of a COPY
+    if (broken)
+        reset_conn(dbConn);
+
+    release_conn(dbConn);
+}
+
+static void *batch_loop(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&batchMutex);
+    while (true) {
+        while (!queueHead && !batchStop)
+            pthread_cond_wait(&batchCond, &batchMutex);
+
+        if (!queueHead && batchStop)
+            break;
+
+        // Let the batch fill up for one interval, the first upload sets the deadline
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += batchIntervalMs / 1000;
+        deadline.tv_nsec += (long)(batchIntervalMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (!batchStop && queuedBytes < maxBatchBytes) {
+            if (pthread_cond_timedwait(&batchCond, &batchMutex, &deadline) != 0)
+                break;
+        }
+
+        CopySubmission *batch = queueHead;
+        queueHead = NULL;
+        queueTail = NULL;
+        queuedBytes = 0;
+        pthread_mutex_unlock(&batchMutex);
+
+        write_batch(batch);
+
+        pthread_mutex_lock(&batchMutex);
+        for (CopySubmission *sub = batch; sub;) {
+            // The submitter owns the struct and may free it once done is set
+            CopySubmission *next = sub->next;
+            sub->done = true;
+            sub = next;
+        }
+        pthread_cond_broadcast(&doneCond);
+    }
+    pthread_mutex_unlock(&batchMutex);
+
+    return NULL;
+}
+
+static bool init_monotonic_cond(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0)
+        return false;
+
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int ret = pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return ret == 0;
+}
+
+bool init_copy_batcher(const char *command, int intervalMs, size_t maxBytes) {
+    if (!command || intervalMs < 0 || batchRunning)
+        return false;
+
+    copyCommand = strdup(command);
+    if (!copyCommand)
+        return false;
+
+    batchIntervalMs = intervalMs;
+    maxBatchBytes = maxBytes;
+
+    if (!init_monotonic_cond(&batchCond)) {
+        free(copyCommand);
+        copyCommand = NULL;
+        return false;
+    }
+
+    batchStop = false;
+    if (pthread_create(&batchThread, NULL, batch_loop, NULL) != 0) {
+        fprintf(stderr, "Failed to start the COPY batcher thread\n");
+        free(copyCommand);
+        copyCommand = NULL;
+        return false;
+    }
+
+    batchRunning = true;
+    return true;
+}
+
+void free_copy_batcher(void) {
+    if (!batchRunning)
+        return;
+
+    // Whatever is queued is still written before the thread exits
+    pthread_mutex_lock(&batchMutex);
+    batchStop = true;
+    pthread_cond_signal(&batchCond);
+    pthread_mutex_unlock(&batchMutex);
+
+    pthread_join(batchThread, NULL);
+    batchRunning = false;
+
+    free(copyCommand);
+    copyCommand = NULL;
+}
+
+copyResult_t copy_batcher_submit(const char *rows, size_t len) {
+    if (!rows || len == 0)
+        return COPY_DATA_ERROR;
+
+    CopySubmission sub = {NULL, rows, len, COPY_DB_ERROR, false};
+
+    pthread_mutex_lock(&batchMutex);
+
+    if (!batchRunning || batchStop) {
+        pthread_mutex_unlock(&batchMutex);
+        return COPY_DB_ERROR;
+    }
+
+    if (queueTail)
+        queueTail->next = &sub;
+    else
+        queueHead = &sub;
+    queueTail = &sub;
+    queuedBytes += len;
+
+    pthread_cond_signal(&batchCond);
+
+    while (!sub.done)
+        pthread_cond_wait(&doneCond, &batchMutex);
+
+    pthread_mutex_unlock(&batchMutex);
+
+    return sub.result;
+}
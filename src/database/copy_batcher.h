@@ -0,0 +1,20 @@
+#ifndef COPY_BATCHER_H
+#define COPY_BATCHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum { COPY_OK = 0, COPY_DATA_ERROR, COPY_DB_ERROR } copyResult_t;
+
+// Groups the rows submitted by every thread into a single COPY FROM STDIN every intervalMs
+// (or as soon as maxBatchBytes are queued). copyCommand is the COPY statement, which must
+// read the text format
+bool init_copy_batcher(const char *copyCommand, int intervalMs, size_t maxBatchBytes);
+
+void free_copy_batcher(void);
+
+// rows holds COPY text lines. Blocks until the batch containing them is committed, a failed
+// batch is retried per submission so bad rows only reject their own upload
+copyResult_t copy_batcher_submit(const char *rows, size_t len);
+
+#endif
@@ -1,20 +1,112 @@
+#include <errno.h>
 #include <libpq-fe.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-typedef struct {
+#include "../utils/admission.h"
+#include "../utils/metrics.h"
+#include "../utils/utils.h"
+#include "database.h"
+
+#define CONN_FREE 0
+#define CONN_BUSY 1
+#define CONN_EMPTY 2 // Slot without an open connection
+
+#define DEFAULT_CHECKOUT_TIMEOUT_MS 5000
+#define DEFAULT_IDLE_TIMEOUT_S 300
+#define DEFAULT_HEALTH_INTERVAL_S 10
+#define DEFAULT_HEALTH_TIMEOUT_MS 5000
+#define DEFAULT_REPLICA_MAX_LAG_MS 1000
+
+#define ENDPOINT_HOST_SIZE 256
+#define ENDPOINT_PORT_SIZE 16
+
+typedef struct Pool Pool;
+
+struct ConnWrapper {
+    Pool *pool;
     PGconn *conn;
-    int busy;
-} ConnWrapper;
+    int index;
+    int state;     // CONN_FREE, CONN_BUSY or CONN_EMPTY, claimed with a CAS
+    int inStack;   // Whether the index is currently linked in the free stack
+    uint32_t next; // Next free stack entry, encoded as index + 1
+    uint64_t lastUsedUs;
+    // Names of the statements already prepared on this connection
+    char stmts[MAX_PREPARED_STMTS][STMT_NAME_SIZE];
+    int nStmts;
+    // Session TimeZone last set on this connection
+    char timezone[TIMEZONE_SIZE];
+    // statement_timeout last set, 0 for the server default and -1 when unknown
+    int statementTimeoutMs;
+};
+
+// Connections to one server, the primary or a replica
+struct Pool {
+    int id; // 0 for the primary, replicas from 1, indexes the thread affinity
+    char host[ENDPOINT_HOST_SIZE];
+    char port[ENDPOINT_PORT_SIZE];
+    ConnWrapper *slots;
+    int maxConn;
+    int minConn;
+
+    // Treiber stack of free connection indices: the high 32 bits are an ABA tag and the low 32
+    // bits the top index + 1 (0 means empty)
+    uint64_t freeHead;
+
+    // Only used to sleep when the free stack is empty and to track the empty slots
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int waiters;
+
+    // Slots without a connection, the pool grows into them when checkouts queue
+    int *emptySlots;
+    int nEmpty;
+    int openConns;
+
+    uint64_t statCheckouts;
+    uint64_t statWaits;
+    uint64_t statWaitTimeUs;
+    uint64_t statMaxWaitUs;
+    uint64_t statTimeouts;
+    uint64_t statReconnects;
+    int statBusy;
 
-ConnWrapper *pool;
-int maxConn;
+    // Replicas only, written by the health thread. Reads go elsewhere while it is false
+    bool healthy;
+    int lagMs;
+};
 
-pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER;
+static Pool primary;
+static Pool replicas[DB_MAX_REPLICAS];
+static int nReplicas = 0;
+static bool poolReady = false;
+
+static int checkoutTimeoutMs;
+static int idleTimeoutS;
+static int healthIntervalS;
+static int healthTimeoutMs;
+static int replicaMaxLagMs;
+static int replicaMaxConn;
+static int replicaMinConn;
+
+// Each worker first tries the connection it released last on every server, encoded as index
+// + 1 (0 means none)
+static __thread int connAffinity[DB_MAX_REPLICAS + 1];
+
+static pthread_t healthThread;
+static bool healthRunning = false;
+static bool healthStop = false;
+static pthread_mutex_t healthMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t healthCond = PTHREAD_COND_INITIALIZER;
+
+static void push_free(Pool *pool, int index);
 
 const char *DB_HOST;
 const char *DB_USER;
@@ -22,6 +114,67 @@ const char *DB_PASS;
 const char *DB_NAME;
 const char *DB_PORT;
 
+static bool set_endpoint(Pool *pool, const char *host, size_t hostLen, const char *port) {
+    if (hostLen == 0 || hostLen >= sizeof(pool->host) || strlen(port) >= sizeof(pool->port))
+        return false;
+
+    memcpy(pool->host, host, hostLen);
+    pool->host[hostLen] = '\0';
+    strcpy(pool->port, port);
+    return true;
+}
+
+// DB_REPLICAS is a comma separated list of host or host:port, on DB_PORT when it has none
+static bool parse_replicas(const char *list) {
+    nReplicas = 0;
+    if (!list)
+        return true;
+
+    const char *p = list;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        if (len > 0) {
+            if (nReplicas == DB_MAX_REPLICAS) {
+                fprintf(stderr, "Error: more than %d DB_REPLICAS\n", DB_MAX_REPLICAS);
+                return false;
+            }
+
+            // A single colon separates the port, IPv6 addresses take DB_PORT
+            const char *colon = memchr(p, ':', len);
+            if (colon && memchr(colon + 1, ':', len - (size_t)(colon + 1 - p)))
+                colon = NULL;
+
+            Pool *replica = &replicas[nReplicas];
+            char port[ENDPOINT_PORT_SIZE];
+            size_t hostLen = len;
+            snprintf(port, sizeof(port), "%s", DB_PORT);
+
+            if (colon) {
+                size_t portLen = len - (size_t)(colon + 1 - p);
+                if (portLen == 0 || portLen >= sizeof(port)) {
+                    fprintf(stderr, "Error: invalid replica port in DB_REPLICAS\n");
+                    return false;
+                }
+                memcpy(port, colon + 1, portLen);
+                port[portLen] = '\0';
+                hostLen = (size_t)(colon - p);
+            }
+
+            if (!set_endpoint(replica, p, hostLen, port)) {
+                fprintf(stderr, "Error: invalid replica in DB_REPLICAS\n");
+                return false;
+            }
+            nReplicas++;
+        }
+
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+
+    return true;
+}
+
 bool init_db_vars(void) {
     DB_HOST = getenv("DB_HOST");
     DB_USER = getenv("DB_USER");
@@ -44,32 +197,53 @@ bool init_db_vars(void) {
         return false;
     }
 
-    // Max connections
-    const char *maxConnStr = getenv("MAX_DB_CONN");
-    if (maxConnStr) {
-        maxConn = atoi(maxConnStr);
-        if (maxConn <= 0)
-            maxConn = 1; // fallback
+    if (!set_endpoint(&primary, DB_HOST, strlen(DB_HOST), DB_PORT)) {
+        fprintf(stderr, "Error: invalid DB_HOST or DB_PORT\n");
+        return false;
     }
-    else {
-        maxConn = (int)sysconf(_SC_NPROCESSORS_ONLN);
-        if (maxConn <= 0)
-            maxConn = 1; // fallback
+
+    // Max connections
+    int nProc = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    primary.maxConn = env_int("MAX_DB_CONN", nProc > 0 ? nProc : 1, 1);
+
+    // Connections kept open even when idle
+    primary.minConn = env_int("MIN_DB_CONN", primary.maxConn / 2 > 0 ? primary.maxConn / 2 : 1, 1);
+    if (primary.minConn > primary.maxConn)
+        primary.minConn = primary.maxConn;
+
+    checkoutTimeoutMs = env_int("DB_CHECKOUT_TIMEOUT_MS", DEFAULT_CHECKOUT_TIMEOUT_MS, 1);
+    idleTimeoutS = env_int("DB_IDLE_TIMEOUT", DEFAULT_IDLE_TIMEOUT_S, 1);
+    healthIntervalS = env_int("DB_HEALTH_INTERVAL", DEFAULT_HEALTH_INTERVAL_S, 1);
+    healthTimeoutMs = env_int("DB_HEALTH_TIMEOUT_MS", DEFAULT_HEALTH_TIMEOUT_MS, 1);
+
+    // Replicas are sized on their own, they take the reads
+    if (!parse_replicas(getenv("DB_REPLICAS")))
+        return false;
+
+    replicaMaxConn = env_int("MAX_DB_REPLICA_CONN", primary.maxConn, 1);
+    replicaMinConn = env_int("MIN_DB_REPLICA_CONN", 1, 0);
+    if (replicaMinConn > replicaMaxConn)
+        replicaMinConn = replicaMaxConn;
+    replicaMaxLagMs = env_int("DB_REPLICA_MAX_LAG_MS", DEFAULT_REPLICA_MAX_LAG_MS, 0);
+
+    for (int i = 0; i < nReplicas; i++) {
+        replicas[i].maxConn = replicaMaxConn;
+        replicas[i].minConn = replicaMinConn;
     }
 
     return true;
 }
 
-PGconn *init_db_conn(void) {
-
+static PGconn *connect_endpoint(const Pool *pool) {
     PGconn *conn;
-    conn = PQsetdbLogin(DB_HOST, DB_PORT,
+    conn = PQsetdbLogin(pool->host, pool->port,
                         NULL, // options
                         NULL, // tty
                         DB_NAME, DB_USER, DB_PASS);
 
     if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection error: %s\n", PQerrorMessage(conn));
+        fprintf(stderr, "Connection error (%s:%s): %s\n", pool->host, pool->port,
+                PQerrorMessage(conn));
         PQfinish(conn);
         return NULL;
     }
@@ -77,72 +251,795 @@ PGconn *init_db_conn(void) {
     return conn;
 }
 
-bool init_pool(void) {
-    // Reserve memory for the pool
-    pool = malloc(sizeof(ConnWrapper) * maxConn);
-    if (!pool) {
+PGconn *init_db_conn(void) {
+    return connect_endpoint(&primary);
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// A new or reset session has no statements and the server default TimeZone
+static void reset_conn_state(ConnWrapper *wrapper) {
+    wrapper->nStmts = 0;
+    wrapper->timezone[0] = '\0';
+    wrapper->statementTimeoutMs = 0;
+
+    // The server reports its TimeZone on connect
+    const char *timezone = PQparameterStatus(wrapper->conn, "TimeZone");
+    if (timezone && strlen(timezone) < TIMEZONE_SIZE)
+        strcpy(wrapper->timezone, timezone);
+}
+
+static bool open_slot(ConnWrapper *wrapper) {
+    wrapper->conn = connect_endpoint(wrapper->pool);
+    if (!wrapper->conn)
+        return false;
+
+    reset_conn_state(wrapper);
+    wrapper->lastUsedUs = now_us();
+    __atomic_add_fetch(&wrapper->pool->openConns, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+static void close_slot(ConnWrapper *wrapper) {
+    Pool *pool = wrapper->pool;
+
+    PQfinish(wrapper->conn);
+    wrapper->conn = NULL;
+    __atomic_sub_fetch(&pool->openConns, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&wrapper->state, CONN_EMPTY, __ATOMIC_SEQ_CST);
+
+    // A waiter can open the slot again
+    pthread_mutex_lock(&pool->mutex);
+    pool->emptySlots[pool->nEmpty++] = wrapper->index;
+    if (__atomic_load_n(&pool->waiters, __ATOMIC_SEQ_CST) > 0)
+        pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static bool reconnect_conn(ConnWrapper *wrapper) {
+    __atomic_add_fetch(&wrapper->pool->statReconnects, 1, __ATOMIC_RELAXED);
+
+    PQreset(wrapper->conn);
+    if (PQstatus(wrapper->conn) != CONNECTION_OK) {
+        fprintf(stderr, "Connection error: %s\n", PQerrorMessage(wrapper->conn));
+        return false;
+    }
+
+    reset_conn_state(wrapper);
+    return true;
+}
+
+// Reconnects a connection that broke since its last use
+static bool check_conn(ConnWrapper *wrapper) {
+    if (PQstatus(wrapper->conn) == CONNECTION_OK)
+        return true;
+
+    fprintf(stderr, "Database connection lost (%s:%s), reconnecting\n", wrapper->pool->host,
+            wrapper->pool->port);
+    return reconnect_conn(wrapper);
+}
+
+bool reset_conn(ConnWrapper *wrapper) {
+    if (!wrapper)
+        return false;
+
+    fprintf(stderr, "Resetting a database connection left mid protocol (%s:%s)\n",
+            wrapper->pool->host, wrapper->pool->port);
+    return reconnect_conn(wrapper);
+}
+
+static void put_conn(ConnWrapper *wrapper) {
+    Pool *pool = wrapper->pool;
+
+    __atomic_store_n(&wrapper->state, CONN_FREE, __ATOMIC_SEQ_CST);
+
+    // Only link it if it is not already waiting in the stack as a stale entry
+    if (__atomic_exchange_n(&wrapper->inStack, 1, __ATOMIC_SEQ_CST) == 0)
+        push_free(pool, wrapper->index);
+
+    if (__atomic_load_n(&pool->waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->cond); // Awake a waiting thread
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+static void push_free(Pool *pool, int index) {
+    uint64_t head = __atomic_load_n(&pool->freeHead, __ATOMIC_ACQUIRE);
+    uint64_t newHead;
+
+    do {
+        __atomic_store_n(&pool->slots[index].next, (uint32_t)head, __ATOMIC_RELAXED);
+        newHead = (((head >> 32) + 1) << 32) | (uint32_t)(index + 1);
+    } while (!__atomic_compare_exchange_n(&pool->freeHead, &head, newHead, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static int pop_free(Pool *pool) {
+    uint64_t head = __atomic_load_n(&pool->freeHead, __ATOMIC_ACQUIRE);
+
+    while ((uint32_t)head != 0) {
+        int index = (int)(uint32_t)head - 1;
+        uint32_t next = __atomic_load_n(&pool->slots[index].next, __ATOMIC_RELAXED);
+        uint64_t newHead = (((head >> 32) + 1) << 32) | next;
+
+        // The tag makes a stale next fail the CAS if the top was popped and pushed again
+        if (__atomic_compare_exchange_n(&pool->freeHead, &head, newHead, true, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+            return index;
+    }
+    return -1;
+}
+
+static bool claim_conn(Pool *pool, int index) {
+    int expected = CONN_FREE;
+    return __atomic_compare_exchange_n(&pool->slots[index].state, &expected, CONN_BUSY, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static ConnWrapper *try_get_conn(Pool *pool) {
+    int affinity = connAffinity[pool->id] - 1;
+    if (affinity >= 0 && affinity < pool->maxConn && claim_conn(pool, affinity))
+        return &pool->slots[affinity];
+
+    while (1) {
+        int index = pop_free(pool);
+        if (index < 0)
+            return NULL;
+
+        // Unlinked before the claim so a concurrent release pushes it again if the claim fails
+        __atomic_store_n(&pool->slots[index].inStack, 0, __ATOMIC_SEQ_CST);
+
+        if (claim_conn(pool, index))
+            return &pool->slots[index];
+        // Stale entry, the connection was taken through its thread affinity or closed
+    }
+}
+
+// Opens a connection in an empty slot, only called when no connection is free
+static ConnWrapper *grow_pool(Pool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->nEmpty == 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+    }
+    ConnWrapper *wrapper = &pool->slots[pool->emptySlots[--pool->nEmpty]];
+    pthread_mutex_unlock(&pool->mutex);
+
+    __atomic_store_n(&wrapper->state, CONN_BUSY, __ATOMIC_SEQ_CST);
+
+    if (!open_slot(wrapper)) {
+        __atomic_store_n(&wrapper->state, CONN_EMPTY, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&pool->mutex);
+        pool->emptySlots[pool->nEmpty++] = wrapper->index;
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+    }
+    return wrapper;
+}
+
+static void record_wait(Pool *pool, uint64_t waited) {
+    __atomic_add_fetch(&pool->statWaits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->statWaitTimeUs, waited, __ATOMIC_RELAXED);
+
+    uint64_t maxWait = __atomic_load_n(&pool->statMaxWaitUs, __ATOMIC_RELAXED);
+    while (waited > maxWait &&
+           !__atomic_compare_exchange_n(&pool->statMaxWaitUs, &maxWait, waited, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Sleeps until a connection is released or DB_CHECKOUT_TIMEOUT_MS passes
+static ConnWrapper *wait_for_conn(Pool *pool) {
+    uint64_t start = now_us();
+    ConnWrapper *wrapper;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += checkoutTimeoutMs / 1000;
+    deadline.tv_nsec += (long)(checkoutTimeoutMs % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_add_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+
+    // Wait for release_conn to make a signal, or for a slot to open. Connections closed by the
+    // health check or that failed to open while the database was down leave empty slots
+    bool timedOut = false;
+    while (!(wrapper = try_get_conn(pool))) {
+        if (pool->nEmpty > 0) {
+            pthread_mutex_unlock(&pool->mutex);
+            wrapper = grow_pool(pool);
+            pthread_mutex_lock(&pool->mutex);
+            if (wrapper)
+                break;
+        }
+
+        if (timedOut)
+            break;
+        if (pthread_cond_timedwait(&pool->cond, &pool->mutex, &deadline) == ETIMEDOUT)
+            timedOut = true;
+    }
+
+    __atomic_sub_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->mutex);
+
+    record_wait(pool, now_us() - start);
+
+    if (!wrapper) {
+        fprintf(stderr, "Timed out waiting for a database connection\n");
+        __atomic_add_fetch(&pool->statTimeouts, 1, __ATOMIC_RELAXED);
+    }
+
+    return wrapper;
+}
+
+// Without wait it gives up at once when every connection of the pool is busy
+static ConnWrapper *checkout_conn(Pool *pool, bool wait) {
+    if (!poolReady)
+        return NULL;
+
+    ConnWrapper *wrapper = try_get_conn(pool);
+
+    if (!wrapper)
+        wrapper = grow_pool(pool);
+
+    if (!wrapper && wait)
+        wrapper = wait_for_conn(pool);
+
+    if (!wrapper)
+        return NULL;
+
+    connAffinity[pool->id] = wrapper->index + 1;
+
+    if (!check_conn(wrapper)) {
+        put_conn(wrapper);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&pool->statCheckouts, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->statBusy, 1, __ATOMIC_RELAXED);
+
+    return wrapper;
+}
+
+// Skips the round trip when the connection already has the timeout
+static void set_conn_statement_timeout(ConnWrapper *wrapper, int timeoutMs) {
+    if (wrapper->statementTimeoutMs == timeoutMs)
+        return;
+
+    char command[64];
+    if (timeoutMs > 0)
+        snprintf(command, sizeof(command), "SET statement_timeout = %d;", timeoutMs);
+    else
+        snprintf(command, sizeof(command), "SET statement_timeout TO DEFAULT;");
+
+    PGresult *res = PQexec(wrapper->conn, command);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Error setting the statement timeout: %s",
+                PQerrorMessage(wrapper->conn));
+        wrapper->statementTimeoutMs = -1;
+    }
+    else {
+        wrapper->statementTimeoutMs = timeoutMs;
+    }
+    PQclear(res);
+}
+
+// What is left of the request deadline, rounded up to whole seconds so the requests of a lane
+// mostly ask for the same timeout and the connection keeps it
+static int deadline_timeout_ms(void) {
+    uint64_t deadline = admission_deadline();
+    if (deadline == 0)
+        return 0;
+
+    uint64_t now = metrics_now_us();
+    uint64_t seconds = deadline > now ? (deadline - now + 999999) / 1000000 : 1;
+
+    return seconds > INT32_MAX / 1000 ? INT32_MAX : (int)(seconds * 1000);
+}
+
+// Charges the whole checkout, health check included, to the request of the calling thread
+ConnWrapper *get_conn(void) {
+    uint64_t start = now_us();
+    ConnWrapper *wrapper = checkout_conn(&primary, true);
+    if (wrapper)
+        set_conn_statement_timeout(wrapper, deadline_timeout_ms());
+    metrics_add(METRICS_PHASE_DB_WAIT, now_us() - start);
+    return wrapper;
+}
+
+// The healthy replica with the fewest connections checked out, skipping the ones in tried
+static Pool *least_busy_replica(const bool *tried) {
+    Pool *best = NULL;
+    int bestBusy = 0;
+
+    for (int i = 0; i < nReplicas; i++) {
+        Pool *replica = &replicas[i];
+        if (tried[i] || !__atomic_load_n(&replica->healthy, __ATOMIC_RELAXED))
+            continue;
+
+        int busy = __atomic_load_n(&replica->statBusy, __ATOMIC_RELAXED);
+        if (!best || busy < bestBusy) {
+            best = replica;
+            bestBusy = busy;
+        }
+    }
+
+    return best;
+}
+
+ConnWrapper *get_read_conn(void) {
+    if (nReplicas == 0)
+        return get_conn();
+
+    uint64_t start = now_us();
+    ConnWrapper *wrapper = NULL;
+    bool tried[DB_MAX_REPLICAS] = {false};
+
+    // A replica that has no free connection right now passes the read to the next one
+    Pool *replica;
+    while (!wrapper && (replica = least_busy_replica(tried))) {
+        tried[replica->id - 1] = true;
+        wrapper = checkout_conn(replica, false);
+    }
+
+    // Every replica is busy, down or lagging
+    if (!wrapper)
+        wrapper = checkout_conn(&primary, true);
+
+    if (wrapper)
+        set_conn_statement_timeout(wrapper, deadline_timeout_ms());
+    metrics_add(METRICS_PHASE_DB_WAIT, now_us() - start);
+    return wrapper;
+}
+
+void release_conn(ConnWrapper *wrapper) {
+    if (!wrapper)
+        return;
+
+    __atomic_sub_fetch(&wrapper->pool->statBusy, 1, __ATOMIC_RELAXED);
+    wrapper->lastUsedUs = now_us();
+    put_conn(wrapper);
+}
+
+PGconn *get_pg_conn(const ConnWrapper *wrapper) {
+    if (!wrapper)
+        return NULL;
+    return wrapper->conn;
+}
+
+static void read_pool_stats(const Pool *pool, PoolStats *stats) {
+    stats->size = pool->maxConn;
+    stats->open = __atomic_load_n(&pool->openConns, __ATOMIC_RELAXED);
+    stats->busy = __atomic_load_n(&pool->statBusy, __ATOMIC_RELAXED);
+    stats->checkouts = __atomic_load_n(&pool->statCheckouts, __ATOMIC_RELAXED);
+    stats->waits = __atomic_load_n(&pool->statWaits, __ATOMIC_RELAXED);
+    stats->waitTimeUs = __atomic_load_n(&pool->statWaitTimeUs, __ATOMIC_RELAXED);
+    stats->maxWaitUs = __atomic_load_n(&pool->statMaxWaitUs, __ATOMIC_RELAXED);
+    stats->timeouts = __atomic_load_n(&pool->statTimeouts, __ATOMIC_RELAXED);
+    stats->reconnects = __atomic_load_n(&pool->statReconnects, __ATOMIC_RELAXED);
+}
+
+void get_pool_stats(PoolStats *stats) {
+    if (!stats)
+        return;
+
+    read_pool_stats(&primary, stats);
+}
+
+int get_replica_count(void) {
+    return nReplicas;
+}
+
+bool get_replica_stats(int replica, ReplicaStats *stats) {
+    if (!stats || replica < 0 || replica >= nReplicas)
+        return false;
+
+    const Pool *pool = &replicas[replica];
+    snprintf(stats->endpoint, sizeof(stats->endpoint), "%s:%s", pool->host, pool->port);
+    stats->healthy = __atomic_load_n(&pool->healthy, __ATOMIC_RELAXED);
+    stats->lagMs = __atomic_load_n(&pool->lagMs, __ATOMIC_RELAXED);
+    read_pool_stats(pool, &stats->pool);
+
+    return true;
+}
+
+// PQexec bounded by DB_HEALTH_TIMEOUT_MS, so a server that stopped answering without closing the
+// socket can not hang the health thread. On a timeout the connection is left mid query and
+// *timedOut tells the caller to close it
+static PGresult *exec_health_query(PGconn *conn, const char *query, bool *timedOut) {
+    *timedOut = false;
+    if (!PQsendQuery(conn, query))
+        return NULL;
+
+    uint64_t deadlineUs = now_us() + (uint64_t)healthTimeoutMs * 1000;
+    PGresult *last = NULL;
+
+    for (;;) {
+        int pending = PQflush(conn);
+        if (pending < 0)
+            break;
+
+        // Like PQexec the last result is returned
+        if (pending == 0 && !PQisBusy(conn)) {
+            PGresult *res = PQgetResult(conn);
+            if (!res)
+                return last;
+            PQclear(last);
+            last = res;
+            continue;
+        }
+
+        uint64_t nowUs = now_us();
+        if (nowUs >= deadlineUs) {
+            *timedOut = true;
+            break;
+        }
+
+        struct pollfd fd = {PQsocket(conn), (short)(POLLIN | (pending ? POLLOUT : 0)), 0};
+        int ready = poll(&fd, 1, (int)((deadlineUs - nowUs + 999) / 1000));
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready > 0 && !PQconsumeInput(conn))
+            break;
+    }
+
+    PQclear(last);
+    return NULL;
+}
+
+// Pings idle connections, resetting the broken ones and closing the ones above minConn that
+// have not been used for idleTimeoutS, or that did not answer the ping
+static void check_idle_conns(Pool *pool) {
+    for (int i = 0; i < pool->maxConn; i++) {
+        if (!claim_conn(pool, i))
+            continue; // Busy or empty
+
+        ConnWrapper *wrapper = &pool->slots[i];
+
+        if (__atomic_load_n(&pool->openConns, __ATOMIC_RELAXED) > pool->minConn &&
+            now_us() - wrapper->lastUsedUs > (uint64_t)idleTimeoutS * 1000000) {
+            close_slot(wrapper);
+            continue;
+        }
+
+        if (PQstatus(wrapper->conn) == CONNECTION_OK) {
+            bool timedOut;
+            PQclear(exec_health_query(wrapper->conn, "", &timedOut));
+            if (timedOut) {
+                fprintf(stderr, "Database connection not answering (%s:%s), closing it\n",
+                        pool->host, pool->port);
+                close_slot(wrapper);
+                continue;
+            }
+        }
+
+        check_conn(wrapper);
+        put_conn(wrapper);
+    }
+}
+
+// Replay lag in milliseconds, 0 once the replica replayed everything it received so an idle
+// primary does not look like lag. That only holds while its WAL receiver streams, one that lost
+// the primary has replayed everything too. -1 on errors and without a receiver. The receiver
+// status is only shown to pg_read_all_stats, a running one has to do without
+static int query_replica_lag(ConnWrapper *wrapper, bool *timedOut) {
+    PGresult *res =
+        exec_health_query(wrapper->conn,
+                          "SELECT CASE WHEN NOT pg_is_in_recovery() THEN 0 "
+                          "  WHEN NOT EXISTS (SELECT 1 FROM pg_stat_wal_receiver "
+                          "    WHERE COALESCE(status, 'streaming') = 'streaming') THEN NULL "
+                          "  WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 "
+                          "  ELSE COALESCE((EXTRACT(EPOCH FROM "
+                          "    now() - pg_last_xact_replay_timestamp()) * 1000)::bigint, 0) "
+                          "END;",
+                          timedOut);
+
+    int lagMs = -1;
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        // No streaming WAL receiver, the replica is cut off from the primary
+        if (PQgetisnull(res, 0, 0)) {
+            PQclear(res);
+            return -1;
+        }
+
+        long long value = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+        lagMs = value < 0 ? 0 : value > INT32_MAX ? INT32_MAX : (int)value;
+    }
+    else {
+        fprintf(stderr, "Error checking the replica lag (%s:%s): %s", wrapper->pool->host,
+                wrapper->pool->port, PQerrorMessage(wrapper->conn));
+    }
+    PQclear(res);
+
+    return lagMs;
+}
+
+// Marks the replica unhealthy while it is unreachable or more than DB_REPLICA_MAX_LAG_MS behind
+static void check_replica(Pool *replica) {
+    ConnWrapper *wrapper = checkout_conn(replica, false);
+
+    int lagMs = -1;
+    if (wrapper) {
+        bool timedOut;
+        lagMs = query_replica_lag(wrapper, &timedOut);
+        if (timedOut) {
+            __atomic_sub_fetch(&replica->statBusy, 1, __ATOMIC_RELAXED);
+            close_slot(wrapper);
+        }
+        else {
+            release_conn(wrapper);
+        }
+    }
+
+    bool healthy = lagMs >= 0 && lagMs <= replicaMaxLagMs;
+    if (healthy != __atomic_load_n(&replica->healthy, __ATOMIC_RELAXED))
+        fprintf(stderr, "Replica %s:%s %s\n", replica->host, replica->port,
+                healthy ? "is taking reads" : "is down or lagging, reads go elsewhere");
+
+    __atomic_store_n(&replica->lagMs, lagMs, __ATOMIC_RELAXED);
+    __atomic_store_n(&replica->healthy, healthy, __ATOMIC_RELAXED);
+}
+
+static void *health_check_loop(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&healthMutex);
+    while (!healthStop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += healthIntervalS;
+
+        pthread_cond_timedwait(&healthCond, &healthMutex, &deadline);
+        if (healthStop)
+            break;
+
+        pthread_mutex_unlock(&healthMutex);
+        check_idle_conns(&primary);
+        for (int i = 0; i < nReplicas; i++) {
+            check_idle_conns(&replicas[i]);
+            check_replica(&replicas[i]);
+        }
+        pthread_mutex_lock(&healthMutex);
+    }
+    pthread_mutex_unlock(&healthMutex);
+
+    return NULL;
+}
+
+static bool init_monotonic_cond(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0)
+        return false;
+
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int ret = pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return ret == 0;
+}
+
+static void free_slots(Pool *pool) {
+    if (pool->slots) {
+        for (int i = 0; i < pool->maxConn; i++) {
+            if (pool->slots[i].conn)
+                PQfinish(pool->slots[i].conn);
+        }
+    }
+
+    free(pool->slots);
+    pool->slots = NULL;
+    free(pool->emptySlots);
+    pool->emptySlots = NULL;
+}
+
+// With required false the connections that fail to open are left to the health checks
+static bool init_endpoint_pool(Pool *pool, int id, bool required) {
+    pool->id = id;
+    pool->slots = malloc(sizeof(ConnWrapper) * pool->maxConn);
+    pool->emptySlots = malloc(sizeof(int) * pool->maxConn);
+    if (!pool->slots || !pool->emptySlots) {
         perror("malloc");
+        free_slots(pool);
         return false;
     }
 
-    for (int i = 0; i < maxConn; i++) {
-        pool[i].conn = init_db_conn();
-        pool[i].busy = 0;
-        if (!pool[i].conn) {
-            // Clean all initialized connections
+    // Timed waits use CLOCK_MONOTONIC deadlines
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0 || !init_monotonic_cond(&pool->cond)) {
+        free_slots(pool);
+        return false;
+    }
+
+    pool->freeHead = 0;
+    pool->waiters = 0;
+    pool->nEmpty = 0;
+    pool->openConns = 0;
+    pool->healthy = false;
+    pool->lagMs = -1;
+
+    for (int i = 0; i < pool->maxConn; i++) {
+        ConnWrapper *wrapper = &pool->slots[i];
+        wrapper->pool = pool;
+        wrapper->conn = NULL;
+        wrapper->index = i;
+        wrapper->state = CONN_EMPTY;
+        wrapper->inStack = 0;
+        wrapper->next = 0;
+        wrapper->lastUsedUs = 0;
+        wrapper->nStmts = 0;
+        wrapper->timezone[0] = '\0';
+        wrapper->statementTimeoutMs = 0;
+    }
+
+    // Open the minimum connections now, the rest on demand
+    int nOpen = 0;
+    while (nOpen < pool->minConn && open_slot(&pool->slots[nOpen]))
+        nOpen++;
+
+    if (nOpen < pool->minConn && required) {
+        // Clean all initialized connections
+        free_slots(pool);
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_cond_destroy(&pool->cond);
+        return false;
+    }
+
+    for (int i = pool->maxConn - 1; i >= nOpen; i--)
+        pool->emptySlots[pool->nEmpty++] = i;
+
+    for (int i = nOpen - 1; i >= 0; i--) {
+        pool->slots[i].state = CONN_FREE;
+        pool->slots[i].inStack = 1;
+        push_free(pool, i);
+    }
+
+    return true;
+}
+
+static void free_endpoint_pool(Pool *pool) {
+    if (!pool->slots)
+        return;
+
+    free_slots(pool);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+}
+
+bool init_pool(void) {
+    if (!init_monotonic_cond(&healthCond))
+        return false;
+
+    if (!init_endpoint_pool(&primary, 0, true))
+        return false;
+
+    // A replica that is down at startup only starts taking reads once a health check finds it
+    for (int i = 0; i < nReplicas; i++) {
+        if (!init_endpoint_pool(&replicas[i], i + 1, false)) {
             for (int j = 0; j < i; j++)
-                PQfinish(pool[j].conn);
-            free(pool);
-            pool = NULL;
+                free_endpoint_pool(&replicas[j]);
+            free_endpoint_pool(&primary);
             return false;
         }
     }
+
+    poolReady = true;
+
+    for (int i = 0; i < nReplicas; i++)
+        check_replica(&replicas[i]);
+
+    healthStop = false;
+    if (pthread_create(&healthThread, NULL, health_check_loop, NULL) == 0)
+        healthRunning = true;
+    else
+        fprintf(stderr, "Failed to start the database health check thread\n");
+
     return true;
 }
 
 void free_pool(void) {
-    if (!pool)
+    if (!poolReady)
         return;
 
-    for (int i = 0; i < maxConn; i++) {
-        PQfinish(pool[i].conn);
+    if (healthRunning) {
+        pthread_mutex_lock(&healthMutex);
+        healthStop = true;
+        pthread_cond_signal(&healthCond);
+        pthread_mutex_unlock(&healthMutex);
+
+        pthread_join(healthThread, NULL);
+        healthRunning = false;
     }
 
-    free(pool);
-    pool = NULL;
+    poolReady = false;
 
-    pthread_mutex_destroy(&poolMutex);
-    pthread_cond_destroy(&poolCond);
+    free_endpoint_pool(&primary);
+    for (int i = 0; i < nReplicas; i++)
+        free_endpoint_pool(&replicas[i]);
+
+    pthread_mutex_destroy(&healthMutex);
+    pthread_cond_destroy(&healthCond);
 }
 
-PGconn *get_conn(void) {
-    PGconn *ret = NULL;
+bool conn_statement_prepared(ConnWrapper *wrapper, const char *stmtName) {
+    if (!wrapper || !stmtName)
+        return false;
 
-    pthread_mutex_lock(&poolMutex);
+    // The connection is checked out by the caller, so its cache needs no locking
+    for (int i = 0; i < wrapper->nStmts; i++) {
+        if (strcmp(wrapper->stmts[i], stmtName) == 0)
+            return true;
+    }
+    return false;
+}
 
-    // Wait for a free connection
-    while (1) {
-        for (int i = 0; i < maxConn; i++) {
-            if (pool[i].busy == 0) {
-                pool[i].busy = 1; // Mark connection as busy
-                ret = pool[i].conn;
-                pthread_mutex_unlock(&poolMutex);
-                return ret;
-            }
+bool conn_prepare_statement(ConnWrapper *wrapper, const char *stmtName, const char *query,
+                            int nParams) {
+    if (!wrapper || !stmtName || !query || strlen(stmtName) >= STMT_NAME_SIZE)
+        return false;
+
+    PGconn *conn = wrapper->conn;
+
+    PGresult *res;
+
+    // Cache full, drop every statement of the connection and start over
+    if (wrapper->nStmts >= MAX_PREPARED_STMTS) {
+        res = PQexec(conn, "DEALLOCATE ALL;");
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            fprintf(stderr, "Error deallocating statements: %s", PQerrorMessage(conn));
+            PQclear(res);
+            return false;
         }
-        // There aren't any free connection, wait for release_conn to make a signal
-        pthread_cond_wait(&poolCond, &poolMutex);
+        PQclear(res);
+        wrapper->nStmts = 0;
     }
+
+    res = PQprepare(conn, stmtName, query, nParams, NULL);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Error preparing the statement: %s", PQerrorMessage(conn));
+        PQclear(res);
+        return false;
+    }
+    PQclear(res);
+
+    strcpy(wrapper->stmts[wrapper->nStmts], stmtName);
+    wrapper->nStmts++;
+
+    return true;
 }
 
-void release_conn(PGconn *conn) {
-    pthread_mutex_lock(&poolMutex);
-    for (int i = 0; i < maxConn; i++) {
-        if (pool[i].conn == conn) {
-            pool[i].busy = 0;               // Mark connection as free
-            pthread_cond_signal(&poolCond); // Awake a waiting thread
-            break;
-        }
+bool set_conn_timezone(ConnWrapper *wrapper, const char *timezone) {
+    if (!wrapper || !timezone || strlen(timezone) >= TIMEZONE_SIZE)
+        return false;
+
+    PGconn *conn = wrapper->conn;
+
+    if (strcmp(wrapper->timezone, timezone) == 0)
+        return true;
+
+    const char *paramValues[1] = {timezone};
+
+    PGresult *res = PQexecParams(conn, "SELECT set_config('TimeZone', $1, false);", 1, NULL,
+                                 paramValues, NULL, NULL, 0);
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Error setting the timezone: %s", PQerrorMessage(conn));
+        PQclear(res);
+        // The session state is unknown now
+        wrapper->timezone[0] = '\0';
+        return false;
     }
-    pthread_mutex_unlock(&poolMutex);
+    PQclear(res);
+
+    strcpy(wrapper->timezone, timezone);
+
+    return true;
 }
@@ -4,13 +4,70 @@
 #include <libpq-fe.h>
 #include <stdbool.h>
 
+#define MAX_PREPARED_STMTS 64
+#define STMT_NAME_SIZE 64
+#define TIMEZONE_SIZE 64
+#define DB_MAX_REPLICAS 8
+#define DB_ENDPOINT_SIZE 280
+
+// Pooled connection handle
+typedef struct ConnWrapper ConnWrapper;
+
+typedef struct {
+    int size; // Slots, the pool grows up to MAX_DB_CONN
+    int open;
+    int busy;
+    unsigned long long checkouts;
+    unsigned long long waits; // Checkouts that had to block for a free connection
+    unsigned long long waitTimeUs;
+    unsigned long long maxWaitUs;
+    unsigned long long timeouts; // Checkouts that gave up after DB_CHECKOUT_TIMEOUT_MS
+    unsigned long long reconnects;
+} PoolStats;
+
+typedef struct {
+    char endpoint[DB_ENDPOINT_SIZE]; // host:port
+    bool healthy;                    // Taking reads, reachable and within DB_REPLICA_MAX_LAG_MS
+    int lagMs;                       // Last measured replay lag, -1 when it could not be checked
+    PoolStats pool;
+} ReplicaStats;
+
 bool init_db_vars(void);
 
+// Standalone connection outside the pool, the caller has to PQfinish it
+PGconn *init_db_conn(void);
+
 bool init_pool(void);
 void free_pool(void);
 
-PGconn *get_conn(void);
+// NULL when no connection frees up within DB_CHECKOUT_TIMEOUT_MS or the database is down
+ConnWrapper *get_conn(void);
+
+// For reads that do not need to see the caller's own writes: the least busy healthy replica from
+// DB_REPLICAS, falling back to get_conn when there are none or all of them are busy or lagging
+ConnWrapper *get_read_conn(void);
+
+void release_conn(ConnWrapper *wrapper);
+
+// Reconnects a checked out connection whose session state is unknown, like one stuck in a COPY
+// that could not be ended. A failed reset is retried by the next checkout
+bool reset_conn(ConnWrapper *wrapper);
+
+PGconn *get_pg_conn(const ConnWrapper *wrapper);
+
+// Primary connections only
+void get_pool_stats(PoolStats *stats);
+
+int get_replica_count(void);
+bool get_replica_stats(int replica, ReplicaStats *stats);
+
+// Per connection prepared statement cache, stmtName must be shorter than STMT_NAME_SIZE
+bool conn_statement_prepared(ConnWrapper *wrapper, const char *stmtName);
+
+bool conn_prepare_statement(ConnWrapper *wrapper, const char *stmtName, const char *query,
+                            int nParams);
 
-void release_conn(PGconn *conn);
+// Sets the session TimeZone, skipping the round trip when it is already the current one
+bool set_conn_timezone(ConnWrapper *wrapper, const char *timezone);
 
 #endif
@@ -0,0 +1,178 @@
+#include <errno.h>
+#include <libpq-fe.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "listener.h"
+
+#define MAX_SUBSCRIPTIONS 8
+#define CHANNEL_SIZE 64
+#define RECONNECT_INTERVAL_MS 1000
+
+typedef struct {
+    char channel[CHANNEL_SIZE];
+    listenerCallback_t callback;
+    void *cls;
+} Subscription;
+
+static Subscription subscriptions[MAX_SUBSCRIPTIONS];
+static int nSubscriptions = 0;
+
+static pthread_t listenerThread;
+static bool listenerRunning = false;
+static volatile bool listenerStop = false;
+static int wakePipe[2] = {-1, -1}; // Interrupts the poll on stop
+
+static void dispatch(listenerEvent_t event, const char *channel, const char *payload) {
+    for (int i = 0; i < nSubscriptions; i++) {
+        if (!channel || strcmp(subscriptions[i].channel, channel) == 0)
+            subscriptions[i].callback(event, payload, subscriptions[i].cls);
+    }
+}
+
+static bool listen_all(PGconn *conn) {
+    for (int i = 0; i < nSubscriptions; i++) {
+        char *channel =
+            PQescapeIdentifier(conn, subscriptions[i].channel, strlen(subscriptions[i].channel));
+        if (!channel)
+            return false;
+
+        char command[CHANNEL_SIZE * 2 + 16];
+        snprintf(command, sizeof(command), "LISTEN %s", channel);
+        PQfreemem(channel);
+
+        PGresult *res = PQexec(conn, command);
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        if (!ok)
+            fprintf(stderr, "Error executing LISTEN: %s", PQerrorMessage(conn));
+        PQclear(res);
+
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// Returns false once stop was requested
+static bool wait_for(int fd, int timeoutMs) {
+    struct pollfd fds[2];
+    int nFds = 0;
+
+    fds[nFds].fd = wakePipe[0];
+    fds[nFds].events = POLLIN;
+    nFds++;
+
+    if (fd >= 0) {
+        fds[nFds].fd = fd;
+        fds[nFds].events = POLLIN;
+        nFds++;
+    }
+
+    if (poll(fds, (nfds_t)nFds, timeoutMs) < 0 && errno != EINTR)
+        fprintf(stderr, "Listener poll failed: %s\n", strerror(errno));
+
+    return !listenerStop;
+}
+
+static void *listener_loop(void *arg) {
+    (void)arg;
+    PGconn *conn = NULL;
+
+    while (!listenerStop) {
+        if (!conn) {
+            conn = init_db_conn();
+            if (!conn || !listen_all(conn)) {
+                if (conn) {
+                    PQfinish(conn);
+                    conn = NULL;
+                }
+                wait_for(-1, RECONNECT_INTERVAL_MS);
+                continue;
+            }
+            dispatch(LISTENER_CONNECTED, NULL, NULL);
+        }
+
+        if (!wait_for(PQsocket(conn), RECONNECT_INTERVAL_MS))
+            break;
+
+        if (!PQconsumeInput(conn) || PQstatus(conn) != CONNECTION_OK) {
+            fprintf(stderr, "Listener connection lost: %s", PQerrorMessage(conn));
+            PQfinish(conn);
+            conn = NULL;
+            dispatch(LISTENER_DISCONNECTED, NULL, NULL);
+            continue;
+        }
+
+        PGnotify *notify;
+        while ((notify = PQnotifies(conn))) {
+            dispatch(LISTENER_NOTIFY, notify->relname, notify->extra);
+            PQfreemem(notify);
+        }
+    }
+
+    if (conn)
+        PQfinish(conn);
+
+    return NULL;
+}
+
+bool listener_subscribe(const char *channel, listenerCallback_t callback, void *cls) {
+    if (!channel || !callback || listenerRunning || nSubscriptions == MAX_SUBSCRIPTIONS ||
+        strlen(channel) >= CHANNEL_SIZE)
+        return false;
+
+    Subscription *sub = &subscriptions[nSubscriptions++];
+    snprintf(sub->channel, sizeof(sub->channel), "%s", channel);
+    sub->callback = callback;
+    sub->cls = cls;
+
+    return true;
+}
+
+bool start_listener(void) {
+    if (listenerRunning)
+        return false;
+
+    if (nSubscriptions == 0)
+        return true;
+
+    if (pipe(wakePipe) != 0) {
+        perror("pipe");
+        return false;
+    }
+
+    listenerStop = false;
+    if (pthread_create(&listenerThread, NULL, listener_loop, NULL) != 0) {
+        fprintf(stderr, "Failed to start the listener thread\n");
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+        wakePipe[0] = wakePipe[1] = -1;
+        return false;
+    }
+
+    listenerRunning = true;
+    return true;
+}
+
+void stop_listener(void) {
+    if (!listenerRunning)
+        return;
+
+    listenerStop = true;
+    if (write(wakePipe[1], "x", 1) < 0)
+        perror("write");
+
+    pthread_join(listenerThread, NULL);
+    listenerRunning = false;
+
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    wakePipe[0] = wakePipe[1] = -1;
+    nSubscriptions = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdbool.h>
+
+typedef enum {
+    LISTENER_NOTIFY = 0,
+    LISTENER_CONNECTED,   // (Re)connected and listening, notifications may have been missed
+    LISTENER_DISCONNECTED // Notifications are not delivered until the next LISTENER_CONNECTED
+} listenerEvent_t;
+
+// payload is only set for LISTENER_NOTIFY. Called from the listener thread
+typedef void (*listenerCallback_t)(listenerEvent_t event, const char *payload, void *cls);
+
+// Subscriptions are only accepted before start_listener
+bool listener_subscribe(const char *channel, listenerCallback_t callback, void *cls);
+
+// Runs LISTEN for every subscribed channel on a dedicated connection outside the pool,
+// reconnecting whenever it drops
+bool start_listener(void);
+
+void stop_listener(void);
+
+#endif
@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <libpq-fe.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "reactor.h"
+
+#define REACTOR_MAX_EVENTS 64
+#define CANCEL_ERROR_SIZE 256
+
+// One query in flight, only touched by the reactor thread once it is registered
+typedef struct ReactorOp {
+    ConnWrapper *wrapper;
+    PGconn *conn;
+    PGresult *res; // First result, the ones after it are discarded
+    bool flushing; // Part of the query is still in the libpq output buffer
+    dbReactorDone_t done;
+    void *cls;
+    struct ReactorOp *prev;
+    struct ReactorOp *next;
+} ReactorOp;
+
+static pthread_t reactorThread;
+static bool reactorRunning = false;
+static volatile bool reactorStop = false;
+static int epollFd = -1;
+static int wakeFd = -1; // Interrupts the epoll_wait on stop
+
+// Every registered query, so the ones still pending on stop can be completed
+static ReactorOp *pending = NULL;
+static pthread_mutex_t pendingMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Linked and watched under the lock, so fail_pending never sees an op before it is registered
+// and nothing is registered after it ran
+static bool register_op(ReactorOp *op) {
+    pthread_mutex_lock(&pendingMutex);
+    if (!reactorRunning) {
+        pthread_mutex_unlock(&pendingMutex);
+        return false;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN | (op->flushing ? EPOLLOUT : 0),
+                                .data.ptr = op};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, PQsocket(op->conn), &event) != 0) {
+        fprintf(stderr, "Failed to watch the query socket: %s\n", strerror(errno));
+        pthread_mutex_unlock(&pendingMutex);
+        return false;
+    }
+
+    op->prev = NULL;
+    op->next = pending;
+    if (pending)
+        pending->prev = op;
+    pending = op;
+    pthread_mutex_unlock(&pendingMutex);
+
+    return true;
+}
+
+static void unlink_op(ReactorOp *op) {
+    pthread_mutex_lock(&pendingMutex);
+    if (op->prev)
+        op->prev->next = op->next;
+    else
+        pending = op->next;
+    if (op->next)
+        op->next->prev = op->prev;
+    pthread_mutex_unlock(&pendingMutex);
+}
+
+// Leaves the connection with no query running so the pool can hand it out again
+static void abandon_query(PGconn *conn) {
+    if (PQstatus(conn) != CONNECTION_OK)
+        return;
+
+    PGcancel *cancel = PQgetCancel(conn);
+    if (cancel) {
+        char error[CANCEL_ERROR_SIZE];
+        if (!PQcancel(cancel, error, sizeof(error)))
+            fprintf(stderr, "Error cancelling a query: %s\n", error);
+        PQfreeCancel(cancel);
+    }
+
+    PQsetnonblocking(conn, 0);
+
+    PGresult *res;
+    while ((res = PQgetResult(conn)))
+        PQclear(res);
+}
+
+static void finish_op(ReactorOp *op, bool completed) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, PQsocket(op->conn), NULL);
+    unlink_op(op);
+
+    if (!completed) {
+        PQclear(op->res);
+        op->res = NULL;
+        abandon_query(op->conn);
+    }
+
+    PQsetnonblocking(op->conn, 0);
+    release_conn(op->wrapper);
+
+    op->done(op->res, op->cls);
+    free(op);
+}
+
+// Reads whatever arrived, completing the query once libpq returns its last result
+static void advance_op(ReactorOp *op, uint32_t events) {
+    if (op->flushing) {
+        int flushed = PQflush(op->conn);
+        if (flushed < 0) {
+            fprintf(stderr, "Error sending a query: %s", PQerrorMessage(op->conn));
+            finish_op(op, false);
+            return;
+        }
+
+        if (flushed == 0) {
+            op->flushing = false;
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = op};
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, PQsocket(op->conn), &event);
+        }
+    }
+
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
+
+    if (!PQconsumeInput(op->conn)) {
+        fprintf(stderr, "Error reading a query result: %s", PQerrorMessage(op->conn));
+        finish_op(op, false);
+        return;
+    }
+
+    while (!PQisBusy(op->conn)) {
+        PGresult *res = PQgetResult(op->conn);
+        if (!res) {
+            finish_op(op, true);
+            return;
+        }
+
+        if (!op->res)
+            op->res = res;
+        else
+            PQclear(res);
+    }
+}
+
+static void fail_pending(void) {
+    for (;;) {
+        pthread_mutex_lock(&pendingMutex);
+        ReactorOp *op = pending;
+        pthread_mutex_unlock(&pendingMutex);
+
+        if (!op)
+            break;
+
+        finish_op(op, false);
+    }
+}
+
+static void *reactor_loop(void *arg) {
+    (void)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (!reactorStop) {
+        int nEvents = epoll_wait(epollFd, events, REACTOR_MAX_EVENTS, -1);
+        if (nEvents < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Reactor epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nEvents; i++) {
+            // The wake descriptor is registered without an op
+            if (events[i].data.ptr)
+                advance_op(events[i].data.ptr, events[i].events);
+        }
+    }
+
+    fail_pending();
+    return NULL;
+}
+
+bool start_db_reactor(void) {
+    if (reactorRunning)
+        return false;
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (epollFd < 0 || wakeFd < 0) {
+        perror("epoll_create1");
+        if (epollFd >= 0)
+            close(epollFd);
+        if (wakeFd >= 0)
+            close(wakeFd);
+        epollFd = wakeFd = -1;
+        return false;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) != 0) {
+        perror("epoll_ctl");
+        close(epollFd);
+        close(wakeFd);
+        epollFd = wakeFd = -1;
+        return false;
+    }
+
+    reactorStop = false;
+    if (pthread_create(&reactorThread, NULL, reactor_loop, NULL) != 0) {
+        fprintf(stderr, "Failed to start the database reactor thread\n");
+        close(epollFd);
+        close(wakeFd);
+        epollFd = wakeFd = -1;
+        return false;
+    }
+
+    pthread_mutex_lock(&pendingMutex);
+    reactorRunning = true;
+    pthread_mutex_unlock(&pendingMutex);
+
+    return true;
+}
+
+void stop_db_reactor(void) {
+    if (!reactorRunning)
+        return;
+
+    pthread_mutex_lock(&pendingMutex);
+    reactorRunning = false;
+    pthread_mutex_unlock(&pendingMutex);
+
+    reactorStop = true;
+
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0)
+        perror("write");
+
+    pthread_join(reactorThread, NULL);
+
+    close(epollFd);
+    close(wakeFd);
+    epollFd = wakeFd = -1;
+}
+
+bool db_reactor_running(void) {
+    pthread_mutex_lock(&pendingMutex);
+    bool running = reactorRunning;
+    pthread_mutex_unlock(&pendingMutex);
+    return running;
+}
+
+bool db_reactor_send_prepared(ConnWrapper *wrapper, const char *stmtName, int nParams,
+                              const char *const *paramValues, int resultFormat,
+                              dbReactorDone_t done, void *cls) {
+    if (!wrapper || !done)
+        return false;
+
+    ReactorOp *op = calloc(1, sizeof(ReactorOp));
+    if (!op)
+        return false;
+
+    op->wrapper = wrapper;
+    op->conn = get_pg_conn(wrapper);
+    op->done = done;
+    op->cls = cls;
+
+    // Big parameter lists are flushed by the reactor instead of blocking here
+    if (PQsetnonblocking(op->conn, 1) != 0 ||
+        !PQsendQueryPrepared(op->conn, stmtName, nParams, paramValues, NULL, NULL,
+                             resultFormat)) {
+        fprintf(stderr, "Error sending the query: %s", PQerrorMessage(op->conn));
+        PQsetnonblocking(op->conn, 0);
+        free(op);
+        return false;
+    }
+
+    int flushed = PQflush(op->conn);
+    if (flushed < 0) {
+        fprintf(stderr, "Error sending the query: %s", PQerrorMessage(op->conn));
+        PQsetnonblocking(op->conn, 0);
+        free(op);
+        return false;
+    }
+    op->flushing = flushed == 1;
+
+    // From here on the op belongs to the reactor thread, which may already be completing it
+    if (!register_op(op)) {
+        abandon_query(op->conn);
+        free(op);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <libpq-fe.h>
+#include <stdbool.h>
+
+#include "database.h"
+
+// Gets the first result of the query and owns it, NULL when the connection failed before one
+// arrived. Called from the reactor thread once the whole query was read and its connection is
+// back in the pool, so it should only hand the result over
+typedef void (*dbReactorDone_t)(PGresult *res, void *cls);
+
+// Starts the thread that waits on the sockets of every query in flight with epoll
+bool start_db_reactor(void);
+
+// Pending queries are completed with a NULL result before it returns
+void stop_db_reactor(void);
+
+bool db_reactor_running(void);
+
+// Sends the prepared statement without waiting for it and hands the checked out connection to
+// the reactor, which releases it once the query is done. On false nothing was queued, the
+// connection is still the caller's and done is never called
+bool db_reactor_send_prepared(ConnWrapper *wrapper, const char *stmtName, int nParams,
+                              const char *const *paramValues, int resultFormat,
+                              dbReactorDone_t done, void *cls);
+
+#endif
@@ -0,0 +1,343 @@
+#include "compression.h"
+#include "server.h"
+#include <brotli/encode.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#define DEFAULT_MIN_SIZE 1024
+#define DEFAULT_GZIP_LEVEL 6
+#define DEFAULT_BROTLI_QUALITY 5
+#define GZIP_WINDOW_BITS (15 + 16) // Max window with a gzip header instead of zlib
+#define STREAM_INPUT_SIZE 16384
+
+static size_t minSize = DEFAULT_MIN_SIZE;
+static int gzipLevel = DEFAULT_GZIP_LEVEL;
+static int brotliQuality = DEFAULT_BROTLI_QUALITY;
+
+typedef struct {
+    contentEncoding_t encoding;
+    z_stream zs;
+    BrotliEncoderState *brotli;
+    char *out;
+    size_t outLen;
+    size_t outCap;
+} Encoder;
+
+struct CompressedStream {
+    Encoder encoder;
+    streamRead_t read;
+    streamFree_t free;
+    void *cls;
+    size_t outPos; // Bytes of encoder.out already handed to the reader
+    bool finished;
+    char in[STREAM_INPUT_SIZE];
+};
+
+static int env_level(const char *name, int defaultValue, int minValue, int maxValue) {
+    const char *str = getenv(name);
+    if (!str)
+        return defaultValue;
+
+    int value = atoi(str);
+    if (value < minValue || value > maxValue) {
+        fprintf(stderr, "%s out of range [%d, %d], using %d\n", name, minValue, maxValue,
+                defaultValue);
+        return defaultValue;
+    }
+    return value;
+}
+
+void init_compression(void) {
+    minSize = (size_t)env_level("COMPRESSION_MIN_SIZE", DEFAULT_MIN_SIZE, 0, 1 << 30);
+    gzipLevel = env_level("GZIP_LEVEL", DEFAULT_GZIP_LEVEL, 1, 9);
+    brotliQuality =
+        env_level("BROTLI_QUALITY", DEFAULT_BROTLI_QUALITY, BROTLI_MIN_QUALITY, BROTLI_MAX_QUALITY);
+}
+
+// Parses the q parameter of a coding, 1 when missing
+static double parse_quality(const char *params, size_t len) {
+    const char *p = params;
+    const char *end = params + len;
+
+    while (p < end) {
+        while (p < end && (*p == ';' || *p == ' ' || *p == '\t'))
+            p++;
+
+        if (end - p > 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+            return strtod(p + 2, NULL);
+
+        while (p < end && *p != ';')
+            p++;
+    }
+
+    return 1.0;
+}
+
+contentEncoding_t negotiate_encoding(const char *acceptEncoding) {
+    if (!acceptEncoding)
+        return ENCODING_IDENTITY;
+
+    double gzipQ = 0.0;
+    double brotliQ = 0.0;
+    double anyQ = 0.0;
+    bool gzipListed = false;
+    bool brotliListed = false;
+
+    const char *p = acceptEncoding;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (!*p)
+            break;
+
+        const char *token = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        size_t tokenLen = (size_t)(p - token);
+
+        const char *params = p;
+        while (*p && *p != ',')
+            p++;
+        double q = parse_quality(params, (size_t)(p - params));
+
+        if (tokenLen == 4 && strncasecmp(token, "gzip", 4) == 0) {
+            gzipQ = q;
+            gzipListed = true;
+        }
+        else if (tokenLen == 2 && strncasecmp(token, "br", 2) == 0) {
+            brotliQ = q;
+            brotliListed = true;
+        }
+        else if (tokenLen == 1 && token[0] == '*') {
+            anyQ = q;
+        }
+    }
+
+    // * only covers the codings that were not listed
+    if (!gzipListed)
+        gzipQ = anyQ;
+    if (!brotliListed)
+        brotliQ = anyQ;
+
+    if (brotliQ > 0.0 && brotliQ >= gzipQ)
+        return ENCODING_BROTLI;
+    if (gzipQ > 0.0)
+        return ENCODING_GZIP;
+
+    return ENCODING_IDENTITY;
+}
+
+const char *encoding_name(contentEncoding_t encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP:
+            return "gzip";
+        case ENCODING_BROTLI:
+            return "br";
+        default:
+            return "identity";
+    }
+}
+
+bool should_compress(size_t len) {
+    return len >= minSize;
+}
+
+static bool encoder_init(Encoder *encoder, contentEncoding_t encoding, size_t outCap) {
+    memset(encoder, 0, sizeof(Encoder));
+    encoder->encoding = encoding;
+
+    encoder->out = malloc(outCap);
+    if (!encoder->out)
+        return false;
+    encoder->outCap = outCap;
+
+    if (encoding == ENCODING_GZIP) {
+        if (deflateInit2(&encoder->zs, gzipLevel, Z_DEFLATED, GZIP_WINDOW_BITS, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(encoder->out);
+            encoder->out = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    if (encoding == ENCODING_BROTLI) {
+        encoder->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+        if (!encoder->brotli) {
+            free(encoder->out);
+            encoder->out = NULL;
+            return false;
+        }
+        BrotliEncoderSetParameter(encoder->brotli, BROTLI_PARAM_QUALITY, (uint32_t)brotliQuality);
+        BrotliEncoderSetParameter(encoder->brotli, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+        return true;
+    }
+
+    free(encoder->out);
+    encoder->out = NULL;
+    return false;
+}
+
+static void encoder_free(Encoder *encoder) {
+    if (encoder->encoding == ENCODING_GZIP)
+        deflateEnd(&encoder->zs);
+    else if (encoder->brotli)
+        BrotliEncoderDestroyInstance(encoder->brotli);
+
+    free(encoder->out);
+    encoder->out = NULL;
+}
+
+static bool encoder_grow(Encoder *encoder) {
+    if (encoder->outLen < encoder->outCap)
+        return true;
+
+    size_t newCap = encoder->outCap * 2;
+    char *newOut = realloc(encoder->out, newCap);
+    if (!newOut)
+        return false;
+
+    encoder->out = newOut;
+    encoder->outCap = newCap;
+    return true;
+}
+
+// Appends the compressed input to encoder->out, flushing so the client can decode everything
+// written so far, or finishing the stream
+static bool encoder_write(Encoder *encoder, const char *in, size_t inLen, bool finish) {
+    if (encoder->encoding == ENCODING_GZIP) {
+        z_stream *zs = &encoder->zs;
+        zs->next_in = (Bytef *)in;
+        zs->avail_in = (uInt)inLen;
+
+        int ret;
+        do {
+            if (!encoder_grow(encoder))
+                return false;
+
+            zs->next_out = (Bytef *)(encoder->out + encoder->outLen);
+            zs->avail_out = (uInt)(encoder->outCap - encoder->outLen);
+
+            ret = deflate(zs, finish ? Z_FINISH : Z_SYNC_FLUSH);
+            if (ret == Z_STREAM_ERROR)
+                return false;
+
+            encoder->outLen = encoder->outCap - zs->avail_out;
+        } while (zs->avail_out == 0 || (finish && ret != Z_STREAM_END));
+
+        return true;
+    }
+
+    size_t availIn = inLen;
+    const uint8_t *nextIn = (const uint8_t *)in;
+    BrotliEncoderOperation op = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH;
+
+    do {
+        if (!encoder_grow(encoder))
+            return false;
+
+        size_t availOut = encoder->outCap - encoder->outLen;
+        uint8_t *nextOut = (uint8_t *)(encoder->out + encoder->outLen);
+
+        if (!BrotliEncoderCompressStream(encoder->brotli, op, &availIn, &nextIn, &availOut,
+                                         &nextOut, NULL))
+            return false;
+
+        encoder->outLen = encoder->outCap - availOut;
+    } while (availIn > 0 || BrotliEncoderHasMoreOutput(encoder->brotli) ||
+             (finish && !BrotliEncoderIsFinished(encoder->brotli)));
+
+    return true;
+}
+
+bool compress_buffer(contentEncoding_t encoding, const char *data, size_t len, char **out,
+                     size_t *outLen) {
+    if (!data || !out || !outLen)
+        return false;
+
+    // Text compresses well, a quarter of the input is rarely exceeded
+    Encoder encoder;
+    if (!encoder_init(&encoder, encoding, len / 4 + 64))
+        return false;
+
+    if (!encoder_write(&encoder, data, len, true)) {
+        encoder_free(&encoder);
+        return false;
+    }
+
+    *out = encoder.out;
+    *outLen = encoder.outLen;
+    encoder.out = NULL;
+    encoder_free(&encoder);
+
+    return true;
+}
+
+CompressedStream *compressed_stream_create(contentEncoding_t encoding, streamRead_t sourceRead,
+                                           streamFree_t sourceFree, void *sourceCls) {
+    CompressedStream *stream = calloc(1, sizeof(CompressedStream));
+    if (!stream)
+        return NULL;
+
+    if (!encoder_init(&stream->encoder, encoding, STREAM_INPUT_SIZE / 2)) {
+        free(stream);
+        return NULL;
+    }
+
+    stream->read = sourceRead;
+    stream->free = sourceFree;
+    stream->cls = sourceCls;
+
+    return stream;
+}
+
+ssize_t compressed_stream_read(void *cls, char *buf, size_t max) {
+    CompressedStream *stream = cls;
+    Encoder *encoder = &stream->encoder;
+
+    while (stream->outPos == encoder->outLen) {
+        if (stream->finished)
+            return RESPONSE_STREAM_END;
+
+        encoder->outLen = 0;
+        stream->outPos = 0;
+
+        ssize_t len = stream->read(stream->cls, stream->in, sizeof(stream->in));
+        if (len == RESPONSE_STREAM_END) {
+            stream->finished = true;
+            len = 0;
+        }
+        else if (len < 0) {
+            return RESPONSE_STREAM_ERROR;
+        }
+
+        if (!encoder_write(encoder, stream->in, (size_t)len, stream->finished))
+            return RESPONSE_STREAM_ERROR;
+    }
+
+    size_t len = encoder->outLen - stream->outPos;
+    if (len > max)
+        len = max;
+
+    memcpy(buf, encoder->out + stream->outPos, len);
+    stream->outPos += len;
+
+    return (ssize_t)len;
+}
+
+void compressed_stream_free(void *cls) {
+    CompressedStream *stream = cls;
+    if (!stream)
+        return;
+
+    if (stream->free)
+        stream->free(stream->cls);
+
+    encoder_free(&stream->encoder);
+    free(stream);
+}
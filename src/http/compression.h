@@ -0,0 +1,38 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include "server.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef enum { ENCODING_IDENTITY = 0, ENCODING_GZIP, ENCODING_BROTLI } contentEncoding_t;
+
+// Reads COMPRESSION_MIN_SIZE, GZIP_LEVEL and BROTLI_QUALITY
+void init_compression(void);
+
+// Best encoding allowed by an Accept-Encoding header, brotli winning ties
+contentEncoding_t negotiate_encoding(const char *acceptEncoding);
+
+// Value for the Content-Encoding header
+const char *encoding_name(contentEncoding_t encoding);
+
+// Bodies below the threshold are cheaper to send as they are
+bool should_compress(size_t len);
+
+// On success *out is a malloc'd buffer the caller has to free()
+bool compress_buffer(contentEncoding_t encoding, const char *data, size_t len, char **out,
+                     size_t *outLen);
+
+// Wraps a stream reader, compressing the body as it is produced. Takes ownership of the
+// source stream, which is freed together with the wrapper
+typedef struct CompressedStream CompressedStream;
+
+CompressedStream *compressed_stream_create(contentEncoding_t encoding, streamRead_t sourceRead,
+                                           streamFree_t sourceFree, void *sourceCls);
+
+ssize_t compressed_stream_read(void *cls, char *buf, size_t max);
+
+void compressed_stream_free(void *cls);
+
+#endif
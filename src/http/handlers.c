@@ -1,104 +1,163 @@
 #include <jansson.h>
+#include <limits.h>
 #include <microhttpd.h>
 #include <sodium/utils.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "../core/live_feed.h"
 #include "../core/weather.h"
+#include "../utils/arena.h"
+#include "../utils/downsample.h"
+#include "../utils/metrics.h"
 #include "../utils/utils.h"
 #include "handlers.h"
 #include "server.h"
 
 #define DEFAULT_SESSION_AGE 3600
 
-int apiError_to_http(apiError_t err, char **data) {
+// Error bodies are constants, handed to MHD without copying them
+static int set_error_body(struct ResponseData *responseData, const char *body, int httpStatus) {
+    responseData->data = (char *)body;
+    responseData->dataPersistent = true;
+    return httpStatus;
+}
+
+int apiError_to_http(apiError_t err, struct ResponseData *responseData) {
     switch (err) {
         case API_INVALID_PARAMS:
-            *data = strdup("{\"error\":\"Invalid parameters\"}");
-            return MHD_HTTP_BAD_REQUEST;
+            return set_error_body(responseData, "{\"error\":\"Invalid parameters\"}",
+                                  MHD_HTTP_BAD_REQUEST);
         case API_AUTH_ERROR:
-            *data = strdup("{\"error\":\"Authentication error\"}");
-            return MHD_HTTP_UNAUTHORIZED;
+            return set_error_body(responseData, "{\"error\":\"Authentication error\"}",
+                                  MHD_HTTP_UNAUTHORIZED);
         case API_FORBIDDEN:
-            *data = strdup("{\"error\":\"Forbidden\"}");
-            return MHD_HTTP_FORBIDDEN;
+            return set_error_body(responseData, "{\"error\":\"Forbidden\"}",
+                                  MHD_HTTP_FORBIDDEN);
         case API_NOT_FOUND:
-            *data = strdup("{\"error\":\"Resource not found\"}");
-            return MHD_HTTP_NOT_FOUND;
+            return set_error_body(responseData, "{\"error\":\"Resource not found\"}",
+                                  MHD_HTTP_NOT_FOUND);
         case API_DB_ERROR:
-            *data = strdup("{\"error\":\"Database error\"}");
-            return MHD_HTTP_INTERNAL_SERVER_ERROR;
+            return set_error_body(responseData, "{\"error\":\"Database error\"}",
+                                  MHD_HTTP_INTERNAL_SERVER_ERROR);
         case API_JSON_ERROR:
-            *data = strdup("{\"error\":\"Json parsing error\"}");
-            return MHD_HTTP_INTERNAL_SERVER_ERROR;
+            return set_error_body(responseData, "{\"error\":\"Json parsing error\"}",
+                                  MHD_HTTP_INTERNAL_SERVER_ERROR);
         case API_MEMORY_ERROR:
-            *data = strdup("{\"error\":\"Memory error\"}");
-            return MHD_HTTP_INTERNAL_SERVER_ERROR;
+            return set_error_body(responseData, "{\"error\":\"Memory error\"}",
+                                  MHD_HTTP_INTERNAL_SERVER_ERROR);
+        case API_BUSY:
+            return set_error_body(responseData, "{\"error\":\"Too many requests\"}",
+                                  MHD_HTTP_TOO_MANY_REQUESTS);
+        case API_TIMEOUT:
+            return set_error_body(responseData, "{\"error\":\"Request timed out\"}",
+                                  MHD_HTTP_SERVICE_UNAVAILABLE);
         default:
-            *data = strdup("{\"error\":\"Internal server error\"}");
-            return MHD_HTTP_INTERNAL_SERVER_ERROR;
+            return set_error_body(responseData, "{\"error\":\"Internal server error\"}",
+                                  MHD_HTTP_INTERNAL_SERVER_ERROR);
     }
 }
 
+// Compact unless the client asked for ?pretty=1
+static char *dump_json(const struct HandlerContext *handlerContext, const json_t *json) {
+    uint64_t start = metrics_now_us();
+    char *dump =
+        json_dumps(json, handlerContext->queryData->pretty ? JSON_INDENT(2) : JSON_COMPACT);
+    metrics_add(METRICS_PHASE_SERIALIZE, metrics_now_us() - start);
+    return dump;
+}
+
 void handle_user(struct HandlerContext *handlerContext, const char *userId) {
-    if (strcmp(handlerContext->method, "GET") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_OK;
-        handle_users_list(handlerContext, userId);
-    }
-    else if (strcmp(handlerContext->method, "POST") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_CREATED;
-        handle_users_create(handlerContext);
-    }
-    else if (strcmp(handlerContext->method, "DELETE") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_NO_CONTENT;
-        handle_users_delete(handlerContext, userId);
-    }
-    else if (strcmp(handlerContext->method, "PATCH") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_OK;
-        handle_users_patch(handlerContext, userId);
+    switch (handlerContext->method) {
+        case HTTP_GET:
+            handlerContext->responseData->httpStatus = MHD_HTTP_OK;
+            handle_users_list(handlerContext, userId);
+            break;
+        case HTTP_POST:
+            handlerContext->responseData->httpStatus = MHD_HTTP_CREATED;
+            handle_users_create(handlerContext);
+            break;
+        case HTTP_DELETE:
+            handlerContext->responseData->httpStatus = MHD_HTTP_NO_CONTENT;
+            handle_users_delete(handlerContext, userId);
+            break;
+        case HTTP_PATCH:
+            handlerContext->responseData->httpStatus = MHD_HTTP_OK;
+            handle_users_patch(handlerContext, userId);
+            break;
+        default:
+            break;
     }
 }
 
 void handle_sessions(struct HandlerContext *handlerContext, const char *userId,
                      const char *sessionUUID) {
-    if (strcmp(handlerContext->method, "GET") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_OK;
-        handle_sessions_list(handlerContext, userId, sessionUUID);
-    }
-    else if (strcmp(handlerContext->method, "POST") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_CREATED;
-        handle_sessions_create(handlerContext, userId);
-    }
-    else if (strcmp(handlerContext->method, "DELETE") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_NO_CONTENT;
-        handle_sessions_delete(handlerContext, userId, sessionUUID);
+    switch (handlerContext->method) {
+        case HTTP_GET:
+            handlerContext->responseData->httpStatus = MHD_HTTP_OK;
+            handle_sessions_list(handlerContext, userId, sessionUUID);
+            break;
+        case HTTP_POST:
+            handlerContext->responseData->httpStatus = MHD_HTTP_CREATED;
+            handle_sessions_create(handlerContext, userId);
+            break;
+        case HTTP_DELETE:
+            handlerContext->responseData->httpStatus = MHD_HTTP_NO_CONTENT;
+            handle_sessions_delete(handlerContext, userId, sessionUUID);
+            break;
+        default:
+            break;
     }
 }
 
 void handle_stations(struct HandlerContext *handlerContext, const char *stationId) {
-    if (strcmp(handlerContext->method, "GET") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_OK;
-        handle_stations_list(handlerContext, stationId);
-    }
-    else if (strcmp(handlerContext->method, "POST") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_CREATED;
-        handle_stations_create(handlerContext);
+    switch (handlerContext->method) {
+        case HTTP_GET:
+            handlerContext->responseData->httpStatus = MHD_HTTP_OK;
+            handle_stations_list(handlerContext, stationId);
+            break;
+        case HTTP_POST:
+            handlerContext->responseData->httpStatus = MHD_HTTP_CREATED;
+            handle_stations_create(handlerContext);
+            break;
+        default:
+            break;
     }
 }
 
 void handle_api_key(struct HandlerContext *handlerContext, const char *userId, const char *keyId) {
-    if (strcmp(handlerContext->method, "GET") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_OK;
-        handle_api_key_list(handlerContext, userId, keyId);
-    }
-    else if (strcmp(handlerContext->method, "POST") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_CREATED;
-        handle_api_key_create(handlerContext, userId);
+    switch (handlerContext->method) {
+        case HTTP_GET:
+            handlerContext->responseData->httpStatus = MHD_HTTP_OK;
+            handle_api_key_list(handlerContext, userId, keyId);
+            break;
+        case HTTP_POST:
+            handlerContext->responseData->httpStatus = MHD_HTTP_CREATED;
+            handle_api_key_create(handlerContext, userId);
+            break;
+        case HTTP_DELETE:
+            handlerContext->responseData->httpStatus = MHD_HTTP_NO_CONTENT;
+            handle_api_key_delete(handlerContext, userId, keyId);
+            break;
+        default:
+            break;
     }
-    else if (strcmp(handlerContext->method, "DELETE") == 0) {
-        handlerContext->responseData->httpStatus = MHD_HTTP_NO_CONTENT;
-        handle_api_key_delete(handlerContext, userId, keyId);
+}
+
+void handle_weather_data(struct HandlerContext *handlerContext, const char *stationId) {
+    switch (handlerContext->method) {
+        case HTTP_GET:
+            handlerContext->responseData->httpStatus = MHD_HTTP_OK;
+            handle_weather_data_list(handlerContext, stationId);
+            break;
+        case HTTP_POST:
+            handlerContext->responseData->httpStatus = MHD_HTTP_CREATED;
+            handle_weather_data_upload(handlerContext, stationId);
+            break;
+        default:
+            break;
     }
 }
 
@@ -108,11 +167,11 @@ void handle_users_list(struct HandlerContext *handlerContext, const char *userId
 
     if (code != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(code, &handlerContext->responseData->data);
+            apiError_to_http(code, handlerContext->responseData);
         return;
     }
 
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
+    handlerContext->responseData->data = dump_json(handlerContext, json);
 
     json_decref(json);
 }
@@ -123,7 +182,7 @@ void handle_users_create(struct HandlerContext *handlerContext) {
     if (!handlerContext->requestData->postData || handlerContext->requestData->postDataSize <= 0) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -133,7 +192,7 @@ void handle_users_create(struct HandlerContext *handlerContext) {
     if (!root || !json_is_object(root)) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -149,10 +208,10 @@ void handle_users_create(struct HandlerContext *handlerContext) {
 
     if (errorCode != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
+    handlerContext->responseData->data = dump_json(handlerContext, json);
     json_decref(json);
 }
 
@@ -161,7 +220,7 @@ void handle_users_delete(struct HandlerContext *handlerContext, const char *user
 
     if (code != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(code, &handlerContext->responseData->data);
+            apiError_to_http(code, handlerContext->responseData);
         return;
     }
 }
@@ -172,7 +231,7 @@ void handle_users_patch(struct HandlerContext *handlerContext, const char *userI
     if (!handlerContext->requestData->postData || handlerContext->requestData->postDataSize <= 0) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -182,7 +241,7 @@ void handle_users_patch(struct HandlerContext *handlerContext, const char *userI
     if (!root || !json_is_object(root)) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -220,10 +279,10 @@ void handle_users_patch(struct HandlerContext *handlerContext, const char *userI
 
     if (errorCode != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
+    handlerContext->responseData->data = dump_json(handlerContext, json);
     json_decref(json);
 }
 
@@ -233,7 +292,7 @@ void handle_sessions_create(struct HandlerContext *handlerContext, const char *u
     if (!handlerContext->requestData->postData || handlerContext->requestData->postDataSize <= 0) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -243,7 +302,7 @@ void handle_sessions_create(struct HandlerContext *handlerContext, const char *u
     if (!root || !json_is_object(root)) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -262,27 +321,56 @@ void handle_sessions_create(struct HandlerContext *handlerContext, const char *u
 
     if (errorCode != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
     handlerContext->responseData->sessionToken = strdup(tokenB64);
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
+    handlerContext->responseData->data = dump_json(handlerContext, json);
     json_decref(json);
 }
 
+// ?limit= and ?cursor= of the paged lists. Without either the whole list is returned, a cursor
+// alone gets PAGE_DEFAULT_LIMIT rows
+static bool parse_page(const struct QueryData *queryData, PageRequest *page) {
+    page->limit = 0;
+    page->cursor = queryData->cursor;
+
+    if (!queryData->limit) {
+        if (page->cursor)
+            page->limit = PAGE_DEFAULT_LIMIT;
+        return true;
+    }
+
+    char *end;
+    long value = strtol(queryData->limit, &end, 10);
+    if (*end != '\0' || value < 1 || value > PAGE_MAX_LIMIT)
+        return false;
+
+    page->limit = (int)value;
+    return true;
+}
+
 void handle_sessions_list(struct HandlerContext *handlerContext, const char *userId,
                           const char *sessionUUID) {
+    PageRequest page;
+    if (!parse_page(handlerContext->queryData, &page)) {
+        handlerContext->responseData->httpStatus =
+            apiError_to_http(API_INVALID_PARAMS, handlerContext->responseData);
+        return;
+    }
+
     json_t *json = NULL;
-    apiError_t code = sessions_list(userId, sessionUUID, handlerContext->authData, &json);
+    apiError_t code = sessions_list(userId, sessionUUID, handlerContext->authData, &page, &json,
+                                    &handlerContext->responseData->nextCursor);
 
     if (code != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(code, &handlerContext->responseData->data);
+            apiError_to_http(code, handlerContext->responseData);
         return;
     }
 
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
+    handlerContext->responseData->data = dump_json(handlerContext, json);
 
     json_decref(json);
 }
@@ -293,7 +381,7 @@ void handle_sessions_delete(struct HandlerContext *handlerContext, const char *u
 
     if (code != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(code, &handlerContext->responseData->data);
+            apiError_to_http(code, handlerContext->responseData);
         return;
     }
 }
@@ -304,7 +392,7 @@ void handle_stations_create(struct HandlerContext *handlerContext) {
     if (!handlerContext->requestData->postData || handlerContext->requestData->postDataSize <= 0) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -314,7 +402,7 @@ void handle_stations_create(struct HandlerContext *handlerContext) {
     if (!root || !json_is_object(root)) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -331,27 +419,79 @@ void handle_stations_create(struct HandlerContext *handlerContext) {
 
     if (errorCode != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
+    handlerContext->responseData->data = dump_json(handlerContext, json);
     json_decref(json);
 }
 
+// Reads ?bbox= or ?near= and ?limit=, false when neither is set or they do not parse
+static bool parse_station_area(const struct QueryData *queryData, size_t defaultLimit,
+                               StationArea *area, size_t *limit) {
+    memset(area, 0, sizeof(*area));
+
+    int consumed = -1;
+    if (queryData->near && !queryData->bbox) {
+        area->nearest = true;
+        if (sscanf(queryData->near, "%lf,%lf%n", &area->lon, &area->lat, &consumed) != 2)
+            return false;
+    }
+    else if (queryData->bbox && !queryData->near) {
+        if (sscanf(queryData->bbox, "%lf,%lf,%lf,%lf%n", &area->minLon, &area->minLat,
+                   &area->maxLon, &area->maxLat, &consumed) != 4)
+            return false;
+    }
+    else {
+        return false;
+    }
+
+    // Nothing may follow the numbers
+    const char *str = area->nearest ? queryData->near : queryData->bbox;
+    if (consumed < 0 || str[consumed] != '\0')
+        return false;
+
+    *limit = defaultLimit;
+    if (queryData->limit) {
+        char *end;
+        long value = strtol(queryData->limit, &end, 10);
+        if (*end != '\0' || value < 1)
+            return false;
+        *limit = (size_t)value;
+    }
+
+    return true;
+}
+
 void handle_stations_list(struct HandlerContext *handlerContext, const char *stationId) {
-    json_t *json = NULL;
-    apiError_t code = stations_list(stationId, &json);
+    const struct QueryData *queryData = handlerContext->queryData;
+    char *json = NULL;
+    apiError_t code;
+
+    if (!stationId && (queryData->bbox || queryData->near)) {
+        // Every station in a viewport unless limited, the closest few around a point
+        StationArea area;
+        size_t limit;
+        if (parse_station_area(queryData,
+                               queryData->near ? STATION_SEARCH_DEFAULT_LIMIT
+                                               : STATION_SEARCH_MAX_LIMIT,
+                               &area, &limit))
+            code = stations_search(&area, limit, queryData->pretty, &json);
+        else
+            code = API_INVALID_PARAMS;
+    }
+    else {
+        code = stations_list(stationId, queryData->pretty, &json);
+    }
 
     if (code != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(code, &handlerContext->responseData->data);
+            apiError_to_http(code, handlerContext->responseData);
         return;
     }
 
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
-
-    json_decref(json);
+    handlerContext->responseData->data = json;
 }
 
 void handle_api_key_create(struct HandlerContext *handlerContext, const char *userId) {
@@ -360,7 +500,7 @@ void handle_api_key_create(struct HandlerContext *handlerContext, const char *us
     if (!handlerContext->requestData->postData || handlerContext->requestData->postDataSize <= 0) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -370,7 +510,7 @@ void handle_api_key_create(struct HandlerContext *handlerContext, const char *us
     if (!root || !json_is_object(root)) {
         errorCode = API_INVALID_PARAMS;
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
@@ -386,27 +526,35 @@ void handle_api_key_create(struct HandlerContext *handlerContext, const char *us
 
     if (errorCode != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(errorCode, &handlerContext->responseData->data);
+            apiError_to_http(errorCode, handlerContext->responseData);
         return;
     }
 
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
+    handlerContext->responseData->data = dump_json(handlerContext, json);
     json_decref(json);
 }
 
 void handle_api_key_list(struct HandlerContext *handlerContext, const char *userId,
                          const char *keyId) {
+    PageRequest page;
+    if (!parse_page(handlerContext->queryData, &page)) {
+        handlerContext->responseData->httpStatus =
+            apiError_to_http(API_INVALID_PARAMS, handlerContext->responseData);
+        return;
+    }
+
     json_t *json = NULL;
 
-    apiError_t code = api_key_list(userId, keyId, handlerContext->authData, &json);
+    apiError_t code = api_key_list(userId, keyId, handlerContext->authData, &page, &json,
+                                   &handlerContext->responseData->nextCursor);
 
     if (code != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(code, &handlerContext->responseData->data);
+            apiError_to_http(code, handlerContext->responseData);
         return;
     }
 
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
+    handlerContext->responseData->data = dump_json(handlerContext, json);
 
     json_decref(json);
 }
@@ -417,26 +565,296 @@ void handle_api_key_delete(struct HandlerContext *handlerContext, const char *us
 
     if (code != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(code, &handlerContext->responseData->data);
+            apiError_to_http(code, handlerContext->responseData);
         return;
     }
 }
 
+// ?max_points=, 0 when absent
+static bool parse_max_points(const struct QueryData *queryData, int *maxPoints) {
+    *maxPoints = 0;
+    if (!queryData->maxPoints)
+        return true;
+
+    char *end;
+    long value = strtol(queryData->maxPoints, &end, 10);
+    if (*end != '\0' || value < DOWNSAMPLE_MIN_POINTS || value > INT_MAX)
+        return false;
+
+    *maxPoints = (int)value;
+    return true;
+}
+
+static ssize_t read_weather_stream(void *cls, char *buf, size_t max) {
+    ssize_t len = weather_data_stream_read(cls, buf, max);
+    if (len == WEATHER_STREAM_END)
+        return RESPONSE_STREAM_END;
+    if (len < 0)
+        return RESPONSE_STREAM_ERROR;
+    return len;
+}
+
+static void close_weather_stream(void *cls) {
+    weather_data_stream_close(cls);
+}
+
+static void finish_weather_data_list(void *cls, struct ResponseData *responseData) {
+    char *data = NULL;
+    apiError_t code =
+        weather_data_finish(cls, &data, &responseData->etag, &responseData->nextCursor);
+
+    if (code != API_OK) {
+        responseData->httpStatus = apiError_to_http(code, responseData);
+        return;
+    }
+
+    responseData->httpStatus = MHD_HTTP_OK;
+    responseData->data = data;
+}
+
+static void cancel_weather_data_list(void *cls) {
+    weather_data_cancel(cls);
+}
+
 void handle_weather_data_list(struct HandlerContext *handlerContext, const char *stationId) {
     handlerContext->responseData->httpStatus = MHD_HTTP_OK;
-    json_t *json;
-    apiError_t code = weather_data_list(
-        handlerContext->queryData->fields, handlerContext->queryData->granularity, stationId,
-        handlerContext->queryData->timezone, handlerContext->queryData->startTime,
-        handlerContext->queryData->endTime, &json);
+
+    const struct QueryData *queryData = handlerContext->queryData;
+    WeatherQuery query = {queryData->fields,
+                          queryData->granularity,
+                          stationId,
+                          queryData->timezone,
+                          queryData->startTime,
+                          queryData->endTime,
+                          string_to_data_format(queryData->format),
+                          queryData->pretty,
+                          0,
+                          {0, NULL}};
+
+    if (!parse_max_points(queryData, &query.maxPoints) || !parse_page(queryData, &query.page)) {
+        handlerContext->responseData->httpStatus =
+            apiError_to_http(API_INVALID_PARAMS, handlerContext->responseData);
+        return;
+    }
+
+    // Raw ranges can be arbitrarily large, send them as the rows arrive unless asked for a page
+    if (string_to_granularity(query.granularity) == GRANULARITY_DATA &&
+        query.format == DATA_FORMAT_ROWS && query.maxPoints == 0 && query.page.limit == 0) {
+        WeatherDataStream *stream = NULL;
+        apiError_t code = weather_data_stream_open(&query, &stream);
+
+        if (code != API_OK) {
+            handlerContext->responseData->httpStatus =
+                apiError_to_http(code, handlerContext->responseData);
+            return;
+        }
+
+        handlerContext->responseData->streamRead = read_weather_stream;
+        handlerContext->responseData->streamFree = close_weather_stream;
+        handlerContext->responseData->streamCls = stream;
+        return;
+    }
+
+    // Summaries over long ranges can keep Postgres busy, the worker moves on meanwhile
+    WeatherDataRequest *request = NULL;
+    char *data = NULL;
+    apiError_t code =
+        weather_data_list_async(&query, deferred_response_ready, handlerContext->deferred,
+                                &request, &data, &handlerContext->responseData->etag,
+                                &handlerContext->responseData->nextCursor);
 
     if (code != API_OK) {
         handlerContext->responseData->httpStatus =
-            apiError_to_http(code, &handlerContext->responseData->data);
+            apiError_to_http(code, handlerContext->responseData);
+        return;
+    }
+
+    if (request) {
+        handlerContext->deferred->finish = finish_weather_data_list;
+        handlerContext->deferred->cancel = cancel_weather_data_list;
+        handlerContext->deferred->cls = request;
+        return;
+    }
+
+    // Already serialized by the core
+    handlerContext->responseData->data = data;
+}
+
+void handle_weather_data_upload(struct HandlerContext *handlerContext, const char *stationId) {
+    if (!handlerContext->requestData || !handlerContext->requestData->postData ||
+        handlerContext->requestData->postDataSize <= 0) {
+        handlerContext->responseData->httpStatus =
+            apiError_to_http(API_INVALID_PARAMS, handlerContext->responseData);
         return;
     }
 
-    handlerContext->responseData->data = json_dumps(json, JSON_INDENT(2));
+    json_t *json = NULL;
+    apiError_t code = weather_data_upload(stationId, handlerContext->requestData->postData,
+                                          handlerContext->requestData->postDataSize,
+                                          handlerContext->authData, &json);
+
+    if (code != API_OK) {
+        handlerContext->responseData->httpStatus =
+            apiError_to_http(code, handlerContext->responseData);
+        return;
+    }
+
+    handlerContext->responseData->data = dump_json(handlerContext, json);
 
     json_decref(json);
 }
+
+static ssize_t read_live_feed(void *cls, char *buf, size_t max) {
+    ssize_t len = live_feed_read(cls, buf, max);
+    if (len == LIVE_FEED_END)
+        return RESPONSE_STREAM_END;
+    if (len == 0)
+        return RESPONSE_STREAM_WAIT;
+    return len;
+}
+
+static void attach_live_feed(void *cls, struct DeferredResponse *wake) {
+    live_feed_attach(cls, deferred_response_ready, wake);
+}
+
+static void close_live_feed(void *cls) {
+    live_feed_unsubscribe(cls);
+}
+
+// Server-sent events, the connection stays suspended between readings
+void handle_station_live(struct HandlerContext *handlerContext, const char *stationId) {
+    if (handlerContext->method != HTTP_GET)
+        return;
+
+    LiveSubscriber *subscriber = NULL;
+    apiError_t code = weather_live_subscribe(stationId, &subscriber);
+
+    if (code != API_OK) {
+        handlerContext->responseData->httpStatus =
+            apiError_to_http(code, handlerContext->responseData);
+        return;
+    }
+
+    handlerContext->responseData->httpStatus = MHD_HTTP_OK;
+    handlerContext->responseData->contentType = "text/event-stream";
+    handlerContext->responseData->streamRead = read_live_feed;
+    handlerContext->responseData->streamFree = close_live_feed;
+    handlerContext->responseData->streamAttach = attach_live_feed;
+    handlerContext->responseData->streamCls = subscriber;
+}
+
+// Splits ?stations= into arena memory, NULL when an id is invalid or there are too many. Repeated
+// ids are only queried once
+static const char **parse_station_ids(struct HandlerContext *handlerContext, size_t *nStations) {
+    const char *stations = handlerContext->queryData->stations;
+    if (!stations)
+        return NULL;
+
+    char *list = arena_strdup(handlerContext->arena, stations);
+    const char **ids = arena_alloc(handlerContext->arena,
+                                   WEATHER_BATCH_MAX_STATIONS * sizeof(const char *));
+    if (!list || !ids)
+        return NULL;
+
+    size_t count = 0;
+    char *saveptr;
+    for (char *token = strtok_r(list, ",", &saveptr); token;
+         token = strtok_r(NULL, ",", &saveptr)) {
+        if (!validate_name(token) && !validate_uuid(token))
+            return NULL;
+
+        bool repeated = false;
+        for (size_t i = 0; i < count && !repeated; i++)
+            repeated = strcmp(ids[i], token) == 0;
+        if (repeated)
+            continue;
+
+        if (count == WEATHER_BATCH_MAX_STATIONS)
+            return NULL;
+        ids[count++] = token;
+    }
+
+    *nStations = count;
+    return count > 0 ? ids : NULL;
+}
+
+void handle_weather_data_batch(struct HandlerContext *handlerContext) {
+    if (handlerContext->method != HTTP_GET)
+        return;
+
+    handlerContext->responseData->httpStatus = MHD_HTTP_OK;
+
+    const struct QueryData *queryData = handlerContext->queryData;
+    WeatherQuery query = {queryData->fields,
+                          queryData->granularity,
+                          NULL,
+                          queryData->timezone,
+                          queryData->startTime,
+                          queryData->endTime,
+                          string_to_data_format(queryData->format),
+                          queryData->pretty,
+                          0,
+                          {0, NULL}};
+
+    if (!parse_max_points(queryData, &query.maxPoints)) {
+        handlerContext->responseData->httpStatus =
+            apiError_to_http(API_INVALID_PARAMS, handlerContext->responseData);
+        return;
+    }
+
+    char *data = NULL;
+    apiError_t code;
+
+    if (!queryData->stations && (queryData->bbox || queryData->near)) {
+        // The stations in view, found by the station search
+        StationArea area;
+        size_t limit;
+        if (parse_station_area(queryData,
+                               queryData->near ? STATION_SEARCH_DEFAULT_LIMIT
+                                               : WEATHER_BATCH_MAX_STATIONS,
+                               &area, &limit))
+            code = weather_data_area(&query, &area, limit, &data,
+                                     &handlerContext->responseData->etag);
+        else
+            code = API_INVALID_PARAMS;
+    }
+    else {
+        size_t nStations = 0;
+        const char **stationIds = parse_station_ids(handlerContext, &nStations);
+        if (!stationIds) {
+            handlerContext->responseData->httpStatus =
+                apiError_to_http(API_INVALID_PARAMS, handlerContext->responseData);
+            return;
+        }
+
+        code = weather_data_batch(&query, stationIds, nStations, &data,
+                                  &handlerContext->responseData->etag);
+    }
+
+    if (code != API_OK) {
+        handlerContext->responseData->httpStatus =
+            apiError_to_http(code, handlerContext->responseData);
+        return;
+    }
+
+    handlerContext->responseData->data = data;
+}
+
+void handle_metrics(struct HandlerContext *handlerContext) {
+    if (handlerContext->method != HTTP_GET)
+        return;
+
+    handlerContext->responseData->httpStatus = MHD_HTTP_OK;
+
+    char *metrics = NULL;
+    apiError_t code = metrics_list(&metrics);
+
+    if (code != API_OK) {
+        handlerContext->responseData->httpStatus =
+            apiError_to_http(code, handlerContext->responseData);
+        return;
+    }
+
+    handlerContext->responseData->data = metrics;
+    handlerContext->responseData->contentType = "text/plain; version=0.0.4; charset=utf-8";
+}
@@ -12,6 +12,10 @@ void handle_api_key(struct HandlerContext *handlerContext, const char *userId, c
 
 void handle_stations(struct HandlerContext *handlerContext, const char *stationId);
 
+void handle_weather_data(struct HandlerContext *handlerContext, const char *stationId);
+
+void handle_station_live(struct HandlerContext *handlerContext, const char *stationId);
+
 void handle_users_list(struct HandlerContext *handlerContext, const char *userId);
 
 void handle_users_create(struct HandlerContext *handlerContext);
@@ -34,6 +38,12 @@ void handle_stations_list(struct HandlerContext *handlerContext, const char *sta
 
 void handle_weather_data_list(struct HandlerContext *handlerContext, const char *stationId);
 
+void handle_weather_data_upload(struct HandlerContext *handlerContext, const char *stationId);
+
+void handle_weather_data_batch(struct HandlerContext *handlerContext);
+
+void handle_metrics(struct HandlerContext *handlerContext);
+
 void handle_api_key_create(struct HandlerContext *handlerContext, const char *userId);
 
 void handle_api_key_list(struct HandlerContext *handlerContext, const char *userId,
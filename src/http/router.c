@@ -0,0 +1,181 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../utils/metrics.h"
+#include "../utils/utils.h"
+#include "handlers.h"
+#include "router.h"
+#include "server.h"
+
+#define ROUTER_MAX_URL 512
+#define ROUTER_MAX_SEGMENTS 4 // Longest route is /users/{id}/api-keys/{id}
+
+// Splits the path in place, -1 when it has too many or empty segments. A trailing slash is
+// allowed
+static int split_path(char *path, char **segments) {
+    if (*path != '/')
+        return -1;
+
+    int nSegments = 0;
+    char *p = path + 1;
+    while (*p != '\0') {
+        char *slash = strchr(p, '/');
+        if (slash == p || nSegments == ROUTER_MAX_SEGMENTS)
+            return -1;
+
+        segments[nSegments++] = p;
+        if (!slash)
+            break;
+
+        *slash = '\0';
+        p = slash + 1;
+    }
+
+    return nSegments;
+}
+
+static bool validate_id(const char *id) {
+    return validate_name(id) || validate_uuid(id);
+}
+
+// /users, /users/{id}, /users/{id}/api-keys[/{id}], /users/{id}/sessions[/{uuid}]
+static void route_users(struct HandlerContext *handlerContext, char **segments, int nSegments) {
+    if (nSegments == 0) {
+        metrics_request_route(METRICS_ROUTE_USERS);
+        handle_user(handlerContext, NULL);
+        return;
+    }
+
+    const char *userId = segments[0];
+    if (!validate_id(userId)) {
+        DEBUG_PRINTF("Invalid userId: %s\n", userId);
+        return;
+    }
+
+    if (nSegments == 1) {
+        metrics_request_route(METRICS_ROUTE_USERS);
+        handle_user(handlerContext, userId);
+        return;
+    }
+
+    if (nSegments > 3)
+        return;
+
+    const char *resourceId = nSegments == 3 ? segments[2] : NULL;
+
+    if (strcmp(segments[1], "api-keys") == 0) {
+        if (resourceId && !validate_id(resourceId)) {
+            DEBUG_PRINTF("Invalid key: %s\n", resourceId);
+            return;
+        }
+        metrics_request_route(METRICS_ROUTE_API_KEYS);
+        handle_api_key(handlerContext, userId, resourceId);
+    }
+    else if (strcmp(segments[1], "sessions") == 0) {
+        if (resourceId && !validate_uuid(resourceId)) {
+            DEBUG_PRINTF("Invalid UUID: %s\n", resourceId);
+            return;
+        }
+        metrics_request_route(METRICS_ROUTE_SESSIONS);
+        handle_sessions(handlerContext, userId, resourceId);
+    }
+}
+
+// /stations, /stations/{id}, /stations/{id}/data, /stations/{id}/live
+static void route_stations(struct HandlerContext *handlerContext, char **segments,
+                           int nSegments) {
+    if (nSegments == 0) {
+        metrics_request_route(METRICS_ROUTE_STATIONS);
+        handle_stations(handlerContext, NULL);
+        return;
+    }
+
+    const char *stationId = segments[0];
+
+    if (nSegments == 1) {
+        if (!validate_id(stationId)) {
+            DEBUG_PRINTF("Invalid stationId: %s\n", stationId);
+            return;
+        }
+        metrics_request_route(METRICS_ROUTE_STATIONS);
+        handle_stations(handlerContext, stationId);
+    }
+    else if (nSegments == 2 && strcmp(segments[1], "data") == 0) {
+        metrics_request_route(METRICS_ROUTE_STATION_DATA);
+        handle_weather_data(handlerContext, stationId);
+    }
+    else if (nSegments == 2 && strcmp(segments[1], "live") == 0) {
+        if (!validate_id(stationId)) {
+            DEBUG_PRINTF("Invalid stationId: %s\n", stationId);
+            return;
+        }
+        metrics_request_route(METRICS_ROUTE_STATION_LIVE);
+        handle_station_live(handlerContext, stationId);
+    }
+}
+
+void route_request(struct HandlerContext *handlerContext, const char *url) {
+    char path[ROUTER_MAX_URL];
+    size_t urlLen = strlen(url);
+    if (urlLen >= sizeof(path))
+        return;
+
+    memcpy(path, url, urlLen + 1);
+
+    char *segments[ROUTER_MAX_SEGMENTS];
+    int nSegments = split_path(path, segments);
+    if (nSegments <= 0)
+        return;
+
+    if (strcmp(segments[0], "users") == 0) {
+        route_users(handlerContext, segments + 1, nSegments - 1);
+    }
+    else if (strcmp(segments[0], "stations") == 0) {
+        route_stations(handlerContext, segments + 1, nSegments - 1);
+    }
+    else if (nSegments == 1 && strcmp(segments[0], "data") == 0) {
+        metrics_request_route(METRICS_ROUTE_DATA);
+        handle_weather_data_batch(handlerContext);
+    }
+    else if (nSegments == 1 && strcmp(segments[0], "metrics") == 0) {
+        metrics_request_route(METRICS_ROUTE_METRICS);
+        handle_metrics(handlerContext);
+    }
+}
+
+admissionLane_t route_lane(httpMethod_t method, const char *url) {
+    char path[ROUTER_MAX_URL];
+    size_t urlLen = strlen(url);
+    if (urlLen >= sizeof(path))
+        return ADMISSION_LANE_NONE;
+
+    memcpy(path, url, urlLen + 1);
+
+    char *segments[ROUTER_MAX_SEGMENTS];
+    int nSegments = split_path(path, segments);
+    if (nSegments <= 0)
+        return ADMISSION_LANE_NONE;
+
+    if (strcmp(segments[0], "users") == 0) {
+        // Creating a user or a session and changing a password hash a password
+        bool hashes = (nSegments <= 2 && (method == HTTP_POST || method == HTTP_PATCH)) ||
+                      (nSegments == 3 && method == HTTP_POST &&
+                       strcmp(segments[2], "sessions") == 0);
+        return hashes ? ADMISSION_LANE_AUTH : ADMISSION_LANE_LOOKUP;
+    }
+
+    if (strcmp(segments[0], "stations") == 0) {
+        if (nSegments == 3 && strcmp(segments[2], "data") == 0)
+            return method == HTTP_GET ? ADMISSION_LANE_DATA : ADMISSION_LANE_NONE;
+        // A subscriber would hold its slot for as long as it stays connected
+        if (nSegments == 3 && strcmp(segments[2], "live") == 0)
+            return ADMISSION_LANE_NONE;
+        return ADMISSION_LANE_LOOKUP;
+    }
+
+    if (nSegments == 1 && strcmp(segments[0], "data") == 0)
+        return ADMISSION_LANE_DATA;
+
+    return ADMISSION_LANE_NONE;
+}
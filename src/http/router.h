@@ -1,16 +1,14 @@
 #ifndef ROUTER_H
 #define ROUTER_H
 
+#include "../utils/admission.h"
 #include "server.h"
 
-typedef struct yyguts_t *yyscan_t;
-typedef struct yy_buffer_state *YY_BUFFER_STATE;
+// Dispatches the request path to its handler without touching the heap, an unknown path or
+// an invalid id leaves the response untouched (404)
+void route_request(struct HandlerContext *handlerContext, const char *url);
 
-int yylex(yyscan_t scanner);
-int yylex_init_extra(struct HandlerContext *ctx, yyscan_t *scanner);
-int yylex_destroy(yyscan_t scanner);
-
-YY_BUFFER_STATE yy_scan_string(const char *str, yyscan_t scanner);
-void yy_delete_buffer(YY_BUFFER_STATE buffer, yyscan_t scanner);
+// Lane whose limits apply to the request, decided before it is admitted and routed
+admissionLane_t route_lane(httpMethod_t method, const char *url);
 
 #endif
@@ -1,5 +1,9 @@
 #include "server.h"
+#include "../utils/admission.h"
+#include "../utils/arena.h"
+#include "../utils/metrics.h"
 #include "../utils/utils.h"
+#include "compression.h"
 #include "router.h"
 #include <arpa/inet.h>
 #include <microhttpd.h>
@@ -15,14 +19,171 @@ struct MHD_Connection;
 static struct MHD_Daemon *httpDaemon = NULL;
 
 #define MAX_POST_DATA_SIZE 16384 // 16KiB max
+#define INITIAL_POST_DATA_SIZE 1024
+#define STREAM_BLOCK_SIZE 32768  // Buffer MHD hands to the stream readers
+#define RETRY_AFTER_SECONDS "1"  // Sent with the 429 and 503 of a full queue
+#define DEFAULT_HTTP_MAX_CONNECTIONS 4096
+
+#define DEFERRED_PENDING 0   // The handler returned, the connection is not suspended yet
+#define DEFERRED_SUSPENDED 1 // Waiting for deferred_response_ready
+#define DEFERRED_READY 2
+
+struct ResponseStream {
+    streamRead_t read;
+    streamFree_t free;
+    void *cls;
+    struct DeferredResponse wake; // Suspends the connection while the reader waits
+};
+
+// Everything a request allocates until MHD completes it comes from its arena
+struct RequestContext {
+    Arena *arena;
+    struct RequestData *requestData; // Only for methods with a body
+    size_t postDataCap;
+    metricsRoute_t route;
+    int httpStatus;
+    uint64_t startUs;
+    uint64_t queuedUs; // Zero until a response was queued
+    struct DeferredResponse deferred;
+    admissionLane_t lane;
+    bool admitted; // Holds a slot of lane until the request completes
+    bool queued;   // Suspended until the waiter gets a slot
+    AdmissionWaiter waiter;
+    uint64_t deadlineUs; // Zero when the lane has no timeout
+};
+
+struct ParamContext {
+    struct QueryData *queryData;
+    Arena *arena;
+};
+
+static void request_completed(void *cls, struct MHD_Connection *connection, void **conCls,
+                              enum MHD_RequestTerminationCode toe) {
+    (void)cls;
+    (void)connection;
+    (void)toe;
+
+    struct RequestContext *requestContext = *conCls;
+    if (requestContext) {
+        // Resumed with a slot but closed before the handler ran again, the slot is still its own
+        if (requestContext->admitted ||
+            (requestContext->queued && requestContext->waiter.admitted))
+            admission_leave(requestContext->lane);
+
+        // The client went away between the deferred result coming in and finish. Until it is
+        // ready the reactor still writes into cls, and a suspended connection only completes
+        // once resumed
+        struct DeferredResponse *deferred = &requestContext->deferred;
+        if (deferred->finish && deferred->cancel &&
+            __atomic_load_n(&deferred->state, __ATOMIC_ACQUIRE) == DEFERRED_READY)
+            deferred->cancel(deferred->cls);
+
+        if (requestContext->queuedUs)
+            metrics_request_completed(requestContext->route, requestContext->httpStatus,
+                                      requestContext->startUs, requestContext->queuedUs);
+        arena_destroy(requestContext->arena);
+        *conCls = NULL;
+    }
+}
 
-static void free_request_data(struct RequestData *requestData) {
-    if (requestData) {
-        if (requestData->postData) {
-            free(requestData->postData);
-        }
-        free(requestData);
+static struct RequestContext *create_request_context(void) {
+    Arena *arena = arena_create();
+    if (!arena)
+        return NULL;
+
+    struct RequestContext *requestContext = arena_alloc(arena, sizeof(struct RequestContext));
+    if (!requestContext) {
+        arena_destroy(arena);
+        return NULL;
+    }
+
+    requestContext->arena = arena;
+    requestContext->requestData = NULL;
+    requestContext->postDataCap = 0;
+    requestContext->route = METRICS_ROUTE_NONE;
+    requestContext->httpStatus = 0;
+    requestContext->startUs = metrics_now_us();
+    requestContext->queuedUs = 0;
+    requestContext->deferred.finish = NULL;
+    requestContext->deferred.cancel = NULL;
+    requestContext->deferred.cls = NULL;
+    requestContext->deferred.connection = NULL;
+    requestContext->deferred.state = DEFERRED_PENDING;
+    requestContext->lane = ADMISSION_LANE_NONE;
+    requestContext->admitted = false;
+    requestContext->queued = false;
+    requestContext->waiter.resume = deferred_response_ready;
+    requestContext->waiter.cls = &requestContext->deferred;
+    requestContext->deadlineUs = 0;
+
+    return requestContext;
+}
+
+// Sized from Content-Length when the client sent it, the buffer grows otherwise
+static bool init_post_data(struct RequestContext *requestContext,
+                           struct MHD_Connection *connection) {
+    size_t cap = INITIAL_POST_DATA_SIZE;
+
+    const char *contentLength =
+        MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Content-Length");
+    if (contentLength) {
+        unsigned long long length = strtoull(contentLength, NULL, 10);
+        if (length > MAX_POST_DATA_SIZE)
+            return false;
+        if (length > 0)
+            cap = (size_t)length;
+    }
+
+    struct RequestData *requestData =
+        arena_alloc(requestContext->arena, sizeof(struct RequestData));
+    if (!requestData)
+        return false;
+
+    requestData->postData = arena_alloc(requestContext->arena, cap + 1);
+    if (!requestData->postData)
+        return false;
+
+    requestData->postData[0] = '\0';
+    requestData->postDataSize = 0;
+    requestData->postDataProcessed = 0;
+
+    requestContext->requestData = requestData;
+    requestContext->postDataCap = cap;
+
+    return true;
+}
+
+static bool append_post_data(struct RequestContext *requestContext, const char *data,
+                             size_t size) {
+    struct RequestData *requestData = requestContext->requestData;
+    size_t needed = requestData->postDataSize + size;
+    if (needed > MAX_POST_DATA_SIZE)
+        return false;
+
+    if (needed > requestContext->postDataCap) {
+        size_t cap = requestContext->postDataCap * 2;
+        while (cap < needed)
+            cap *= 2;
+        if (cap > MAX_POST_DATA_SIZE)
+            cap = MAX_POST_DATA_SIZE;
+
+        // The old buffer stays in the arena until the request completes
+        char *postData = arena_alloc(requestContext->arena, cap + 1);
+        if (!postData)
+            return false;
+
+        memcpy(postData, requestData->postData, requestData->postDataSize);
+        requestData->postData = postData;
+        requestContext->postDataCap = cap;
     }
+
+    metrics_add_bytes_in(size);
+
+    memcpy(requestData->postData + requestData->postDataSize, data, size);
+    requestData->postDataSize = needed;
+    requestData->postData[needed] = '\0'; // Null-terminate
+
+    return true;
 }
 
 void get_client_ip(struct MHD_Connection *connection, char *clientIp, size_t clientIpSize) {
@@ -54,16 +215,145 @@ void get_client_ip(struct MHD_Connection *connection, char *clientIp, size_t cli
     }
 }
 
-bool method_accepts_body(const char *method) {
-    if (strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "PATCH") == 0)
-        return true;
+// Suspends the connection until deferred_response_ready, which may have been called already
+static void suspend_deferred(struct DeferredResponse *deferred) {
+    MHD_suspend_connection(deferred->connection);
+
+    int expected = DEFERRED_PENDING;
+    if (!__atomic_compare_exchange_n(&deferred->state, &expected, DEFERRED_SUSPENDED, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        MHD_resume_connection(deferred->connection); // It was ready before the suspension
+}
+
+static ssize_t read_response_stream(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct ResponseStream *stream = cls;
+    (void)pos;
+
+    // Anything the stream gets after this is seen by the read or resumes the connection
+    __atomic_store_n(&stream->wake.state, DEFERRED_PENDING, __ATOMIC_RELEASE);
+
+    ssize_t len = stream->read(stream->cls, buf, max);
+    if (len == RESPONSE_STREAM_WAIT) {
+        suspend_deferred(&stream->wake);
+        return 0;
+    }
+    if (len == RESPONSE_STREAM_END)
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    if (len < 0)
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+
+    metrics_add_bytes_out((size_t)len);
+    return len;
+}
+
+static void free_response_stream(void *cls) {
+    struct ResponseStream *stream = cls;
+
+    if (stream->free)
+        stream->free(stream->cls);
+    free(stream);
+}
+
+// Without a known size MHD answers with chunked transfer encoding
+static struct MHD_Response *create_stream_response(struct MHD_Connection *connection,
+                                                   struct ResponseData *responseData) {
+    struct ResponseStream *stream = malloc(sizeof(struct ResponseStream));
+    if (!stream) {
+        if (responseData->streamFree)
+            responseData->streamFree(responseData->streamCls);
+        return NULL;
+    }
+
+    stream->read = responseData->streamRead;
+    stream->free = responseData->streamFree;
+    stream->cls = responseData->streamCls;
+    stream->wake.finish = NULL;
+    stream->wake.cancel = NULL;
+    stream->wake.cls = NULL;
+    stream->wake.connection = connection;
+    stream->wake.state = DEFERRED_PENDING;
+
+    if (responseData->streamAttach)
+        responseData->streamAttach(responseData->streamCls, &stream->wake);
+
+    struct MHD_Response *response =
+        MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, STREAM_BLOCK_SIZE,
+                                          read_response_stream, stream, free_response_stream);
+    if (!response)
+        free_response_stream(stream);
+
+    return response;
+}
+
+// If-None-Match holds a list of entity tags, weak ones compare equal too
+static bool etag_matches(const char *ifNoneMatch, const char *etag) {
+    size_t etagLen = strlen(etag);
+    const char *p = ifNoneMatch;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '*')
+            return true;
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+
+        const char *start = p;
+        while (*p && *p != ',')
+            p++;
+
+        const char *end = p;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+
+        if ((size_t)(end - start) == etagLen && strncmp(start, etag, etagLen) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+httpMethod_t parse_http_method(const char *method) {
+    if (strcmp(method, "GET") == 0)
+        return HTTP_GET;
+    else if (strcmp(method, "POST") == 0)
+        return HTTP_POST;
+    else if (strcmp(method, "PUT") == 0)
+        return HTTP_PUT;
+    else if (strcmp(method, "PATCH") == 0)
+        return HTTP_PATCH;
+    else if (strcmp(method, "DELETE") == 0)
+        return HTTP_DELETE;
     else
-        return false;
+        return HTTP_OTHER;
+}
+
+static void set_persistent_body(struct ResponseData *responseData, const char *body) {
+    if (!responseData->dataPersistent)
+        free(responseData->data);
+
+    responseData->data = (char *)body;
+    responseData->dataPersistent = true;
+}
+
+static void release_body(struct ResponseData *responseData) {
+    if (!responseData->dataPersistent)
+        free(responseData->data);
+
+    responseData->data = NULL;
+    responseData->dataPersistent = false;
+}
+
+bool method_accepts_body(const char *method) {
+    httpMethod_t httpMethod = parse_http_method(method);
+    return httpMethod == HTTP_POST || httpMethod == HTTP_PUT || httpMethod == HTTP_PATCH;
 }
 
 static enum MHD_Result process_param(void *cls, enum MHD_ValueKind kind, const char *key,
                                      const char *value) {
-    struct QueryData *queryData = cls;
+    struct ParamContext *paramContext = cls;
+    struct QueryData *queryData = paramContext->queryData;
+    Arena *arena = paramContext->arena;
     (void)kind;
     DEBUG_PRINTF("Processing: %s = %s\n", key, value);
 
@@ -71,19 +361,43 @@ static enum MHD_Result process_param(void *cls, enum MHD_ValueKind kind, const c
         return MHD_NO;
 
     if (strcmp(key, "start_time") == 0) {
-        queryData->startTime = strdup(value);
+        queryData->startTime = arena_strdup(arena, value);
     }
     else if (strcmp(key, "end_time") == 0) {
-        queryData->endTime = strdup(value);
+        queryData->endTime = arena_strdup(arena, value);
     }
     else if (strcmp(key, "timezone") == 0) {
-        queryData->timezone = strdup(value);
+        queryData->timezone = arena_strdup(arena, value);
     }
     else if (strcmp(key, "granularity") == 0) {
-        queryData->granularity = strdup(value);
+        queryData->granularity = arena_strdup(arena, value);
+    }
+    else if (strcmp(key, "stations") == 0) {
+        queryData->stations = arena_strdup(arena, value);
+    }
+    else if (strcmp(key, "bbox") == 0) {
+        queryData->bbox = arena_strdup(arena, value);
+    }
+    else if (strcmp(key, "near") == 0) {
+        queryData->near = arena_strdup(arena, value);
+    }
+    else if (strcmp(key, "limit") == 0) {
+        queryData->limit = arena_strdup(arena, value);
+    }
+    else if (strcmp(key, "max_points") == 0) {
+        queryData->maxPoints = arena_strdup(arena, value);
+    }
+    else if (strcmp(key, "cursor") == 0) {
+        queryData->cursor = arena_strdup(arena, value);
+    }
+    else if (strcmp(key, "format") == 0) {
+        queryData->format = arena_strdup(arena, value);
+    }
+    else if (strcmp(key, "pretty") == 0) {
+        queryData->pretty = strcmp(value, "1") == 0 || strcmp(value, "true") == 0;
     }
     else if (strcmp(key, "fields") == 0) {
-        char *tmp = strdup(value);
+        char *tmp = arena_strdup(arena, value);
         if (!tmp)
             return MHD_NO;
 
@@ -99,13 +413,221 @@ static enum MHD_Result process_param(void *cls, enum MHD_ValueKind kind, const c
             }
             token = strtok_r(NULL, ",", &saveptr);
         }
+    }
+
+    return MHD_YES;
+}
+
+static void init_response_data(struct ResponseData *responseData) {
+    responseData->data = NULL;
+    responseData->dataPersistent = false;
+    responseData->httpStatus = MHD_HTTP_NOT_FOUND;
+    responseData->sessionToken = NULL;
+    responseData->sessionTokenMaxAge = 3600;
+    responseData->etag = NULL;
+    responseData->nextCursor = NULL;
+    responseData->streamRead = NULL;
+    responseData->streamFree = NULL;
+    responseData->streamAttach = NULL;
+    responseData->streamCls = NULL;
+    responseData->contentType = NULL;
+}
+
+static enum MHD_Result send_response(struct MHD_Connection *connection, const char *method,
+                                     struct RequestContext *requestContext,
+                                     struct ResponseData *responseData) {
+    struct MHD_Response *response;
+    enum MHD_Result ret;
+
+    // Check if responseData->data was written
+    if (!responseData->data && !responseData->streamRead)
+        set_persistent_body(responseData, "");
+
+    // The client already has this exact body
+    if (responseData->etag && responseData->httpStatus == MHD_HTTP_OK) {
+        const char *ifNoneMatch =
+            MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+        if (ifNoneMatch && etag_matches(ifNoneMatch, responseData->etag)) {
+            set_persistent_body(responseData, "");
+            responseData->httpStatus = MHD_HTTP_NOT_MODIFIED;
+        }
+    }
+
+    // Compressed here, on the worker thread that ran the handler
+    contentEncoding_t encoding = negotiate_encoding(
+        MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept-Encoding"));
+    bool compressed = false;
+
+    // Create the response and say MHD to free the responseData->data on finish
+    if (responseData->streamRead) {
+        if (encoding != ENCODING_IDENTITY && !responseData->streamAttach) {
+            CompressedStream *stream =
+                compressed_stream_create(encoding, responseData->streamRead,
+                                         responseData->streamFree, responseData->streamCls);
+            if (stream) {
+                responseData->streamRead = compressed_stream_read;
+                responseData->streamFree = compressed_stream_free;
+                responseData->streamCls = stream;
+                compressed = true;
+            }
+        }
+        response = create_stream_response(connection, responseData);
+    }
+    else {
+        size_t dataLen = strlen(responseData->data);
+        char *body;
+        size_t bodyLen;
+
+        if (encoding != ENCODING_IDENTITY && dataLen > 0 && should_compress(dataLen) &&
+            compress_buffer(encoding, responseData->data, dataLen, &body, &bodyLen)) {
+            release_body(responseData);
+            responseData->data = body;
+            dataLen = bodyLen;
+            compressed = true;
+        }
+
+        // Constant and arena bodies outlive the response, the rest is MHD's to free
+        response = MHD_create_response_from_buffer(dataLen, responseData->data,
+                                                   responseData->dataPersistent
+                                                       ? MHD_RESPMEM_PERSISTENT
+                                                       : MHD_RESPMEM_MUST_FREE);
+        if (response)
+            metrics_add_bytes_out(dataLen);
+    }
+
+    if (!response) {
+        release_body(responseData);
+        free(responseData->etag);
+        free(responseData->nextCursor);
+        free(responseData->sessionToken);
+        return MHD_NO;
+    }
 
-        free(tmp);
+    MHD_add_response_header(response, "Content-Type",
+                            responseData->contentType ? responseData->contentType
+                                                      : "application/json");
+    MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    if (compressed)
+        MHD_add_response_header(response, "Content-Encoding", encoding_name(encoding));
+    // Streams that wait for data are never complete, nothing on the way may keep a copy
+    if (responseData->streamAttach)
+        MHD_add_response_header(response, "Cache-Control", "no-cache");
+    if (responseData->etag) {
+        // The tag identifies the uncompressed body, so an encoded one is only weakly equal
+        char etagHeader[64];
+        snprintf(etagHeader, sizeof(etagHeader), "%s%s", compressed ? "W/" : "",
+                 responseData->etag);
+        MHD_add_response_header(response, "ETag", etagHeader);
+        free(responseData->etag);
+    }
+    if (responseData->nextCursor) {
+        MHD_add_response_header(response, "X-Next-Cursor", responseData->nextCursor);
+        free(responseData->nextCursor);
+    }
+    if (strcmp(method, "GET") == 0) {
+        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+        // Browsers only let scripts read the listed headers of cross origin responses
+        MHD_add_response_header(response, "Access-Control-Expose-Headers", "ETag, X-Next-Cursor");
     }
+    if (responseData->httpStatus == MHD_HTTP_TOO_MANY_REQUESTS ||
+        responseData->httpStatus == MHD_HTTP_SERVICE_UNAVAILABLE)
+        MHD_add_response_header(response, "Retry-After", RETRY_AFTER_SECONDS);
+
+    // Create cookie if exists
+    if (responseData->sessionToken) {
+        char cookieHeader[256];
+        snprintf(cookieHeader, sizeof(cookieHeader),
+                 "sessiontoken=%s; Path=/; HttpOnly; Secure; SameSite=Lax; Max-Age=%d",
+                 responseData->sessionToken, responseData->sessionTokenMaxAge);
+        MHD_add_response_header(response, "Set-Cookie", cookieHeader);
+
+        free(responseData->sessionToken);
+    }
+
+    // Send and destroy the response, the arena goes once MHD reports the request completed
+    ret = MHD_queue_response(connection, responseData->httpStatus, response);
+    MHD_destroy_response(response);
+
+    if (ret == MHD_YES) {
+        requestContext->httpStatus = responseData->httpStatus;
+        requestContext->queuedUs = metrics_now_us();
+    }
+
+    return ret;
+}
 
+void deferred_response_ready(void *cls) {
+    struct DeferredResponse *deferred = cls;
+
+    // Before the suspension the worker that ran the handler sees the state and resumes it
+    if (__atomic_exchange_n(&deferred->state, DEFERRED_READY, __ATOMIC_ACQ_REL) ==
+        DEFERRED_SUSPENDED)
+        MHD_resume_connection(deferred->connection);
+}
+
+// The handler deferred its answer or the request waits for an admission slot
+static enum MHD_Result suspend_request(struct RequestContext *requestContext) {
+    suspend_deferred(&requestContext->deferred);
     return MHD_YES;
 }
 
+static admission_t admit_request(struct RequestContext *requestContext, const char *method,
+                                 const char *url) {
+    if (requestContext->queued) {
+        // Resumed by admission_leave or on shutdown, the state is reused by deferred handlers
+        requestContext->queued = false;
+        requestContext->deferred.state = DEFERRED_PENDING;
+        if (!requestContext->waiter.admitted)
+            return ADMISSION_REJECTED;
+
+        requestContext->admitted = true;
+
+        // The wait took the whole budget, the slot is given back on completion
+        if (requestContext->deadlineUs && metrics_now_us() >= requestContext->deadlineUs)
+            return ADMISSION_REJECTED;
+        return ADMISSION_ADMITTED;
+    }
+
+    requestContext->lane = route_lane(parse_http_method(method), url);
+
+    int timeoutMs = admission_timeout_ms(requestContext->lane);
+    if (timeoutMs > 0)
+        requestContext->deadlineUs = requestContext->startUs + (uint64_t)timeoutMs * 1000;
+
+    admission_t admission = admission_enter(requestContext->lane, &requestContext->waiter);
+    if (admission == ADMISSION_ADMITTED)
+        requestContext->admitted = true;
+    else if (admission == ADMISSION_QUEUED)
+        requestContext->queued = true;
+
+    return admission;
+}
+
+static enum MHD_Result send_busy(struct MHD_Connection *connection, const char *method,
+                                 struct RequestContext *requestContext) {
+    struct ResponseData responseData;
+    init_response_data(&responseData);
+    set_persistent_body(&responseData, "{\"error\":\"Server busy\"}");
+    responseData.httpStatus = MHD_HTTP_SERVICE_UNAVAILABLE;
+
+    return send_response(connection, method, requestContext, &responseData);
+}
+
+static enum MHD_Result finish_deferred(struct MHD_Connection *connection, const char *method,
+                                       struct RequestContext *requestContext) {
+    struct DeferredResponse *deferred = &requestContext->deferred;
+
+    struct ResponseData responseData;
+    init_response_data(&responseData);
+
+    metrics_request_resume(requestContext->route);
+    deferred->finish(deferred->cls, &responseData);
+    deferred->finish = NULL;
+    metrics_request_end();
+
+    return send_response(connection, method, requestContext, &responseData);
+}
+
 static enum MHD_Result handle_request(void *cls, struct MHD_Connection *connection, const char *url,
                                       const char *method, const char *version,
                                       const char *uploadData, size_t *uploadDataSize,
@@ -116,54 +638,62 @@ static enum MHD_Result handle_request(void *cls, struct MHD_Connection *connecti
     DEBUG_PRINTF("Request [%s] %s\n", method, url);
     DEBUG_PRINTF("uploadDataSize = %zu\n", uploadDataSize ? *uploadDataSize : 0);
 
-    struct RequestData *requestData = *conCls;
+    struct RequestContext *requestContext = *conCls;
 
-    // Reserve memory for the body of the request
-    if (method_accepts_body(method) && requestData == NULL) {
+    if (!requestContext) {
         DEBUG_PRINTF("First call - initializing connection info\n");
-        requestData = calloc(1, sizeof(struct RequestData));
-        if (!requestData)
+        requestContext = create_request_context();
+        if (!requestContext)
             return MHD_NO;
 
-        requestData->postData = malloc(MAX_POST_DATA_SIZE);
-        if (!requestData->postData) {
-            free(requestData);
-            return MHD_NO;
-        }
-        requestData->postData[0] = '\0';
-        requestData->postDataSize = 0;
-        requestData->postDataProcessed = 0;
+        *conCls = requestContext;
+        requestContext->deferred.connection = connection;
 
-        *conCls = requestData;
-        return MHD_YES;
+        // Reserve memory for the body of the request
+        if (method_accepts_body(method)) {
+            if (!init_post_data(requestContext, connection))
+                return MHD_NO;
+            return MHD_YES;
+        }
     }
 
+    // Called again after deferred_response_ready resumed the connection
+    if (requestContext->deferred.finish)
+        return finish_deferred(connection, method, requestContext);
+
+    struct RequestData *requestData = requestContext->requestData;
+
     // Accumulate incoming body data into a buffer
-    if (method_accepts_body(method) && *uploadDataSize != 0) {
+    if (requestData && *uploadDataSize != 0) {
         DEBUG_PRINTF("Received %zu bytes of POST/PUT data\n", *uploadDataSize);
         if (uploadData) {
             DEBUG_PRINTF("Data: '%.*s'\n", (int)*uploadDataSize, uploadData);
         }
 
-        if (requestData->postDataSize + *uploadDataSize <= MAX_POST_DATA_SIZE) {
-            memcpy(requestData->postData + requestData->postDataSize, uploadData, *uploadDataSize);
-            requestData->postDataSize += *uploadDataSize;
-            requestData->postData[requestData->postDataSize] = '\0'; // Null-terminate
+        if (!append_post_data(requestContext, uploadData, *uploadDataSize))
+            return MHD_NO;
 
-            DEBUG_PRINTF("Total accumulated data: %zu bytes\n", requestData->postDataSize);
-            *uploadDataSize = 0;
-            return MHD_YES;
-        }
-        return MHD_NO;
+        DEBUG_PRINTF("Total accumulated data: %zu bytes\n", requestData->postDataSize);
+        *uploadDataSize = 0;
+        return MHD_YES;
     }
 
     // Mark the body as fully recived
-    if (method_accepts_body(method) && !requestData->postDataProcessed) {
+    if (requestData && !requestData->postDataProcessed) {
         DEBUG_PRINTF("Finished receiving data - setting processed flag\n");
         requestData->postDataProcessed = 1;
         return MHD_YES;
     }
 
+    // Lanes bound how many requests of each kind run at once, the others wait suspended
+    if (!requestContext->admitted) {
+        admission_t admission = admit_request(requestContext, method, url);
+        if (admission == ADMISSION_QUEUED)
+            return suspend_request(requestContext);
+        if (admission == ADMISSION_REJECTED)
+            return send_busy(connection, method, requestContext);
+    }
+
     // Print the body
     if (requestData != NULL) {
         DEBUG_PRINTF("Processing request with %zu bytes of data\n", requestData->postDataSize);
@@ -174,10 +704,7 @@ static enum MHD_Result handle_request(void *cls, struct MHD_Connection *connecti
 
     // Response data initialization
     struct ResponseData responseData;
-    responseData.data = NULL;
-    responseData.httpStatus = MHD_HTTP_NOT_FOUND;
-    responseData.sessionToken = NULL;
-    responseData.sessionTokenMaxAge = 3600;
+    init_response_data(&responseData);
 
     // Auth data initialization
     struct AuthData authData;
@@ -193,88 +720,58 @@ static enum MHD_Result handle_request(void *cls, struct MHD_Connection *connecti
 
     DEBUG_PRINTF("Cliente IP: %s, User-Agent: %s\n", authData.clientIp, authData.userAgent);
 
-    struct QueryData queryData = {NULL, NULL, NULL, NULL, -1};
+    metrics_request_begin();
+
+    struct QueryData queryData = {NULL, NULL, NULL, NULL, -1, NULL, false,
+                                  NULL, NULL, NULL, NULL, NULL, NULL};
 
-    MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, process_param, &queryData);
+    struct ParamContext paramContext = {&queryData, requestContext->arena};
+    MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, process_param, &paramContext);
 
     // ---- Endpoint handling -----
     struct HandlerContext handlerContext;
-    handlerContext.method = method;
+    handlerContext.method = parse_http_method(method);
     handlerContext.responseData = &responseData;
     handlerContext.authData = &authData;
     handlerContext.requestData = requestData;
     handlerContext.queryData = &queryData;
+    handlerContext.arena = requestContext->arena;
+    handlerContext.deferred = &requestContext->deferred;
 
-    // Init scanner with the extra context
-    yyscan_t scanner;
-    yylex_init_extra(&handlerContext, &scanner);
-
-    // Create buffer from URL
-    YY_BUFFER_STATE flexBuffer = yy_scan_string(url, scanner);
-
-    // Execute flex
-    yylex(scanner);
-
-    // Free resources
-    yy_delete_buffer(flexBuffer, scanner);
-    yylex_destroy(scanner);
+    // Postgres stops the statements of the request once its deadline passes
+    admission_set_deadline(requestContext->deadlineUs);
+    route_request(&handlerContext, url);
+    admission_set_deadline(0);
     // ---------------------------------
 
-    // Response handling
-    struct MHD_Response *response;
-    enum MHD_Result ret;
-
-    // Check if responseData.data was written
-    if (!responseData.data) {
-        responseData.data = strdup("");
-    }
-
-    if (queryData.startTime)
-        free(queryData.startTime);
-
-    if (queryData.endTime)
-        free(queryData.endTime);
-
-    if (queryData.timezone)
-        free(queryData.timezone);
+    requestContext->route = metrics_request_end();
 
-    if (queryData.granularity)
-        free(queryData.granularity);
+    // The answer comes from the reactor, MHD calls back once the connection is resumed
+    if (requestContext->deferred.finish)
+        return suspend_request(requestContext);
 
-    // Create the response and say MHD to free the responseData.data on finish
-    response = MHD_create_response_from_buffer(strlen(responseData.data), responseData.data,
-                                               MHD_RESPMEM_MUST_FREE);
-    MHD_add_response_header(response, "Content-Type", "application/json");
-    if (strcmp(method, "GET") == 0) {
-        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-    }
-
-    // Create cookie if exists
-    if (responseData.sessionToken) {
-        char cookieHeader[256];
-        snprintf(cookieHeader, sizeof(cookieHeader),
-                 "sessiontoken=%s; Path=/; HttpOnly; Secure; SameSite=Lax; Max-Age=%d",
-                 responseData.sessionToken, responseData.sessionTokenMaxAge);
-        MHD_add_response_header(response, "Set-Cookie", cookieHeader);
-
-        free(responseData.sessionToken);
-    }
-
-    // Send and destroy the response
-    ret = MHD_queue_response(connection, responseData.httpStatus, response);
-    MHD_destroy_response(response);
-
-    // Free the post data
-    free_request_data(requestData);
-    *conCls = NULL;
+    return send_response(connection, method, requestContext, &responseData);
+}
 
-    return ret;
+int http_connection_limit(void) {
+    const char *str = getenv("HTTP_MAX_CONNECTIONS");
+    int limit = str ? atoi(str) : DEFAULT_HTTP_MAX_CONNECTIONS;
+    return limit > 0 ? limit : DEFAULT_HTTP_MAX_CONNECTIONS;
 }
 
 int http_server_init(int port, int nThreads) {
-    httpDaemon = MHD_start_daemon(MHD_USE_EPOLL_INTERNALLY | MHD_USE_IPv6 | MHD_USE_DUAL_STACK,
+    init_compression();
+
+    // Set explicitly, MHD defaults to FD_SETSIZE - 4 even with epoll
+    unsigned int connectionLimit = (unsigned int)http_connection_limit();
+
+    httpDaemon = MHD_start_daemon(MHD_USE_EPOLL_INTERNALLY | MHD_USE_IPv6 | MHD_USE_DUAL_STACK |
+                                      MHD_ALLOW_SUSPEND_RESUME,
                                   port, NULL, NULL, &handle_request, NULL,
-                                  MHD_OPTION_THREAD_POOL_SIZE, nThreads, MHD_OPTION_END);
+                                  MHD_OPTION_THREAD_POOL_SIZE, nThreads,
+                                  MHD_OPTION_CONNECTION_LIMIT, connectionLimit,
+                                  MHD_OPTION_NOTIFY_COMPLETED, request_completed, NULL,
+                                  MHD_OPTION_END);
 
     if (httpDaemon)
         return 0;
@@ -2,21 +2,77 @@
 #define SERVER_H
 
 #include <netinet/in.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
+
+typedef enum {
+    HTTP_GET = 0,
+    HTTP_POST,
+    HTTP_PUT,
+    HTTP_PATCH,
+    HTTP_DELETE,
+    HTTP_OTHER
+} httpMethod_t;
+
+struct Arena;
+struct MHD_Connection;
+struct ResponseData;
+
+// Fills the response of a deferred request on a worker thread
+typedef void (*deferredFinish_t)(void *cls, struct ResponseData *responseData);
+
+// Frees cls of a deferred request that completed without finish being called
+typedef void (*deferredCancel_t)(void *cls);
+
+// Lets a handler answer once a query issued to the database reactor completes, without holding
+// its worker thread. The handler sets finish and returns, the connection is then suspended
+// until deferred_response_ready is called, from any thread
+struct DeferredResponse {
+    deferredFinish_t finish; // NULL when the handler answered right away
+    deferredCancel_t cancel; // NULL when cls needs no freeing
+    void *cls;
+    struct MHD_Connection *connection;
+    int state; // Owned by the server
+};
 
 struct HandlerContext {
-    const char *method;
+    httpMethod_t method;
     struct ResponseData *responseData;
     struct AuthData *authData;
     struct RequestData *requestData;
     struct QueryData *queryData;
+    struct Arena *arena; // Freed in one go when the request completes
+    struct DeferredResponse *deferred;
 };
 
+// Returned by a stream reader once the body is complete or to abort the response
+#define RESPONSE_STREAM_END -1
+#define RESPONSE_STREAM_ERROR -2
+// Nothing to send yet, the connection is suspended until the stream calls
+// deferred_response_ready with the handle streamAttach got, then read again
+#define RESPONSE_STREAM_WAIT -3
+
+// Writes up to max bytes of the body into buf and returns how many were written
+typedef ssize_t (*streamRead_t)(void *cls, char *buf, size_t max);
+typedef void (*streamFree_t)(void *cls);
+// Hands the stream its wake handle once the response exists, only streams that wait set it
+typedef void (*streamAttach_t)(void *cls, struct DeferredResponse *wake);
+
 struct ResponseData {
     char *data;
+    bool dataPersistent; // Constant or arena memory, not freed with the response
     int httpStatus;
     char *sessionToken;
     int sessionTokenMaxAge;
+    char *etag;              // Allows answering If-None-Match with 304
+    char *nextCursor;        // ?cursor= of the next page of a list, sent as X-Next-Cursor
+    const char *contentType; // application/json when NULL
+    // Used instead of data to send the body with chunked encoding as it is produced
+    streamRead_t streamRead;
+    streamFree_t streamFree;
+    streamAttach_t streamAttach; // Also keeps the stream uncompressed, which would hold it back
+    void *streamCls;
 };
 
 struct AuthData {
@@ -38,8 +94,25 @@ struct QueryData {
     char *timezone;
     char *granularity;
     int fields;
+    char *format;
+    bool pretty;    // Indented JSON, compact unless ?pretty=1
+    char *stations; // Comma separated station ids of GET /data
+    char *bbox;     // minLon,minLat,maxLon,maxLat of the station searches
+    char *near;     // lon,lat of the nearest station searches
+    char *limit;
+    char *maxPoints; // Rows kept by the downsampling of the weather data
+    char *cursor;    // Opaque position of a page, from X-Next-Cursor
 };
 
+httpMethod_t parse_http_method(const char *method);
+
+// Takes the DeferredResponse, the connection is resumed and finish called on a worker thread
+void deferred_response_ready(void *deferred);
+
+// HTTP_MAX_CONNECTIONS, the connections MHD accepts at once. Each one is a file descriptor, the
+// open files limit has to be above it
+int http_connection_limit(void);
+
 int http_server_init(int port, int nThreads);
 
 void http_server_process(void);
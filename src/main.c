@@ -5,7 +5,17 @@
 #include <unistd.h>
 
 #include "./http/server.h"
+#include "core/api_key_cache.h"
+#include "core/live_feed.h"
+#include "core/station_directory.h"
+#include "core/weather.h"
 #include "database/database.h"
+#include "database/listener.h"
+#include "database/reactor.h"
+#include "utils/admission.h"
+#include "utils/pwhash_pool.h"
+#include "utils/response_cache.h"
+#include "utils/session_cache.h"
 
 static volatile int keepRuning = 1;
 
@@ -33,6 +43,48 @@ int main(void) {
         return EXIT_FAILURE;
     }
 
+    // Without it the data queries run on the worker threads
+    if (!start_db_reactor())
+        fprintf(stderr, "Failed to start the database reactor\n");
+
+    init_session_cache();
+    init_response_cache();
+    init_admission();
+
+    if (!init_pwhash_pool()) {
+        fprintf(stderr, "Failed to initialize the password hashing pool\n");
+        stop_db_reactor();
+        free_pool();
+        return EXIT_FAILURE;
+    }
+
+    if (!init_weather_ingest()) {
+        fprintf(stderr, "Failed to initialize the weather ingestion\n");
+        free_pwhash_pool();
+        stop_db_reactor();
+        free_pool();
+        return EXIT_FAILURE;
+    }
+
+    if (!init_live_feed(http_connection_limit())) {
+        fprintf(stderr, "Failed to initialize the live feed\n");
+        free_weather_ingest();
+        free_pwhash_pool();
+        stop_db_reactor();
+        free_pool();
+        return EXIT_FAILURE;
+    }
+
+    if (!init_api_key_cache() || !init_station_directory() || !start_listener()) {
+        fprintf(stderr, "Failed to initialize the API key cache and station directory\n");
+        free_live_feed();
+        free_weather_ingest();
+        free_pwhash_pool();
+        stop_db_reactor();
+        free_pool();
+        return EXIT_FAILURE;
+    }
+
     const char *apiPortStr = getenv("API_PORT");
     int apiPort;
     if (apiPortStr)
@@ -44,6 +96,13 @@ int main(void) {
 
     if (http_server_init(apiPort, nThreads) != 0) {
         fprintf(stderr, "Failed to initialize HTTP server\n");
+        stop_listener();
+        free_station_directory();
+        free_api_key_cache();
+        free_live_feed();
+        free_weather_ingest();
+        free_pwhash_pool();
+        stop_db_reactor();
         free_pool();
         return EXIT_FAILURE;
     }
@@ -54,7 +113,16 @@ int main(void) {
         http_server_process();
     }
 
+    // Completes the suspended requests first, MHD cannot stop with them still suspended
+    admission_release_waiters();
+    free_live_feed();
+    stop_db_reactor();
     http_server_cleanup();
+    stop_listener();
+    free_station_directory();
+    free_api_key_cache();
+    free_weather_ingest();
+    free_pwhash_pool();
     free_pool();
     printf("\nServer shutdown complete\n");
 
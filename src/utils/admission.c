@@ -0,0 +1,212 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "metrics.h"
+#include "utils.h"
+
+#define ENV_NAME_SIZE 64
+#define LABEL_SIZE 32
+
+typedef struct {
+    const char *name; // For the env vars and the metrics label
+    int concurrency;
+    int queueSize;
+    int timeoutMs;
+    pthread_mutex_t mutex;
+    int active;
+    int queued;
+    AdmissionWaiter *head; // FIFO of the waiters
+    AdmissionWaiter *tail;
+    uint64_t admittedTotal;
+    uint64_t queuedTotal;
+    uint64_t rejectedTotal;
+} Lane;
+
+static Lane lanes[ADMISSION_LANE_COUNT] = {
+    {"none", 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, NULL, 0, 0, 0},
+    {"lookup", 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, NULL, 0, 0, 0},
+    {"data", 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, NULL, 0, 0, 0},
+    {"auth", 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, NULL, 0, 0, 0},
+};
+
+static __thread uint64_t requestDeadlineUs = 0;
+
+static void init_lane(admissionLane_t index, const char *envName, int concurrency, int queueSize,
+                      int timeoutMs) {
+    Lane *lane = &lanes[index];
+    char name[ENV_NAME_SIZE];
+
+    snprintf(name, sizeof(name), "ADMISSION_%s_CONCURRENCY", envName);
+    lane->concurrency = env_int(name, concurrency, 1);
+
+    snprintf(name, sizeof(name), "ADMISSION_%s_QUEUE", envName);
+    lane->queueSize = env_int(name, queueSize, 0);
+
+    // 0 leaves the statements of the lane without a timeout
+    snprintf(name, sizeof(name), "ADMISSION_%s_TIMEOUT_MS", envName);
+    lane->timeoutMs = env_int(name, timeoutMs, 0);
+}
+
+void init_admission(void) {
+    int nProc = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nProc < 1)
+        nProc = 1;
+
+    // Lookups answer in a few milliseconds, the limit only stops them piling up without end
+    init_lane(ADMISSION_LANE_LOOKUP, "LOOKUP", nProc * 16, nProc * 64, 5000);
+    // Queries in flight wait on the reactor, not on a worker, so the pool is the real bound
+    init_lane(ADMISSION_LANE_DATA, "DATA", nProc * 2, nProc * 8, 30000);
+    // The password hashing pool has its own queue, this keeps the workers off it
+    init_lane(ADMISSION_LANE_AUTH, "AUTH", nProc, nProc * 4, 10000);
+}
+
+admission_t admission_enter(admissionLane_t index, AdmissionWaiter *waiter) {
+    if (index <= ADMISSION_LANE_NONE || index >= ADMISSION_LANE_COUNT)
+        return ADMISSION_ADMITTED;
+
+    Lane *lane = &lanes[index];
+    admission_t result;
+
+    pthread_mutex_lock(&lane->mutex);
+    if (lane->active < lane->concurrency) {
+        lane->active++;
+        lane->admittedTotal++;
+        result = ADMISSION_ADMITTED;
+    }
+    else if (waiter && lane->queued < lane->queueSize) {
+        waiter->admitted = false;
+        waiter->next = NULL;
+        if (lane->tail)
+            lane->tail->next = waiter;
+        else
+            lane->head = waiter;
+        lane->tail = waiter;
+        lane->queued++;
+        lane->queuedTotal++;
+        result = ADMISSION_QUEUED;
+    }
+    else {
+        lane->rejectedTotal++;
+        result = ADMISSION_REJECTED;
+    }
+    pthread_mutex_unlock(&lane->mutex);
+
+    return result;
+}
+
+static AdmissionWaiter *pop_waiter(Lane *lane) {
+    AdmissionWaiter *waiter = lane->head;
+    if (!waiter)
+        return NULL;
+
+    lane->head = waiter->next;
+    if (!lane->head)
+        lane->tail = NULL;
+    lane->queued--;
+
+    return waiter;
+}
+
+void admission_leave(admissionLane_t index) {
+    if (index <= ADMISSION_LANE_NONE || index >= ADMISSION_LANE_COUNT)
+        return;
+
+    Lane *lane = &lanes[index];
+
+    pthread_mutex_lock(&lane->mutex);
+    // The slot goes straight to the waiter, active stays the same
+    AdmissionWaiter *waiter = pop_waiter(lane);
+    if (waiter) {
+        waiter->admitted = true;
+        lane->admittedTotal++;
+    }
+    else {
+        lane->active--;
+    }
+    pthread_mutex_unlock(&lane->mutex);
+
+    // Outside the lock, it may resume the waiter's connection right away
+    if (waiter)
+        waiter->resume(waiter->cls);
+}
+
+void admission_release_waiters(void) {
+    for (int index = ADMISSION_LANE_NONE + 1; index < ADMISSION_LANE_COUNT; index++) {
+        Lane *lane = &lanes[index];
+
+        for (;;) {
+            pthread_mutex_lock(&lane->mutex);
+            AdmissionWaiter *waiter = pop_waiter(lane);
+            if (waiter)
+                lane->rejectedTotal++;
+            pthread_mutex_unlock(&lane->mutex);
+
+            if (!waiter)
+                break;
+
+            waiter->admitted = false;
+            waiter->resume(waiter->cls);
+        }
+    }
+}
+
+int admission_timeout_ms(admissionLane_t index) {
+    if (index <= ADMISSION_LANE_NONE || index >= ADMISSION_LANE_COUNT)
+        return 0;
+    return lanes[index].timeoutMs;
+}
+
+void admission_set_deadline(uint64_t deadlineUs) {
+    requestDeadlineUs = deadlineUs;
+}
+
+uint64_t admission_deadline(void) {
+    return requestDeadlineUs;
+}
+
+static bool write_lane_series(StrBuf *out, const char *name, const char *type, const char *help,
+                              const double *values) {
+    if (!metrics_write_help(out, name, type, help))
+        return false;
+
+    for (int index = ADMISSION_LANE_NONE + 1; index < ADMISSION_LANE_COUNT; index++) {
+        char labels[LABEL_SIZE];
+        snprintf(labels, sizeof(labels), "lane=\"%s\"", lanes[index].name);
+        if (!metrics_write_sample(out, name, labels, values[index]))
+            return false;
+    }
+
+    return true;
+}
+
+bool admission_write_metrics(StrBuf *out) {
+    double active[ADMISSION_LANE_COUNT], queued[ADMISSION_LANE_COUNT];
+    double admittedTotal[ADMISSION_LANE_COUNT], queuedTotal[ADMISSION_LANE_COUNT];
+    double rejectedTotal[ADMISSION_LANE_COUNT];
+
+    for (int index = ADMISSION_LANE_NONE + 1; index < ADMISSION_LANE_COUNT; index++) {
+        Lane *lane = &lanes[index];
+        pthread_mutex_lock(&lane->mutex);
+        active[index] = lane->active;
+        queued[index] = lane->queued;
+        admittedTotal[index] = (double)lane->admittedTotal;
+        queuedTotal[index] = (double)lane->queuedTotal;
+        rejectedTotal[index] = (double)lane->rejectedTotal;
+        pthread_mutex_unlock(&lane->mutex);
+    }
+
+    return write_lane_series(out, "picoweather_admission_active", "gauge",
+                             "Requests holding a slot of the lane.", active) &&
+           write_lane_series(out, "picoweather_admission_queued", "gauge",
+                             "Requests suspended waiting for a slot of the lane.", queued) &&
+           write_lane_series(out, "picoweather_admission_admitted_total", "counter",
+                             "Requests that got a slot of the lane.", admittedTotal) &&
+           write_lane_series(out, "picoweather_admission_queued_total", "counter",
+                             "Requests that had to wait for a slot of the lane.", queuedTotal) &&
+           write_lane_series(out, "picoweather_admission_rejected_total", "counter",
+                             "Requests refused with 503 because the lane was full.",
+                             rejectedTotal);
+}
@@ -0,0 +1,58 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "json_writer.h"
+
+// Kinds of requests limited separately, so one kind filling up does not stall the others
+typedef enum {
+    ADMISSION_LANE_NONE = 0, // Not limited: metrics, uploads (bounded by the COPY batcher)
+    ADMISSION_LANE_LOOKUP,   // Users, stations and keys lookups, cheap single row queries
+    ADMISSION_LANE_DATA,     // Weather data queries, summaries can aggregate years of raw data
+    ADMISSION_LANE_AUTH,     // Requests hashing a password
+    ADMISSION_LANE_COUNT
+} admissionLane_t;
+
+typedef enum {
+    ADMISSION_ADMITTED = 0,
+    ADMISSION_QUEUED,  // resume of the waiter is called once it got a slot or was refused
+    ADMISSION_REJECTED // The lane and its queue are full
+} admission_t;
+
+typedef void (*admissionResume_t)(void *cls);
+
+// Owned by the caller, it must stay valid while queued
+typedef struct AdmissionWaiter {
+    admissionResume_t resume;
+    void *cls;
+    bool admitted; // Set before resume, false when it was refused on shutdown
+    struct AdmissionWaiter *next;
+} AdmissionWaiter;
+
+// Reads ADMISSION_<LANE>_CONCURRENCY, ADMISSION_<LANE>_QUEUE and ADMISSION_<LANE>_TIMEOUT_MS for
+// the LOOKUP, DATA and AUTH lanes
+void init_admission(void);
+
+admission_t admission_enter(admissionLane_t lane, AdmissionWaiter *waiter);
+
+// Hands the slot to the oldest waiter of the lane, if any
+void admission_leave(admissionLane_t lane);
+
+// Refuses every waiter, before stopping the server
+void admission_release_waiters(void);
+
+// Deadline given to the requests of the lane, from their arrival
+int admission_timeout_ms(admissionLane_t lane);
+
+// Deadline in metrics_now_us time of the request the calling thread runs, 0 for none. get_conn
+// turns what is left of it into the statement_timeout of the connection
+void admission_set_deadline(uint64_t deadlineUs);
+
+uint64_t admission_deadline(void);
+
+// Active, queued and refused requests of every lane in the Prometheus text format
+bool admission_write_metrics(StrBuf *out);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size; // Usable bytes after the header
+    size_t used;
+} ArenaBlock;
+
+struct Arena {
+    ArenaBlock *head; // Block being bumped, the larger allocations are linked behind it
+};
+
+#define BLOCK_HEADER_SIZE ALIGN_UP(sizeof(ArenaBlock))
+#define BLOCK_DATA(block) ((unsigned char *)(block) + BLOCK_HEADER_SIZE)
+
+// Bigger requests get a block of their own instead of wasting the rest of the current one
+#define ARENA_LARGE_ALLOC (ARENA_BLOCK_SIZE / 4)
+
+// Blocks are freed on the thread that completes the request, which for MHD's thread pool is
+// the one that started it
+static __thread ArenaBlock *spareBlock = NULL;
+
+static ArenaBlock *new_block(size_t size) {
+    ArenaBlock *block;
+
+    if (size == ARENA_BLOCK_SIZE && spareBlock) {
+        block = spareBlock;
+        spareBlock = NULL;
+    }
+    else {
+        block = malloc(BLOCK_HEADER_SIZE + size);
+        if (!block)
+            return NULL;
+        block->size = size;
+    }
+
+    block->next = NULL;
+    block->used = 0;
+
+    return block;
+}
+
+static void free_block(ArenaBlock *block) {
+    if (block->size == ARENA_BLOCK_SIZE && !spareBlock)
+        spareBlock = block;
+    else
+        free(block);
+}
+
+Arena *arena_create(void) {
+    ArenaBlock *block = new_block(ARENA_BLOCK_SIZE);
+    if (!block)
+        return NULL;
+
+    Arena *arena = (Arena *)BLOCK_DATA(block);
+    block->used = ALIGN_UP(sizeof(Arena));
+    arena->head = block;
+
+    return arena;
+}
+
+void arena_destroy(Arena *arena) {
+    if (!arena)
+        return;
+
+    // The arena itself sits in the last block of the list, read the links before freeing it
+    ArenaBlock *block = arena->head;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free_block(block);
+        block = next;
+    }
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    if (!arena || size > SIZE_MAX - BLOCK_HEADER_SIZE - ARENA_ALIGN)
+        return NULL;
+
+    size = ALIGN_UP(size > 0 ? size : 1);
+    ArenaBlock *head = arena->head;
+
+    if (head->size - head->used >= size) {
+        void *ptr = BLOCK_DATA(head) + head->used;
+        head->used += size;
+        return ptr;
+    }
+
+    if (size >= ARENA_LARGE_ALLOC) {
+        // Kept behind the head, which still has room for the small ones
+        ArenaBlock *block = new_block(size);
+        if (!block)
+            return NULL;
+
+        block->used = size;
+        block->next = head->next;
+        head->next = block;
+        return BLOCK_DATA(block);
+    }
+
+    ArenaBlock *block = new_block(ARENA_BLOCK_SIZE);
+    if (!block)
+        return NULL;
+
+    block->used = size;
+    block->next = head;
+    arena->head = block;
+
+    return BLOCK_DATA(block);
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+    if (!str)
+        return NULL;
+
+    size_t len = strlen(str);
+    char *copy = arena_alloc(arena, len + 1);
+    if (!copy)
+        return NULL;
+
+    memcpy(copy, str, len + 1);
+    return copy;
+}
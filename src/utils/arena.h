@@ -0,0 +1,22 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 8192
+
+// Bump allocator for memory that shares one lifetime, everything is released at once
+typedef struct Arena Arena;
+
+// The arena lives inside its own first block, each thread keeps one spare block around so a
+// request normally does not reach malloc at all
+Arena *arena_create(void);
+
+void arena_destroy(Arena *arena);
+
+// 16 byte aligned, NULL on allocation failure
+void *arena_alloc(Arena *arena, size_t size);
+
+char *arena_strdup(Arena *arena, const char *str);
+
+#endif
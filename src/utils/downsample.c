@@ -0,0 +1,196 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "downsample.h"
+
+// Scale of every series, so the widest one does not decide alone. 0 for flat or empty ones
+static void series_scales(const double *ys, int nSeries, int nRows, double *scales) {
+    for (int s = 0; s < nSeries; s++) {
+        const double *y = ys + (size_t)s * nRows;
+        double min = INFINITY, max = -INFINITY;
+        for (int i = 0; i < nRows; i++) {
+            if (y[i] < min)
+                min = y[i];
+            if (y[i] > max)
+                max = y[i];
+        }
+        // NaN compares false, so the missing values are skipped
+        scales[s] = max > min ? 1.0 / (max - min) : 0.0;
+    }
+}
+
+static int bucket_bound(int bucket, double bucketSize, int nRows) {
+    int bound = (int)floor(bucket * bucketSize) + 1;
+    return bound < nRows - 1 ? bound : nRows - 1;
+}
+
+int lttb_select(const double *x, const double *ys, int nSeries, int nRows, int maxPoints,
+                int *rows) {
+    if (maxPoints < DOWNSAMPLE_MIN_POINTS || nRows <= maxPoints) {
+        for (int i = 0; i < nRows; i++)
+            rows[i] = i;
+        return nRows;
+    }
+
+    // The first and last rows are kept, the ones between are split in maxPoints - 2 buckets of
+    // more than one row each
+    double bucketSize = (double)(nRows - 2) / (maxPoints - 2);
+    int maxBucket = (int)ceil(bucketSize) + 1;
+
+    double *scales = malloc((nSeries > 0 ? nSeries : 1) * sizeof(double));
+    double *areas = malloc(maxBucket * sizeof(double));
+    if (!scales || !areas) {
+        free(scales);
+        free(areas);
+        return -1;
+    }
+
+    series_scales(ys, nSeries, nRows, scales);
+
+    double xSpan = x[nRows - 1] - x[0];
+    double xScale = xSpan > 0 ? 1.0 / xSpan : 1.0;
+
+    int nKept = 0;
+    int a = 0; // The row kept from the previous bucket
+    rows[nKept++] = 0;
+
+    for (int bucket = 0; bucket < maxPoints - 2; bucket++) {
+        int start = bucket_bound(bucket, bucketSize, nRows);
+        int end = bucket_bound(bucket + 1, bucketSize, nRows);
+
+        // The third corner is the average of the next bucket, the last row for the last one
+        int nextStart = end;
+        int nextEnd = bucket + 2 < maxPoints - 2 ? bucket_bound(bucket + 2, bucketSize, nRows)
+                                                 : nRows;
+
+        double xNext = 0;
+        for (int i = nextStart; i < nextEnd; i++)
+            xNext += x[i];
+        xNext /= nextEnd - nextStart;
+
+        double xa = (x[a] - x[0]) * xScale;
+        double xn = (xNext - x[0]) * xScale;
+
+        for (int c = start; c < end; c++)
+            areas[c - start] = 0;
+
+        // One series at a time, each is a contiguous column
+        for (int s = 0; s < nSeries; s++) {
+            if (scales[s] == 0.0)
+                continue;
+
+            const double *y = ys + (size_t)s * nRows;
+            double yNext = 0;
+            int nNext = 0;
+            for (int i = nextStart; i < nextEnd; i++) {
+                if (!isnan(y[i])) {
+                    yNext += y[i];
+                    nNext++;
+                }
+            }
+            if (nNext == 0 || isnan(y[a]))
+                continue;
+
+            double ya = y[a] * scales[s];
+            double yn = yNext / nNext * scales[s];
+
+            for (int c = start; c < end; c++) {
+                if (isnan(y[c]))
+                    continue;
+                double xc = (x[c] - x[0]) * xScale;
+                double yc = y[c] * scales[s];
+                areas[c - start] += fabs((xa - xn) * (yc - ya) - (xa - xc) * (yn - ya));
+            }
+        }
+
+        int best = start;
+        for (int c = start + 1; c < end; c++) {
+            if (areas[c - start] > areas[best - start])
+                best = c;
+        }
+
+        rows[nKept++] = best;
+        a = best;
+    }
+
+    rows[nKept++] = nRows - 1;
+
+    free(scales);
+    free(areas);
+    return nKept;
+}
+
+static bool read_digits(const char **p, int count, int *value) {
+    int v = 0;
+    for (int i = 0; i < count; i++) {
+        char c = (*p)[i];
+        if (c < '0' || c > '9')
+            return false;
+        v = v * 10 + (c - '0');
+    }
+    *p += count;
+    *value = v;
+    return true;
+}
+
+// Days between 1970-01-01 and a date of the proleptic Gregorian calendar
+static int64_t days_from_civil(int year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int yoe = (int)(year - era * 400);
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+bool parse_timestamptz(const char *str, double *seconds) {
+    const char *p = str;
+    int year, month, day, hour, minute, second;
+
+    if (!read_digits(&p, 4, &year) || *p++ != '-' || !read_digits(&p, 2, &month) ||
+        *p++ != '-' || !read_digits(&p, 2, &day) || (*p != ' ' && *p != 'T'))
+        return false;
+    p++;
+    if (!read_digits(&p, 2, &hour) || *p++ != ':' || !read_digits(&p, 2, &minute) ||
+        *p++ != ':' || !read_digits(&p, 2, &second))
+        return false;
+
+    double fraction = 0;
+    if (*p == '.') {
+        double scale = 0.1;
+        for (p++; *p >= '0' && *p <= '9'; p++) {
+            fraction += (*p - '0') * scale;
+            scale /= 10;
+        }
+    }
+
+    // +HH, +HH:MM or +HH:MM:SS east of UTC
+    int offset = 0;
+    if (*p == '+' || *p == '-') {
+        int sign = *p++ == '-' ? -1 : 1;
+        int offsetHour, offsetMinute = 0, offsetSecond = 0;
+        if (!read_digits(&p, 2, &offsetHour))
+            return false;
+        if (*p == ':') {
+            p++;
+            if (!read_digits(&p, 2, &offsetMinute))
+                return false;
+        }
+        if (*p == ':') {
+            p++;
+            if (!read_digits(&p, 2, &offsetSecond))
+                return false;
+        }
+        offset = sign * (offsetHour * 3600 + offsetMinute * 60 + offsetSecond);
+    }
+
+    if (*p != '\0' || month < 1 || month > 12 || day < 1 || day > 31)
+        return false;
+
+    *seconds = (double)(days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 +
+                        second - offset) +
+               fraction;
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef DOWNSAMPLE_H
+#define DOWNSAMPLE_H
+
+#include <stdbool.h>
+
+// Fewest points worth downsampling to, the first and last rows are always kept
+#define DOWNSAMPLE_MIN_POINTS 3
+
+// Largest-Triangle-Three-Buckets over several series sharing the x axis, so one set of rows is
+// kept for all of them. ys holds nSeries columns of nRows values each, NaN where a series has no
+// value. Fills rows with the indexes kept, in order, and returns how many there are, every row
+// when there are no more than maxPoints. -1 when out of memory
+int lttb_select(const double *x, const double *ys, int nSeries, int nRows, int maxPoints,
+                int *rows);
+
+// Seconds since the epoch of a timestamptz as Postgres prints it: 2025-09-11 10:00:00.5+02
+bool parse_timestamptz(const char *str, double *seconds);
+
+#endif
@@ -0,0 +1,1024 @@
+#include "json_writer.h"
+#include "metrics.h"
+#include <libpq-fe.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BOOLOID 16
+#define INT8OID 20
+#define INT2OID 21
+#define INT4OID 23
+#define FLOAT4OID 700
+#define FLOAT8OID 701
+#define NUMERICOID 1700
+
+#define NUMERIC_NEG 0x4000
+#define NUMERIC_NAN 0xC000
+#define NUMERIC_PINF 0xD000
+#define NUMERIC_NINF 0xF000
+
+// Rough size of a serialized value, used to size the buffer up front
+#define ESTIMATED_VALUE_SIZE 24
+// Most reserved up front, a huge result grows the buffer as it is written instead of asking for
+// all of its estimate at once
+#define MAX_INITIAL_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef enum {
+    ENCODE_BOOL,
+    ENCODE_NUMBER,
+    ENCODE_STRING,
+    // Columns requested with resultFormat = 1, decoded from network byte order
+    ENCODE_BINARY_BOOL,
+    ENCODE_BINARY_INT2,
+    ENCODE_BINARY_INT4,
+    ENCODE_BINARY_INT8,
+    ENCODE_BINARY_FLOAT4,
+    ENCODE_BINARY_FLOAT8,
+    ENCODE_BINARY_NUMERIC,
+    ENCODE_BINARY_TEXT
+} columnEncoder_t;
+
+typedef struct {
+    columnEncoder_t encoder;
+    char *key; // Escaped "name": ready to copy
+    size_t keyLen;
+} ColumnWriter;
+
+bool strbuf_init(StrBuf *buf, size_t cap) {
+    if (cap < 16)
+        cap = 16;
+
+    buf->data = malloc(cap);
+    if (!buf->data) {
+        buf->len = 0;
+        buf->cap = 0;
+        return false;
+    }
+
+    buf->data[0] = '\0';
+    buf->len = 0;
+    buf->cap = cap;
+    return true;
+}
+
+static bool strbuf_reserve(StrBuf *buf, size_t extra) {
+    if (buf->len + extra + 1 <= buf->cap)
+        return true;
+
+    size_t newCap = buf->cap ? buf->cap : 16;
+    while (buf->len + extra + 1 > newCap)
+        newCap *= 2;
+
+    char *newData = realloc(buf->data, newCap);
+    if (!newData)
+        return false;
+
+    buf->data = newData;
+    buf->cap = newCap;
+    return true;
+}
+
+bool strbuf_append(StrBuf *buf, const char *str, size_t len) {
+    if (!strbuf_reserve(buf, len))
+        return false;
+
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return true;
+}
+
+bool strbuf_append_str(StrBuf *buf, const char *str) {
+    return strbuf_append(buf, str, strlen(str));
+}
+
+bool strbuf_append_char(StrBuf *buf, char c) {
+    if (!strbuf_reserve(buf, 1))
+        return false;
+
+    buf->data[buf->len++] = c;
+    buf->data[buf->len] = '\0';
+    return true;
+}
+
+bool strbuf_append_json_string(StrBuf *buf, const char *str) {
+    if (!strbuf_append_char(buf, '"'))
+        return false;
+
+    const char *start = str;
+    const char *p = str;
+
+    for (; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        // Flush the run of plain characters before the escape
+        if (!strbuf_append(buf, start, (size_t)(p - start)))
+            return false;
+
+        char escaped[8];
+        switch (c) {
+            case '"':
+                strcpy(escaped, "\\\"");
+                break;
+            case '\\':
+                strcpy(escaped, "\\\\");
+                break;
+            case '\b':
+                strcpy(escaped, "\\b");
+                break;
+            case '\f':
+                strcpy(escaped, "\\f");
+                break;
+            case '\n':
+                strcpy(escaped, "\\n");
+                break;
+            case '\r':
+                strcpy(escaped, "\\r");
+                break;
+            case '\t':
+                strcpy(escaped, "\\t");
+                break;
+            default:
+                snprintf(escaped, sizeof(escaped), "\\u%04X", c);
+                break;
+        }
+
+        if (!strbuf_append_str(buf, escaped))
+            return false;
+        start = p + 1;
+    }
+
+    if (!strbuf_append(buf, start, (size_t)(p - start)))
+        return false;
+
+    return strbuf_append_char(buf, '"');
+}
+
+char *strbuf_release(StrBuf *buf) {
+    char *data = buf->data;
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+    return data;
+}
+
+void strbuf_free(StrBuf *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+static columnEncoder_t binary_encoder_for_type(Oid colType) {
+    switch (colType) {
+        case BOOLOID:
+            return ENCODE_BINARY_BOOL;
+        case INT2OID:
+            return ENCODE_BINARY_INT2;
+        case INT4OID:
+            return ENCODE_BINARY_INT4;
+        case INT8OID:
+            return ENCODE_BINARY_INT8;
+        case FLOAT4OID:
+            return ENCODE_BINARY_FLOAT4;
+        case FLOAT8OID:
+            return ENCODE_BINARY_FLOAT8;
+        case NUMERICOID:
+            return ENCODE_BINARY_NUMERIC;
+        default:
+            // text, varchar and the timestamps the queries cast to text
+            return ENCODE_BINARY_TEXT;
+    }
+}
+
+static columnEncoder_t encoder_for_type(Oid colType, int format) {
+    if (format == 1)
+        return binary_encoder_for_type(colType);
+
+    switch (colType) {
+        case BOOLOID:
+            return ENCODE_BOOL;
+        case INT8OID:
+        case INT2OID:
+        case INT4OID:
+        case FLOAT4OID:
+        case FLOAT8OID:
+            return ENCODE_NUMBER;
+        default:
+            return ENCODE_STRING;
+    }
+}
+
+static void free_columns(ColumnWriter *columns, int nFields) {
+    for (int j = 0; j < nFields; j++)
+        free(columns[j].key);
+    free(columns);
+}
+
+// Column names and encoders only depend on the result description, not on the rows
+static ColumnWriter *prepare_columns(PGresult *res, int nFields, bool pretty) {
+    ColumnWriter *columns = calloc(nFields > 0 ? nFields : 1, sizeof(ColumnWriter));
+    if (!columns)
+        return NULL;
+
+    for (int j = 0; j < nFields; j++) {
+        StrBuf key;
+        if (!strbuf_init(&key, 32) || !strbuf_append_json_string(&key, PQfname(res, j)) ||
+            !strbuf_append_str(&key, pretty ? ": " : ":")) {
+            strbuf_free(&key);
+            free_columns(columns, nFields);
+            return NULL;
+        }
+
+        columns[j].encoder = encoder_for_type(PQftype(res, j), PQfformat(res, j));
+        columns[j].keyLen = key.len;
+        columns[j].key = strbuf_release(&key);
+    }
+
+    return columns;
+}
+
+static uint16_t read_uint16(const char *value) {
+    const unsigned char *p = (const unsigned char *)value;
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t read_uint32(const char *value) {
+    const unsigned char *p = (const unsigned char *)value;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t read_uint64(const char *value) {
+    return ((uint64_t)read_uint32(value) << 32) | read_uint32(value + 4);
+}
+
+// Grisu3 (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with Integers"): the
+// shortest digits that read back as the same double, and of those the closest, come out of 64 bit
+// integer arithmetic in one pass. About 0.5% of doubles can not be decided that way and take the
+// snprintf and strtod path instead
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define DOUBLE_SIGNIFICAND_BITS 52
+#define DOUBLE_HIDDEN_BIT (UINT64_C(1) << DOUBLE_SIGNIFICAND_BITS)
+#define DOUBLE_EXPONENT_BIAS (0x3FF + DOUBLE_SIGNIFICAND_BITS)
+#define DOUBLE_MAX_DIGITS 17
+
+// Normalized 10^k for k = -348, -340, ... 340, rounded to 64 bits
+static const uint64_t cachedPowersF[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+    0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+    0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+    0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+    0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+    0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+    0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+    0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+    0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+    0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+    0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+    0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+    0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+    0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+    0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL};
+
+static const int16_t cachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927, -901, -874,
+    -847, -821, -794, -768, -741, -715, -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3,
+    30, 56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455, 481, 508,
+    534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986, 1013,
+    1039, 1066};
+
+static const uint32_t pow10u32[] = {1,      10,      100,      1000,      10000,
+                                    100000, 1000000, 10000000, 100000000, 1000000000};
+
+static DiyFp diyfp_from_double(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int biasedE = (int)((bits >> DOUBLE_SIGNIFICAND_BITS) & 0x7FF);
+    uint64_t significand = bits & (DOUBLE_HIDDEN_BIT - 1);
+
+    DiyFp fp;
+    if (biasedE != 0) {
+        fp.f = significand + DOUBLE_HIDDEN_BIT;
+        fp.e = biasedE - DOUBLE_EXPONENT_BIAS;
+    }
+    else {
+        // Subnormal
+        fp.f = significand;
+        fp.e = 1 - DOUBLE_EXPONENT_BIAS;
+    }
+    return fp;
+}
+
+// Upper 64 bits of the 128 bit product, rounded
+static DiyFp diyfp_multiply(DiyFp x, DiyFp y) {
+    uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFF, c = y.f >> 32, d = y.f & 0xFFFFFFFF;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & 0xFFFFFFFF) + (bc & 0xFFFFFFFF) + (UINT64_C(1) << 31);
+
+    DiyFp product = {ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64};
+    return product;
+}
+
+static DiyFp diyfp_normalize(DiyFp fp) {
+    while (!(fp.f & (UINT64_C(1) << 63))) {
+        fp.f <<= 1;
+        fp.e--;
+    }
+    return fp;
+}
+
+// The midpoints to the neighbouring doubles, on the exponent of the normalized upper one
+static void diyfp_boundaries(DiyFp v, DiyFp *minus, DiyFp *plus) {
+    DiyFp upper = {(v.f << 1) + 1, v.e - 1};
+    *plus = diyfp_normalize(upper);
+
+    // Powers of two are closer to the double below them
+    DiyFp lower = v.f == DOUBLE_HIDDEN_BIT ? (DiyFp){(v.f << 2) - 1, v.e - 2}
+                                           : (DiyFp){(v.f << 1) - 1, v.e - 1};
+    lower.f <<= lower.e - plus->e;
+    lower.e = plus->e;
+    *minus = lower;
+}
+
+// A cached 10^-k bringing the product of a number on exponent e into [-60, -32], so its integral
+// part fits 32 bits
+static DiyFp cached_power(int e, int *k) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    if (dk - ik > 0.0)
+        ik++;
+
+    int index = (ik >> 3) + 1;
+    *k = -(-348 + index * 8);
+
+    DiyFp power = {cachedPowersF[index], cachedPowersE[index]};
+    return power;
+}
+
+// Moves the last digit down while that brings it closer to w, then tells whether the digits are
+// surely the closest to it. Each bound is only known to within unit, when the closest digits could
+// be on either side of one of them Grisu3 gives up rather than risk a wrong one
+static bool grisu_round_weed(char *digits, int len, uint64_t distanceHighW, uint64_t unsafeInterval,
+                             uint64_t rest, uint64_t tenKappa, uint64_t unit) {
+    uint64_t smallDistance = distanceHighW - unit;
+    uint64_t bigDistance = distanceHighW + unit;
+
+    while (rest < smallDistance && unsafeInterval - rest >= tenKappa &&
+           (rest + tenKappa < smallDistance ||
+            smallDistance - rest >= rest + tenKappa - smallDistance)) {
+        digits[len - 1]--;
+        rest += tenKappa;
+    }
+
+    // Another step could as well have been closer
+    if (rest < bigDistance && unsafeInterval - rest >= tenKappa &&
+        (rest + tenKappa < bigDistance || bigDistance - rest > rest + tenKappa - bigDistance))
+        return false;
+
+    // Far enough from both ends to be inside the real interval
+    return 2 * unit <= rest && rest <= unsafeInterval - 4 * unit;
+}
+
+static int count_digits(uint32_t n) {
+    int count = 1;
+    while (count < 10 && n >= pow10u32[count])
+        count++;
+    return count;
+}
+
+// Generates the digits of w, stopping at the first length with one of them within the interval
+// between lower and upper. 0 when they could not be proven shortest and closest
+static int grisu_digits(DiyFp lower, DiyFp w, DiyFp upper, char *digits, int *k) {
+    uint64_t unit = 1;
+    DiyFp tooLow = {lower.f - unit, lower.e};
+    DiyFp tooHigh = {upper.f + unit, upper.e};
+    uint64_t unsafeInterval = tooHigh.f - tooLow.f;
+
+    DiyFp one = {UINT64_C(1) << -w.e, w.e};
+    uint32_t integral = (uint32_t)(tooHigh.f >> -one.e);
+    uint64_t fraction = tooHigh.f & (one.f - 1);
+    int kappa = count_digits(integral);
+    int len = 0;
+
+    while (kappa > 0) {
+        uint32_t divisor = pow10u32[kappa - 1];
+        digits[len++] = (char)('0' + integral / divisor);
+        integral %= divisor;
+        kappa--;
+
+        uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest < unsafeInterval) {
+            *k += kappa;
+            return grisu_round_weed(digits, len, tooHigh.f - w.f, unsafeInterval, rest,
+                                    (uint64_t)divisor << -one.e, unit)
+                       ? len
+                       : 0;
+        }
+    }
+
+    for (;;) {
+        fraction *= 10;
+        unit *= 10;
+        unsafeInterval *= 10;
+        digits[len++] = (char)('0' + (fraction >> -one.e));
+        fraction &= one.f - 1;
+        kappa--;
+
+        if (fraction < unsafeInterval) {
+            *k += kappa;
+            return grisu_round_weed(digits, len, (tooHigh.f - w.f) * unit, unsafeInterval,
+                                    fraction, one.f, unit)
+                       ? len
+                       : 0;
+        }
+    }
+}
+
+// Shortest digits of a positive finite double, which is digits * 10^k. 0 for the few doubles
+// Grisu3 can not decide
+static int grisu3(double value, char *digits, int *k) {
+    DiyFp v = diyfp_from_double(value);
+    DiyFp minus, plus;
+    diyfp_boundaries(v, &minus, &plus);
+
+    DiyFp power = cached_power(plus.e, k);
+    DiyFp w = diyfp_multiply(diyfp_normalize(v), power);
+    DiyFp upper = diyfp_multiply(plus, power);
+    DiyFp lower = diyfp_multiply(minus, power);
+
+    return grisu_digits(lower, w, upper, digits, k);
+}
+
+// Lays digits * 10^k out as %.*g does, with the precision of the wider of 15 and the number of
+// digits, so only the digits themselves differ from the earlier snprintf based output
+static int write_digits(char *out, bool negative, const char *digits, int len, int k) {
+    int precision = len > 15 ? len : 15;
+    int exponent = len + k - 1; // Of the first digit
+    int n = 0;
+
+    if (negative)
+        out[n++] = '-';
+
+    if (exponent < -4 || exponent >= precision) {
+        out[n++] = digits[0];
+        if (len > 1) {
+            out[n++] = '.';
+            memcpy(out + n, digits + 1, (size_t)(len - 1));
+            n += len - 1;
+        }
+        n += sprintf(out + n, "e%c%02d", exponent < 0 ? '-' : '+', abs(exponent));
+    }
+    else if (exponent < 0) {
+        out[n++] = '0';
+        out[n++] = '.';
+        for (int i = exponent + 1; i < 0; i++)
+            out[n++] = '0';
+        memcpy(out + n, digits, (size_t)len);
+        n += len;
+    }
+    else {
+        int whole = exponent + 1;
+        for (int i = 0; i < whole; i++)
+            out[n++] = i < len ? digits[i] : '0';
+        if (len > whole) {
+            out[n++] = '.';
+            memcpy(out + n, digits + whole, (size_t)(len - whole));
+            n += len - whole;
+        }
+    }
+
+    out[n] = '\0';
+    return n;
+}
+
+// Tries 15, 16 and 17 digits until one reads back as the same double
+static int format_double_slow(char *buf, size_t size, double value) {
+    int len = 0;
+    for (int precision = 15; precision <= 17; precision++) {
+        len = snprintf(buf, size, "%.*g", precision, value);
+        if (precision == 17 || strtod(buf, NULL) == value)
+            break;
+    }
+    return len;
+}
+
+int format_double(char *buf, size_t size, double value) {
+    if (!isfinite(value))
+        return snprintf(buf, size, "%.17g", value);
+
+    // Sign, digits, a point, the leading zeros down to 1e-5 and the exponent
+    char out[DOUBLE_MAX_DIGITS + 16];
+    int len;
+
+    if (value == 0) {
+        len = signbit(value) ? 2 : 1;
+        memcpy(out, signbit(value) ? "-0" : "0", (size_t)len + 1);
+    }
+    else {
+        char digits[DOUBLE_MAX_DIGITS + 1];
+        int k;
+        int nDigits = grisu3(fabs(value), digits, &k);
+        if (nDigits > 0)
+            len = write_digits(out, value < 0, digits, nDigits, k);
+        else
+            len = format_double_slow(out, sizeof(out), value);
+    }
+
+    // Truncated like snprintf, the length is the one it needed
+    if (size > 0) {
+        size_t copied = (size_t)len < size ? (size_t)len : size - 1;
+        memcpy(buf, out, copied);
+        buf[copied] = '\0';
+    }
+    return len;
+}
+
+static bool write_double(StrBuf *out, double value) {
+    if (!isfinite(value))
+        return strbuf_append_str(out, "null");
+
+    char buf[32];
+    int len = format_double(buf, sizeof(buf), value);
+
+    return strbuf_append(out, buf, (size_t)len);
+}
+
+static bool write_float(StrBuf *out, float value) {
+    if (!isfinite(value))
+        return strbuf_append_str(out, "null");
+
+    char buf[32];
+    int len = 0;
+    for (int precision = 6; precision <= 9; precision++) {
+        len = snprintf(buf, sizeof(buf), "%.*g", precision, (double)value);
+        if (precision == 9 || strtof(buf, NULL) == value)
+            break;
+    }
+
+    return strbuf_append(out, buf, (size_t)len);
+}
+
+// Binary numeric: ndigits, weight, sign and dscale followed by base 10000 digits, the first
+// one weighted 10000^weight. Printed like numeric_out, as a JSON string
+static bool write_numeric(StrBuf *out, const char *value, int len) {
+    if (len < 8)
+        return false;
+
+    int ndigits = (int16_t)read_uint16(value);
+    int weight = (int16_t)read_uint16(value + 2);
+    uint16_t sign = read_uint16(value + 4);
+    int dscale = read_uint16(value + 6);
+
+    if (ndigits < 0 || len < 8 + ndigits * 2)
+        return false;
+
+    if (sign == NUMERIC_NAN)
+        return strbuf_append_str(out, "\"NaN\"");
+    if (sign == NUMERIC_PINF)
+        return strbuf_append_str(out, "\"Infinity\"");
+    if (sign == NUMERIC_NINF)
+        return strbuf_append_str(out, "\"-Infinity\"");
+
+    const char *digits = value + 8;
+    char group[8];
+
+    if (!strbuf_append_char(out, '"'))
+        return false;
+    if (sign == NUMERIC_NEG && !strbuf_append_char(out, '-'))
+        return false;
+
+    if (weight < 0) {
+        if (!strbuf_append_char(out, '0'))
+            return false;
+    }
+    else {
+        for (int i = 0; i <= weight; i++) {
+            int digit = i < ndigits ? read_uint16(digits + i * 2) : 0;
+            int groupLen = snprintf(group, sizeof(group), i == 0 ? "%d" : "%04d", digit);
+            if (!strbuf_append(out, group, (size_t)groupLen))
+                return false;
+        }
+    }
+
+    if (dscale > 0) {
+        if (!strbuf_append_char(out, '.'))
+            return false;
+
+        int written = 0;
+        for (int i = weight + 1; written < dscale; i++) {
+            int digit = (i >= 0 && i < ndigits) ? read_uint16(digits + i * 2) : 0;
+            snprintf(group, sizeof(group), "%04d", digit);
+
+            int take = dscale - written < 4 ? dscale - written : 4;
+            if (!strbuf_append(out, group, (size_t)take))
+                return false;
+            written += take;
+        }
+    }
+
+    return strbuf_append_char(out, '"');
+}
+
+static bool write_binary_value(StrBuf *out, columnEncoder_t encoder, const char *value, int len) {
+    char buf[32];
+    int bufLen;
+
+    switch (encoder) {
+        case ENCODE_BINARY_BOOL:
+            if (len < 1)
+                return false;
+            return strbuf_append_str(out, value[0] ? "true" : "false");
+        case ENCODE_BINARY_INT2:
+            if (len < 2)
+                return false;
+            bufLen = snprintf(buf, sizeof(buf), "%d", (int)(int16_t)read_uint16(value));
+            return strbuf_append(out, buf, (size_t)bufLen);
+        case ENCODE_BINARY_INT4:
+            if (len < 4)
+                return false;
+            bufLen = snprintf(buf, sizeof(buf), "%ld", (long)(int32_t)read_uint32(value));
+            return strbuf_append(out, buf, (size_t)bufLen);
+        case ENCODE_BINARY_INT8:
+            if (len < 8)
+                return false;
+            bufLen = snprintf(buf, sizeof(buf), "%lld", (long long)(int64_t)read_uint64(value));
+            return strbuf_append(out, buf, (size_t)bufLen);
+        case ENCODE_BINARY_FLOAT4: {
+            if (len < 4)
+                return false;
+            uint32_t bits = read_uint32(value);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            return write_float(out, f);
+        }
+        case ENCODE_BINARY_FLOAT8: {
+            if (len < 8)
+                return false;
+            uint64_t bits = read_uint64(value);
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            return write_double(out, d);
+        }
+        case ENCODE_BINARY_NUMERIC:
+            return write_numeric(out, value, len);
+        default:
+            // The binary form of text is the string itself, libpq NUL terminates it
+            return strbuf_append_json_string(out, value);
+    }
+}
+
+static bool write_value(StrBuf *out, const ColumnWriter *column, const char *value, int len) {
+    switch (column->encoder) {
+        case ENCODE_BOOL:
+            return strbuf_append_str(out, value[0] == 't' ? "true" : "false");
+        case ENCODE_NUMBER:
+            // NaN and infinities have no JSON representation
+            if (value[0] == 'N' || value[0] == 'I' || (value[0] == '-' && value[1] == 'I'))
+                return strbuf_append_str(out, "null");
+            return strbuf_append(out, value, (size_t)len);
+        case ENCODE_STRING:
+            return strbuf_append_json_string(out, value);
+        default:
+            return write_binary_value(out, column->encoder, value, len);
+    }
+}
+
+static bool write_row(StrBuf *out, PGresult *res, int row, const ColumnWriter *columns,
+                      int nFields, const char *indent) {
+    if (nFields == 0)
+        return strbuf_append_str(out, "{}");
+
+    if (!strbuf_append_char(out, '{'))
+        return false;
+
+    for (int j = 0; j < nFields; j++) {
+        if (j > 0 && !strbuf_append_char(out, ','))
+            return false;
+
+        if (indent && (!strbuf_append_char(out, '\n') || !strbuf_append_str(out, indent) ||
+                       !strbuf_append_str(out, "  ")))
+            return false;
+
+        if (!strbuf_append(out, columns[j].key, columns[j].keyLen))
+            return false;
+
+        bool ok;
+        if (PQgetisnull(res, row, j))
+            ok = strbuf_append_str(out, "null");
+        else
+            ok = write_value(out, &columns[j], PQgetvalue(res, row, j),
+                             PQgetlength(res, row, j));
+        if (!ok)
+            return false;
+    }
+
+    if (indent && (!strbuf_append_char(out, '\n') || !strbuf_append_str(out, indent)))
+        return false;
+
+    return strbuf_append_char(out, '}');
+}
+
+struct JsonArrayWriter {
+    ColumnWriter *columns;
+    int nFields;
+    bool pretty;
+    int nRows;
+};
+
+static bool array_append(JsonArrayWriter *writer, PGresult *res, int row, StrBuf *out) {
+    bool ok = strbuf_append_char(out, writer->nRows == 0 ? '[' : ',');
+    if (ok && writer->pretty)
+        ok = strbuf_append_str(out, "\n  ");
+    if (ok)
+        ok = write_row(out, res, row, writer->columns, writer->nFields,
+                       writer->pretty ? "  " : NULL);
+    if (ok)
+        writer->nRows++;
+    return ok;
+}
+
+static bool array_finish(const JsonArrayWriter *writer, StrBuf *out) {
+    if (writer->nRows == 0)
+        return strbuf_append_str(out, "[]");
+
+    if (writer->pretty && !strbuf_append_char(out, '\n'))
+        return false;
+
+    return strbuf_append_char(out, ']');
+}
+
+JsonArrayWriter *json_array_writer_create(PGresult *res, bool pretty) {
+    if (!res)
+        return NULL;
+
+    JsonArrayWriter *writer = calloc(1, sizeof(JsonArrayWriter));
+    if (!writer)
+        return NULL;
+
+    writer->nFields = PQnfields(res);
+    writer->pretty = pretty;
+    writer->columns = prepare_columns(res, writer->nFields, pretty);
+    if (!writer->columns) {
+        free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+bool json_array_writer_append(JsonArrayWriter *writer, PGresult *res, int row, StrBuf *out) {
+    if (!writer || !res || !out || row >= PQntuples(res))
+        return false;
+
+    return array_append(writer, res, row, out);
+}
+
+bool json_array_writer_finish(JsonArrayWriter *writer, StrBuf *out) {
+    if (!writer || !out)
+        return false;
+
+    return array_finish(writer, out);
+}
+
+void json_array_writer_free(JsonArrayWriter *writer) {
+    if (!writer)
+        return;
+
+    free_columns(writer->columns, writer->nFields);
+    free(writer);
+}
+
+static size_t initial_buffer_size(size_t nValues) {
+    size_t size = nValues * ESTIMATED_VALUE_SIZE;
+    return size < MAX_INITIAL_BUFFER_SIZE ? size : MAX_INITIAL_BUFFER_SIZE;
+}
+
+// rows lists the rows to write, in order, every row of res is written when NULL
+static bool write_json_rows(PGresult *res, const int *rows, int nRows, bool canBeObject,
+                            bool pretty, StrBuf *out) {
+    if (!res || !out || PQresultStatus(res) != PGRES_TUPLES_OK)
+        return false;
+
+    if (!rows)
+        nRows = PQntuples(res);
+    int nFields = PQnfields(res);
+
+    if (!out->data && !strbuf_init(out, initial_buffer_size((size_t)nRows * (nFields + 1))))
+        return false;
+
+    if (nRows == 0)
+        return strbuf_append_str(out, "[]");
+
+    JsonArrayWriter writer = {prepare_columns(res, nFields, pretty), nFields, pretty, 0};
+    if (!writer.columns)
+        return false;
+
+    bool ok = true;
+
+    if (nRows == 1 && canBeObject) {
+        ok = write_row(out, res, rows ? rows[0] : 0, writer.columns, nFields, pretty ? "" : NULL);
+    }
+    else {
+        for (int i = 0; ok && i < nRows; i++)
+            ok = array_append(&writer, res, rows ? rows[i] : i, out);
+        if (ok)
+            ok = array_finish(&writer, out);
+    }
+
+    free_columns(writer.columns, nFields);
+
+    return ok;
+}
+
+static bool write_json_columns(PGresult *res, const int *rows, int nRows, bool pretty,
+                               StrBuf *out) {
+    if (!res || !out || PQresultStatus(res) != PGRES_TUPLES_OK)
+        return false;
+
+    if (!rows)
+        nRows = PQntuples(res);
+    int nFields = PQnfields(res);
+
+    if (!out->data && !strbuf_init(out, initial_buffer_size((size_t)nRows * nFields) + 64))
+        return false;
+
+    if (nFields == 0)
+        return strbuf_append_str(out, "{}");
+
+    ColumnWriter *columns = prepare_columns(res, nFields, pretty);
+    if (!columns)
+        return false;
+
+    bool ok = strbuf_append_char(out, '{');
+
+    for (int j = 0; ok && j < nFields; j++) {
+        if (j > 0)
+            ok = strbuf_append_char(out, ',');
+        if (ok && pretty)
+            ok = strbuf_append_str(out, "\n  ");
+        if (ok)
+            ok = strbuf_append(out, columns[j].key, columns[j].keyLen);
+
+        if (ok && nRows == 0) {
+            ok = strbuf_append_str(out, "[]");
+            continue;
+        }
+
+        if (ok)
+            ok = strbuf_append_char(out, '[');
+
+        for (int i = 0; ok && i < nRows; i++) {
+            if (i > 0)
+                ok = strbuf_append_char(out, ',');
+            if (ok && pretty)
+                ok = strbuf_append_str(out, "\n    ");
+            if (!ok)
+                break;
+
+            int row = rows ? rows[i] : i;
+            if (PQgetisnull(res, row, j))
+                ok = strbuf_append_str(out, "null");
+            else
+                ok = write_value(out, &columns[j], PQgetvalue(res, row, j),
+                                 PQgetlength(res, row, j));
+        }
+
+        if (ok && pretty)
+            ok = strbuf_append_str(out, "\n  ");
+        if (ok)
+            ok = strbuf_append_char(out, ']');
+    }
+
+    if (ok && pretty)
+        ok = strbuf_append_char(out, '\n');
+    if (ok)
+        ok = strbuf_append_char(out, '}');
+
+    free_columns(columns, nFields);
+
+    return ok;
+}
+
+bool pgresult_write_json(PGresult *res, bool canBeObject, bool pretty, StrBuf *out) {
+    uint64_t start = metrics_now_us();
+    bool ok = write_json_rows(res, NULL, 0, canBeObject, pretty, out);
+    metrics_add(METRICS_PHASE_SERIALIZE, metrics_now_us() - start);
+    return ok;
+}
+
+bool pgresult_write_json_columns(PGresult *res, bool pretty, StrBuf *out) {
+    uint64_t start = metrics_now_us();
+    bool ok = write_json_columns(res, NULL, 0, pretty, out);
+    metrics_add(METRICS_PHASE_SERIALIZE, metrics_now_us() - start);
+    return ok;
+}
+
+bool pgresult_write_json_subset(PGresult *res, const int *rows, int nRows, bool pretty,
+                                StrBuf *out) {
+    uint64_t start = metrics_now_us();
+    bool ok = rows && write_json_rows(res, rows, nRows, false, pretty, out);
+    metrics_add(METRICS_PHASE_SERIALIZE, metrics_now_us() - start);
+    return ok;
+}
+
+bool pgresult_write_json_columns_subset(PGresult *res, const int *rows, int nRows, bool pretty,
+                                        StrBuf *out) {
+    uint64_t start = metrics_now_us();
+    bool ok = rows && write_json_columns(res, rows, nRows, pretty, out);
+    metrics_add(METRICS_PHASE_SERIALIZE, metrics_now_us() - start);
+    return ok;
+}
+
+// Same layout as write_numeric reads, only as precise as a double
+static double numeric_to_double(const char *value, int len) {
+    if (len < 8)
+        return NAN;
+
+    int ndigits = (int16_t)read_uint16(value);
+    int weight = (int16_t)read_uint16(value + 2);
+    uint16_t sign = read_uint16(value + 4);
+
+    if (ndigits < 0 || len < 8 + ndigits * 2 || sign == NUMERIC_NAN || sign == NUMERIC_PINF ||
+        sign == NUMERIC_NINF)
+        return NAN;
+
+    double result = 0;
+    for (int i = 0; i < ndigits; i++)
+        result = result * 10000 + read_uint16(value + 8 + i * 2);
+    result *= pow(10000, weight - ndigits + 1);
+
+    return sign == NUMERIC_NEG ? -result : result;
+}
+
+static double value_to_double(columnEncoder_t encoder, const char *value, int len) {
+    switch (encoder) {
+        case ENCODE_NUMBER:
+            return strtod(value, NULL);
+        case ENCODE_BINARY_INT2:
+            return len < 2 ? NAN : (int16_t)read_uint16(value);
+        case ENCODE_BINARY_INT4:
+            return len < 4 ? NAN : (int32_t)read_uint32(value);
+        case ENCODE_BINARY_INT8:
+            return len < 8 ? NAN : (double)(int64_t)read_uint64(value);
+        case ENCODE_BINARY_FLOAT4: {
+            if (len < 4)
+                return NAN;
+            uint32_t bits = read_uint32(value);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            return f;
+        }
+        case ENCODE_BINARY_FLOAT8: {
+            if (len < 8)
+                return NAN;
+            uint64_t bits = read_uint64(value);
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            return d;
+        }
+        case ENCODE_BINARY_NUMERIC:
+            return numeric_to_double(value, len);
+        default:
+            return NAN;
+    }
+}
+
+bool pgresult_column_values(PGresult *res, int column, double *values) {
+    if (!res || column < 0 || column >= PQnfields(res))
+        return false;
+
+    columnEncoder_t encoder = encoder_for_type(PQftype(res, column), PQfformat(res, column));
+    if (encoder == ENCODE_BOOL || encoder == ENCODE_STRING || encoder == ENCODE_BINARY_BOOL ||
+        encoder == ENCODE_BINARY_TEXT)
+        return false;
+
+    int nRows = PQntuples(res);
+    for (int i = 0; i < nRows; i++) {
+        double value = PQgetisnull(res, i, column)
+                           ? NAN
+                           : value_to_double(encoder, PQgetvalue(res, i, column),
+                                             PQgetlength(res, i, column));
+        values[i] = isfinite(value) ? value : NAN;
+    }
+
+    return true;
+}
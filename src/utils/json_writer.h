@@ -0,0 +1,68 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <libpq-fe.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Growable NUL terminated output buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+bool strbuf_init(StrBuf *buf, size_t cap);
+
+bool strbuf_append(StrBuf *buf, const char *str, size_t len);
+
+bool strbuf_append_str(StrBuf *buf, const char *str);
+
+bool strbuf_append_char(StrBuf *buf, char c);
+
+bool strbuf_append_json_string(StrBuf *buf, const char *str);
+
+// Hands the buffer over to the caller, who has to free() it
+char *strbuf_release(StrBuf *buf);
+
+void strbuf_free(StrBuf *buf);
+
+// Shortest digits that read back as the same double, laid out as %.*g would with 15 digits or more
+int format_double(char *buf, size_t size, double value);
+
+// The shape json_dumps(pgresult_to_json(res, canBeObject), JSON_INDENT(2)) prints when pretty,
+// compact otherwise, without building the jansson tree. Floats are not spelled the same, they
+// take their shortest round trip form instead of %.17g and NaN or infinities are null. Numeric
+// columns stay JSON strings, as in pgresult_to_json. Results in binary format are decoded
+// directly for bool, integer, float and numeric columns, any other type is taken as text
+bool pgresult_write_json(PGresult *res, bool canBeObject, bool pretty, StrBuf *out);
+
+// One object member per column holding the array of its values, in row order
+bool pgresult_write_json_columns(PGresult *res, bool pretty, StrBuf *out);
+
+// Same as pgresult_write_json and pgresult_write_json_columns, only with the rows listed, in that
+// order. The rows format is always an array
+bool pgresult_write_json_subset(PGresult *res, const int *rows, int nRows, bool pretty,
+                                StrBuf *out);
+
+bool pgresult_write_json_columns_subset(PGresult *res, const int *rows, int nRows, bool pretty,
+                                        StrBuf *out);
+
+// Decodes a numeric column into values, one per row, NaN for NULL and non-finite values. False
+// when the column is not numeric
+bool pgresult_column_values(PGresult *res, int column, double *values);
+
+// Writes a JSON array one row at a time, for results fetched in single row mode. All the rows
+// appended have to share the description of the result the writer was created from
+typedef struct JsonArrayWriter JsonArrayWriter;
+
+JsonArrayWriter *json_array_writer_create(PGresult *res, bool pretty);
+
+bool json_array_writer_append(JsonArrayWriter *writer, PGresult *res, int row, StrBuf *out);
+
+// Closes the array, writing [] when nothing was appended
+bool json_array_writer_finish(JsonArrayWriter *writer, StrBuf *out);
+
+void json_array_writer_free(JsonArrayWriter *writer);
+
+#endif
@@ -0,0 +1,294 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define METRICS_BUCKETS 17 // The last one is +Inf
+#define METRICS_STATUS_CLASSES 5
+#define METRICS_LINE_SIZE 256
+
+static const uint64_t bucketBoundsUs[METRICS_BUCKETS - 1] = {
+    100,    250,    500,     1000,    2500,    5000,    10000,   25000,
+    50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+
+static const char *bucketLabels[METRICS_BUCKETS] = {
+    "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05",
+    "0.1",    "0.25",    "0.5",    "1",     "2.5",    "5",     "10",   "+Inf"};
+
+static const char *routeLabels[METRICS_ROUTE_COUNT] = {
+    "unmatched",           "/users",    "/users/{id}/sessions", "/users/{id}/api-keys",
+    "/stations",           "/stations/{id}/data", "/stations/{id}/live", "/data",
+    "/metrics"};
+
+static const char *phaseLabels[METRICS_PHASE_COUNT] = {"routing", "db_wait",   "query",
+                                                       "serialize", "send", "total"};
+
+typedef struct {
+    uint64_t buckets[METRICS_ROUTE_COUNT][METRICS_PHASE_COUNT][METRICS_BUCKETS];
+    uint64_t sumUs[METRICS_ROUTE_COUNT][METRICS_PHASE_COUNT];
+    uint64_t requests[METRICS_ROUTE_COUNT][METRICS_STATUS_CLASSES];
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+} MetricsCounters;
+
+// Only written by the thread owning it, the scrape reads every shard without locking
+typedef struct MetricsShard {
+    MetricsCounters counters;
+    struct MetricsShard *next;
+} MetricsShard;
+
+// Shards are pushed once per thread and never removed
+static MetricsShard *shards = NULL;
+
+static __thread MetricsShard *localShard = NULL;
+
+static __thread struct {
+    bool active;
+    bool resumed; // Routing was observed before the request was suspended
+    metricsRoute_t route;
+    uint64_t beginUs;
+    uint64_t routedUs;
+    uint64_t phaseUs[METRICS_PHASE_COUNT];
+    unsigned int phaseMask; // Phases added during the request, the others are not observed
+} current;
+
+uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static MetricsShard *get_shard(void) {
+    if (localShard)
+        return localShard;
+
+    MetricsShard *shard = calloc(1, sizeof(MetricsShard));
+    if (!shard)
+        return NULL;
+
+    shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+        ;
+
+    localShard = shard;
+    return shard;
+}
+
+// Single writer, a plain store keeps the value whole for the readers without a locked add
+static void counter_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                     __ATOMIC_RELAXED);
+}
+
+static void observe(metricsRoute_t route, metricsPhase_t phase, uint64_t us) {
+    MetricsShard *shard = get_shard();
+    if (!shard)
+        return;
+
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && us > bucketBoundsUs[bucket])
+        bucket++;
+
+    counter_add(&shard->counters.buckets[route][phase][bucket], 1);
+    counter_add(&shard->counters.sumUs[route][phase], us);
+}
+
+void metrics_request_begin(void) {
+    memset(&current, 0, sizeof(current));
+    current.active = true;
+    current.route = METRICS_ROUTE_NONE;
+    current.beginUs = metrics_now_us();
+}
+
+void metrics_request_route(metricsRoute_t route) {
+    if (!current.active || route >= METRICS_ROUTE_COUNT)
+        return;
+
+    current.route = route;
+    current.routedUs = metrics_now_us();
+}
+
+void metrics_request_resume(metricsRoute_t route) {
+    metrics_request_begin();
+    current.resumed = true;
+    metrics_request_route(route);
+}
+
+void metrics_add(metricsPhase_t phase, uint64_t us) {
+    if (!current.active || phase >= METRICS_PHASE_COUNT)
+        return;
+
+    current.phaseUs[phase] += us;
+    current.phaseMask |= 1u << phase;
+}
+
+metricsRoute_t metrics_request_end(void) {
+    if (!current.active)
+        return METRICS_ROUTE_NONE;
+
+    // Requests no route matched spent all their time routing
+    if (!current.resumed) {
+        uint64_t routedUs = current.routedUs ? current.routedUs : metrics_now_us();
+        observe(current.route, METRICS_PHASE_ROUTING, routedUs - current.beginUs);
+    }
+
+    for (int phase = METRICS_PHASE_DB_WAIT; phase < METRICS_PHASE_SEND; phase++) {
+        if (current.phaseMask & (1u << phase))
+            observe(current.route, (metricsPhase_t)phase, current.phaseUs[phase]);
+    }
+
+    current.active = false;
+    return current.route;
+}
+
+void metrics_request_completed(metricsRoute_t route, int httpStatus, uint64_t startUs,
+                               uint64_t queuedUs) {
+    if (route >= METRICS_ROUTE_COUNT)
+        return;
+
+    uint64_t now = metrics_now_us();
+    observe(route, METRICS_PHASE_SEND, now - queuedUs);
+    observe(route, METRICS_PHASE_TOTAL, now - startUs);
+
+    int statusClass = httpStatus / 100 - 1;
+    if (statusClass < 0 || statusClass >= METRICS_STATUS_CLASSES)
+        statusClass = METRICS_STATUS_CLASSES - 1;
+
+    MetricsShard *shard = get_shard();
+    if (shard)
+        counter_add(&shard->counters.requests[route][statusClass], 1);
+}
+
+void metrics_add_bytes_in(size_t bytes) {
+    MetricsShard *shard = get_shard();
+    if (shard)
+        counter_add(&shard->counters.bytesIn, bytes);
+}
+
+void metrics_add_bytes_out(size_t bytes) {
+    MetricsShard *shard = get_shard();
+    if (shard)
+        counter_add(&shard->counters.bytesOut, bytes);
+}
+
+static void sum_shards(MetricsCounters *totals) {
+    // MetricsCounters is nothing but uint64_t counters
+    uint64_t *sums = (uint64_t *)totals;
+    size_t nFields = sizeof(MetricsCounters) / sizeof(uint64_t);
+
+    for (MetricsShard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard;
+         shard = shard->next) {
+        const uint64_t *fields = (const uint64_t *)&shard->counters;
+        for (size_t i = 0; i < nFields; i++)
+            sums[i] += __atomic_load_n(&fields[i], __ATOMIC_RELAXED);
+    }
+}
+
+static bool append_line(StrBuf *out, const char *fmt, ...) {
+    char line[METRICS_LINE_SIZE];
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= sizeof(line))
+        return false;
+
+    return strbuf_append(out, line, (size_t)len);
+}
+
+static bool write_histograms(const MetricsCounters *totals, StrBuf *out) {
+    if (!strbuf_append_str(out, "# HELP picoweather_request_phase_seconds Time spent by the "
+                                "requests of each route in each phase.\n"
+                                "# TYPE picoweather_request_phase_seconds histogram\n"))
+        return false;
+
+    for (int route = 0; route < METRICS_ROUTE_COUNT; route++) {
+        for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+            const uint64_t *buckets = totals->buckets[route][phase];
+
+            uint64_t count = 0;
+            for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++)
+                count += buckets[bucket];
+
+            // Series for combinations that never happened are left out
+            if (count == 0)
+                continue;
+
+            uint64_t cumulative = 0;
+            for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+                cumulative += buckets[bucket];
+                if (!append_line(out,
+                                 "picoweather_request_phase_seconds_bucket{route=\"%s\","
+                                 "phase=\"%s\",le=\"%s\"} %llu\n",
+                                 routeLabels[route], phaseLabels[phase], bucketLabels[bucket],
+                                 (unsigned long long)cumulative))
+                    return false;
+            }
+
+            if (!append_line(out,
+                             "picoweather_request_phase_seconds_sum{route=\"%s\",phase=\"%s\"} "
+                             "%.6f\n",
+                             routeLabels[route], phaseLabels[phase],
+                             (double)totals->sumUs[route][phase] / 1e6) ||
+                !append_line(out,
+                             "picoweather_request_phase_seconds_count{route=\"%s\",phase=\"%s\"} "
+                             "%llu\n",
+                             routeLabels[route], phaseLabels[phase], (unsigned long long)count))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool metrics_write(StrBuf *out) {
+    MetricsCounters *totals = calloc(1, sizeof(MetricsCounters));
+    if (!totals)
+        return false;
+
+    sum_shards(totals);
+
+    bool ok = strbuf_append_str(out, "# HELP picoweather_requests_total Completed requests.\n"
+                                     "# TYPE picoweather_requests_total counter\n");
+
+    for (int route = 0; route < METRICS_ROUTE_COUNT && ok; route++) {
+        for (int statusClass = 0; statusClass < METRICS_STATUS_CLASSES && ok; statusClass++) {
+            uint64_t requests = totals->requests[route][statusClass];
+            if (requests > 0)
+                ok = append_line(out,
+                                 "picoweather_requests_total{route=\"%s\",code=\"%dxx\"} %llu\n",
+                                 routeLabels[route], statusClass + 1,
+                                 (unsigned long long)requests);
+        }
+    }
+
+    ok = ok && write_histograms(totals, out) &&
+         metrics_write_value(out, "picoweather_received_bytes_total", "counter",
+                             "Request bodies received.", (double)totals->bytesIn) &&
+         metrics_write_value(out, "picoweather_sent_bytes_total", "counter",
+                             "Response bodies sent, after compression.",
+                             (double)totals->bytesOut);
+
+    free(totals);
+    return ok;
+}
+
+bool metrics_write_value(StrBuf *out, const char *name, const char *type, const char *help,
+                         double value) {
+    return metrics_write_help(out, name, type, help) &&
+           append_line(out, "%s %.17g\n", name, value);
+}
+
+bool metrics_write_help(StrBuf *out, const char *name, const char *type, const char *help) {
+    return append_line(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+bool metrics_write_sample(StrBuf *out, const char *name, const char *labels, double value) {
+    return append_line(out, "%s{%s} %.17g\n", name, labels, value);
+}
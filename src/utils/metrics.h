@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "json_writer.h"
+
+typedef enum {
+    METRICS_ROUTE_NONE = 0, // No route matched
+    METRICS_ROUTE_USERS,
+    METRICS_ROUTE_SESSIONS,
+    METRICS_ROUTE_API_KEYS,
+    METRICS_ROUTE_STATIONS,
+    METRICS_ROUTE_STATION_DATA,
+    METRICS_ROUTE_STATION_LIVE,
+    METRICS_ROUTE_DATA,
+    METRICS_ROUTE_METRICS,
+    METRICS_ROUTE_COUNT
+} metricsRoute_t;
+
+typedef enum {
+    METRICS_PHASE_ROUTING = 0, // Parameters and route matching, up to the handler
+    METRICS_PHASE_DB_WAIT,     // Checking out pool connections
+    METRICS_PHASE_QUERY,       // Waiting on Postgres for the data queries
+    METRICS_PHASE_SERIALIZE,   // Writing JSON bodies
+    METRICS_PHASE_SEND,        // From queueing the response until MHD completes the request
+    METRICS_PHASE_TOTAL,       // From the first byte of the request until it completes
+    METRICS_PHASE_COUNT
+} metricsPhase_t;
+
+uint64_t metrics_now_us(void);
+
+// Phases added between begin and end on the same thread are charged to the request, anything
+// outside a request, like the ingestion flushes, is not recorded per route
+void metrics_request_begin(void);
+
+// Called by the router right before the handler runs
+void metrics_request_route(metricsRoute_t route);
+
+// Starts the second part of a request that was suspended after metrics_request_end, its routing
+// having been recorded by the first one
+void metrics_request_resume(metricsRoute_t route);
+
+void metrics_add(metricsPhase_t phase, uint64_t us);
+
+// Records the phases of the handler and returns the route it was charged to
+metricsRoute_t metrics_request_end(void);
+
+// startUs is when the request arrived and queuedUs when its response was queued
+void metrics_request_completed(metricsRoute_t route, int httpStatus, uint64_t startUs,
+                               uint64_t queuedUs);
+
+void metrics_add_bytes_in(size_t bytes);
+
+void metrics_add_bytes_out(size_t bytes);
+
+// Appends the request counters and histograms of every thread in the Prometheus text format
+bool metrics_write(StrBuf *out);
+
+// Appends a single unlabeled sample with its HELP and TYPE lines
+bool metrics_write_value(StrBuf *out, const char *name, const char *type, const char *help,
+                         double value);
+
+// For labeled series, the HELP and TYPE lines once and then a sample per label set, labels
+// being the contents of the braces like lane="data"
+bool metrics_write_help(StrBuf *out, const char *name, const char *type, const char *help);
+
+bool metrics_write_sample(StrBuf *out, const char *name, const char *labels, double value);
+
+#endif
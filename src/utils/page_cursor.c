@@ -0,0 +1,62 @@
+#include <sodium/utils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "downsample.h"
+#include "page_cursor.h"
+#include "utils.h"
+
+// The tag, the timestamp and |id
+#define PAGE_KEY_SIZE (1 + PAGE_TIME_SIZE + PAGE_ID_SIZE)
+#define PAGE_TOKEN_SIZE sodium_base64_ENCODED_LEN(PAGE_KEY_SIZE, BASE64_VARIANT)
+
+char *page_cursor_encode(char tag, const char *time, const char *id) {
+    if (!time || strlen(time) >= PAGE_TIME_SIZE || (id && strlen(id) >= PAGE_ID_SIZE))
+        return NULL;
+
+    char key[PAGE_KEY_SIZE];
+    int len = snprintf(key, sizeof(key), "%c%s%s%s", tag, time, id ? "|" : "", id ? id : "");
+    if (len < 0 || (size_t)len >= sizeof(key))
+        return NULL;
+
+    char *token = malloc(PAGE_TOKEN_SIZE);
+    if (!token)
+        return NULL;
+
+    sodium_bin2base64(token, PAGE_TOKEN_SIZE, (const unsigned char *)key, (size_t)len,
+                      BASE64_VARIANT);
+    return token;
+}
+
+bool page_cursor_decode(const char *token, char tag, char *time, char *id) {
+    if (!token || strlen(token) >= PAGE_TOKEN_SIZE)
+        return false;
+
+    char key[PAGE_KEY_SIZE];
+    size_t len;
+    if (sodium_base642bin((unsigned char *)key, sizeof(key) - 1, token, strlen(token), NULL, &len,
+                          NULL, BASE64_VARIANT) != 0 ||
+        len == 0 || key[0] != tag)
+        return false;
+    key[len] = '\0';
+
+    char *separator = strchr(key + 1, '|');
+    if ((separator != NULL) != (id != NULL))
+        return false;
+
+    if (separator) {
+        *separator = '\0';
+        if (!validate_uuid(separator + 1))
+            return false;
+        memcpy(id, separator + 1, PAGE_ID_SIZE);
+    }
+
+    // Handed to Postgres as a timestamptz, it has to parse as one
+    double seconds;
+    if (strlen(key + 1) >= PAGE_TIME_SIZE || !parse_timestamptz(key + 1, &seconds))
+        return false;
+
+    memcpy(time, key + 1, strlen(key + 1) + 1);
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef PAGE_CURSOR_H
+#define PAGE_CURSOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PAGE_DEFAULT_LIMIT 1000
+#define PAGE_MAX_LIMIT 10000
+
+// Longest timestamptz Postgres prints, with microseconds and a seconds offset
+#define PAGE_TIME_SIZE 48
+#define PAGE_ID_SIZE 37
+
+// Tags of the lists a cursor belongs to, so the token of one is rejected by the others
+#define PAGE_CURSOR_WEATHER 'w'
+#define PAGE_CURSOR_SESSIONS 's'
+#define PAGE_CURSOR_API_KEYS 'k'
+
+// ?limit= and ?cursor= of a list answered one page at a time
+typedef struct {
+    int limit;          // Rows of a page, 0 for every row at once
+    const char *cursor; // X-Next-Cursor of the previous page, NULL for the first one
+} PageRequest;
+
+// Opaque token holding the keyset of the last row of a page, its timestamp and for the lists
+// that can share one its UUID. id is NULL for the weather data. The caller frees it
+char *page_cursor_encode(char tag, const char *time, const char *id);
+
+// Reverses page_cursor_encode, checking the tag and the shape of the keys before they reach a
+// query. time holds PAGE_TIME_SIZE bytes, id PAGE_ID_SIZE unless NULL
+bool page_cursor_decode(const char *token, char tag, char *time, char *id);
+
+#endif
@@ -0,0 +1,185 @@
+#include <pthread.h>
+#include <sodium/crypto_pwhash.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pwhash_pool.h"
+#include "utils.h"
+
+#define DEFAULT_PWHASH_THREADS 2
+#define DEFAULT_PWHASH_QUEUE 32
+
+typedef enum { PWHASH_JOB_CREATE, PWHASH_JOB_VERIFY } pwhashJob_t;
+
+// Lives on the stack of the waiting caller
+typedef struct {
+    pwhashJob_t type;
+    const char *password;
+    const char *hash; // Verify input
+    char *out;        // Create output
+    pwhashResult_t result;
+    bool done;
+    pthread_cond_t cond;
+} PwhashJob;
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER;
+
+static PwhashJob **queue = NULL; // Ring of jobs waiting for a worker
+static int queueSize = 0;
+static int queueHead = 0;
+static int queueCount = 0;
+
+static pthread_t *workers = NULL;
+static int nWorkers = 0;
+static bool poolStop = false;
+
+static void run_job(PwhashJob *job) {
+    size_t passwordLen = strlen(job->password);
+
+    if (job->type == PWHASH_JOB_CREATE) {
+        if (crypto_pwhash_str(job->out, job->password, passwordLen,
+                              crypto_pwhash_OPSLIMIT_MODERATE,
+                              crypto_pwhash_MEMLIMIT_MODERATE) != 0)
+            job->result = PWHASH_ERROR; // Out of memory
+        else
+            job->result = PWHASH_OK;
+    }
+    else {
+        if (crypto_pwhash_str_verify(job->hash, job->password, passwordLen) != 0)
+            job->result = PWHASH_MISMATCH;
+        else
+            job->result = PWHASH_OK;
+    }
+}
+
+static void *worker_loop(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&poolMutex);
+    while (true) {
+        while (queueCount == 0 && !poolStop)
+            pthread_cond_wait(&poolCond, &poolMutex);
+
+        if (queueCount == 0)
+            break; // Stopping and nothing left
+
+        PwhashJob *job = queue[queueHead];
+        queueHead = (queueHead + 1) % queueSize;
+        queueCount--;
+
+        pthread_mutex_unlock(&poolMutex);
+        run_job(job);
+        pthread_mutex_lock(&poolMutex);
+
+        job->done = true;
+        pthread_cond_signal(&job->cond);
+    }
+    pthread_mutex_unlock(&poolMutex);
+
+    return NULL;
+}
+
+static pwhashResult_t submit(PwhashJob *job) {
+    job->done = false;
+    job->result = PWHASH_ERROR;
+    pthread_cond_init(&job->cond, NULL);
+
+    pthread_mutex_lock(&poolMutex);
+
+    if (!queue || poolStop) {
+        pthread_mutex_unlock(&poolMutex);
+        pthread_cond_destroy(&job->cond);
+        return PWHASH_ERROR;
+    }
+
+    // Backpressure instead of piling up callers, each of them holds an HTTP worker
+    if (queueCount == queueSize) {
+        pthread_mutex_unlock(&poolMutex);
+        pthread_cond_destroy(&job->cond);
+        return PWHASH_BUSY;
+    }
+
+    queue[(queueHead + queueCount) % queueSize] = job;
+    queueCount++;
+    pthread_cond_signal(&poolCond);
+
+    while (!job->done)
+        pthread_cond_wait(&job->cond, &poolMutex);
+
+    pthread_mutex_unlock(&poolMutex);
+    pthread_cond_destroy(&job->cond);
+
+    return job->result;
+}
+
+bool init_pwhash_pool(void) {
+    nWorkers = env_int("PWHASH_THREADS", DEFAULT_PWHASH_THREADS, 1);
+    queueSize = env_int("PWHASH_QUEUE", DEFAULT_PWHASH_QUEUE, 1);
+
+    queue = calloc((size_t)queueSize, sizeof(*queue));
+    workers = calloc((size_t)nWorkers, sizeof(*workers));
+    if (!queue || !workers) {
+        free(queue);
+        free(workers);
+        queue = NULL;
+        workers = NULL;
+        return false;
+    }
+
+    poolStop = false;
+    for (int i = 0; i < nWorkers; i++) {
+        if (pthread_create(&workers[i], NULL, worker_loop, NULL) != 0) {
+            fprintf(stderr, "Failed to start the password hashing threads\n");
+            nWorkers = i;
+            free_pwhash_pool();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void free_pwhash_pool(void) {
+    pthread_mutex_lock(&poolMutex);
+    poolStop = true;
+    pthread_cond_broadcast(&poolCond);
+    pthread_mutex_unlock(&poolMutex);
+
+    // Workers drain the queue before exiting, so no caller is left waiting
+    for (int i = 0; i < nWorkers; i++)
+        pthread_join(workers[i], NULL);
+
+    free(queue);
+    free(workers);
+    queue = NULL;
+    workers = NULL;
+    nWorkers = 0;
+    queueCount = 0;
+    queueHead = 0;
+}
+
+pwhashResult_t pwhash_create(const char *password, char *hash) {
+    if (!password || !hash)
+        return PWHASH_ERROR;
+
+    PwhashJob job = {.type = PWHASH_JOB_CREATE, .password = password, .out = hash};
+    return submit(&job);
+}
+
+pwhashResult_t pwhash_verify(const char *hash, const char *password) {
+    if (!hash || !password)
+        return PWHASH_MISMATCH;
+
+    PwhashJob job = {.type = PWHASH_JOB_VERIFY, .password = password, .hash = hash};
+    return submit(&job);
+}
+
+int pwhash_queue_depth(void) {
+    pthread_mutex_lock(&poolMutex);
+    int depth = queueCount;
+    pthread_mutex_unlock(&poolMutex);
+    return depth;
+}
@@ -0,0 +1,27 @@
+#ifndef PWHASH_POOL_H
+#define PWHASH_POOL_H
+
+#include <sodium/crypto_pwhash.h>
+#include <stdbool.h>
+
+typedef enum {
+    PWHASH_OK = 0,
+    PWHASH_MISMATCH, // Only from pwhash_verify
+    PWHASH_BUSY,     // The queue is full, nothing was computed
+    PWHASH_ERROR
+} pwhashResult_t;
+
+// Every hash takes crypto_pwhash_MEMLIMIT_MODERATE, so PWHASH_THREADS bounds the memory used
+bool init_pwhash_pool(void);
+
+void free_pwhash_pool(void);
+
+// Both block the caller until a worker is done, hash holds crypto_pwhash_STRBYTES
+pwhashResult_t pwhash_create(const char *password, char *hash);
+
+pwhashResult_t pwhash_verify(const char *hash, const char *password);
+
+// Jobs waiting for a worker, not counting the ones being hashed
+int pwhash_queue_depth(void);
+
+#endif
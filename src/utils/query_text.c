@@ -0,0 +1,144 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../core/flags.h"
+#include "query_text.h"
+#include "utils.h"
+
+// Bounded, a client walking through every mask only ends up building its queries per call
+#define QUERY_TEXT_SLOTS 1024
+#define QUERY_TEXT_MAX_PROBES 32
+
+#define DATA_FIELDS_MASK ((1 << 11) - 1)
+#define SUMMARY_FIELDS_MASK ((1 << 24) - 1)
+
+// Columns of weather_hourly_summary
+#define HOURLY_FIELDS_MASK                                                                         \
+    (SUMMARY_AVG_TEMPERATURE | SUMMARY_AVG_HUMIDITY | SUMMARY_AVG_PRESSURE |                       \
+     SUMMARY_SUM_RAINFALL | SUMMARY_STDDEV_RAINFALL | SUMMARY_AVG_WIND_SPEED |                     \
+     SUMMARY_AVG_WIND_DIRECTION | SUMMARY_STDDEV_WIND_SPEED | SUMMARY_MAX_GUST_SPEED |             \
+     SUMMARY_MAX_GUST_DIRECTION | SUMMARY_AVG_LUX | SUMMARY_AVG_UVI |                              \
+     SUMMARY_AVG_SOLAR_IRRADIANCE)
+
+// Columns of weather_monthly_summary and weather_yearly_summary
+#define MONTHLY_FIELDS_MASK                                                                        \
+    (HOURLY_FIELDS_MASK | SUMMARY_MAX_TEMPERATURE | SUMMARY_MIN_TEMPERATURE |                      \
+     SUMMARY_STDDEV_TEMPERATURE | SUMMARY_MAX_HUMIDITY | SUMMARY_MIN_HUMIDITY |                    \
+     SUMMARY_STDDEV_HUMIDITY | SUMMARY_MAX_PRESSURE | SUMMARY_MIN_PRESSURE | SUMMARY_MAX_LUX |     \
+     SUMMARY_MAX_UVI)
+
+// Columns of weather_daily_summary
+#define DAILY_FIELDS_MASK (MONTHLY_FIELDS_MASK | SUMMARY_WIND_RUN)
+
+typedef struct {
+    uint32_t key;
+    char text[];
+} QueryText;
+
+// Slots only go from NULL to an entry, which is never modified or freed afterwards
+static QueryText *slots[QUERY_TEXT_SLOTS];
+
+int normalize_weather_fields(weatherQuery_t kind, granularity_t granularity, int fields) {
+    if (kind != WEATHER_QUERY_STATIC)
+        return fields & SUMMARY_FIELDS_MASK;
+
+    switch (granularity) {
+        case GRANULARITY_DATA:
+            return fields & DATA_FIELDS_MASK;
+        case GRANULARITY_HOUR:
+            return fields & HOURLY_FIELDS_MASK;
+        case GRANULARITY_DAY:
+            return fields & DAILY_FIELDS_MASK;
+        case GRANULARITY_MONTH:
+        case GRANULARITY_YEAR:
+            return fields & MONTHLY_FIELDS_MASK;
+        default:
+            return fields;
+    }
+}
+
+static uint32_t query_key(weatherQuery_t kind, granularity_t granularity, int fields,
+                          bool paged) {
+    return (uint32_t)fields | ((uint32_t)granularity << 24) | ((uint32_t)kind << 28) |
+           ((uint32_t)paged << 31);
+}
+
+// Finalizer of murmur3, spreads the mask bits over the slot index
+static uint32_t hash_key(uint32_t key) {
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+    return key;
+}
+
+char *build_weather_query(weatherQuery_t kind, granularity_t granularity, int fields,
+                          bool paged) {
+    switch (kind) {
+        case WEATHER_QUERY_GENERIC:
+            return build_generic_weather_query(fields, paged);
+        case WEATHER_QUERY_PARTIALS:
+            return build_partials_weather_query(fields, paged);
+        default:
+            return build_static_query(fields, granularity, paged);
+    }
+}
+
+static QueryText *build_entry(uint32_t key, weatherQuery_t kind, granularity_t granularity,
+                              int fields, bool paged) {
+    char *text = build_weather_query(kind, granularity, fields, paged);
+    if (!text)
+        return NULL;
+
+    size_t len = strlen(text);
+    QueryText *entry = malloc(sizeof(QueryText) + len + 1);
+    if (entry) {
+        entry->key = key;
+        memcpy(entry->text, text, len + 1);
+    }
+
+    free(text);
+    return entry;
+}
+
+const char *lookup_weather_query(weatherQuery_t kind, granularity_t granularity, int fields,
+                                 bool paged) {
+    if (fields < 0 || fields > SUMMARY_FIELDS_MASK)
+        return NULL;
+
+    uint32_t key = query_key(kind, granularity, fields, paged);
+    uint32_t slot = hash_key(key) % QUERY_TEXT_SLOTS;
+    QueryText *entry = NULL;
+
+    for (int probe = 0; probe < QUERY_TEXT_MAX_PROBES; probe++) {
+        QueryText *current = __atomic_load_n(&slots[slot], __ATOMIC_ACQUIRE);
+
+        if (!current) {
+            // Built outside any lock, two threads racing for the slot just waste one build
+            if (!entry) {
+                entry = build_entry(key, kind, granularity, fields, paged);
+                if (!entry)
+                    return NULL;
+            }
+
+            if (__atomic_compare_exchange_n(&slots[slot], &current, entry, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return entry->text;
+
+            // Lost the slot, current now holds the winner
+        }
+
+        if (current->key == key) {
+            free(entry);
+            return current->text;
+        }
+
+        slot = (slot + 1) % QUERY_TEXT_SLOTS;
+    }
+
+    free(entry);
+    return NULL;
+}
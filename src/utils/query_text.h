@@ -0,0 +1,27 @@
+#ifndef QUERY_TEXT_H
+#define QUERY_TEXT_H
+
+#include "../core/flags.h"
+#include <stdbool.h>
+
+typedef enum {
+    WEATHER_QUERY_STATIC = 0, // Stored summaries, build_static_query
+    WEATHER_QUERY_GENERIC,    // Raw data, build_generic_weather_query
+    WEATHER_QUERY_PARTIALS    // Hourly partials, build_partials_weather_query
+} weatherQuery_t;
+
+// Drops the bits the query for granularity has no column for, so equivalent masks share one
+// query text and one prepared statement
+int normalize_weather_fields(weatherQuery_t kind, granularity_t granularity, int fields);
+
+// Query text for normalized fields, built once and kept for the life of the process. Lookups
+// take no lock. NULL when the table is full or out of memory, the caller builds its own then.
+// paged texts take the keyset and the limit of a page after the usual params
+const char *lookup_weather_query(weatherQuery_t kind, granularity_t granularity, int fields,
+                                 bool paged);
+
+// Builds a query text the caller owns and has to free
+char *build_weather_query(weatherQuery_t kind, granularity_t granularity, int fields,
+                          bool paged);
+
+#endif
@@ -0,0 +1,270 @@
+#include "response_cache.h"
+#include "utils.h"
+#include <pthread.h>
+#include <sodium/crypto_generichash.h>
+#include <sodium/crypto_shorthash.h>
+#include <sodium/randombytes.h>
+#include <sodium/utils.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RESPONSE_CACHE_SHARDS 16
+#define RESPONSE_CACHE_BUCKETS 256 // Per shard
+#define DEFAULT_RESPONSE_CACHE_MB 64
+#define DEFAULT_CLOSED_TTL 86400
+#define DEFAULT_OPEN_TTL 30
+#define ETAG_DIGEST_BYTES 16
+
+// Stations share a generation when they hash to the same slot, which only costs extra misses
+#define RESPONSE_CACHE_GENERATIONS 4096
+
+typedef struct ResponseCacheEntry {
+    struct ResponseCacheEntry *hashNext;
+    struct ResponseCacheEntry *lruPrev; // Towards the most recently used
+    struct ResponseCacheEntry *lruNext;
+    uint64_t hash;
+    char *key;
+    char *body;
+    size_t bodyLen;
+    size_t size; // Bytes charged to the shard budget
+    char etag[ETAG_SIZE];
+    time_t expiresAt;
+    uint32_t generationSlot;
+    uint64_t generation; // Of its station when put, stale once the slot moved on
+} ResponseCacheEntry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    ResponseCacheEntry *buckets[RESPONSE_CACHE_BUCKETS];
+    ResponseCacheEntry *lruHead;
+    ResponseCacheEntry *lruTail;
+    size_t size;
+} ResponseCacheShard;
+
+static ResponseCacheShard shards[RESPONSE_CACHE_SHARDS];
+static size_t shardBudget = (size_t)DEFAULT_RESPONSE_CACHE_MB * 1024 * 1024 / RESPONSE_CACHE_SHARDS;
+static unsigned char hashKey[crypto_shorthash_KEYBYTES];
+static int closedTtl = DEFAULT_CLOSED_TTL;
+static int openTtl = DEFAULT_OPEN_TTL;
+static uint64_t generations[RESPONSE_CACHE_GENERATIONS];
+
+void init_response_cache(void) {
+    // RESPONSE_CACHE_MB=0 disables the cache
+    int cacheMb = env_int("RESPONSE_CACHE_MB", DEFAULT_RESPONSE_CACHE_MB, 0);
+    shardBudget = (size_t)cacheMb * 1024 * 1024 / RESPONSE_CACHE_SHARDS;
+    closedTtl = env_int("RESPONSE_CACHE_TTL", DEFAULT_CLOSED_TTL, 0);
+    openTtl = env_int("RESPONSE_CACHE_OPEN_TTL", DEFAULT_OPEN_TTL, 0);
+    randombytes_buf(hashKey, sizeof(hashKey));
+
+    for (int i = 0; i < RESPONSE_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+        shards[i].lruHead = NULL;
+        shards[i].lruTail = NULL;
+        shards[i].size = 0;
+    }
+}
+
+int response_cache_ttl(bool closedRange) {
+    return closedRange ? closedTtl : openTtl;
+}
+
+// Keyed SipHash, the keys come from query parameters and must not be steerable into one bucket
+static uint64_t hash_key(const char *key) {
+    unsigned char out[crypto_shorthash_BYTES];
+    crypto_shorthash(out, (const unsigned char *)key, strlen(key), hashKey);
+
+    uint64_t hash;
+    memcpy(&hash, out, sizeof(hash));
+    return hash;
+}
+
+static uint32_t generation_slot(const char *station) {
+    return (uint32_t)(hash_key(station) % RESPONSE_CACHE_GENERATIONS);
+}
+
+static ResponseCacheShard *get_shard(uint64_t hash) {
+    return &shards[hash % RESPONSE_CACHE_SHARDS];
+}
+
+static ResponseCacheEntry **get_bucket(ResponseCacheShard *shard, uint64_t hash) {
+    return &shard->buckets[(hash / RESPONSE_CACHE_SHARDS) % RESPONSE_CACHE_BUCKETS];
+}
+
+static void lru_unlink(ResponseCacheShard *shard, ResponseCacheEntry *entry) {
+    if (entry->lruPrev)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        shard->lruHead = entry->lruNext;
+
+    if (entry->lruNext)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        shard->lruTail = entry->lruPrev;
+
+    entry->lruPrev = NULL;
+    entry->lruNext = NULL;
+}
+
+static void lru_push_front(ResponseCacheShard *shard, ResponseCacheEntry *entry) {
+    entry->lruPrev = NULL;
+    entry->lruNext = shard->lruHead;
+    if (shard->lruHead)
+        shard->lruHead->lruPrev = entry;
+    shard->lruHead = entry;
+    if (!shard->lruTail)
+        shard->lruTail = entry;
+}
+
+static void remove_entry(ResponseCacheShard *shard, ResponseCacheEntry *entry) {
+    ResponseCacheEntry **link = get_bucket(shard, entry->hash);
+    while (*link && *link != entry)
+        link = &(*link)->hashNext;
+    if (*link)
+        *link = entry->hashNext;
+
+    lru_unlink(shard, entry);
+    shard->size -= entry->size;
+
+    free(entry->key);
+    free(entry->body);
+    free(entry);
+}
+
+static ResponseCacheEntry *find_entry(ResponseCacheShard *shard, uint64_t hash, const char *key) {
+    for (ResponseCacheEntry *entry = *get_bucket(shard, hash); entry; entry = entry->hashNext) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+bool response_cache_get(const char *key, char **body, char *etag) {
+    if (!key || !body || !etag || shardBudget == 0)
+        return false;
+
+    uint64_t hash = hash_key(key);
+    ResponseCacheShard *shard = get_shard(hash);
+    bool found = false;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    ResponseCacheEntry *entry = find_entry(shard, hash, key);
+    if (entry && (entry->expiresAt <= time(NULL) ||
+                  entry->generation !=
+                      __atomic_load_n(&generations[entry->generationSlot], __ATOMIC_ACQUIRE))) {
+        remove_entry(shard, entry);
+        entry = NULL;
+    }
+
+    if (entry) {
+        char *copy = malloc(entry->bodyLen + 1);
+        if (copy) {
+            memcpy(copy, entry->body, entry->bodyLen + 1);
+            memcpy(etag, entry->etag, ETAG_SIZE);
+            *body = copy;
+            found = true;
+
+            lru_unlink(shard, entry);
+            lru_push_front(shard, entry);
+        }
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    return found;
+}
+
+uint64_t response_cache_generation(const char *station) {
+    if (!station)
+        return 0;
+    return __atomic_load_n(&generations[generation_slot(station)], __ATOMIC_ACQUIRE);
+}
+
+void response_cache_invalidate_station(const char *station) {
+    if (!station || shardBudget == 0)
+        return;
+
+    // The stale entries are dropped when next looked up, or pushed out of the LRU
+    __atomic_add_fetch(&generations[generation_slot(station)], 1, __ATOMIC_RELEASE);
+}
+
+void response_cache_put(const char *key, const char *station, uint64_t generation,
+                        const char *body, size_t bodyLen, const char *etag, int ttl) {
+    if (!key || !station || !body || !etag || ttl <= 0 || shardBudget == 0)
+        return;
+
+    size_t keyLen = strlen(key);
+    size_t size = sizeof(ResponseCacheEntry) + keyLen + 1 + bodyLen + 1;
+
+    // A single huge range would flush everything else
+    if (size > shardBudget / 4)
+        return;
+
+    ResponseCacheEntry *newEntry = calloc(1, sizeof(ResponseCacheEntry));
+    if (!newEntry)
+        return;
+
+    newEntry->key = malloc(keyLen + 1);
+    newEntry->body = malloc(bodyLen + 1);
+    if (!newEntry->key || !newEntry->body) {
+        free(newEntry->key);
+        free(newEntry->body);
+        free(newEntry);
+        return;
+    }
+
+    memcpy(newEntry->key, key, keyLen + 1);
+    memcpy(newEntry->body, body, bodyLen);
+    newEntry->body[bodyLen] = '\0';
+    newEntry->bodyLen = bodyLen;
+    newEntry->size = size;
+    newEntry->hash = hash_key(key);
+    memcpy(newEntry->etag, etag, ETAG_SIZE);
+    newEntry->expiresAt = time(NULL) + ttl;
+    newEntry->generationSlot = generation_slot(station);
+    newEntry->generation = generation;
+
+    ResponseCacheShard *shard = get_shard(newEntry->hash);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    // An upload landed while the body was being built, it may not hold the new rows. It would
+    // only ever miss, as would one put just before an invalidation that follows this check
+    if (__atomic_load_n(&generations[newEntry->generationSlot], __ATOMIC_ACQUIRE) != generation) {
+        pthread_mutex_unlock(&shard->mutex);
+        free(newEntry->key);
+        free(newEntry->body);
+        free(newEntry);
+        return;
+    }
+
+    // Another thread may have filled it meanwhile, the newest copy wins
+    ResponseCacheEntry *old = find_entry(shard, newEntry->hash, key);
+    if (old)
+        remove_entry(shard, old);
+
+    while (shard->lruTail && shard->size + size > shardBudget)
+        remove_entry(shard, shard->lruTail);
+
+    ResponseCacheEntry **bucket = get_bucket(shard, newEntry->hash);
+    newEntry->hashNext = *bucket;
+    *bucket = newEntry;
+    lru_push_front(shard, newEntry);
+    shard->size += size;
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void compute_etag(const char *body, size_t bodyLen, char *etag) {
+    unsigned char digest[ETAG_DIGEST_BYTES];
+    crypto_generichash(digest, sizeof(digest), (const unsigned char *)body, bodyLen, NULL, 0);
+
+    etag[0] = '"';
+    sodium_bin2hex(etag + 1, ETAG_SIZE - 2, digest, sizeof(digest));
+    etag[ETAG_SIZE - 2] = '"';
+    etag[ETAG_SIZE - 1] = '\0';
+}
@@ -0,0 +1,32 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Quoted hex digest, NUL included
+#define ETAG_SIZE 35
+
+void init_response_cache(void);
+
+// Seconds an entry stays cached, depending on whether its range can still get new data
+int response_cache_ttl(bool closedRange);
+
+// On a hit *body is a malloc'd copy the caller has to free()
+bool response_cache_get(const char *key, char **body, char *etag);
+
+// Generation of the entries of a station, read before the query whose body is then put
+uint64_t response_cache_generation(const char *station);
+
+// Dropped when the station was invalidated since generation was read, the body may predate it
+void response_cache_put(const char *key, const char *station, uint64_t generation,
+                        const char *body, size_t bodyLen, const char *etag, int ttl);
+
+// Every entry put for the station misses from now on, as new data may change any of them
+void response_cache_invalidate_station(const char *station);
+
+// Strong validator for a body, written into etag (ETAG_SIZE bytes)
+void compute_etag(const char *body, size_t bodyLen, char *etag);
+
+#endif
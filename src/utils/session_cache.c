@@ -0,0 +1,160 @@
+#include "session_cache.h"
+#include <pthread.h>
+#include <sodium/utils.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SESSION_CACHE_SHARDS 16
+#define SESSION_CACHE_SETS 64 // Per shard
+#define SESSION_CACHE_WAYS 4
+#define DEFAULT_SESSION_CACHE_TTL 30
+
+typedef struct {
+    bool valid;
+    unsigned char tokenHash[crypto_generichash_BYTES];
+    time_t validUntil; // Earliest of the session expiry and the cache TTL
+    SessionInfo info;
+} SessionCacheEntry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    SessionCacheEntry entries[SESSION_CACHE_SETS][SESSION_CACHE_WAYS];
+} SessionCacheShard;
+
+static SessionCacheShard shards[SESSION_CACHE_SHARDS];
+static int cacheTtl = DEFAULT_SESSION_CACHE_TTL;
+
+void init_session_cache(void) {
+    const char *ttlStr = getenv("SESSION_CACHE_TTL");
+    if (ttlStr) {
+        cacheTtl = atoi(ttlStr);
+        if (cacheTtl < 0)
+            cacheTtl = 0; // 0 disables the cache
+    }
+
+    for (int i = 0; i < SESSION_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        memset(shards[i].entries, 0, sizeof(shards[i].entries));
+    }
+}
+
+// The token hash is already uniformly distributed, its first bytes pick the shard and the set
+static SessionCacheShard *get_shard(const unsigned char *tokenHash) {
+    return &shards[tokenHash[0] % SESSION_CACHE_SHARDS];
+}
+
+static SessionCacheEntry *get_set(SessionCacheShard *shard, const unsigned char *tokenHash) {
+    uint16_t set = (uint16_t)(tokenHash[1] | (tokenHash[2] << 8));
+    return shard->entries[set % SESSION_CACHE_SETS];
+}
+
+bool session_cache_get(const unsigned char *tokenHash, SessionInfo *info) {
+    if (!tokenHash || !info || cacheTtl == 0)
+        return false;
+
+    SessionCacheShard *shard = get_shard(tokenHash);
+    time_t now = time(NULL);
+    bool found = false;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    SessionCacheEntry *set = get_set(shard, tokenHash);
+    for (int i = 0; i < SESSION_CACHE_WAYS; i++) {
+        SessionCacheEntry *entry = &set[i];
+        if (!entry->valid ||
+            sodium_memcmp(entry->tokenHash, tokenHash, sizeof(entry->tokenHash)) != 0)
+            continue;
+
+        if (entry->validUntil <= now) {
+            entry->valid = false;
+            break;
+        }
+
+        *info = entry->info;
+        found = true;
+        break;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    return found;
+}
+
+void session_cache_put(const unsigned char *tokenHash, const SessionInfo *info) {
+    if (!tokenHash || !info || cacheTtl == 0)
+        return;
+
+    SessionCacheShard *shard = get_shard(tokenHash);
+    time_t now = time(NULL);
+
+    time_t validUntil = now + cacheTtl;
+    if (info->expiresAt < validUntil)
+        validUntil = info->expiresAt;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    // Reuse the entry of the same token, else a free one, else the one expiring first
+    SessionCacheEntry *set = get_set(shard, tokenHash);
+    SessionCacheEntry *victim = NULL;
+
+    for (int i = 0; i < SESSION_CACHE_WAYS && !victim; i++) {
+        if (set[i].valid &&
+            sodium_memcmp(set[i].tokenHash, tokenHash, sizeof(set[i].tokenHash)) == 0)
+            victim = &set[i];
+    }
+
+    for (int i = 0; i < SESSION_CACHE_WAYS && !victim; i++) {
+        if (!set[i].valid || set[i].validUntil <= now)
+            victim = &set[i];
+    }
+
+    if (!victim) {
+        victim = &set[0];
+        for (int i = 1; i < SESSION_CACHE_WAYS; i++) {
+            if (set[i].validUntil < victim->validUntil)
+                victim = &set[i];
+        }
+    }
+
+    memcpy(victim->tokenHash, tokenHash, sizeof(victim->tokenHash));
+    victim->validUntil = validUntil;
+    victim->info = *info;
+    victim->valid = true;
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static void invalidate_matching(const char *sessionUUID, const char *userId) {
+    for (int i = 0; i < SESSION_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].mutex);
+
+        for (int s = 0; s < SESSION_CACHE_SETS; s++) {
+            for (int w = 0; w < SESSION_CACHE_WAYS; w++) {
+                SessionCacheEntry *entry = &shards[i].entries[s][w];
+                if (!entry->valid)
+                    continue;
+
+                if (sessionUUID && strcmp(entry->info.sessionUUID, sessionUUID) == 0)
+                    entry->valid = false;
+                else if (userId && (strcmp(entry->info.userUUID, userId) == 0 ||
+                                    strcmp(entry->info.username, userId) == 0))
+                    entry->valid = false;
+            }
+        }
+
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+}
+
+void session_cache_invalidate_session(const char *sessionUUID) {
+    if (sessionUUID)
+        invalidate_matching(sessionUUID, NULL);
+}
+
+void session_cache_invalidate_user(const char *userId) {
+    if (userId)
+        invalidate_matching(NULL, userId);
+}
@@ -0,0 +1,30 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include <sodium/crypto_generichash.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "utils.h"
+
+typedef struct {
+    char userUUID[UUID_SIZE + 1];
+    char username[NAME_SIZE + 1];
+    char sessionUUID[UUID_SIZE + 1];
+    bool isAdmin;
+    time_t expiresAt;
+} SessionInfo;
+
+void init_session_cache(void);
+
+// tokenHash is the crypto_generichash of the session token, as stored in the database
+bool session_cache_get(const unsigned char *tokenHash, SessionInfo *info);
+
+void session_cache_put(const unsigned char *tokenHash, const SessionInfo *info);
+
+void session_cache_invalidate_session(const char *sessionUUID);
+
+// userId can be the uuid or the username
+void session_cache_invalidate_user(const char *userId);
+
+#endif
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unicode/ucal.h>
+#include <unicode/ustring.h>
+
+#include "tz_table.h"
+
+// A few hundred system zones, aliases included, fit with room to spare
+#define TZ_TABLE_SLOTS 1024
+#define TZ_TABLE_MAX_PROBES 32
+
+#define TZ_NAME_SIZE 128
+#define TZ_INITIAL_TRANSITIONS 64
+
+// 1900-01-01T00:00:00Z and 2100-01-01T00:00:00Z, ranges outside them are never answered
+#define TZ_TABLE_START (-2208988800000.0)
+#define TZ_TABLE_END (4102444800000.0)
+
+#define MS_PER_HOUR (3600 * 1000)
+#define MS_PER_DAY ((int64_t)24 * MS_PER_HOUR)
+
+typedef struct {
+    int64_t at;     // UTC milliseconds the offset starts at
+    int32_t offset; // Zone plus DST offset in milliseconds, until the next transition
+} TzTransition;
+
+struct TzTable {
+    uint32_t hash;
+    char name[TZ_NAME_SIZE];
+    size_t count;
+    TzTransition transitions[]; // The first one is TZ_TABLE_START
+};
+
+// Slots only go from NULL to a table, which is never modified or freed afterwards
+static TzTable *slots[TZ_TABLE_SLOTS];
+
+// FNV-1a
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int32_t calendar_offset(UCalendar *cal, UErrorCode *status) {
+    return ucal_get(cal, UCAL_ZONE_OFFSET, status) + ucal_get(cal, UCAL_DST_OFFSET, status);
+}
+
+static TzTable *build_table(const char *tz, uint32_t hash) {
+    UChar uTz[TZ_NAME_SIZE];
+    u_charsToUChars(tz, uTz, strlen(tz) + 1);
+
+    // Unknown ids silently become a GMT calendar, custom "GMT+hh:mm" ids are never cached
+    UErrorCode status = U_ZERO_ERROR;
+    UChar canonical[TZ_NAME_SIZE];
+    UBool isSystemID = false;
+    ucal_getCanonicalTimeZoneID(uTz, -1, canonical, TZ_NAME_SIZE, &isSystemID, &status);
+    if (U_FAILURE(status) || !isSystemID)
+        return NULL;
+
+    UCalendar *cal = ucal_open(uTz, -1, NULL, UCAL_GREGORIAN, &status);
+    if (U_FAILURE(status) || !cal) {
+        if (cal)
+            ucal_close(cal);
+        return NULL;
+    }
+
+    size_t capacity = TZ_INITIAL_TRANSITIONS;
+    TzTable *table = malloc(sizeof(TzTable) + capacity * sizeof(TzTransition));
+    if (!table) {
+        ucal_close(cal);
+        return NULL;
+    }
+
+    table->hash = hash;
+    strcpy(table->name, tz);
+    table->count = 0;
+
+    UDate at = TZ_TABLE_START;
+    for (;;) {
+        ucal_setMillis(cal, at, &status);
+        int32_t offset = calendar_offset(cal, &status);
+        if (U_FAILURE(status))
+            break;
+
+        // Transitions that only rename the offset, standard to DST with the same total, add nothing
+        if (table->count == 0 || table->transitions[table->count - 1].offset != offset) {
+            if (table->count == capacity) {
+                capacity *= 2;
+                TzTable *grown = realloc(table, sizeof(TzTable) + capacity * sizeof(TzTransition));
+                if (!grown) {
+                    status = U_MEMORY_ALLOCATION_ERROR;
+                    break;
+                }
+                table = grown;
+            }
+
+            table->transitions[table->count].at = (int64_t)at;
+            table->transitions[table->count].offset = offset;
+            table->count++;
+        }
+
+        UDate next;
+        if (!ucal_getTimeZoneTransitionDate(cal, UCAL_TZ_TRANSITION_NEXT, &next, &status) ||
+            U_FAILURE(status) || next >= TZ_TABLE_END)
+            break;
+        at = next;
+    }
+
+    ucal_close(cal);
+
+    if (U_FAILURE(status)) {
+        fprintf(stderr, "Error reading the transitions of %s: %s\n", tz, u_errorName(status));
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+const TzTable *tz_table_get(const char *tz) {
+    if (!tz || strlen(tz) >= TZ_NAME_SIZE)
+        return NULL;
+
+    uint32_t hash = hash_name(tz);
+    uint32_t slot = hash % TZ_TABLE_SLOTS;
+    TzTable *table = NULL;
+
+    for (int probe = 0; probe < TZ_TABLE_MAX_PROBES; probe++) {
+        TzTable *current = __atomic_load_n(&slots[slot], __ATOMIC_ACQUIRE);
+
+        if (!current) {
+            // Built outside any lock, two threads racing for the slot just waste one build
+            if (!table) {
+                table = build_table(tz, hash);
+                if (!table)
+                    return NULL;
+            }
+
+            if (__atomic_compare_exchange_n(&slots[slot], &current, table, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return table;
+
+            // Lost the slot, current now holds the winner
+        }
+
+        if (current->hash == hash && strcmp(current->name, tz) == 0) {
+            free(table);
+            return current;
+        }
+
+        slot = (slot + 1) % TZ_TABLE_SLOTS;
+    }
+
+    free(table);
+    return NULL;
+}
+
+// Index of the last transition at or before ms, ms has to be past the first one
+static size_t find_transition(const TzTable *table, int64_t ms) {
+    size_t low = 0, high = table->count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (table->transitions[mid].at <= ms)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static bool table_covers(const TzTable *table, int64_t startMs, int64_t endMs) {
+    return startMs >= table->transitions[0].at && endMs < (int64_t)TZ_TABLE_END;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date
+static int64_t days_from_civil(int64_t year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yearOfEra = year - era * 400;
+    int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+bool tz_local_to_utc(const TzTable *table, const char *timeStr, int64_t *utcMs) {
+    if (!table || !timeStr || !utcMs)
+        return false;
+
+    int year, month, day, hour, min, sec;
+    if (sscanf(timeStr, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &min, &sec) != 6 ||
+        month < 1 || month > 12)
+        return false;
+
+    // Days, hours and minutes past their range just carry over, like a lenient calendar
+    int64_t wallMs = days_from_civil(year, month, day) * MS_PER_DAY +
+                     ((int64_t)hour * 3600 + (int64_t)min * 60 + sec) * 1000;
+
+    // The wall clock starts showing a transition's offset at at + offset. Repeated wall times
+    // take the later offset and skipped ones the earlier, as UCAL_WALLTIME_LAST does
+    size_t low = 0, high = table->count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (table->transitions[mid].at + table->transitions[mid].offset <= wallMs)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    int64_t ms = wallMs - table->transitions[low].offset;
+    if (!table_covers(table, ms, ms))
+        return false;
+
+    *utcMs = ms;
+    return true;
+}
+
+bool tz_same_offset(const TzTable *table1, const TzTable *table2, int64_t startMs, int64_t endMs) {
+    if (!table1 || !table2)
+        return false;
+
+    if (table1 == table2)
+        return true;
+
+    if (endMs < startMs)
+        endMs = startMs;
+
+    if (!table_covers(table1, startMs, endMs) || !table_covers(table2, startMs, endMs))
+        return false;
+
+    // Merge walk over the transitions of both zones that fall inside the range
+    size_t i = find_transition(table1, startMs);
+    size_t j = find_transition(table2, startMs);
+    for (;;) {
+        if (table1->transitions[i].offset != table2->transitions[j].offset)
+            return false;
+
+        int64_t next1 = i + 1 < table1->count ? table1->transitions[i + 1].at : INT64_MAX;
+        int64_t next2 = j + 1 < table2->count ? table2->transitions[j + 1].at : INT64_MAX;
+        int64_t next = next1 < next2 ? next1 : next2;
+        if (next > endMs)
+            return true;
+
+        if (next1 == next)
+            i++;
+        if (next2 == next)
+            j++;
+    }
+}
+
+bool tz_whole_hour_offset(const TzTable *table, int64_t startMs, int64_t endMs) {
+    if (!table)
+        return false;
+
+    if (endMs < startMs)
+        endMs = startMs;
+
+    if (!table_covers(table, startMs, endMs))
+        return false;
+
+    size_t i = find_transition(table, startMs);
+    do {
+        if (table->transitions[i].offset % MS_PER_HOUR != 0)
+            return false;
+        i++;
+    } while (i < table->count && table->transitions[i].at <= endMs);
+
+    return true;
+}
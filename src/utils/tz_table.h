@@ -0,0 +1,24 @@
+#ifndef TZ_TABLE_H
+#define TZ_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// UTC offsets of a timezone between 1900 and 2100, read once from ICU's transition rules
+typedef struct TzTable TzTable;
+
+// Table for an ICU system timezone, built on first use and kept for the life of the process.
+// Lookups take no lock. NULL for unknown or custom zones, or when the cache is full
+const TzTable *tz_table_get(const char *tz);
+
+// Local "YYYY-MM-DDTHH:MM:SS" time in the table's zone to UTC milliseconds. Repeated and
+// skipped wall times resolve like ICU's default calendar does
+bool tz_local_to_utc(const TzTable *table, const char *timeStr, int64_t *utcMs);
+
+// Both zones have the same offset at every instant of [startMs, endMs]
+bool tz_same_offset(const TzTable *table1, const TzTable *table2, int64_t startMs, int64_t endMs);
+
+// Every offset of the zone during [startMs, endMs] is a whole number of hours
+bool tz_whole_hour_offset(const TzTable *table, int64_t startMs, int64_t endMs);
+
+#endif
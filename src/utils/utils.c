@@ -1,12 +1,14 @@
 #include "utils.h"
 #include "../core/flags.h"
+#include "metrics.h"
+#include "session_cache.h"
+#include "tz_table.h"
 #include "../core/weather.h"
 #include "postgres_ext.h"
 #include <ctype.h>
 #include <jansson.h>
 #include <libpq-fe.h>
 #include <sodium/crypto_generichash.h>
-#include <sodium/crypto_pwhash.h>
 #include <sodium/randombytes.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -14,10 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unicode/putil.h>
-#include <unicode/ucal.h>
-#include <unicode/umachine.h>
-#include <unicode/utypes.h>
+#include <time.h>
 
 #define GENERIC_WEATHER_QUERY_SIZE 4096
 #define APPEND_QUERY_FIELD(FIELD_FLAG, SQL_EXPR)                                                   \
@@ -76,8 +75,8 @@ bool validate_uuid(const char *uuid) {
     return uuid[36] == '\0';
 }
 
-bool validate_password(PGconn *conn, const char *userId, const char *password) {
-    if (!password || !userId)
+bool get_password_hash(PGconn *conn, const char *userId, char *hash, size_t hashLen) {
+    if (!userId || !hash)
         return false;
 
     const char *paramValues[1] = {userId};
@@ -95,22 +94,19 @@ bool validate_password(PGconn *conn, const char *userId, const char *password) {
         return false;
     }
 
-    if (PQntuples(res) != 1) {
+    if (PQntuples(res) != 1 || (size_t)PQgetlength(res, 0, 0) >= hashLen) {
         PQclear(res);
         return false;
     }
 
-    const char *passHash = PQgetvalue(res, 0, 0);
-    if (crypto_pwhash_str_verify(passHash, password, strlen(password)) != 0) {
-        PQclear(res);
-        return false;
-    }
+    memcpy(hash, PQgetvalue(res, 0, 0), (size_t)PQgetlength(res, 0, 0) + 1);
 
     PQclear(res);
     return true;
 }
 
-bool validate_session_token(PGconn *conn, const char *userId, const char *sessionToken) {
+// Resolves a session token to its user, hitting the database only on a cache miss
+static bool lookup_session(PGconn *conn, const char *sessionToken, SessionInfo *info) {
     if (!sessionToken)
         return false;
 
@@ -124,38 +120,32 @@ bool validate_session_token(PGconn *conn, const char *userId, const char *sessio
     crypto_generichash(recievedTokenHash, sizeof(recievedTokenHash), recievedToken,
                        sizeof(recievedToken), NULL, 0);
 
+    if (session_cache_get(recievedTokenHash, info))
+        return true;
+
     // Convert the hash into base64 for the query
     char recievedTokenHashB64[sodium_base64_ENCODED_LEN((sizeof(recievedTokenHash)),
                                                         BASE64_VARIANT)];
     sodium_bin2base64(recievedTokenHashB64, sizeof(recievedTokenHashB64), recievedTokenHash,
                       (sizeof(recievedTokenHash)), BASE64_VARIANT);
 
-    PGresult *res;
-
-    const char *paramValues[2] = {recievedTokenHashB64, userId};
-
-    res = PQexecParams(conn,
-                       "SELECT 1 "
-                       "FROM auth.user_sessions s "
-                       "JOIN auth.users u ON s.user_id = u.user_id "
-                       "WHERE s.session_token = $1 "
-                       "  AND s.expires_at > NOW() "
-                       "  AND s.revoked_at IS NULL "
-                       "  AND u.deleted_at IS NULL "
-                       "  AND ( "
-                       "        ($2::text IS NULL AND u.is_admin = true) "
-                       "        OR ($2::text IS NOT NULL AND ( "
-                       "              u.is_admin = true "
-                       "              OR u.uuid::text = $2::text "
-                       "              OR u.username = $2::text "
-                       "        )) "
-                       "      )",
-                       2,           // number of parameters
-                       NULL,        // param types
-                       paramValues, // param values
-                       NULL,        // param lengths
-                       NULL,        // param formats
-                       0);          // result format (0 = text)
+    const char *paramValues[1] = {recievedTokenHashB64};
+
+    PGresult *res = PQexecParams(conn,
+                                 "SELECT u.uuid, u.username, u.is_admin, s.uuid, "
+                                 "  EXTRACT(EPOCH FROM s.expires_at)::bigint "
+                                 "FROM auth.user_sessions s "
+                                 "JOIN auth.users u ON s.user_id = u.user_id "
+                                 "WHERE s.session_token = $1 "
+                                 "  AND s.expires_at > NOW() "
+                                 "  AND s.revoked_at IS NULL "
+                                 "  AND u.deleted_at IS NULL",
+                                 1,           // number of parameters
+                                 NULL,        // param types
+                                 paramValues, // param values
+                                 NULL,        // param lengths
+                                 NULL,        // param formats
+                                 0);          // result format (0 = text)
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
@@ -163,109 +153,121 @@ bool validate_session_token(PGconn *conn, const char *userId, const char *sessio
         return false;
     }
 
-    if (PQntuples(res) > 0) {
-        PQclear(res);
-        return true;
-    }
-    else {
+    if (PQntuples(res) == 0) {
         PQclear(res);
         return false;
     }
+
+    snprintf(info->userUUID, sizeof(info->userUUID), "%s", PQgetvalue(res, 0, 0));
+    snprintf(info->username, sizeof(info->username), "%s", PQgetvalue(res, 0, 1));
+    info->isAdmin = strcmp(PQgetvalue(res, 0, 2), "t") == 0;
+    snprintf(info->sessionUUID, sizeof(info->sessionUUID), "%s", PQgetvalue(res, 0, 3));
+    info->expiresAt = (time_t)atoll(PQgetvalue(res, 0, 4));
+
+    PQclear(res);
+
+    session_cache_put(recievedTokenHash, info);
+
+    return true;
 }
 
-bool validate_admin_session_token(PGconn *conn, const char *sessionToken) {
-    if (!sessionToken)
+bool validate_session_token(PGconn *conn, const char *userId, const char *sessionToken) {
+    SessionInfo info;
+    if (!lookup_session(conn, sessionToken, &info))
         return false;
 
-    unsigned char receivedToken[KEY_ENTROPY];
-    if (sodium_base642bin(receivedToken, sizeof(receivedToken), sessionToken, strlen(sessionToken),
-                          NULL, NULL, NULL, BASE64_VARIANT) != 0) {
+    // Admins can act on any user, the rest only on themselves
+    if (info.isAdmin)
+        return true;
+
+    if (!userId)
         return false;
-    }
 
-    unsigned char receivedTokenHash[crypto_generichash_BYTES];
-    crypto_generichash(receivedTokenHash, sizeof(receivedTokenHash), receivedToken,
-                       sizeof(receivedToken), NULL, 0);
-
-    // Convert hash to base64 for the query
-    char receivedTokenHashB64[sodium_base64_ENCODED_LEN(sizeof(receivedTokenHash), BASE64_VARIANT)];
-    sodium_bin2base64(receivedTokenHashB64, sizeof(receivedTokenHashB64), receivedTokenHash,
-                      sizeof(receivedTokenHash), BASE64_VARIANT);
-
-    PGresult *res;
-    const char *paramValues[1] = {receivedTokenHashB64};
-
-    res = PQexecParams(conn,
-                       "SELECT 1 "
-                       "FROM auth.user_sessions s "
-                       "JOIN auth.users u ON s.user_id = u.user_id "
-                       "WHERE s.session_token = $1 "
-                       "  AND s.expires_at > NOW() "
-                       "  AND s.revoked_at IS NULL "
-                       "  AND u.deleted_at IS NULL "
-                       "  AND u.is_admin = true",
-                       1,           // number of parameters
-                       NULL,        // param types
-                       paramValues, // param values
-                       NULL,        // param lengths
-                       NULL,        // param formats
-                       0);          // result format (0 = text)
+    return strcmp(info.userUUID, userId) == 0 || strcmp(info.username, userId) == 0;
+}
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
-        PQclear(res);
+bool validate_admin_session_token(PGconn *conn, const char *sessionToken) {
+    SessionInfo info;
+    if (!lookup_session(conn, sessionToken, &info))
         return false;
-    }
 
-    bool isAdmin = PQntuples(res) > 0;
-    PQclear(res);
-    return isAdmin;
+    return info.isAdmin;
 }
 
 bool get_user_session_token(PGconn *conn, char **userId, const char *sessionToken) {
-    if (!sessionToken || !userId)
+    if (!userId)
         return false;
 
-    unsigned char recievedToken[KEY_ENTROPY];
-    if (sodium_base642bin(recievedToken, sizeof(recievedToken), sessionToken, strlen(sessionToken),
-                          NULL, NULL, NULL, BASE64_VARIANT) != 0) {
+    SessionInfo info;
+    if (!lookup_session(conn, sessionToken, &info))
+        return false;
+
+    *userId = strdup(info.userUUID);
+    if (!*userId)
+        return false;
+
+    return true;
+}
+
+bool hash_api_key(const char *apiKey, unsigned char *keyHash) {
+    if (!apiKey || !keyHash)
+        return false;
+
+    unsigned char recievedKey[KEY_ENTROPY];
+    if (sodium_base642bin(recievedKey, sizeof(recievedKey), apiKey, strlen(apiKey), NULL, NULL,
+                          NULL, BASE64_VARIANT) != 0) {
         return false;
     }
 
-    unsigned char recievedTokenHash[crypto_generichash_BYTES];
-    crypto_generichash(recievedTokenHash, sizeof(recievedTokenHash), recievedToken,
-                       sizeof(recievedToken), NULL, 0);
+    // Keys are stored hashed, like the session tokens
+    crypto_generichash(keyHash, crypto_generichash_BYTES, recievedKey, sizeof(recievedKey), NULL,
+                       0);
 
-    // Convert the hash into base64 for the query
-    char recievedTokenHashB64[sodium_base64_ENCODED_LEN((sizeof(recievedTokenHash)),
-                                                        BASE64_VARIANT)];
-    sodium_bin2base64(recievedTokenHashB64, sizeof(recievedTokenHashB64), recievedTokenHash,
-                      (sizeof(recievedTokenHash)), BASE64_VARIANT);
+    return true;
+}
 
-    const char *paramValues[1] = {recievedTokenHashB64};
+bool validate_station_api_key(PGconn *conn, const char *apiKey, const char *keyType,
+                              const char *stationId, char *stationDbId, size_t stationDbIdLen) {
+    if (!apiKey || !keyType || !stationId || !stationDbId)
+        return false;
+
+    unsigned char recievedKeyHash[crypto_generichash_BYTES];
+    if (!hash_api_key(apiKey, recievedKeyHash))
+        return false;
+
+    char recievedKeyHashB64[sodium_base64_ENCODED_LEN(sizeof(recievedKeyHash), BASE64_VARIANT)];
+    sodium_bin2base64(recievedKeyHashB64, sizeof(recievedKeyHashB64), recievedKeyHash,
+                      sizeof(recievedKeyHash), BASE64_VARIANT);
+
+    const char *paramValues[3] = {recievedKeyHashB64, keyType, stationId};
 
     PGresult *res = PQexecParams(conn,
-                                 "SELECT u.uuid AS user_uuid "
-                                 "FROM auth.user_sessions s "
-                                 "JOIN auth.users u ON s.user_id = u.user_id "
-                                 "WHERE s.session_token = $1",
-                                 1, NULL, paramValues, NULL, NULL, 0);
+                                 "SELECT s.station_id::text "
+                                 "FROM auth.api_keys k "
+                                 "JOIN stations.stations s ON k.station_id = s.station_id "
+                                 "WHERE k.api_key = $1 "
+                                 "  AND k.api_key_type = $2 "
+                                 "  AND k.revoked_at IS NULL "
+                                 "  AND (k.expires_at IS NULL OR k.expires_at > NOW()) "
+                                 "  AND (s.name = $3 OR s.uuid::text = $3) "
+                                 "  AND s.deleted_at IS NULL",
+                                 3, NULL, paramValues, NULL, NULL, 0);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "Error executing query: %s\n", PQerrorMessage(conn));
+        fprintf(stderr, "Error executing the query: %s", PQerrorMessage(conn));
         PQclear(res);
         return false;
     }
 
-    if (PQntuples(res) > 0) {
-        *userId = strdup(PQgetvalue(res, 0, 0));
-    }
-    else {
+    if (PQntuples(res) == 0) {
         PQclear(res);
         return false;
     }
 
+    snprintf(stationDbId, stationDbIdLen, "%s", PQgetvalue(res, 0, 0));
+
     PQclear(res);
+
     return true;
 }
 
@@ -288,7 +290,7 @@ void generate_session_token(char *tokenB64, size_t tokenB64Len, char *hashB64, s
                       BASE64_VARIANT);
 }
 
-json_t *pgresult_to_json(PGresult *res, bool canBeObject) {
+static json_t *build_json_tree(PGresult *res, bool canBeObject) {
     if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
         return NULL;
 
@@ -375,6 +377,29 @@ json_t *pgresult_to_json(PGresult *res, bool canBeObject) {
     return jsonArray;
 }
 
+json_t *pgresult_to_json(PGresult *res, bool canBeObject) {
+    uint64_t start = metrics_now_us();
+    json_t *json = build_json_tree(res, canBeObject);
+    metrics_add(METRICS_PHASE_SERIALIZE, metrics_now_us() - start);
+    return json;
+}
+
+bool validate_local_timestamp(const char *str) {
+    if (str == NULL)
+        return false;
+
+    // YYYY-MM-DD, then [T ]HH:MM[:SS[.fraction]]
+    size_t len = strlen(str);
+    if (len < 10 || strspn(str, "0123456789-") != 10)
+        return false;
+    if (len == 10)
+        return true;
+    if (str[10] != 'T' && str[10] != ' ')
+        return false;
+
+    return len > 11 && strspn(str + 11, "0123456789:.") == len - 11;
+}
+
 bool validate_email(const char *email) {
     if (email == NULL)
         return false;
@@ -431,22 +456,22 @@ bool append_to_buffer(char **buf_ptr, size_t *remaining, const char *fmt, ...) {
     return true;
 }
 
-char *build_generic_weather_query(int fields) {
+char *build_generic_weather_query(int fields, bool paged) {
     const char *queryBase = "WITH params AS (\n"
                             "    SELECT\n"
-                            "        (SELECT station_id FROM stations.stations WHERE name = $1 OR "
-                            "uuid::text = $1) AS station_id,\n"
+                            "        $1::bigint AS station_id,\n"
                             "        $2::timestamp AS start_ts,\n"
                             "        $3::timestamp AS end_ts,\n"
-                            "        $4::text AS granularity\n"
+                            "        $4::text AS granularity,\n"
+                            "        $5::text AS tz\n"
                             "),\n"
                             "time_ranges AS (\n"
                             "    SELECT\n"
                             "        station_id,\n"
                             "        granularity,\n"
                             "        tstzrange(\n"
-                            "            ts,\n"
-                            "            ts + (\n"
+                            "            ts AT TIME ZONE tz,\n"
+                            "            (ts + (\n"
                             "                CASE granularity\n"
                             "                    WHEN 'hour' THEN interval '1 hour'\n"
                             "                    WHEN 'day' THEN interval '1 day'\n"
@@ -454,7 +479,7 @@ char *build_generic_weather_query(int fields) {
                             "                    WHEN 'month' THEN interval '1 month'\n"
                             "                    WHEN 'year' THEN interval '1 year'\n"
                             "                END\n"
-                            "            )\n"
+                            "            )) AT TIME ZONE tz\n"
                             "        ) AS time_range\n"
                             "    FROM params,\n"
                             "    generate_series(\n"
@@ -470,17 +495,27 @@ char *build_generic_weather_query(int fields) {
                             "    ) AS ts\n"
                             ")\n"
                             "SELECT "
-                            "lower(d.time_range) AS period_start, "
-                            "upper(d.time_range) AS period_end, "
+                            "lower(d.time_range)::text AS period_start, "
+                            "upper(d.time_range)::text AS period_end, "
                             "d.granularity, ";
 
-    const char *queryEnd = " FROM time_ranges d\n"
-                           "LEFT JOIN weather.weather_data wd\n"
-                           "   ON wd.station_id = d.station_id\n"
-                           "   AND wd.time_range && d.time_range\n"
-                           "GROUP BY d.station_id, d.time_range, d.granularity\n"
-                           "HAVING COUNT(wd.*) > 0\n"
-                           "ORDER BY d.time_range;";
+    // The periods before the cursor are not even joined
+    const char *queryEnd = paged ? " FROM time_ranges d\n"
+                                   "LEFT JOIN weather.weather_data wd\n"
+                                   "   ON wd.station_id = d.station_id\n"
+                                   "   AND wd.time_range && d.time_range\n"
+                                   "WHERE lower(d.time_range) > $6::timestamptz\n"
+                                   "GROUP BY d.station_id, d.time_range, d.granularity\n"
+                                   "HAVING COUNT(wd.*) > 0\n"
+                                   "ORDER BY d.time_range\n"
+                                   "LIMIT $7;"
+                                 : " FROM time_ranges d\n"
+                                   "LEFT JOIN weather.weather_data wd\n"
+                                   "   ON wd.station_id = d.station_id\n"
+                                   "   AND wd.time_range && d.time_range\n"
+                                   "GROUP BY d.station_id, d.time_range, d.granularity\n"
+                                   "HAVING COUNT(wd.*) > 0\n"
+                                   "ORDER BY d.time_range;";
 
     size_t querySize = GENERIC_WEATHER_QUERY_SIZE;
     size_t remaining = GENERIC_WEATHER_QUERY_SIZE;
@@ -560,47 +595,168 @@ char *build_generic_weather_query(int fields) {
     return query;
 }
 
-char *build_static_query(int fields, granularity_t granularity) {
+char *build_partials_weather_query(int fields, bool paged) {
+    const char *queryHours =
+        "WITH params AS (\n"
+        "    SELECT\n"
+        "        $1::bigint AS station_id,\n"
+        "        date_trunc($4::text, $2::timestamp) AS start_ts,\n"
+        "        date_trunc($4::text, $3::timestamp) + ('1 ' || $4::text)::interval AS end_ts,\n"
+        "        $4::text AS granularity,\n"
+        "        ('1 ' || $4::text)::interval AS step,\n"
+        "        $5::text AS tz\n"
+        "),\n"
+        "hours AS (\n"
+        "    SELECT\n"
+        "        date_trunc(params.granularity, p.hour AT TIME ZONE params.tz) AS local_start,\n"
+        "        params.granularity, params.step, params.tz, p.*\n"
+        "    FROM params\n"
+        "    JOIN weather.weather_hourly_partials p ON p.station_id = params.station_id\n"
+        "        AND p.hour >= params.start_ts AT TIME ZONE params.tz\n"
+        "        AND p.hour < params.end_ts AT TIME ZONE params.tz\n";
+
+    // Hours up to the cursor only belong to periods before it or to the one it points at
+    const char *pagedHours = "        AND p.hour > $6::timestamptz\n";
+
+    const char *querySelect =
+        ")\n"
+        "SELECT "
+        "(local_start AT TIME ZONE tz)::text AS period_start, "
+        "((local_start + step) AT TIME ZONE tz)::text AS period_end, "
+        "granularity, ";
+
+    const char *queryEnd = paged ? " FROM hours\n"
+                                   "GROUP BY local_start, granularity, step, tz\n"
+                                   "HAVING (local_start AT TIME ZONE tz) > $6::timestamptz\n"
+                                   "ORDER BY local_start\n"
+                                   "LIMIT $7;"
+                                 : " FROM hours\n"
+                                   "GROUP BY local_start, granularity, step, tz\n"
+                                   "ORDER BY local_start;";
+
+    size_t querySize = GENERIC_WEATHER_QUERY_SIZE;
+    size_t remaining = GENERIC_WEATHER_QUERY_SIZE;
+    char *query = malloc(querySize);
+    if (!query)
+        return NULL;
+
+    char *p = query;
+
+    if (!append_to_buffer(&p, &remaining, "%s%s%s", queryHours, paged ? pagedHours : "",
+                          querySelect)) {
+        free(query);
+        return NULL;
+    }
+
+    // Sample standard deviation merged from the count, sum and sum of squares of every hour
+#define PARTIAL_STDDEV(COL)                                                                        \
+    " sqrt(GREATEST((SUM(" COL "_sumsq) - SUM(" COL "_sum) ^ 2 / NULLIF(SUM(" COL "_n), 0)) / "    \
+    "NULLIF(SUM(" COL "_n) - 1, 0), 0))"
+#define PARTIAL_AVG(COL) " SUM(" COL "_sum) / NULLIF(SUM(" COL "_n), 0)"
+
+    APPEND_QUERY_FIELD(SUMMARY_AVG_TEMPERATURE, PARTIAL_AVG("temperature") " AS avg_temperature,");
+    APPEND_QUERY_FIELD(SUMMARY_MAX_TEMPERATURE, " MAX(temperature_max) AS max_temperature,");
+    APPEND_QUERY_FIELD(SUMMARY_MIN_TEMPERATURE, " MIN(temperature_min) AS min_temperature,");
+    APPEND_QUERY_FIELD(SUMMARY_STDDEV_TEMPERATURE,
+                       PARTIAL_STDDEV("temperature") " AS stddev_temperature,");
+
+    APPEND_QUERY_FIELD(SUMMARY_AVG_HUMIDITY, PARTIAL_AVG("humidity") " AS avg_humidity,");
+    APPEND_QUERY_FIELD(SUMMARY_MAX_HUMIDITY, " MAX(humidity_max) AS max_humidity,");
+    APPEND_QUERY_FIELD(SUMMARY_MIN_HUMIDITY, " MIN(humidity_min) AS min_humidity,");
+    APPEND_QUERY_FIELD(SUMMARY_STDDEV_HUMIDITY, PARTIAL_STDDEV("humidity") " AS stddev_humidity,");
+
+    APPEND_QUERY_FIELD(SUMMARY_AVG_PRESSURE, PARTIAL_AVG("pressure") " AS avg_pressure,");
+    APPEND_QUERY_FIELD(SUMMARY_MAX_PRESSURE, " MAX(pressure_max) AS max_pressure,");
+    APPEND_QUERY_FIELD(SUMMARY_MIN_PRESSURE, " MIN(pressure_min) AS min_pressure,");
+
+    APPEND_QUERY_FIELD(SUMMARY_SUM_RAINFALL,
+                       " CASE WHEN SUM(rainfall_n) > 0 THEN SUM(rainfall_sum) END AS sum_rainfall,");
+    APPEND_QUERY_FIELD(SUMMARY_STDDEV_RAINFALL, PARTIAL_STDDEV("rainfall") " AS stddev_rainfall,");
+
+    APPEND_QUERY_FIELD(SUMMARY_AVG_WIND_SPEED, PARTIAL_AVG("wind_speed") " AS avg_wind_speed,");
+    // Vector average, the hours keep the sums of both components
+    APPEND_QUERY_FIELD(SUMMARY_AVG_WIND_DIRECTION,
+                       " MOD(CAST(DEGREES(ATAN2(SUM(wind_x), SUM(wind_y))) AS numeric) + 360, 360)"
+                       " AS avg_wind_direction,");
+    APPEND_QUERY_FIELD(SUMMARY_STDDEV_WIND_SPEED,
+                       PARTIAL_STDDEV("wind_speed") " AS stddev_wind_speed,");
+    APPEND_QUERY_FIELD(SUMMARY_WIND_RUN,
+                       " CASE WHEN SUM(wind_speed_n) > 0 THEN SUM(wind_run) END AS wind_run,");
+
+    APPEND_QUERY_FIELD(SUMMARY_MAX_GUST_SPEED, " MAX(gust_speed_max) AS max_gust_speed,");
+    APPEND_QUERY_FIELD(SUMMARY_MAX_GUST_DIRECTION,
+                       " (array_agg(gust_direction_at_max ORDER BY gust_speed_max DESC NULLS "
+                       "LAST))[1] AS max_gust_direction,");
+
+    APPEND_QUERY_FIELD(SUMMARY_MAX_LUX, " MAX(lux_max) AS max_lux,");
+    APPEND_QUERY_FIELD(SUMMARY_AVG_LUX, PARTIAL_AVG("lux") " AS avg_lux,");
+
+    APPEND_QUERY_FIELD(SUMMARY_MAX_UVI, " MAX(uvi_max) AS max_uvi,");
+    APPEND_QUERY_FIELD(SUMMARY_AVG_UVI, PARTIAL_AVG("uvi") " AS avg_uvi,");
+
+    APPEND_QUERY_FIELD(SUMMARY_AVG_SOLAR_IRRADIANCE,
+                       PARTIAL_AVG("solar_irradiance") " AS avg_solar_irradiance,");
+
+#undef PARTIAL_STDDEV
+#undef PARTIAL_AVG
+
+    // Delete the last ,
+    if (p > query && *(p - 1) == ',') {
+        p--;
+        *p = '\0';
+        remaining++;
+    }
+
+    if (!append_to_buffer(&p, &remaining, "%s", queryEnd)) {
+        free(query);
+        return NULL;
+    }
+
+    return query;
+}
+
+char *build_static_query(int fields, granularity_t granularity, bool paged) {
     const char *queryBase = "SELECT\n"
-                            "lower(time_range) AS period_start,\n"
-                            "upper(time_range) AS period_end,\n";
+                            "lower(time_range)::text AS period_start,\n"
+                            "upper(time_range)::text AS period_end,\n";
 
     const char *queryEnd;
 
     if (granularity == GRANULARITY_DATA) {
         queryEnd = " FROM weather.weather_data\n"
-                   "WHERE station_id = (SELECT station_id FROM stations.stations WHERE name = $1 "
-                   "OR uuid::text = $1)\n"
-                   "    AND time_range && tstzrange($2, $3)\n"
-                   "ORDER BY lower(time_range);";
+                   "WHERE station_id = $1::bigint\n"
+                   "    AND time_range && tstzrange($2::timestamp AT TIME ZONE $4, "
+                   "$3::timestamp AT TIME ZONE $4)\n";
     }
     else if (granularity == GRANULARITY_HOUR)
         queryEnd = " FROM weather.weather_hourly_summary\n"
-                   "WHERE station_id = (SELECT station_id FROM stations.stations WHERE name = $1 "
-                   "OR uuid::text = $1)\n"
-                   "    AND time_range && tstzrange($2, $3)\n"
-                   "ORDER BY lower(time_range);";
+                   "WHERE station_id = $1::bigint\n"
+                   "    AND time_range && tstzrange($2::timestamp AT TIME ZONE $4, "
+                   "$3::timestamp AT TIME ZONE $4)\n";
     else if (granularity == GRANULARITY_DAY)
         queryEnd = " FROM weather.weather_daily_summary\n"
-                   "WHERE station_id = (SELECT station_id FROM stations.stations WHERE name = $1 "
-                   "OR uuid::text = $1)\n"
-                   "    AND time_range && tstzrange($2, $3)\n"
-                   "ORDER BY lower(time_range);";
+                   "WHERE station_id = $1::bigint\n"
+                   "    AND time_range && tstzrange($2::timestamp AT TIME ZONE $4, "
+                   "$3::timestamp AT TIME ZONE $4)\n";
     else if (granularity == GRANULARITY_MONTH)
         queryEnd = " FROM weather.weather_monthly_summary\n"
-                   "WHERE station_id = (SELECT station_id FROM stations.stations WHERE name = $1 "
-                   "OR uuid::text = $1)\n"
-                   "    AND time_range && tstzrange($2, $3)\n"
-                   "ORDER BY lower(time_range);";
+                   "WHERE station_id = $1::bigint\n"
+                   "    AND time_range && tstzrange($2::timestamp AT TIME ZONE $4, "
+                   "$3::timestamp AT TIME ZONE $4)\n";
     else if (granularity == GRANULARITY_YEAR)
         queryEnd = " FROM weather.weather_yearly_summary\n"
-                   "WHERE station_id = (SELECT station_id FROM stations.stations WHERE name = $1 "
-                   "OR uuid::text = $1)\n"
-                   "    AND time_range && tstzrange($2, $3)\n"
-                   "ORDER BY lower(time_range);";
+                   "WHERE station_id = $1::bigint\n"
+                   "    AND time_range && tstzrange($2::timestamp AT TIME ZONE $4, "
+                   "$3::timestamp AT TIME ZONE $4)\n";
     else
         queryEnd = NULL;
 
+    // Walks the index of sql/keyset_pagination.sql on the raw data up to the limit
+    const char *queryOrder = paged ? "    AND lower(time_range) > $5::timestamptz\n"
+                                     "ORDER BY lower(time_range)\n"
+                                     "LIMIT $6;"
+                                   : "ORDER BY lower(time_range);";
+
     size_t querySize = GENERIC_WEATHER_QUERY_SIZE;
     size_t remaining = GENERIC_WEATHER_QUERY_SIZE;
     char *query = malloc(querySize);
@@ -670,7 +826,6 @@ char *build_static_query(int fields, granularity_t granularity) {
 
         APPEND_QUERY_FIELD(SUMMARY_MAX_LUX, " max_lux,");
         APPEND_QUERY_FIELD(SUMMARY_MAX_UVI, " max_uvi,");
-        APPEND_QUERY_FIELD(SUMMARY_AVG_SOLAR_IRRADIANCE, " avg_solar_irradiance,");
     }
 
     // Delete the last ,
@@ -680,7 +835,7 @@ char *build_static_query(int fields, granularity_t granularity) {
         remaining++;
     }
 
-    if (!append_to_buffer(&p, &remaining, "%s", queryEnd)) {
+    if (!append_to_buffer(&p, &remaining, "%s%s", queryEnd, queryOrder)) {
         free(query);
         return NULL;
     }
@@ -706,6 +861,18 @@ granularity_t string_to_granularity(const char *granularityStr) {
         return GRANULARITY_HOUR;
 }
 
+dataFormat_t string_to_data_format(const char *formatStr) {
+    if (!formatStr)
+        return DATA_FORMAT_ROWS;
+
+    if (strcmp(formatStr, "rows") == 0)
+        return DATA_FORMAT_ROWS;
+    else if (strcmp(formatStr, "columns") == 0)
+        return DATA_FORMAT_COLUMNS;
+    else
+        return DATA_FORMAT_INVALID;
+}
+
 int string_to_field(const char *fieldStr) {
     if (strcmp(fieldStr, "temperature") == 0)
         return DATA_TEMP;
@@ -790,68 +957,43 @@ bool same_timezone_offset_during_range(const char *startStr, const char *endStr,
         return true;
     }
 
-    UErrorCode status = U_ZERO_ERROR;
-
-    // Convert timezone names from char* to UChar* for ICU
-    UChar uTz1[128], uTz2[128];
-    u_charsToUChars(tz1, uTz1, strlen(tz1) + 1);
-    u_charsToUChars(tz2, uTz2, strlen(tz2) + 1);
-
-    // Open ICU calendars for both timezones
-    UCalendar *cal1 = ucal_open(uTz1, -1, NULL, UCAL_GREGORIAN, &status);
-    UCalendar *cal2 = ucal_open(uTz2, -1, NULL, UCAL_GREGORIAN, &status);
-    if (U_FAILURE(status) || !cal1 || !cal2) {
-        if (cal1)
-            ucal_close(cal1);
-        if (cal2)
-            ucal_close(cal2);
+    const TzTable *table1 = tz_table_get(tz1);
+    const TzTable *table2 = tz_table_get(tz2);
+    if (!table1 || !table2)
         return false;
-    }
 
-    // Parse start and end timestamps into year, month, day, hour, minute, second
-    int year, month, day, hour, min, sec;
-    sscanf(startStr, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &min, &sec);
-    ucal_setDateTime(cal1, year, month - 1, day, hour, min, sec, &status);
-    UDate start = ucal_getMillis(cal1, &status);
+    // The range is given in tz1
+    int64_t start, end;
+    if (!tz_local_to_utc(table1, startStr, &start) || !tz_local_to_utc(table1, endStr, &end))
+        return false;
 
-    sscanf(endStr, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &min, &sec);
-    ucal_setDateTime(cal1, year, month - 1, day, hour, min, sec, &status);
-    UDate end = ucal_getMillis(cal1, &status);
+    return tz_same_offset(table1, table2, start, end);
+}
 
-    if (U_FAILURE(status)) {
-        ucal_close(cal1);
-        ucal_close(cal2);
+bool whole_hour_offset_during_range(const char *startStr, const char *endStr, const char *tz) {
+    if (!startStr || !endStr || !tz)
         return false;
-    }
 
-    // Initialize currentTime to start of range
-    UDate currentTime = start;
+    const TzTable *table = tz_table_get(tz);
+    if (!table)
+        return false;
 
-    while (currentTime <= end) {
-        // Set calendars to currentTime
-        ucal_setMillis(cal1, currentTime, &status);
-        ucal_setMillis(cal2, currentTime, &status);
+    int64_t start, end;
+    if (!tz_local_to_utc(table, startStr, &start) || !tz_local_to_utc(table, endStr, &end))
+        return false;
 
-        // Get total UTC offset including DST
-        int32_t offset1 =
-            ucal_get(cal1, UCAL_ZONE_OFFSET, &status) + ucal_get(cal1, UCAL_DST_OFFSET, &status);
-        int32_t offset2 =
-            ucal_get(cal2, UCAL_ZONE_OFFSET, &status) + ucal_get(cal2, UCAL_DST_OFFSET, &status);
+    return tz_whole_hour_offset(table, start, end);
+}
 
-        // If offsets differ, return false immediately
-        if (offset1 != offset2) {
-            ucal_close(cal1);
-            ucal_close(cal2);
-            return false;
-        }
+bool local_time_to_epoch(const char *timeStr, const char *timezone, time_t *epoch) {
+    if (!timeStr || !timezone || !epoch)
+        return false;
 
-        // Advance to next possible DST change (approx. next day)
-        currentTime += 24 * 3600 * 1000; // 1 day in milliseconds
-    }
+    int64_t millis;
+    if (!tz_local_to_utc(tz_table_get(timezone), timeStr, &millis))
+        return false;
 
-    // Close calendars and return true if offsets were identical throughout the range
-    ucal_close(cal1);
-    ucal_close(cal2);
+    *epoch = (time_t)(millis / 1000);
     return true;
 }
 
@@ -865,3 +1007,14 @@ apiKeyType_t string_to_key_type(const char *typeStr) {
     else
         return KEY_TYPE_INVALID;
 }
+
+int env_int(const char *name, int defaultValue, int minValue) {
+    const char *str = getenv(name);
+    if (!str)
+        return defaultValue;
+
+    int value = atoi(str);
+    if (value < minValue)
+        value = minValue; // fallback
+    return value;
+}
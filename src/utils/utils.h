@@ -8,6 +8,7 @@
 #include <sodium/utils.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <time.h>
 
 #ifdef DEBUG
 #define DEBUG_PRINTF(...)                                                                          \
@@ -28,34 +29,63 @@
 bool validate_name(const char *str);
 bool validate_uuid(const char *uuid);
 
-bool validate_password(PGconn *conn, const char *userId, const char *password);
+// Only fetches the stored Argon2 string, verifying it is left to the pwhash pool
+bool get_password_hash(PGconn *conn, const char *userId, char *hash, size_t hashLen);
 
 bool validate_session_token(PGconn *conn, const char *userId, const char *sessionToken);
 
 bool validate_admin_session_token(PGconn *conn, const char *sessionToken);
 
+// The crypto_generichash of a base64 API key, the database stores its base64 form
+bool hash_api_key(const char *apiKey, unsigned char *keyHash);
+
+// On success stationDbId gets the internal id of the station the key is bound to
+bool validate_station_api_key(PGconn *conn, const char *apiKey, const char *keyType,
+                              const char *stationId, char *stationDbId, size_t stationDbIdLen);
+
 void generate_session_token(char *tokenB64, size_t tokenB64Len, char *hashB64, size_t hashB64Len);
 
 bool get_user_session_token(PGconn *conn, char **userId, const char *sessionToken);
 
 bool validate_email(const char *email);
 
-char *build_generic_weather_query(int fields);
+// A date with an optional time of day and nothing after it. ::timestamp silently drops an offset
+// or a zone name, so a range taken in ?timezone= can not carry one
+bool validate_local_timestamp(const char *str);
 
 json_t *pgresult_to_json(PGresult *res, bool canBeObject);
 
 granularity_t string_to_granularity(const char *granularityStr);
 
-// Query with 4 params $1 = stationId, $2 startTime, $3 endTime, $4 granularity
-char *build_generic_weather_query(int fields);
+dataFormat_t string_to_data_format(const char *formatStr);
+
+// Query with 5 params $1 = station_id, $2 startTime, $3 endTime, $4 granularity, $5 timezone.
+// The data queries cast the period bounds to text so they can be fetched in binary format.
+// paged adds $6, the period_start the rows come after, and $7 the LIMIT
+char *build_generic_weather_query(int fields, bool paged);
+
+// Query with 4 params $1 = station_id, $2 startTime, $3 endTime, $4 timezone. paged adds $5 and
+// $6, the period_start the rows come after and the LIMIT
+char *build_static_query(int fields, granularity_t granularity, bool paged);
 
-// Query with 3 params $1 = stationId, $2 startTime, $3 endTime
-char *build_static_query(int fields, granularity_t granularity);
+// Same params and columns as build_generic_weather_query, composed from
+// weather.weather_hourly_partials instead of the raw data. Only valid when every offset of the
+// timezone in the range is a whole number of hours
+char *build_partials_weather_query(int fields, bool paged);
 
 bool same_timezone_offset_during_range(const char *startStr, const char *endStr, const char *tz1,
                                        const char *tz2);
 
+// Hour boundaries in tz are UTC hour boundaries for the whole range
+bool whole_hour_offset_during_range(const char *startStr, const char *endStr, const char *tz);
+
+// timeStr is a local YYYY-MM-DDTHH:MM:SS in timezone
+bool local_time_to_epoch(const char *timeStr, const char *timezone, time_t *epoch);
+
 int string_to_field(const char *fieldStr);
 
 apiKeyType_t string_to_key_type(const char *typeStr);
+
+// Integer from the environment, defaultValue when unset and minValue when below it
+int env_int(const char *name, int defaultValue, int minValue);
 #endif